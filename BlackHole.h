@@ -13,6 +13,7 @@
 #include <boost/asio.hpp>
 
 #include "message.h"
+#include "transport.h"
 #include "aodv.h"
 #include "wormhole.h"
 #include "message_handler.h"
@@ -21,8 +22,6 @@
 using boost::asio::ip::tcp;
 using namespace std;
 
-typedef deque<ad_hoc_message> ad_hoc_message_queue;
-
 const int AODV_HELLO_INTERVAL = 10;
 const int AODV_ACTIVE_ROUTE_TIMEOUT = 300;
 
@@ -38,30 +37,21 @@ public:
     *
     * @param endpoint 将要连接的server的IP和端口
     * @param io_context 接收数据的IO事件循环
+    * @param transport 到server的传输方式，TRANSPORT_TCP或TRANSPORT_UDP
     */
 
-    bh_client(tcp::endpoint &endpoint, boost::asio::io_context &io_context, int id, int another_wormhole)
-            : socket(io_context),
-              io_context(io_context),
+    bh_client(tcp::endpoint &endpoint, boost::asio::io_context &io_context, int id, int another_wormhole,
+              int transport = TRANSPORT_TCP)
+            : io_context(io_context),
+              executor(io_context),
+              transport_(ad_hoc_make_transport(transport, endpoint, io_context, id, WIRE_FEATURE_CRC32C, this)),
               hello_timer(io_context, boost::posix_time::seconds(AODV_HELLO_INTERVAL)),
               wormhole(another_wormhole) {
-        //第一个参数指向某个IP主机的IP端口，第二个是偏函数对象，实际代码地址指向成员函数handle_connect
-
-        socket.open(boost::asio::ip::tcp::v4());
-        socket.bind(tcp::endpoint(
-                boost::asio::ip::address::from_string("127.0.0.1"),
-                id
-        ));
-
-
         aodv_seq = 0;
         aodv_rreq_id = 0;
 
-        socket.async_connect(endpoint,
-                             boost::bind(
-                                     &bh_client::handle_connect,
-                                     this,
-                                     boost::asio::placeholders::error));
+        //TCP上连接建立后首先发送协商报文，请求本程序支持的最高版本和帧校验
+        transport_->start();
         if (wormhole != -1) {
             tcp::endpoint wormhole_endpoint(boost::asio::ip::address::from_string("127.0.0.1"), wormhole);
             wormhole_client = new ad_hoc_wormhole_client(wormhole_endpoint, io_context, this);
@@ -75,16 +65,15 @@ public:
         *
         * @param msg 待发消息
         */
-    void write(const ad_hoc_message msg) {
+    void write(const ad_hoc_message &msg) {
         io_context.post(boost::bind(&bh_client::do_write, this, msg));
     }
 
-    void write_to_wormhole(ad_hoc_message &msg) {
+    void write_to_wormhole(const ad_hoc_message &msg) {
         ad_hoc_message wormhole_msg;
-        wormhole_msg.body_length(msg.length());
         wormhole_msg.msg_type(WORMHOLE_MESSAGE);
-        memcpy(wormhole_msg.body(), msg.data(), msg.length());
-        wormhole_msg.encode_header();
+        //外层帧直接引用内层帧的缓冲区，只在发送时在其前面加上外层首部
+        wormhole_msg.encapsulate(msg);
         wormhole_client->write(wormhole_msg);
     }
 
@@ -93,7 +82,7 @@ public:
     }
 
     int get_sent_id() {
-        return socket.local_endpoint().port();
+        return transport_->local_id();
     }
 
     ~bh_client() {
@@ -111,106 +100,16 @@ public:
         }
     }
 
-private:
     /**
-     * 与server发起连接成功后的回调函数
-     *
-     * 在建立连接成功后，发起异步读操作，等待数据到来。
-     *
-     * @param error
+     * 到server的传输建立之后开始周期性地发送hello
      */
-    void handle_connect(const boost::system::error_code &error) {
-        if (!error) {
-            cout << "connected to " << socket.remote_endpoint().address() << ":" << socket.remote_endpoint().port()
-                 << endl;
-            cout << "local port is " << socket.local_endpoint().port() << endl;
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&bh_client::handle_read_header, this,
-                                                boost::asio::placeholders::error));
+    void handle_connected() override {
 #if DYNAMIC
-            send_hello();
-#endif
-        } else {
-            cerr << error << endl;
-        }
-    }
-
-    /**
-        * 读取消息首部的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_read_header(const boost::system::error_code &error) {
-        if (!error && read_msg_.decode_header()) {
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                                    boost::bind(&bh_client::handle_read_body,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
-        }
-    }
-
-    /**
-        * 读取消息数据载荷的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_read_body(const boost::system::error_code &error) {
-        if (!error) {
-#if DEBUG
-            print("received", read_msg_);
-#endif
-            handle_message(read_msg_, false);
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&bh_client::handle_read_header,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
-        }
-    }
-
-    /**
-        * 发送消息的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_write(const boost::system::error_code &error) {
-        if (!error) {
-            auto msg = write_msgs_.front();
-#if DEBUG
-            cout << "sent" << endl;
-            print_time();
-            print_message(msg);
-            if (msg.msg_type() == ORDINARY_MESSAGE) {
-                cout.write(msg.body(), msg.body_length());
-                cout << endl;
-            } else {
-                print_aodv(msg.body());
-            }
-            cout << endl;
+        send_hello();
 #endif
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty()) {
-                boost::asio::async_write(socket,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&bh_client::handle_write,
-                                                     this,
-                                                     boost::asio::placeholders::error));
-            }
-        } else {
-            do_close();
-        }
     }
 
+private:
     /**
         * 发送消息函数
         *
@@ -231,19 +130,10 @@ private:
 #if DEBUG
             print("sending", msg);
 #endif
-            bool write_in_progress = !write_msgs_.empty();
-            write_msgs_.push_back(msg);
-            if (!write_in_progress) {
-                boost::asio::async_write(socket,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&bh_client::handle_write,
-                                                     this,
-                                                     boost::asio::placeholders::error));
-            }
+            transport_->send(msg);
         } else {
             send_rreq(msg.destid(), -1);
-            auto timer = msg_buffer.new_timer(io_context, msg);
+            auto timer = msg_buffer.new_timer(executor, msg);
             timer->expires_from_now(boost::posix_time::seconds(AODV_MESSAGE_WAITING_ROUTE_TIMEOUT));
             timer->async_wait(
                     boost::bind(&bh_client::aodv_msg_waiting_route_timeout, this, msg,
@@ -251,11 +141,11 @@ private:
         }
     }
 
-    void handle_user_message(ad_hoc_message msg, bool through_wormhole) {
+    void handle_user_message(ad_hoc_message &msg, bool through_wormhole) {
         broadcast_back(msg);
         if (id() == msg.destid()) {
 #if DEBUG
-            cout.write(read_msg_.body(), read_msg_.body_length());
+            cout.write(static_cast<const ad_hoc_message &>(msg).body(), msg.body_length());
             cout << endl;
 #endif
         } else {
@@ -285,7 +175,7 @@ private:
     void aodv_restart_route_timer(ad_hoc_client_routing_table_item item) {
 #if DYNAMIC && AODV_ROUTE_TIMEOUT
         if (item.timer == nullptr) {
-            item.timer = make_shared<boost::asio::deadline_timer>(io_context);
+            item.timer = executor.create_timer();
         }
         item.timer->expires_from_now(boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT));
         item.timer->async_wait(
@@ -318,9 +208,8 @@ private:
             aodv_restart_route_timer(orig_route);
         } else {
             ad_hoc_client_routing_table_item route{rreq.orig, msg.sendid(), rreq.orig_seq, current_hops,
-                                                   make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                            boost::posix_time::seconds(
-                                                                                                    AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                   executor.make_timer(
+                                                           boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
             routing_table_.insert(route);
             aodv_restart_route_timer(route);
         }
@@ -328,7 +217,7 @@ private:
         if (rreq_buffer.contains(rreq.orig, rreq.id)) {
             return;
         } else {
-            auto timer = this->rreq_buffer.new_timer(io_context, rreq.orig, rreq.id);
+            auto timer = this->rreq_buffer.new_timer(executor, rreq.orig, rreq.id);
             timer->async_wait(boost::bind(&bh_client::aodv_path_discovery_timeout, this, rreq.orig, rreq.id));
         }
 
@@ -347,9 +236,8 @@ private:
             send_rrep(rreq.orig, rreq.dest, dest_route.seq, dest_route.hops, msg.sendid());
         } else {
             ad_hoc_client_routing_table_item route{rreq.dest, rreq.dest, rreq.orig_seq, 1,
-                                                   make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                            boost::posix_time::seconds(
-                                                                                                    AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                   executor.make_timer(
+                                                           boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
             routing_table_.insert(route);
             send_rrep(rreq.orig, rreq.dest, rreq.orig_seq, 0, msg.sendid());
         }
@@ -376,9 +264,8 @@ private:
                 }
             } else {
                 ad_hoc_client_routing_table_item route{rrep.dest, msg.sendid(), rrep.dest_seq, current_hops,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
                 aodv_restart_route_timer(route);
             }
@@ -398,9 +285,8 @@ private:
                 aodv_restart_route_timer(dest_route);
             } else {
                 ad_hoc_client_routing_table_item route{rrep.dest, msg.sendid(), rrep.dest_seq, current_hops,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
                 aodv_restart_route_timer(routing_table_.route(rrep.dest));
             }
@@ -444,7 +330,7 @@ private:
             auto route = routing_table_.route(neighbor);
             aodv_restart_route_timer(route);
         } else {
-            auto timer = this->neighbors.new_timer(io_context, neighbor);
+            auto timer = this->neighbors.new_timer(executor, neighbor);
             timer->expires_from_now(boost::posix_time::seconds(AODV_HELLO_TIMEOUT));
             timer->async_wait(boost::bind(&bh_client::aodv_neighbor_timeout, this, neighbor,
                                           boost::asio::placeholders::error));
@@ -454,9 +340,8 @@ private:
                 aodv_restart_route_timer(route);
             } else {
                 ad_hoc_client_routing_table_item route{neighbor, neighbor, 1, 1,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
                 aodv_restart_route_timer(route);
             }
@@ -514,7 +399,7 @@ private:
         }
     }
 
-    void broadcast_back(ad_hoc_message &msg) {
+    void broadcast_back(const ad_hoc_message &msg) {
         ad_hoc_aodv_back back{AODV_BACK, msg.sendid(), msg.receiveid(), msg.sourceid(), msg.destid()};
         for (auto neighbor: neighbors.neighbor_timer_map) {
             ad_hoc_message broadcast_msg;
@@ -542,7 +427,7 @@ private:
         memcpy(msg.body(), &rreq, msg.body_length());
         broadcast_rreq(msg, rreq);
         //启动一个定时器，记录rreq在缓存中的存活时间，在存活时间之内的相同source和id的rreq都会被丢弃
-        auto timer = rreq_buffer.new_timer(io_context, id(), rreq.id);
+        auto timer = rreq_buffer.new_timer(executor, id(), rreq.id);
         timer->async_wait(boost::bind(&bh_client::aodv_path_discovery_timeout, this, id(), rreq.id));
     }
 
@@ -645,18 +530,17 @@ private:
     }
 
     void do_close() {
-        socket.close();
+        transport_->close();
     }
 
     int id() {
-        return socket.local_endpoint().port();
+        return transport_->local_id();
     }
 
     //数据成员，同ad_hoc_session中的对应成员。
     boost::asio::io_context &io_context;
-    tcp::socket socket;
-    ad_hoc_message read_msg_;
-    ad_hoc_message_queue write_msgs_;
+    ad_hoc_asio_executor executor; //AODV各个表中的定时器经过它创建
+    unique_ptr<ad_hoc_transport> transport_; //到server的传输，负责收发帧
     ad_hoc_client_routing_table routing_table_;
     ad_hoc_aodv_rreq_buffer rreq_buffer;
     ad_hoc_aodv_message_buffer msg_buffer;
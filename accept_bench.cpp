@@ -0,0 +1,162 @@
+//
+// Created by 邹迪凯 on 2022/3/25.
+//
+// 测量大量client同时连接时，从开始连接到所有client都加入scope的时间。
+// 每一轮启动一个新的server，fork出一个子进程用一个io_context同时发起N个连接（子进程有自己的文件描述符上限），
+// 父进程轮询scope中的节点数，直到等于N。分别测量单监听器、多个SO_REUSEPORT监听器以及再加上分片时的耗时。
+//
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "server.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+const int BENCH_PORT_BASE = 9700;
+//单轮等待所有client加入的时间上限
+const int BENCH_TIMEOUT = 60;
+
+struct bench_config {
+    const char *name;
+    int threads;
+    int shards;
+    int acceptors;
+};
+
+/**
+ * 子进程：收到开始信号后同时发起n个连接，连接失败的重试，全部连接后保持连接直到父进程通知退出
+ */
+void run_clients(int port, int n, int go_fd, int done_fd) {
+    char byte;
+    if (read(go_fd, &byte, 1) != 1) {
+        _exit(1);
+    }
+    boost::asio::io_context io_context;
+    tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+    vector<unique_ptr<tcp::socket>> sockets;
+    int connected = 0;
+    function<void(int)> connect = [&](int i) {
+        sockets[i].reset(new tcp::socket(io_context));
+        sockets[i]->async_connect(endpoint, [&, i](const boost::system::error_code &error) {
+            if (!error) {
+                connected++;
+            } else {
+                connect(i);
+            }
+        });
+    };
+    sockets.resize(n);
+    for (int i = 0; i < n; i++) {
+        connect(i);
+    }
+    while (connected < n && io_context.run_one() > 0) {
+    }
+    if (read(done_fd, &byte, 1) != 1) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+/**
+ * @return 所有client都加入scope的秒数，超时返回-1
+ */
+double run_round(const bench_config &config, int port, int n) {
+    int go[2], done[2];
+    if (pipe(go) != 0 || pipe(done) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(go[1]);
+        close(done[1]);
+        run_clients(port, n, go[0], done[0]);
+    }
+    close(go[0]);
+    close(done[0]);
+
+    //server的输出写到/dev/null，保留逐个打印新连接本身的开销
+    ofstream null("/dev/null");
+    streambuf *out = cout.rdbuf(null.rdbuf());
+    double seconds = -1;
+    {
+        boost::asio::io_context io_context(config.threads);
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+        unique_ptr<ad_hoc_server> server(
+                new ad_hoc_server(endpoint, io_context, false, config.shards, {}, config.acceptors));
+        ad_hoc_io_thread_pool pool(io_context, config.threads);
+        pool.start();
+
+        auto start = chrono::steady_clock::now();
+        if (write(go[1], "g", 1) == 1) {
+            while (chrono::steady_clock::now() - start < chrono::seconds(BENCH_TIMEOUT)) {
+                if (server->connections() >= (size_t) n) {
+                    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                    break;
+                }
+                this_thread::sleep_for(chrono::microseconds(500));
+            }
+        }
+        if (write(done[1], "d", 1) != 1) {
+            kill(pid, SIGKILL);
+        }
+        waitpid(pid, nullptr, 0);
+        io_context.stop();
+        pool.join();
+        server.reset();
+    }
+    cout.rdbuf(out);
+    close(go[1]);
+    close(done[1]);
+    return seconds;
+}
+
+int main() {
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    int cores = (int) thread::hardware_concurrency();
+    int threads = cores < 2 ? 2 : cores;
+    vector<bench_config> configs = {
+            {"1 acceptor x1 accept",        threads, 0,       1},
+            {"reuseport acceptors x16",     threads, 0,       threads},
+            {"reuseport + shards",          1,       threads, threads},
+    };
+    cout << "cores: " << cores << ", fd limit: " << limit.rlim_cur << ", somaxconn: "
+         << boost::asio::socket_base::max_listen_connections << endl;
+    cout << setw(28) << left << "config" << right << setw(8) << "threads" << setw(8) << "shards" << setw(10)
+         << "acceptors";
+    vector<int> sizes = {1000, 5000, 10000};
+    for (int n: sizes) {
+        cout << setw(10) << n;
+    }
+    cout << "   (seconds until all clients joined)" << endl;
+
+    int port = BENCH_PORT_BASE;
+    for (const bench_config &config: configs) {
+        cout << setw(28) << left << config.name << right << setw(8) << config.threads << setw(8) << config.shards
+             << setw(10) << config.acceptors << flush;
+        for (int n: sizes) {
+            if ((rlim_t) n + 64 > limit.rlim_cur) {
+                cout << setw(10) << "fd limit" << flush;
+                continue;
+            }
+            double seconds = run_round(config, port++, n);
+            if (seconds < 0) {
+                cout << setw(10) << "timeout" << flush;
+            } else {
+                cout << setw(10) << fixed << setprecision(3) << seconds << flush;
+            }
+        }
+        cout << endl;
+    }
+    return 0;
+}
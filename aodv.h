@@ -14,7 +14,7 @@
 #include "boost/asio.hpp"
 #include <memory>
 
-typedef shared_ptr<boost::asio::deadline_timer> timer_ptr;
+#include "executor.h"
 
 using boost::asio::ip::tcp;
 using namespace std;
@@ -185,12 +185,11 @@ public:
         rreq_timer_map.erase(rreq);
     }
 
-    timer_ptr new_timer(boost::asio::io_context &io_context, int src, int id) {
+    timer_ptr new_timer(ad_hoc_executor &executor, int src, int id) {
         ad_hoc_aodv_rreq rreq{};
         rreq.orig = src;
         rreq.id = id;
-        rreq_timer_map[rreq] = make_shared<boost::asio::deadline_timer>(io_context, boost::posix_time::seconds(
-                AODV_PATH_DISCOVERY_TIMEOUT));
+        rreq_timer_map[rreq] = executor.make_timer(boost::posix_time::seconds(AODV_PATH_DISCOVERY_TIMEOUT));
         return rreq_timer_map[rreq];
     }
 
@@ -209,9 +208,8 @@ public:
         msg_timer_map.erase(msg);
     }
 
-    timer_ptr new_timer(boost::asio::io_context &io_context, ad_hoc_message msg) {
-        msg_timer_map[msg] = make_shared<boost::asio::deadline_timer>(io_context, boost::posix_time::seconds(
-                AODV_MESSAGE_WAITING_ROUTE_TIMEOUT));
+    timer_ptr new_timer(ad_hoc_executor &executor, ad_hoc_message msg) {
+        msg_timer_map[msg] = executor.make_timer(boost::posix_time::seconds(AODV_MESSAGE_WAITING_ROUTE_TIMEOUT));
         return msg_timer_map[msg];
     }
 
@@ -240,8 +238,8 @@ public:
         return neighbor_timer_map[neighbor];
     }
 
-    timer_ptr new_timer(boost::asio::io_context &io_context, int neighbor) {
-        neighbor_timer_map[neighbor] = make_shared<boost::asio::deadline_timer>(io_context);
+    timer_ptr new_timer(ad_hoc_executor &executor, int neighbor) {
+        neighbor_timer_map[neighbor] = executor.create_timer();
         return neighbor_timer_map[neighbor];
     }
 
@@ -0,0 +1,227 @@
+//
+// Created by 邹迪凯 on 2022/3/8.
+//
+
+#ifndef ADHOC_SIMULATION_BATCH_WRITER_H
+#define ADHOC_SIMULATION_BATCH_WRITER_H
+
+#include <deque>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+
+#include "message.h"
+#include "message_pool.h"
+#include "wire.h"
+#include "crc32c.h"
+
+//每一批次最多发送的字节数，超过后剩余的消息留到下一批次
+const size_t WRITE_BATCH_MAX_BYTES = 64 * 1024;
+//每一批次最多包含的消息数
+const size_t WRITE_BATCH_MAX_FRAMES = 64;
+//载荷不超过此长度的帧在发送时拷贝到首部之后，避免为控制帧单独占用一个iovec
+const size_t WRITE_INLINE_BODY = 64;
+
+typedef std::deque<ad_hoc_message, ad_hoc_pool_allocator<ad_hoc_message>> ad_hoc_write_queue;
+
+/**
+ * 指向一段连续const_buffer数组的buffer序列
+ *
+ * async_write会按值保存buffer序列，用这个只有两个指针的类型代替vector，避免每次写操作拷贝vector。
+ */
+class ad_hoc_buffer_span {
+public:
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer *const_iterator;
+
+    ad_hoc_buffer_span(const_iterator first, const_iterator last) : first_(first), last_(last) {}
+
+    const_iterator begin() const {
+        return first_;
+    }
+
+    const_iterator end() const {
+        return last_;
+    }
+
+private:
+    const_iterator first_;
+    const_iterator last_;
+};
+
+/**
+ * 批量发送的待发送消息队列
+ *
+ * 写操作进行期间到达的消息先进入队列，上一次写完成后把队列中所有待发消息（不超过字节数上限）收集为一个buffer序列，
+ * 用一次gather写（writev）全部发出，而不是每个消息调用一次async_write。
+ * 首部按codec协商的版本编码到暂存区中，载荷较短的帧连同载荷一起拷贝到暂存区，相邻的短帧合并为一个buffer。
+ * 协商了CRC32C时，每个帧的校验尾部也写在暂存区中。
+ * codec协商完成之前，只发送协商报文，消息留在队列中。
+ *
+ * 使用方式：
+ *   if (writer.push(msg)) async_write(socket, writer.gather(), handle_write);
+ *   handle_write中：if (writer.complete()) async_write(socket, writer.gather(), handle_write);
+ *   协商完成后：if (writer.resume()) async_write(socket, writer.gather(), handle_write);
+ */
+class ad_hoc_batch_writer {
+public:
+    explicit ad_hoc_batch_writer(ad_hoc_wire_codec &codec, size_t max_bytes = WRITE_BATCH_MAX_BYTES) : codec_(codec),
+                                                                                                        in_flight_(0),
+                                                                                                        writing_(false),
+                                                                                                        max_bytes_(
+                                                                                                                max_bytes) {
+        buffers_.reserve(2 * WRITE_BATCH_MAX_FRAMES + 1);
+        scratch_.resize(WIRE_MAX_PREAMBLE_LENGTH +
+                        WRITE_BATCH_MAX_FRAMES * (WIRE_MAX_HEADER_LENGTH + WRITE_INLINE_BODY + WIRE_CRC_LENGTH));
+    }
+
+    /**
+     * 向队列末端添加一个待发送的消息
+     *
+     * @param msg
+     * @return 当前没有进行中的写操作且协商已完成，调用方需要发起一次写
+     */
+    bool push(const ad_hoc_message &msg) {
+        queue_.push_back(msg);
+        return !writing_ && codec_.negotiated();
+    }
+
+    bool push(ad_hoc_message &&msg) {
+        queue_.push_back(std::move(msg));
+        return !writing_ && codec_.negotiated();
+    }
+
+    /**
+     * 从队列头部开始收集本批次要发送的消息
+     *
+     * 至少包含一个消息，之后按顺序加入，直到达到字节数上限或消息数上限。
+     * 在complete()之前，这些消息一直留在队列中，保证缓冲区有效。
+     *
+     * @return
+     */
+    ad_hoc_buffer_span gather() {
+        buffers_.clear();
+        writing_ = true;
+        in_flight_ = 0;
+        char *out = scratch_.data();
+        if (codec_.preamble_pending()) {
+            size_t preamble_length = codec_.preamble_length();
+            memcpy(out, codec_.take_preamble(), preamble_length);
+            append(out, preamble_length);
+            out += preamble_length;
+        }
+        if (!codec_.negotiated()) {
+            return span();
+        }
+        bool checked = codec_.supports(WIRE_FEATURE_CRC32C);
+        size_t trailer_length = checked ? WIRE_CRC_LENGTH : 0;
+        size_t bytes = 0;
+        for (const ad_hoc_message &msg: queue_) {
+            if (in_flight_ > 0 && (bytes + msg.length() > max_bytes_ || in_flight_ >= WRITE_BATCH_MAX_FRAMES)) {
+                break;
+            }
+            size_t header_length = codec_.encode_header(msg, out);
+            auto body_length = (size_t) msg.body_length();
+            bool inline_body = body_length <= WRITE_INLINE_BODY;
+            if (inline_body) {
+                //短帧的载荷直接拷贝到首部之后，和相邻的短帧共用一个buffer
+                memcpy(out + header_length, msg.body(), body_length);
+            }
+            size_t used = header_length + (inline_body ? body_length : 0);
+            if (checked) {
+                uint32_t crc = crc32c(crc32c(0, out, header_length), msg.body(), body_length);
+                put_le32(out + used, (int) crc);
+            }
+            if (inline_body) {
+                append(out, used + trailer_length);
+            } else {
+                append(out, header_length);
+                append(msg.body(), body_length);
+                append(out + used, trailer_length);
+            }
+            out += used + trailer_length;
+            bytes += msg.length();
+            in_flight_++;
+        }
+        return span();
+    }
+
+    /**
+     * 本批次写操作完成，从队列中移除已发送的消息
+     *
+     * @return 还有需要发送的数据，调用方需要继续发起写
+     */
+    bool complete() {
+        for (; in_flight_ > 0; in_flight_--) {
+            queue_.pop_front();
+        }
+        writing_ = false;
+        return resume();
+    }
+
+    /**
+     * 检查是否需要发起新的写操作，用于协商状态变化之后
+     *
+     * @return 没有进行中的写操作，且有待发送的协商报文或（协商完成后）待发送的消息
+     */
+    bool resume() const {
+        return !writing_ && (codec_.preamble_pending() || (codec_.negotiated() && !queue_.empty()));
+    }
+
+    bool empty() const {
+        return queue_.empty();
+    }
+
+    /**
+     * 本批次中的消息，用于写完成后的日志等
+     */
+    ad_hoc_write_queue::const_iterator batch_begin() const {
+        return queue_.begin();
+    }
+
+    ad_hoc_write_queue::const_iterator batch_end() const {
+        return queue_.begin() + in_flight_;
+    }
+
+    void max_bytes(size_t bytes) {
+        max_bytes_ = bytes;
+    }
+
+    size_t max_bytes() const {
+        return max_bytes_;
+    }
+
+private:
+    /**
+     * 向本批次的buffer序列末尾添加一段数据，与上一段首尾相接时直接合并
+     */
+    void append(const char *data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (!buffers_.empty()) {
+            boost::asio::const_buffer &last = buffers_.back();
+            if (static_cast<const char *>(last.data()) + last.size() == data) {
+                last = boost::asio::const_buffer(last.data(), last.size() + length);
+                return;
+            }
+        }
+        buffers_.emplace_back(data, length);
+    }
+
+    ad_hoc_buffer_span span() const {
+        return ad_hoc_buffer_span(buffers_.data(), buffers_.data() + buffers_.size());
+    }
+
+    ad_hoc_wire_codec &codec_;
+    ad_hoc_write_queue queue_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    //本批次的首部和短帧载荷的暂存区，大小在构造时确定，gather期间不会重新分配
+    std::vector<char> scratch_;
+    //本批次中正在发送的消息数
+    size_t in_flight_;
+    //是否有进行中的写操作
+    bool writing_;
+    size_t max_bytes_;
+};
+
+#endif //ADHOC_SIMULATION_BATCH_WRITER_H
@@ -0,0 +1,235 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_CHANNEL_H
+#define ADHOC_SIMULATION_CHANNEL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace std;
+
+/**
+ * 链路的信道参数
+ *
+ * 帧在一条链路上的延迟 = 排队等待链路空闲 + 以bandwidth发送的串行化时间 + 传播延迟delay + [0, jitter)内均匀分布的抖动。
+ * 丢包按Gilbert-Elliott模型：链路在好、坏两个状态之间按概率转移，每个帧先转移状态，再按所在状态的丢包率丢弃。
+ */
+struct ad_hoc_channel_params {
+    int64_t delay_us = -1; //传播延迟，小于0时使用scope的单播、广播延迟
+    int64_t jitter_us = 0;
+    int64_t bandwidth_bps = 0; //为0时不计串行化时间，也不排队
+    double good_to_bad = 0; //每个帧从好状态转入坏状态的概率
+    double bad_to_good = 1; //每个帧从坏状态回到好状态的概率
+    double loss_good = 0; //好状态下的丢包率
+    double loss_bad = 0; //坏状态下的丢包率
+};
+
+/**
+ * xorshift64*伪随机数，不加锁：分片各有一个，scope的几何位置和移动模型在独占锁下使用一个，
+ * 多个IO线程转发时各自使用ad_hoc_thread_random
+ */
+class ad_hoc_random {
+public:
+    explicit ad_hoc_random(uint64_t seed = 0x9E3779B97F4A7C15ull) : state(seed ? seed : 1) {
+    }
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    /**
+     * [0, 1)内均匀分布
+     */
+    double uniform() {
+        return (double) (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    /**
+     * 标准正态分布，Box-Muller变换
+     */
+    double gaussian() {
+        double u = 1.0 - uniform();
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * uniform());
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * 当前线程的信道随机数。种子按线程第一次使用的顺序取，单线程运行时（例如离散事件仿真）结果可以复现
+ */
+inline ad_hoc_random &ad_hoc_thread_random() {
+    static atomic<uint64_t> threads(0);
+    static thread_local ad_hoc_random random(0x9E3779B97F4A7C15ull * (threads.fetch_add(1) + 1));
+    return random;
+}
+
+/**
+ * 一条双向链路的信道：参数两个方向共用，排队和丢包状态每个方向各一份
+ *
+ * 状态都是定长的字段，所有链路的信道连续存放在拓扑的数组中，转发时不分配内存。
+ * 多个IO线程可以同时经过不同的链路，排队和丢包状态由每条链路自己的自旋锁保护，临界区只有几次算术运算。
+ * 参数只在拓扑的独占锁下修改。
+ */
+class ad_hoc_channel {
+public:
+    ad_hoc_channel() = default;
+
+    explicit ad_hoc_channel(const ad_hoc_channel_params &params) : params(params) {
+    }
+
+    //复制参数和状态，不复制锁，拓扑的数组扩容和分片加载快照时使用
+    ad_hoc_channel(const ad_hoc_channel &other) : params(other.params) {
+        directions[0] = other.directions[0];
+        directions[1] = other.directions[1];
+    }
+
+    ad_hoc_channel &operator=(const ad_hoc_channel &other) {
+        params = other.params;
+        directions[0] = other.directions[0];
+        directions[1] = other.directions[1];
+        return *this;
+    }
+
+    /**
+     * 一个帧经过链路的一个方向
+     *
+     * @param forward 是否是从编号小的顶点到编号大的顶点
+     * @param bytes 帧的长度
+     * @param now 当前时间，微秒
+     * @param fallback 没有设置传播延迟时使用的延迟，微秒
+     * @return 帧到达接收方的延迟，微秒；帧丢失时返回-1
+     */
+    int64_t transmit(bool forward, size_t bytes, int64_t now, int64_t fallback, ad_hoc_random &random) {
+        int64_t arrival = now;
+        //默认参数的链路没有状态，不加锁
+        if (params.loss_good > 0 || params.loss_bad > 0 || params.bandwidth_bps > 0) {
+            direction &d = directions[forward ? 0 : 1];
+            lock();
+            if (params.loss_good > 0 || params.loss_bad > 0) {
+                if (d.bad) {
+                    d.bad = random.uniform() >= params.bad_to_good;
+                } else {
+                    d.bad = random.uniform() < params.good_to_bad;
+                }
+                if (random.uniform() < (d.bad ? params.loss_bad : params.loss_good)) {
+                    unlock();
+                    return -1;
+                }
+            }
+            if (params.bandwidth_bps > 0) {
+                int64_t start = d.busy_until > now ? d.busy_until : now;
+                d.busy_until = start + (int64_t) bytes * 8 * 1000000 / params.bandwidth_bps;
+                arrival = d.busy_until;
+            }
+            unlock();
+        }
+        arrival += params.delay_us >= 0 ? params.delay_us : fallback;
+        if (params.jitter_us > 0) {
+            arrival += (int64_t) (random.next() % (uint64_t) params.jitter_us);
+        }
+        return arrival - now;
+    }
+
+    /**
+     * 修改参数，保留排队和丢包状态
+     */
+    void configure(const ad_hoc_channel_params &p) {
+        params = p;
+    }
+
+    const ad_hoc_channel_params &parameters() const {
+        return params;
+    }
+
+private:
+    struct direction {
+        int64_t busy_until = 0; //链路空闲的时间，微秒
+        bool bad = false; //Gilbert-Elliott模型的状态
+    };
+
+    void lock() {
+        while (locked.exchange(true, memory_order_acquire)) {
+            while (locked.load(memory_order_relaxed)) {
+            }
+        }
+    }
+
+    void unlock() {
+        locked.store(false, memory_order_release);
+    }
+
+    ad_hoc_channel_params params;
+    direction directions[2];
+    atomic<bool> locked{false}; //保护directions
+};
+
+/**
+ * 信道模型使用的时间，从1970-01-01开始的微秒数，虚拟时钟也从这一时刻开始
+ */
+inline int64_t ad_hoc_channel_time(const boost::posix_time::ptime &now) {
+    static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    return (now - epoch).total_microseconds();
+}
+
+/**
+ * 解析命令行中的信道参数：逗号分隔的 延迟毫秒,抖动毫秒,带宽kbps,好转坏概率,坏转好概率,好状态丢包率,坏状态丢包率
+ * 可以只给出前面几项，例如"50,10,1000"，其余取默认值
+ *
+ * @return 不合法时返回false
+ */
+inline bool ad_hoc_parse_channel(const string &text, ad_hoc_channel_params &params) {
+    stringstream ss(text);
+    string item;
+    double values[7];
+    int count = 0;
+    while (count < 7 && getline(ss, item, ',')) {
+        try {
+            values[count++] = stod(item);
+        } catch (const exception &) {
+            cerr << "invalid channel parameter: " << item << endl;
+            return false;
+        }
+    }
+    ad_hoc_channel_params parsed; //没有给出的项取默认值
+    for (int i = 0; i < count; i++) {
+        switch (i) {
+            case 0:
+                parsed.delay_us = (int64_t) (values[i] * 1000);
+                break;
+            case 1:
+                parsed.jitter_us = (int64_t) (values[i] * 1000);
+                break;
+            case 2:
+                parsed.bandwidth_bps = (int64_t) (values[i] * 1000);
+                break;
+            case 3:
+                parsed.good_to_bad = values[i];
+                break;
+            case 4:
+                parsed.bad_to_good = values[i];
+                break;
+            case 5:
+                parsed.loss_good = values[i];
+                break;
+            default:
+                parsed.loss_bad = values[i];
+                break;
+        }
+    }
+    params = parsed;
+    return true;
+}
+
+#endif //ADHOC_SIMULATION_CHANNEL_H
@@ -14,7 +14,11 @@
 #include "unordered_map"
 
 #include "message.h"
+#include "transport.h"
+#include "executor.h"
 #include "aodv.h"
+#include "fragment.h"
+#include "compression.h"
 #include "wormhole.h"
 #include "message_handler.h"
 #include "utils.h"
@@ -22,8 +26,6 @@
 using boost::asio::ip::tcp;
 using namespace std;
 
-typedef deque<ad_hoc_message> ad_hoc_message_queue;
-
 const int AODV_HELLO_INTERVAL = 10;
 const int AODV_ACTIVE_ROUTE_TIMEOUT = 300;
 
@@ -39,34 +41,46 @@ public:
     *
     * @param endpoint 将要连接的server的IP和端口
     * @param io_context 接收数据的IO事件循环
+    * @param transport 到server的传输方式，TRANSPORT_TCP或TRANSPORT_UDP
     */
 
-    ad_hoc_client(tcp::endpoint &endpoint, boost::asio::io_context &io_context, int id, int another_wormhole)
-            : socket(io_context),
-              io_context(io_context),
-              hello_timer(io_context, boost::posix_time::seconds(AODV_HELLO_INTERVAL)),
-              wormhole(another_wormhole) {
-        aodv_seq = 0;
-        aodv_rreq_id = 0;
-        //第一个参数指向某个IP主机的IP端口，第二个是偏函数对象，实际代码地址指向成员函数handle_connect
-#if BINDING_PORT
-        socket.open(boost::asio::ip::tcp::v4());
-        socket.bind(tcp::endpoint(
-                boost::asio::ip::address::from_string("127.0.0.1"),
-                id
-        ));
-#endif
-        socket.async_connect(endpoint,
-                             boost::bind(
-                                     &ad_hoc_client::handle_connect,
-                                     this,
-                                     boost::asio::placeholders::error));
+    ad_hoc_client(tcp::endpoint &endpoint, boost::asio::io_context &io_context, int id, int another_wormhole,
+                  int transport = TRANSPORT_TCP)
+            : ad_hoc_client(io_context, [&](ad_hoc_message_handler *handler) {
+        return ad_hoc_make_transport(transport, endpoint, io_context, BINDING_PORT ? id : 0,
+                                     WIRE_FEATURE_COMPRESSION | WIRE_FEATURE_CRC32C, handler);
+    }, another_wormhole) {
+    }
+
+    /**
+     * 由调用方提供传输的构造函数，例如host进程中不经过socket的内存传输
+     *
+     * @param io_context client的所有回调和定时器运行在这个io_context上
+     * @param make_transport 以本client为handler创建传输
+     * @param another_wormhole 虫洞另一端的端口，不是虫洞节点时为-1
+     */
+    ad_hoc_client(boost::asio::io_context &io_context, const ad_hoc_transport_factory &make_transport,
+                  int another_wormhole)
+            : ad_hoc_client(unique_ptr<ad_hoc_executor>(new ad_hoc_asio_executor(io_context)), nullptr,
+                            make_transport, another_wormhole) {
         if (wormhole != -1) {
             tcp::endpoint wormhole_endpoint(boost::asio::ip::address::from_string("127.0.0.1"), wormhole);
             wormhole_client = new ad_hoc_wormhole_client(wormhole_endpoint, io_context, this);
         }
     }
 
+    /**
+     * 由调用方提供执行器的构造函数，例如离散事件仿真中以虚拟时钟驱动的执行器
+     *
+     * 虫洞的隧道是一条TCP连接，这样构造的client不能是虫洞节点。
+     *
+     * @param executor client的所有回调和定时器都经过这个执行器，生命周期长于client
+     * @param make_transport 以本client为handler创建传输
+     */
+    ad_hoc_client(ad_hoc_executor &executor, const ad_hoc_transport_factory &make_transport)
+            : ad_hoc_client(nullptr, &executor, make_transport, -1) {
+    }
+
     /**
         * 主动发送消息
         *
@@ -74,29 +88,28 @@ public:
         *
         * @param msg 待发消息
         */
-    void write(ad_hoc_message msg) {
+    void write(const ad_hoc_message &msg) {
         if (wormhole == -1 && watchdog.is_malicious(msg.receiveid())) {
             return;
         }
-        io_context.post(boost::bind(&ad_hoc_client::do_write, this, msg));
+        executor.post(boost::bind(&ad_hoc_client::do_write, this, msg));
     }
 
     void write_to_wormhole(ad_hoc_message &msg) {
         ad_hoc_message wormhole_msg;
         msg.sourceid(id());
-        wormhole_msg.body_length(msg.length());
         wormhole_msg.msg_type(WORMHOLE_MESSAGE);
-        memcpy(wormhole_msg.body(), msg.data(), msg.length());
-        wormhole_msg.encode_header();
+        //外层帧直接引用内层帧的缓冲区，只在发送时在其前面加上外层首部
+        wormhole_msg.encapsulate(msg);
         wormhole_client->write(wormhole_msg);
     }
 
     void close() {
-        io_context.post(boost::bind(&ad_hoc_client::do_close, this));
+        executor.post(boost::bind(&ad_hoc_client::do_close, this));
     }
 
     int get_sent_id() {
-        return socket.local_endpoint().port();
+        return transport_->local_id();
     }
 
     ~ad_hoc_client() {
@@ -107,6 +120,10 @@ public:
         if (wormhole == -1 && watchdog.is_malicious(msg.sendid())) {
             return;
         }
+        //压缩的载荷只在目的节点解压，中间节点原样转发
+        if (msg.compressed() && id() == msg.destid() && !ad_hoc_decompress(msg)) {
+            return;
+        }
 #if DEBUG
         LOG_HANDLE(msg);
 #endif
@@ -120,6 +137,15 @@ public:
         }
     }
 
+    /**
+     * 发送用户消息
+     *
+     * 载荷长度不受单帧上限的限制，超过ADHOCMESSAGE_MAX_BODY_LENGTH的载荷在找到路由后由do_write拆分为分片发送。
+     *
+     * @param dest 目的节点
+     * @param text 载荷
+     * @param len 载荷长度
+     */
     void send_user_message(int dest, const char *text, int len) {
         ad_hoc_message msg;
         msg.msg_type(ORDINARY_MESSAGE);
@@ -133,104 +159,29 @@ public:
         write(msg);
     }
 
-private:
     /**
-     * 与server发起连接成功后的回调函数
-     *
-     * 在建立连接成功后，发起异步读操作，等待数据到来。
-     *
-     * @param error
+     * 到server的传输建立之后开始周期性地发送hello
      */
-    void handle_connect(const boost::system::error_code &error) {
-        if (!error) {
-            cout << "connected to " << socket.remote_endpoint().address() << ":" << socket.remote_endpoint().port()
-                 << endl;
-            cout << "local port is " << socket.local_endpoint().port() << endl;
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&ad_hoc_client::handle_read_header, this,
-                                                boost::asio::placeholders::error));
+    void handle_connected() override {
 #if DYNAMIC
-            send_hello();
+        send_hello();
 #endif
-        } else {
-            cerr << error << endl;
-        }
     }
 
-    /**
-        * 读取消息首部的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_read_header(const boost::system::error_code &error) {
-        if (!error && read_msg_.decode_header()) {
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                                    boost::bind(&ad_hoc_client::handle_read_body,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
-        }
-    }
-
-    /**
-        * 读取消息数据载荷的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_read_body(const boost::system::error_code &error) {
-        if (!error) {
-#if DEBUG
-            LOG_RECEIVED(read_msg_);
-#endif
-            handle_message(read_msg_, false);
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&ad_hoc_client::handle_read_header,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
-        }
-    }
-
-    /**
-        * 发送消息的回调函数
-        * 同ad_hoc_session中的同名函数
-        *
-        * @param error
-        */
-    void handle_write(const boost::system::error_code &error) {
-        if (!error) {
-            auto msg = write_msgs_.front();
-#if DEBUG
-            //            cout << "sent" << endl;
-            //            print_time();
-            //            print_message(msg);
-            //            if (msg.msg_type() == ORDINARY_MESSAGE) {
-            //                cout.write(msg.body(), msg.body_length());
-            //                cout << endl;
-            //            } else {
-            //                print_aodv(msg.body());
-            //            }
-            //            cout << endl;
-#endif
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty()) {
-                boost::asio::async_write(socket,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&ad_hoc_client::handle_write,
-                                                     this,
-                                                     boost::asio::placeholders::error));
-            }
-        } else {
-            do_close();
-        }
+private:
+    ad_hoc_client(unique_ptr<ad_hoc_executor> own_executor, ad_hoc_executor *executor,
+                  const ad_hoc_transport_factory &make_transport, int another_wormhole)
+            : own_executor(std::move(own_executor)),
+              executor(executor != nullptr ? *executor : *this->own_executor),
+              transport_(make_transport(this)),
+              hello_timer(this->executor.make_timer(boost::posix_time::seconds(AODV_HELLO_INTERVAL))),
+              wormhole_client(nullptr),
+              wormhole(another_wormhole) {
+        aodv_seq = 0;
+        aodv_rreq_id = 0;
+        fragment_id = 0;
+        //TCP上连接建立后首先发送协商报文，请求本程序支持的最高版本，以及载荷压缩和帧校验
+        transport_->start();
     }
 
     /**
@@ -252,26 +203,23 @@ private:
                 msg.receiveid(route.next_hop);
             }
             msg.sendid(id());
+            if (msg.body_length() > ADHOCMESSAGE_MAX_BODY_LENGTH) {
+                write_fragments(msg);
+                return;
+            }
+            compress(msg);
             msg.encode_header();
 #if DEBUG
             print("do_write", msg);
 #endif
-            bool write_in_progress = !write_msgs_.empty();
-            write_msgs_.push_back(msg);
-            if (!write_in_progress) {
+            if (transport_->send(msg)) {
                 if (msg.msg_type() == ORDINARY_MESSAGE) {
                     broadcast_back(msg);
                 }
-                boost::asio::async_write(socket,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&ad_hoc_client::handle_write,
-                                                     this,
-                                                     boost::asio::placeholders::error));
             }
         } else {
             send_rreq(msg.destid(), -1);
-            auto timer = msg_buffer.new_timer(io_context, msg);
+            auto timer = msg_buffer.new_timer(executor, msg);
             timer->expires_from_now(boost::posix_time::seconds(AODV_MESSAGE_WAITING_ROUTE_TIMEOUT));
             timer->async_wait(
                     boost::bind(&ad_hoc_client::aodv_msg_waiting_route_timeout, this, msg,
@@ -279,11 +227,59 @@ private:
         }
     }
 
-    void handle_user_message(ad_hoc_message msg, bool through_wormhole) {
+    /**
+     * 把超过单帧上限的消息拆分为分片，全部放入发送队列
+     *
+     * 所有分片沿同一条路由发出，由传输成批发送，中间节点逐个转发，不需要等待整个载荷。
+     *
+     * @param msg 首部字段已经确定的完整消息
+     */
+    void write_fragments(const ad_hoc_message &msg) {
+        ad_hoc_fragmenter fragmenter(msg, ++fragment_id);
+        ad_hoc_message fragment;
+        while (fragmenter.next(fragment)) {
+            compress(fragment);
+            transport_->send(fragment);
+        }
+    }
+
+    /**
+     * 与server协商了载荷压缩时，压缩较长的用户消息和分片
+     *
+     * @param msg
+     */
+    void compress(ad_hoc_message &msg) {
+        if ((msg.msg_type() == ORDINARY_MESSAGE || msg.msg_type() == FRAGMENT_MESSAGE) &&
+            transport_->supports(WIRE_FEATURE_COMPRESSION)) {
+            ad_hoc_compress(msg);
+        }
+    }
+
+    /**
+     * 目的节点收到分片后的处理，载荷重组完成后交给应用层
+     *
+     * @param msg
+     */
+    void handle_fragment(ad_hoc_message &msg) {
+        ad_hoc_fragment_key key{};
+        ad_hoc_message payload;
+        int result = reassembly_buffer.add(msg, key, payload);
+        if (result == REASSEMBLY_STARTED) {
+            auto timer = reassembly_buffer.new_timer(executor, key);
+            timer->async_wait(boost::bind(&ad_hoc_client::reassembly_timeout, this, key,
+                                          boost::asio::placeholders::error));
+        } else if (result == REASSEMBLY_COMPLETE) {
+            LOG_PAYLOAD(payload);
+        }
+    }
+
+    void handle_user_message(ad_hoc_message &msg, bool through_wormhole) {
         broadcast_back(msg);
-        if (id() == msg.destid()) {
+        if (id() == msg.destid() && msg.msg_type() == FRAGMENT_MESSAGE) {
+            handle_fragment(msg);
+        } else if (id() == msg.destid()) {
 #if DEBUG
-            cout.write(read_msg_.body(), read_msg_.body_length());
+            cout.write(static_cast<const ad_hoc_message &>(msg).body(), msg.body_length());
             cout << endl;
 #endif
         } else if (wormhole != -1 && !through_wormhole) {
@@ -325,7 +321,7 @@ private:
     void aodv_restart_route_timer(ad_hoc_client_routing_table_item item) {
 #if DYNAMIC && AODV_ROUTE_TIMEOUT
         if (item.timer == nullptr) {
-            item.timer = make_shared<boost::asio::deadline_timer>(io_context);
+            item.timer = executor.create_timer();
         }
         item.timer->expires_from_now(boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT));
         item.timer->async_wait(
@@ -371,9 +367,8 @@ private:
             }
         } else {
             ad_hoc_client_routing_table_item route{rreq.orig, msg.sendid(), rreq.orig_seq, current_hops,
-                                                   make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                            boost::posix_time::seconds(
-                                                                                                    AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                   executor.make_timer(
+                                                           boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
             routing_table_.insert(route);
             aodv_restart_route_timer(route);
         }
@@ -385,7 +380,7 @@ private:
         if (rreq_buffer.contains(rreq.orig, rreq.id)) {
             return;
         } else {
-            auto timer = this->rreq_buffer.new_timer(io_context, rreq.orig, rreq.id);
+            auto timer = this->rreq_buffer.new_timer(executor, rreq.orig, rreq.id);
             timer->async_wait(boost::bind(&ad_hoc_client::aodv_path_discovery_timeout, this, rreq.orig, rreq.id));
         }
 
@@ -451,9 +446,8 @@ private:
                 }
             } else {
                 ad_hoc_client_routing_table_item route{rrep.dest, msg.sendid(), rrep.dest_seq, current_hops,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
                 aodv_restart_route_timer(route);
             }
@@ -474,9 +468,8 @@ private:
                 aodv_restart_route_timer(dest_route);
             } else {
                 ad_hoc_client_routing_table_item route{rrep.dest, msg.sendid(), rrep.dest_seq, current_hops,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
                 aodv_restart_route_timer(routing_table_.route(rrep.dest));
             }
@@ -538,7 +531,7 @@ private:
             auto route = routing_table_.route(neighbor);
             aodv_restart_route_timer(route);
         } else {
-            auto timer = this->neighbors.new_timer(io_context, neighbor);
+            auto timer = this->neighbors.new_timer(executor, neighbor);
             timer->expires_from_now(boost::posix_time::seconds(AODV_HELLO_TIMEOUT));
             timer->async_wait(boost::bind(&ad_hoc_client::aodv_neighbor_timeout, this, neighbor,
                                           boost::asio::placeholders::error));
@@ -548,9 +541,8 @@ private:
                 aodv_restart_route_timer(route);
             } else {
                 ad_hoc_client_routing_table_item route{neighbor, neighbor, 1, 1,
-                                                       make_shared<boost::asio::deadline_timer>(io_context,
-                                                                                                boost::posix_time::seconds(
-                                                                                                        AODV_ACTIVE_ROUTE_TIMEOUT))};
+                                                       executor.make_timer(
+                                                               boost::posix_time::seconds(AODV_ACTIVE_ROUTE_TIMEOUT))};
                 routing_table_.insert(route);
 #if DEBUG
 
@@ -611,7 +603,7 @@ private:
         }
     }
 
-    void broadcast_back(ad_hoc_message &msg) {
+    void broadcast_back(const ad_hoc_message &msg) {
         ad_hoc_aodv_back back{AODV_BACK, msg.sendid(), msg.receiveid(), msg.sourceid(), msg.destid()};
         for (auto neighbor: neighbors.neighbor_timer_map) {
             ad_hoc_message broadcast_msg;
@@ -639,7 +631,7 @@ private:
         memcpy(msg.body(), &rreq, msg.body_length());
         broadcast_rreq(msg, rreq);
         //启动一个定时器，记录rreq在缓存中的存活时间，在存活时间之内的相同source和id的rreq都会被丢弃
-        auto timer = rreq_buffer.new_timer(io_context, id(), rreq.id);
+        auto timer = rreq_buffer.new_timer(executor, id(), rreq.id);
         timer->async_wait(boost::bind(&ad_hoc_client::aodv_path_discovery_timeout, this, id(), rreq.id));
     }
 
@@ -698,8 +690,8 @@ private:
             }
         }
 
-        hello_timer.expires_from_now(boost::posix_time::seconds(AODV_HELLO_INTERVAL));
-        hello_timer.async_wait(boost::bind(&ad_hoc_client::send_hello, this));
+        hello_timer->expires_from_now(boost::posix_time::seconds(AODV_HELLO_INTERVAL));
+        hello_timer->async_wait(boost::bind(&ad_hoc_client::send_hello, this));
     }
 
     void send_ack(int dest) {
@@ -725,6 +717,14 @@ private:
         msg_buffer.remove(msg);
     }
 
+    void reassembly_timeout(ad_hoc_fragment_key key, const boost::system::error_code &err) {
+        if (err == boost::asio::error::operation_aborted) {
+            return;
+        }
+        cout << "reassembly timeout: " << key.source << ", " << key.payload_id << endl;
+        reassembly_buffer.remove(key);
+    }
+
     void aodv_path_discovery_timeout(int node, int rreq_id) {
         if (rreq_buffer.contains(node, rreq_id)) {
             rreq_buffer.remove(node, rreq_id);
@@ -756,26 +756,27 @@ private:
     }
 
     void do_close() {
-        socket.close();
+        transport_->close();
     }
 
     int id() {
-        return socket.local_endpoint().port();
+        return transport_->local_id();
     }
 
-    //数据成员，同ad_hoc_session中的对应成员。
-    boost::asio::io_context &io_context;
-    tcp::socket socket;
-    ad_hoc_message read_msg_;
-    ad_hoc_message_queue write_msgs_;
+    unique_ptr<ad_hoc_executor> own_executor; //以io_context构造时自己创建的执行器
+    ad_hoc_executor &executor; //投递回调和创建定时器，仿真时由虚拟时钟驱动
+    unique_ptr<ad_hoc_transport> transport_; //到server的传输，负责收发帧
     ad_hoc_client_routing_table routing_table_;
     ad_hoc_aodv_rreq_buffer rreq_buffer;
     ad_hoc_aodv_message_buffer msg_buffer;
+    ad_hoc_reassembly_buffer reassembly_buffer;
     ad_hoc_aodv_neighbor_list neighbors;
     ad_hoc_wormhole_watchdog watchdog;
-    boost::asio::deadline_timer hello_timer;
+    timer_ptr hello_timer;
     int aodv_seq;
     int aodv_rreq_id;
+    //本节点最近一个被分片的载荷的编号
+    uint32_t fragment_id;
 
     ad_hoc_wormhole_client *wormhole_client;
     int wormhole;
@@ -3,6 +3,7 @@
 //
 #include <iostream>
 #include <thread>
+#include <cstring>
 #include "client.h"
 #include "message.h"
 
@@ -12,12 +13,26 @@ int main(int argc, char **argv) {
     string strServerPort(argv[1]);
     string localPort(argv[2]);
     int wormhole = -1;
-    if (argc > 3) {
-        wormhole = stoi(string(argv[3]));
+    int transport = TRANSPORT_TCP;  //--transport tcp|udp|unix|shm
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--transport") && i + 1 < argc) {
+            transport = ad_hoc_parse_transport(argv[++i]);
+            if (transport < 0) {
+                cerr << "unknown transport: " << argv[i] << endl;
+                return 1;
+            }
+        } else {
+            wormhole = stoi(string(argv[i]));
+        }
+    }
+    //Unix域socket没有端口，节点ID只能由参数给出
+    if ((transport == TRANSPORT_UNIX || transport == TRANSPORT_SHM) && stoi(localPort) <= 0) {
+        cerr << "unix transport needs a node id" << endl;
+        return 1;
     }
     boost::asio::io_context io_context;
     tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), stoi(strServerPort));
-    auto client = new ad_hoc_client(endpoint, io_context, stoi(localPort), wormhole);
+    auto client = new ad_hoc_client(endpoint, io_context, stoi(localPort), wormhole, transport);
     //启动一个线程来运行io_context.run，这样接收数据的流程就不会被用户线程的操作干扰。
     std::thread t(boost::bind(&boost::asio::io_service::run, &io_context));
 
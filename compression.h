@@ -0,0 +1,269 @@
+//
+// Created by 邹迪凯 on 2022/3/18.
+//
+
+#ifndef ADHOC_SIMULATION_COMPRESSION_H
+#define ADHOC_SIMULATION_COMPRESSION_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "message.h"
+
+// 内置的LZ4块格式编解码，与LZ4官方实现的block格式兼容：
+//      sequence：token（高4位为字面量长度，低4位为匹配长度-4）-> [字面量长度扩展] -> 字面量 -> 2字节小端序偏移 -> [匹配长度扩展]
+//      长度为15时，之后的每个字节累加到长度上，直到遇到不为255的字节
+//      最后一个sequence只有字面量，最后5个字节总是字面量，最后一个匹配的起点距离末尾至少12个字节
+//
+// 压缩后的消息载荷：4字节小端序的原载荷长度 + LZ4块，首部中带有MESSAGE_FLAG_COMPRESSED标志
+
+//载荷不小于此长度的用户消息才会压缩，控制帧和很短的消息压缩收益很小
+const int COMPRESSION_MIN_BODY_LENGTH = 128;
+
+const int LZ4_MIN_MATCH = 4;
+const int LZ4_MFLIMIT = 12;
+const int LZ4_LAST_LITERALS = 5;
+const int LZ4_MAX_DISTANCE = 65535;
+const int LZ4_HASH_BITS = 12;
+
+inline uint32_t lz4_read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * 写入一个大于等于15的长度的扩展字节
+ *
+ * @return 写入后的位置，空间不足时返回nullptr
+ */
+inline char *lz4_put_length(char *out, const char *end, int length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= end) {
+            return nullptr;
+        }
+        *out++ = (char) 255;
+    }
+    if (out >= end) {
+        return nullptr;
+    }
+    *out++ = (char) length;
+    return out;
+}
+
+/**
+ * 输出一个sequence，match_length为0时表示只有字面量的最后一个sequence
+ *
+ * @return 写入后的位置，空间不足时返回nullptr
+ */
+inline char *lz4_put_sequence(char *out, const char *end, const char *literals, int literal_length, int offset,
+                              int match_length) {
+    if (out >= end) {
+        return nullptr;
+    }
+    char *token = out++;
+    int match_code = match_length > 0 ? match_length - LZ4_MIN_MATCH : 0;
+    *token = (char) ((literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15 && !(out = lz4_put_length(out, end, literal_length - 15))) {
+        return nullptr;
+    }
+    if (end - out < literal_length) {
+        return nullptr;
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return out;
+    }
+    if (end - out < 2) {
+        return nullptr;
+    }
+    *out++ = (char) offset;
+    *out++ = (char) (offset >> 8);
+    if (match_code >= 15 && !(out = lz4_put_length(out, end, match_code - 15))) {
+        return nullptr;
+    }
+    return out;
+}
+
+/**
+ * LZ4块压缩，使用单个哈希表的贪心匹配
+ *
+ * @param src 原数据
+ * @param length 原数据长度
+ * @param dst 输出缓冲区
+ * @param capacity 输出缓冲区长度
+ * @return 压缩后的长度，输出缓冲区不足时返回0
+ */
+inline int lz4_compress_block(const char *src, int length, char *dst, int capacity) {
+    int table[1 << LZ4_HASH_BITS];
+    memset(table, -1, sizeof(table));
+    const char *end = dst + capacity;
+    char *out = dst;
+    int anchor = 0;
+    int ip = 0;
+    int match_limit = length - LZ4_LAST_LITERALS;
+    for (; ip < length - LZ4_MFLIMIT; ip++) {
+        uint32_t sequence = lz4_read32(src + ip);
+        uint32_t h = lz4_hash(sequence);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ4_MAX_DISTANCE || lz4_read32(src + ref) != sequence) {
+            continue;
+        }
+        int match_length = LZ4_MIN_MATCH;
+        while (ip + match_length < match_limit && src[ref + match_length] == src[ip + match_length]) {
+            match_length++;
+        }
+        out = lz4_put_sequence(out, end, src + anchor, ip - anchor, ip - ref, match_length);
+        if (!out) {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+        //匹配结束处的位置也放进哈希表，提高下一个匹配的命中率
+        if (ip - 2 >= 0 && ip - 2 < length - LZ4_MFLIMIT) {
+            table[lz4_hash(lz4_read32(src + ip - 2))] = ip - 2;
+        }
+        ip--;
+    }
+    out = lz4_put_sequence(out, end, src + anchor, length - anchor, 0, 0);
+    return out ? (int) (out - dst) : 0;
+}
+
+/**
+ * LZ4块解压，对输入做完整的越界检查
+ *
+ * @param src 压缩数据
+ * @param length 压缩数据长度
+ * @param dst 输出缓冲区
+ * @param capacity 输出缓冲区长度
+ * @return 解压后的长度，数据不合法或者输出缓冲区不足时返回-1
+ */
+inline int lz4_decompress_block(const char *src, int length, char *dst, int capacity) {
+    auto in = reinterpret_cast<const uint8_t *>(src);
+    int ip = 0;
+    int op = 0;
+    while (ip < length) {
+        int token = in[ip++];
+        int literal_length = token >> 4;
+        if (literal_length == 15) {
+            int byte;
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                byte = in[ip++];
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > length - ip || literal_length > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == length) {
+            break;
+        }
+        if (length - ip < 2) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+        int match_length = token & 15;
+        if (match_length == 15) {
+            int byte;
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                byte = in[ip++];
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += LZ4_MIN_MATCH;
+        if (match_length > capacity - op) {
+            return -1;
+        }
+        //匹配可能与输出重叠（offset小于匹配长度），只能逐字节拷贝
+        const char *match = dst + op - offset;
+        if (offset >= match_length) {
+            memcpy(dst + op, match, match_length);
+        } else {
+            for (int i = 0; i < match_length; i++) {
+                dst[op + i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+    return op;
+}
+
+/**
+ * 压缩消息载荷
+ *
+ * 压缩后的消息与原消息首部字段相同，带有MESSAGE_FLAG_COMPRESSED标志。已经压缩、长度低于阈值或者压缩后没有变小时保持原样。
+ *
+ * @param msg
+ * @return 是否进行了压缩
+ */
+inline bool ad_hoc_compress(ad_hoc_message &msg) {
+    int raw_length = msg.body_length();
+    if (msg.compressed() || raw_length < COMPRESSION_MIN_BODY_LENGTH) {
+        return false;
+    }
+    const ad_hoc_message &in = msg;
+    ad_hoc_message out(msg.msg_type(), msg.sendid(), msg.receiveid(), msg.sourceid(), msg.destid());
+    out.body_length(raw_length);
+    char *body = out.body();
+    //只接受比原载荷短的压缩结果
+    int length = lz4_compress_block(in.body(), raw_length, body + 4, raw_length - 4 - 1);
+    if (length == 0) {
+        return false;
+    }
+    put_le32(body, raw_length);
+    out.body_length(4 + length);
+    out.flags(msg.flags() | MESSAGE_FLAG_COMPRESSED);
+    out.encode_header();
+    msg = out;
+    return true;
+}
+
+/**
+ * 解压消息载荷，未压缩的消息保持原样
+ *
+ * @param msg
+ * @return 载荷是否合法
+ */
+inline bool ad_hoc_decompress(ad_hoc_message &msg) {
+    if (!msg.compressed()) {
+        return true;
+    }
+    const ad_hoc_message &in = msg;
+    if (in.body_length() < 4) {
+        return false;
+    }
+    int raw_length = get_le32(in.body());
+    if (raw_length < 0 || raw_length > ad_hoc_max_body_length(msg.msg_type())) {
+        return false;
+    }
+    ad_hoc_message out(msg.msg_type(), msg.sendid(), msg.receiveid(), msg.sourceid(), msg.destid());
+    out.flags(msg.flags() & ~MESSAGE_FLAG_COMPRESSED);
+    out.body_length(raw_length);
+    if (lz4_decompress_block(in.body() + 4, in.body_length() - 4, out.body(), raw_length) != raw_length) {
+        return false;
+    }
+    out.encode_header();
+    msg = out;
+    return true;
+}
+
+#endif //ADHOC_SIMULATION_COMPRESSION_H
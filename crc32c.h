@@ -0,0 +1,124 @@
+//
+// Created by 邹迪凯 on 2022/3/21.
+//
+
+#ifndef ADHOC_SIMULATION_CRC32C_H
+#define ADHOC_SIMULATION_CRC32C_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 true
+#else
+#define CRC32C_X86 false
+#endif
+
+// CRC32C（Castagnoli多项式），与iSCSI、ext4等使用的校验和相同。
+// x86上运行时检测SSE4.2，使用crc32指令；不支持时使用slicing-by-8查表实现。
+// 各函数的crc参数为上一段数据的结果，第一段传0，可以分段计算。
+
+const uint32_t CRC32C_POLY = 0x82F63B78;
+
+/**
+ * slicing-by-8的查找表，第一次使用时生成
+ */
+inline const uint32_t (&crc32c_table())[8][256] {
+    static uint32_t table[8][256];
+    static bool ready = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int t = 1; t < 8; t++) {
+                table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+            }
+        }
+        return true;
+    }();
+    (void) ready;
+    return table;
+}
+
+/**
+ * 查表实现，每次处理8个字节
+ */
+inline uint32_t crc32c_sw(uint32_t crc, const char *data, size_t length) {
+    const uint32_t (&table)[8][256] = crc32c_table();
+    auto p = reinterpret_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t low = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^
+              table[4][low >> 24] ^ table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+    }
+    for (; length > 0; length--, p++) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xFF];
+    }
+    return ~crc;
+}
+
+#if CRC32C_X86
+
+/**
+ * SSE4.2 crc32指令实现，64位下每次处理8个字节
+ */
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hw(uint32_t crc, const char *data, size_t length) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; length > 0; length--, data++) {
+        crc = _mm_crc32_u8(crc, (uint8_t) *data);
+    }
+    return ~crc;
+}
+
+inline bool crc32c_hw_available() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+
+#else
+
+inline uint32_t crc32c_hw(uint32_t crc, const char *data, size_t length) {
+    return crc32c_sw(crc, data, length);
+}
+
+inline bool crc32c_hw_available() {
+    return false;
+}
+
+#endif
+
+/**
+ * 计算CRC32C，自动选择硬件或查表实现
+ *
+ * @param crc 上一段数据的结果，第一段为0
+ * @param data
+ * @param length
+ * @return
+ */
+inline uint32_t crc32c(uint32_t crc, const char *data, size_t length) {
+    return crc32c_hw_available() ? crc32c_hw(crc, data, length) : crc32c_sw(crc, data, length);
+}
+
+#endif //ADHOC_SIMULATION_CRC32C_H
@@ -0,0 +1,79 @@
+//
+// Created by 邹迪凯 on 2022/3/21.
+//
+// 测量每个帧计算CRC32C校验尾部的开销：载荷为64B、256B、1KB时，分别使用硬件指令和查表实现，
+// 并以同样长度的memcpy作为参照（接收端从环形缓冲区拷贝载荷本来就需要这一次拷贝）。
+//
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <functional>
+
+#include "crc32c.h"
+#include "wire.h"
+
+using namespace std;
+
+//每种载荷长度至少处理的字节数，保证计时足够长
+const size_t BENCH_BYTES = 512 * 1024 * 1024;
+
+volatile uint32_t bench_sink;
+
+/**
+ * 对frames中的每个帧执行一次op，返回平均每个帧的纳秒数
+ */
+double bench(const vector<vector<char>> &frames, size_t rounds, const function<uint32_t(const vector<char> &)> &op) {
+    uint32_t acc = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (const vector<char> &frame: frames) {
+            acc ^= op(frame);
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    bench_sink = acc;
+    return chrono::duration<double, nano>(end - start).count() / (double) (rounds * frames.size());
+}
+
+int main() {
+    cout << "crc32c hardware: " << (crc32c_hw_available() ? "sse4.2" : "unavailable") << endl;
+    cout << setw(8) << "body" << setw(8) << "frame"
+         << setw(14) << "hw ns/frame" << setw(10) << "hw GB/s"
+         << setw(14) << "sw ns/frame" << setw(10) << "sw GB/s"
+         << setw(16) << "memcpy ns/frame" << endl;
+    for (int body: {64, 256, 1024}) {
+        //v2首部的典型长度为1字节type + 5个varint，这里取10字节
+        size_t frame_length = 10 + body;
+        //64个不同的帧，避免每次都命中同一条缓存行
+        vector<vector<char>> frames(64, vector<char>(frame_length));
+        for (size_t i = 0; i < frames.size(); i++) {
+            for (size_t j = 0; j < frame_length; j++) {
+                frames[i][j] = (char) (i * 131 + j * 7);
+            }
+        }
+        size_t rounds = BENCH_BYTES / (frame_length * frames.size());
+        vector<char> copy(frame_length);
+
+        //没有SSE4.2时执行crc32指令会SIGILL，硬件一栏不测
+        double hw = crc32c_hw_available() ? bench(frames, rounds, [](const vector<char> &f) {
+            return crc32c_hw(0, f.data(), f.size());
+        }) : 0;
+        double sw = bench(frames, rounds, [](const vector<char> &f) {
+            return crc32c_sw(0, f.data(), f.size());
+        });
+        double mc = bench(frames, rounds, [&copy](const vector<char> &f) {
+            memcpy(copy.data(), f.data(), f.size());
+            return (uint32_t) copy[f.size() / 2];
+        });
+        cout << setw(8) << body << setw(8) << frame_length + WIRE_CRC_LENGTH << fixed << setprecision(1);
+        if (hw > 0) {
+            cout << setw(14) << hw << setw(10) << setprecision(2) << frame_length / hw;
+        } else {
+            cout << setw(14) << "n/a" << setw(10) << "n/a";
+        }
+        cout << setw(14) << setprecision(1) << sw << setw(10) << setprecision(2) << frame_length / sw
+             << setw(16) << setprecision(1) << mc << endl;
+    }
+    return 0;
+}
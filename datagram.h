@@ -0,0 +1,323 @@
+//
+// Created by 邹迪凯 on 2022/3/27.
+//
+
+#ifndef ADHOC_SIMULATION_DATAGRAM_H
+#define ADHOC_SIMULATION_DATAGRAM_H
+
+#include <deque>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <boost/asio.hpp>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "message.h"
+#include "wire.h"
+
+using boost::asio::ip::udp;
+using namespace std;
+
+// 数据报传输：每个UDP数据报恰好是一个帧，首部固定使用v2格式，不带CRC32C尾部，不需要协商。
+// 一个帧丢失或者迟到不会阻塞之后的帧，与无线链路的语义一致。
+// 只有8字节协商报文的数据报是控制报文：'A' 'D' 'H' 'C' version features op 0，
+// op为DATAGRAM_JOIN时server把发送方地址上的节点加入scope，为DATAGRAM_LEAVE时离开。
+// JOIN中的features是client支持的特性，server向不支持压缩的节点转发压缩的帧时先解压。
+const int DATAGRAM_JOIN = 1;
+const int DATAGRAM_LEAVE = 2;
+//数据报传输上可以使用的特性
+const int DATAGRAM_FEATURES = WIRE_FEATURE_COMPRESSION;
+//一次recvmmsg/sendmmsg最多处理的数据报数
+const unsigned DATAGRAM_BATCH = 64;
+//一个数据报的最大长度：v2首部加上最长的载荷（隧道帧）
+const size_t DATAGRAM_MAX_LENGTH = WIRE_MAX_HEADER_LENGTH + ADHOCMESSAGE_MAX_TUNNEL_BODY_LENGTH;
+//待发送队列的上限，队列满时丢弃新的帧，而不是让它们等待
+const size_t DATAGRAM_QUEUE_LIMIT = 8192;
+
+/**
+ * 收到数据报的回调接口
+ */
+class ad_hoc_datagram_listener {
+public:
+    virtual ~ad_hoc_datagram_listener() {}
+
+    virtual void handle_datagram(ad_hoc_message &msg, const udp::endpoint &from) = 0;
+
+    /**
+     * @param op DATAGRAM_JOIN或DATAGRAM_LEAVE
+     * @param features 对端支持的特性
+     */
+    virtual void handle_control(int op, int features, const udp::endpoint &from) = 0;
+};
+
+/**
+ * UDP socket上的成批收发
+ *
+ * 接收：socket可读时用一次recvmmsg取出最多DATAGRAM_BATCH个数据报，每个数据报解码为一个帧交给listener；
+ *      取满一批时不等待可读通知，直接再取一批。长度与首部不符、被截断的数据报直接丢弃。
+ * 发送：send只把帧放入队列，并向executor投递一次flush，同一轮事件循环中放入的帧用一次sendmmsg发出。
+ *      首部按v2编码到暂存区，载荷直接引用帧缓冲区，每个数据报是一个两段的iovec。发送缓冲区满时等待可写后继续。
+ * 所有函数和回调都在构造时给定的executor上执行（server上是一个strand），调用方不需要加锁。
+ */
+class ad_hoc_datagram_channel {
+public:
+    struct stats {
+        size_t received; //收到的帧数
+        size_t sent; //发出的帧数
+        size_t dropped; //因为队列满或者发送失败而丢弃的帧数
+        size_t malformed; //不合法而丢弃的数据报数
+        size_t receive_calls; //recvmmsg的次数
+        size_t send_calls; //sendmmsg的次数
+    };
+
+    /**
+     * @param socket
+     * @param executor 执行所有回调的executor
+     * @param listener
+     * @param features 本端支持的特性，不在DATAGRAM_FEATURES中的被忽略
+     */
+    ad_hoc_datagram_channel(udp::socket &socket, const boost::asio::any_io_executor &executor,
+                            ad_hoc_datagram_listener *listener, int features = DATAGRAM_FEATURES)
+            : socket_(socket), executor_(executor), listener_(listener), flush_scheduled_(false),
+              waiting_write_(false), closed_(false), stats_() {
+        codec_.start_datagram(features & DATAGRAM_FEATURES);
+        receive_buffer_.resize(DATAGRAM_BATCH * DATAGRAM_MAX_LENGTH);
+        receive_addrs_.resize(DATAGRAM_BATCH);
+        receive_iovs_.resize(DATAGRAM_BATCH);
+        receive_msgs_.resize(DATAGRAM_BATCH);
+        send_scratch_.resize(DATAGRAM_BATCH * WIRE_MAX_HEADER_LENGTH);
+        send_iovs_.resize(2 * DATAGRAM_BATCH);
+        send_msgs_.resize(DATAGRAM_BATCH);
+    }
+
+    const ad_hoc_wire_codec &codec() const {
+        return codec_;
+    }
+
+    /**
+     * 开始接收，socket应当已经打开并绑定了地址
+     */
+    void start() {
+        socket_.non_blocking(true);
+        wait_read();
+    }
+
+    /**
+     * 把一个帧放入发送队列，帧中的标志应当是本端codec允许的
+     *
+     * @return 本次调用是否发起了新的一轮发送
+     */
+    bool send(const ad_hoc_message &msg, const udp::endpoint &to) {
+        if (closed_) {
+            return false;
+        }
+        if (queue_.size() >= DATAGRAM_QUEUE_LIMIT) {
+            stats_.dropped++;
+            return false;
+        }
+        queue_.push_back(outgoing{to, msg, 0});
+        return schedule_flush();
+    }
+
+    /**
+     * 发送一个控制报文
+     */
+    void send_control(int op, const udp::endpoint &to) {
+        if (!closed_) {
+            queue_.push_back(outgoing{to, ad_hoc_message(), op});
+            schedule_flush();
+        }
+    }
+
+    /**
+     * 关闭socket，队列中还没有发出的帧被丢弃
+     */
+    void close() {
+        closed_ = true;
+        queue_.clear();
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
+
+    stats statistics() const {
+        return stats_;
+    }
+
+private:
+    struct outgoing {
+        udp::endpoint to;
+        ad_hoc_message msg;
+        int control; //不为0时是控制报文
+    };
+
+    void wait_read() {
+        socket_.async_wait(udp::socket::wait_read,
+                           boost::asio::bind_executor(executor_, [this](const boost::system::error_code &error) {
+                               if (!error && !closed_) {
+                                   receive();
+                               }
+                           }));
+    }
+
+    void receive() {
+        for (unsigned i = 0; i < DATAGRAM_BATCH; i++) {
+            receive_iovs_[i].iov_base = receive_buffer_.data() + i * DATAGRAM_MAX_LENGTH;
+            receive_iovs_[i].iov_len = DATAGRAM_MAX_LENGTH;
+            msghdr &hdr = receive_msgs_[i].msg_hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &receive_addrs_[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &receive_iovs_[i];
+            hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(socket_.native_handle(), receive_msgs_.data(), DATAGRAM_BATCH, MSG_DONTWAIT, nullptr);
+        stats_.receive_calls++;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                cerr << "recvmmsg: " << strerror(errno) << endl;
+            }
+            wait_read();
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            const msghdr &hdr = receive_msgs_[i].msg_hdr;
+            udp::endpoint from;
+            memcpy(from.data(), hdr.msg_name, hdr.msg_namelen);
+            from.resize(hdr.msg_namelen);
+            if (hdr.msg_flags & MSG_TRUNC) {
+                stats_.malformed++;
+                continue;
+            }
+            dispatch(static_cast<const char *>(receive_iovs_[i].iov_base), receive_msgs_[i].msg_len, from);
+            if (closed_) {
+                return;
+            }
+        }
+        if (n == (int) DATAGRAM_BATCH) {
+            boost::asio::post(executor_, [this] {
+                if (!closed_) {
+                    receive();
+                }
+            });
+        } else {
+            wait_read();
+        }
+    }
+
+    /**
+     * 解码一个数据报：控制报文交给handle_control，帧分配一个大小正好的缓冲区后交给handle_datagram
+     */
+    void dispatch(const char *in, size_t length, const udp::endpoint &from) {
+        if (length == (size_t) WIRE_PREAMBLE_LENGTH && !memcmp(in, WIRE_PREAMBLE_MAGIC, sizeof(WIRE_PREAMBLE_MAGIC))) {
+            listener_->handle_control((uint8_t) in[6], (uint8_t) in[5], from);
+            return;
+        }
+        ad_hoc_message msg;
+        int header_length = codec_.decode_header(in, length, msg);
+        if (header_length <= 0 || header_length + (size_t) msg.body_length() != length) {
+            stats_.malformed++;
+            return;
+        }
+        memcpy(msg.body(), in + header_length, msg.body_length());
+        msg.encode_header();
+        stats_.received++;
+        listener_->handle_datagram(msg, from);
+    }
+
+    bool schedule_flush() {
+        if (flush_scheduled_ || waiting_write_) {
+            return false;
+        }
+        flush_scheduled_ = true;
+        boost::asio::post(executor_, [this] {
+            flush_scheduled_ = false;
+            flush();
+        });
+        return true;
+    }
+
+    void flush() {
+        while (!queue_.empty() && !closed_) {
+            unsigned count = queue_.size() < DATAGRAM_BATCH ? (unsigned) queue_.size() : DATAGRAM_BATCH;
+            for (unsigned i = 0; i < count; i++) {
+                outgoing &item = queue_[i];
+                char *header = send_scratch_.data() + i * WIRE_MAX_HEADER_LENGTH;
+                iovec *iov = &send_iovs_[2 * i];
+                size_t iov_count = 1;
+                if (item.control) {
+                    memcpy(header, WIRE_PREAMBLE_MAGIC, sizeof(WIRE_PREAMBLE_MAGIC));
+                    header[4] = (char) codec_.version();
+                    header[5] = (char) codec_.features();
+                    header[6] = (char) item.control;
+                    header[7] = 0;
+                    iov[0] = iovec{header, (size_t) WIRE_PREAMBLE_LENGTH};
+                } else {
+                    iov[0] = iovec{header, codec_.encode_header(item.msg, header)};
+                    if (item.msg.body_length() > 0) {
+                        iov[1] = iovec{const_cast<char *>(item.msg.body()), (size_t) item.msg.body_length()};
+                        iov_count = 2;
+                    }
+                }
+                msghdr &hdr = send_msgs_[i].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_name = item.to.data();
+                hdr.msg_namelen = (socklen_t) item.to.size();
+                hdr.msg_iov = iov;
+                hdr.msg_iovlen = iov_count;
+            }
+            int n = sendmmsg(socket_.native_handle(), send_msgs_.data(), count, MSG_DONTWAIT);
+            stats_.send_calls++;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_write();
+                    return;
+                }
+                //其他错误只针对队首的数据报（例如目的地址不可达），丢弃后继续发送其余的
+                stats_.dropped++;
+                queue_.pop_front();
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                if (!queue_.front().control) {
+                    stats_.sent++;
+                }
+                queue_.pop_front();
+            }
+        }
+    }
+
+    void wait_write() {
+        waiting_write_ = true;
+        socket_.async_wait(udp::socket::wait_write,
+                           boost::asio::bind_executor(executor_, [this](const boost::system::error_code &error) {
+                               waiting_write_ = false;
+                               if (!error && !closed_) {
+                                   flush();
+                               }
+                           }));
+    }
+
+    udp::socket &socket_;
+    boost::asio::any_io_executor executor_;
+    ad_hoc_datagram_listener *listener_;
+    ad_hoc_wire_codec codec_;
+    deque<outgoing> queue_; //待发送的帧
+    bool flush_scheduled_; //是否已经投递了flush
+    bool waiting_write_; //是否在等待socket可写
+    bool closed_;
+    stats stats_;
+    //一批recvmmsg/sendmmsg使用的数组，在构造时分配
+    vector<char> receive_buffer_;
+    vector<sockaddr_storage> receive_addrs_;
+    vector<iovec> receive_iovs_;
+    vector<mmsghdr> receive_msgs_;
+    vector<char> send_scratch_;
+    vector<iovec> send_iovs_;
+    vector<mmsghdr> send_msgs_;
+};
+
+#endif //ADHOC_SIMULATION_DATAGRAM_H
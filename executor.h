@@ -0,0 +1,111 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_EXECUTOR_H
+#define ADHOC_SIMULATION_EXECUTOR_H
+
+#include <memory>
+#include <functional>
+#include <boost/asio.hpp>
+
+using namespace std;
+
+typedef function<void(const boost::system::error_code &)> ad_hoc_wait_handler;
+
+/**
+ * 定时器，接口与boost::asio::deadline_timer相同
+ *
+ * 重新设置到期时间、cancel以及定时器析构都会取消正在等待的回调，回调收到operation_aborted。
+ */
+class ad_hoc_timer {
+public:
+    virtual ~ad_hoc_timer() {}
+
+    virtual void expires_from_now(const boost::posix_time::time_duration &duration) = 0;
+
+    virtual void async_wait(ad_hoc_wait_handler handler) = 0;
+
+    virtual void cancel() = 0;
+};
+
+typedef shared_ptr<ad_hoc_timer> timer_ptr;
+
+/**
+ * 执行器：投递回调、创建定时器和读取当前时间
+ *
+ * client和scope的所有回调和定时器都经过执行器。运行在io_context上时使用真实时间；离散事件仿真中由simulation.h的ad_hoc_simulator
+ * 以虚拟时钟驱动，事件按时间顺序依次执行，不等待真实的时间流逝。
+ */
+class ad_hoc_executor {
+public:
+    virtual ~ad_hoc_executor() {}
+
+    virtual void post(function<void()> handler) = 0;
+
+    /**
+     * 创建一个还没有设置到期时间的定时器
+     */
+    virtual timer_ptr create_timer() = 0;
+
+    virtual boost::posix_time::ptime now() = 0;
+
+    /**
+     * 创建一个在duration之后到期的定时器
+     */
+    timer_ptr make_timer(const boost::posix_time::time_duration &duration) {
+        timer_ptr timer = create_timer();
+        timer->expires_from_now(duration);
+        return timer;
+    }
+};
+
+/**
+ * io_context上的定时器
+ */
+class ad_hoc_asio_timer : public ad_hoc_timer {
+public:
+    explicit ad_hoc_asio_timer(boost::asio::io_context &io_context) : timer(io_context) {
+    }
+
+    void expires_from_now(const boost::posix_time::time_duration &duration) override {
+        timer.expires_from_now(duration);
+    }
+
+    void async_wait(ad_hoc_wait_handler handler) override {
+        timer.async_wait(std::move(handler));
+    }
+
+    void cancel() override {
+        timer.cancel();
+    }
+
+private:
+    boost::asio::deadline_timer timer;
+};
+
+/**
+ * io_context上的执行器，使用真实时间
+ */
+class ad_hoc_asio_executor : public ad_hoc_executor {
+public:
+    explicit ad_hoc_asio_executor(boost::asio::io_context &io_context) : io_context(io_context) {
+    }
+
+    void post(function<void()> handler) override {
+        boost::asio::post(io_context, std::move(handler));
+    }
+
+    timer_ptr create_timer() override {
+        return make_shared<ad_hoc_asio_timer>(io_context);
+    }
+
+    boost::posix_time::ptime now() override {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+private:
+    boost::asio::io_context &io_context;
+};
+
+#endif //ADHOC_SIMULATION_EXECUTOR_H
@@ -0,0 +1,231 @@
+//
+// Created by 邹迪凯 on 2022/3/16.
+//
+
+#ifndef ADHOC_SIMULATION_FRAGMENT_H
+#define ADHOC_SIMULATION_FRAGMENT_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include "boost/functional/hash.hpp"
+#include "boost/asio.hpp"
+
+#include "message.h"
+#include "aodv.h"
+
+// 分片的载荷：12字节的分片首部 + 原载荷中的一段
+//      payload_id：发送方为每个被分片的载荷分配的编号，与sourceid一起唯一标识一个载荷
+//      total_length：原载荷的总长度
+//      offset：本分片在原载荷中的偏移，为FRAGMENT_CHUNK_LENGTH的整数倍
+const int FRAGMENT_HEADER_LENGTH = 12;
+//分片帧的载荷长度上限，隧道帧的载荷上限可以容纳一个完整的分片帧
+const int FRAGMENT_BODY_LENGTH = ADHOCMESSAGE_MAX_BODY_LENGTH;
+//每个分片携带的原载荷长度，最后一个分片可能更短
+const int FRAGMENT_CHUNK_LENGTH = FRAGMENT_BODY_LENGTH - FRAGMENT_HEADER_LENGTH;
+
+//单个载荷的长度上限
+const size_t REASSEMBLY_MAX_PAYLOAD_LENGTH = 64 * 1024 * 1024;
+//所有未重组完成的载荷占用的内存上限，超过后新的载荷会被丢弃
+const size_t REASSEMBLY_MAX_BYTES = 64 * 1024 * 1024;
+//从收到第一个分片开始，超过此时间仍未重组完成的载荷会被丢弃
+const int REASSEMBLY_TIMEOUT = 30;
+
+const int REASSEMBLY_DROPPED = -1;
+const int REASSEMBLY_PENDING = 0;
+const int REASSEMBLY_STARTED = 1;
+const int REASSEMBLY_COMPLETE = 2;
+
+/**
+ * 把一个超过单帧上限的消息拆分为多个FRAGMENT_MESSAGE类型的分片
+ *
+ * 分片沿用原消息的首部字段，由调用方逐个取出后连续放入发送队列，中间节点收到一个分片就转发一个，
+ * 不需要等待整个载荷到达，多个分片在路径上流水线式地传输。
+ *
+ * 使用方式：
+ *   ad_hoc_fragmenter fragmenter(msg, payload_id);
+ *   while (fragmenter.next(fragment)) {...}
+ */
+class ad_hoc_fragmenter {
+public:
+    ad_hoc_fragmenter(const ad_hoc_message &msg, uint32_t payload_id) : msg_(msg), payload_id_(payload_id),
+                                                                         offset_(0) {
+    }
+
+    /**
+     * 生成下一个分片
+     *
+     * @param fragment
+     * @return 是否还有分片
+     */
+    bool next(ad_hoc_message &fragment) {
+        auto total = (size_t) msg_.body_length();
+        if (offset_ >= total) {
+            return false;
+        }
+        size_t chunk = total - offset_ < (size_t) FRAGMENT_CHUNK_LENGTH ? total - offset_ : FRAGMENT_CHUNK_LENGTH;
+        fragment = ad_hoc_message(FRAGMENT_MESSAGE, msg_.sendid(), msg_.receiveid(), msg_.sourceid(), msg_.destid());
+        fragment.body_length((int) (FRAGMENT_HEADER_LENGTH + chunk));
+        char *body = fragment.body();
+        put_le32(body, (int) payload_id_);
+        put_le32(body + 4, (int) total);
+        put_le32(body + 8, (int) offset_);
+        memcpy(body + FRAGMENT_HEADER_LENGTH, msg_.body() + offset_, chunk);
+        fragment.encode_header();
+        offset_ += chunk;
+        return true;
+    }
+
+private:
+    const ad_hoc_message msg_;
+    uint32_t payload_id_;
+    size_t offset_;
+};
+
+struct ad_hoc_fragment_key {
+    int source;
+    uint32_t payload_id;
+
+    bool operator==(const ad_hoc_fragment_key &r) const {
+        return source == r.source && payload_id == r.payload_id;
+    }
+};
+
+namespace std {
+    template<>
+    struct hash<ad_hoc_fragment_key> {
+        size_t operator()(const ad_hoc_fragment_key &r) const noexcept {
+            auto t = make_tuple(r.source, r.payload_id);
+            return boost::hash_value(t);
+        }
+    };
+}
+
+/**
+ * 目的节点上的分片重组缓冲区
+ *
+ * 收到一个载荷的第一个分片时，按原载荷的总长度分配一个大小正好的消息，之后每个分片的数据直接拷贝到它在载荷中的位置，
+ * 全部分片到达后把这个消息交给应用层，不再整体拷贝。
+ * 所有未完成载荷的总大小受REASSEMBLY_MAX_BYTES限制，每个未完成载荷有一个定时器，超时后由client调用remove丢弃。
+ */
+class ad_hoc_reassembly_buffer {
+public:
+    explicit ad_hoc_reassembly_buffer(size_t max_bytes = REASSEMBLY_MAX_BYTES) : max_bytes_(max_bytes), bytes_(0) {
+    }
+
+    /**
+     * 处理一个分片
+     *
+     * @param fragment 分片消息
+     * @param key 分片所属载荷的标识
+     * @param payload 重组完成时，为首部字段取自分片、类型为ORDINARY_MESSAGE的完整载荷消息
+     * @return REASSEMBLY_STARTED：收到了一个新载荷的第一个分片，调用方需要为其启动定时器
+     *         REASSEMBLY_PENDING：载荷还未重组完成
+     *         REASSEMBLY_COMPLETE：载荷重组完成
+     *         REASSEMBLY_DROPPED：分片不合法，或者超过了内存上限
+     */
+    int add(const ad_hoc_message &fragment, ad_hoc_fragment_key &key, ad_hoc_message &payload) {
+        if (fragment.body_length() < FRAGMENT_HEADER_LENGTH) {
+            return REASSEMBLY_DROPPED;
+        }
+        const char *body = fragment.body();
+        key = ad_hoc_fragment_key{fragment.sourceid(), (uint32_t) get_le32(body)};
+        auto total = (size_t) (uint32_t) get_le32(body + 4);
+        auto offset = (size_t) (uint32_t) get_le32(body + 8);
+        size_t chunk = fragment.body_length() - FRAGMENT_HEADER_LENGTH;
+        size_t expected = total - offset < (size_t) FRAGMENT_CHUNK_LENGTH ? total - offset : FRAGMENT_CHUNK_LENGTH;
+        if (total == 0 || total > REASSEMBLY_MAX_PAYLOAD_LENGTH || offset >= total ||
+            offset % FRAGMENT_CHUNK_LENGTH != 0 || chunk != expected) {
+            return REASSEMBLY_DROPPED;
+        }
+
+        int result = REASSEMBLY_PENDING;
+        auto it = reassembly_map.find(key);
+        if (it == reassembly_map.end()) {
+            if (bytes_ + total > max_bytes_) {
+                return REASSEMBLY_DROPPED;
+            }
+            ad_hoc_reassembly &entry = reassembly_map[key];
+            entry.payload = ad_hoc_message(ORDINARY_MESSAGE, fragment.sendid(), fragment.receiveid(),
+                                           fragment.sourceid(), fragment.destid());
+            entry.payload.body_length((int) total);
+            entry.received.assign((total + FRAGMENT_CHUNK_LENGTH - 1) / FRAGMENT_CHUNK_LENGTH, false);
+            entry.remaining = entry.received.size();
+            bytes_ += total;
+            it = reassembly_map.find(key);
+            result = REASSEMBLY_STARTED;
+        } else if ((size_t) it->second.payload.body_length() != total) {
+            return REASSEMBLY_DROPPED;
+        }
+
+        ad_hoc_reassembly &entry = it->second;
+        size_t index = offset / FRAGMENT_CHUNK_LENGTH;
+        if (!entry.received[index]) {
+            memcpy(entry.payload.body() + offset, body + FRAGMENT_HEADER_LENGTH, chunk);
+            entry.received[index] = true;
+            entry.remaining--;
+        }
+        if (entry.remaining > 0) {
+            return result;
+        }
+        //先移出载荷再删除表项，保证载荷缓冲区只有一个引用，编码首部时不会触发写时复制
+        payload = std::move(entry.payload);
+        bytes_ -= total;
+        reassembly_map.erase(it);
+        payload.sendid(fragment.sendid());
+        payload.receiveid(fragment.receiveid());
+        payload.encode_header();
+        return REASSEMBLY_COMPLETE;
+    }
+
+    timer_ptr new_timer(ad_hoc_executor &executor, const ad_hoc_fragment_key &key) {
+        auto it = reassembly_map.find(key);
+        if (it == reassembly_map.end()) {
+            return nullptr;
+        }
+        it->second.timer = executor.make_timer(boost::posix_time::seconds(REASSEMBLY_TIMEOUT));
+        return it->second.timer;
+    }
+
+    bool contains(const ad_hoc_fragment_key &key) {
+        return reassembly_map.find(key) != reassembly_map.end();
+    }
+
+    /**
+     * 丢弃一个未完成的载荷，释放其占用的内存
+     *
+     * @param key
+     */
+    void remove(const ad_hoc_fragment_key &key) {
+        auto it = reassembly_map.find(key);
+        if (it == reassembly_map.end()) {
+            return;
+        }
+        bytes_ -= it->second.payload.body_length();
+        reassembly_map.erase(it);
+    }
+
+    /**
+     * 所有未完成载荷占用的字节数
+     */
+    size_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    struct ad_hoc_reassembly {
+        ad_hoc_message payload;
+        //每个分片是否已经收到，重复的分片会被忽略
+        std::vector<bool> received;
+        size_t remaining;
+        timer_ptr timer;
+    };
+
+    unordered_map<ad_hoc_fragment_key, ad_hoc_reassembly> reassembly_map;
+    size_t max_bytes_;
+    size_t bytes_;
+};
+
+#endif //ADHOC_SIMULATION_FRAGMENT_H
@@ -0,0 +1,57 @@
+//
+// Created by 邹迪凯 on 2022/3/2.
+//
+
+#ifndef ADHOC_SIMULATION_FRAME_BUFFER_H
+#define ADHOC_SIMULATION_FRAME_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <boost/intrusive_ptr.hpp>
+
+#include "message_pool.h"
+
+/**
+ * 引用计数的帧缓冲区
+ *
+ * 控制块和字节数据分配在同一块内存上，字节数据紧跟在控制块之后，容量按照实际帧长度向上取整到内存池的尺寸等级。
+ * 多个ad_hoc_message可以共享同一个缓冲区，最后一个引用释放时归还内存。
+ */
+struct ad_hoc_frame_buffer {
+    std::atomic<int> refs;
+    size_t capacity;
+
+    char *bytes() {
+        return reinterpret_cast<char *>(this + 1);
+    }
+
+    static ad_hoc_frame_buffer *allocate(size_t capacity) {
+        size_t size = ad_hoc_message_pool::block_size(sizeof(ad_hoc_frame_buffer) + capacity);
+        void *memory = ad_hoc_message_pool::allocate(size);
+        auto *buffer = new(memory) ad_hoc_frame_buffer;
+        buffer->refs.store(0, std::memory_order_relaxed);
+        buffer->capacity = size - sizeof(ad_hoc_frame_buffer);
+        return buffer;
+    }
+
+    static void release(ad_hoc_frame_buffer *buffer) {
+        size_t size = sizeof(ad_hoc_frame_buffer) + buffer->capacity;
+        buffer->~ad_hoc_frame_buffer();
+        ad_hoc_message_pool::deallocate(buffer, size);
+    }
+};
+
+inline void intrusive_ptr_add_ref(ad_hoc_frame_buffer *buffer) {
+    buffer->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void intrusive_ptr_release(ad_hoc_frame_buffer *buffer) {
+    if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ad_hoc_frame_buffer::release(buffer);
+    }
+}
+
+typedef boost::intrusive_ptr<ad_hoc_frame_buffer> ad_hoc_frame_buffer_ptr;
+
+#endif //ADHOC_SIMULATION_FRAME_BUFFER_H
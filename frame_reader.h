@@ -0,0 +1,243 @@
+//
+// Created by 邹迪凯 on 2022/3/10.
+//
+
+#ifndef ADHOC_SIMULATION_FRAME_READER_H
+#define ADHOC_SIMULATION_FRAME_READER_H
+
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+
+#include "message.h"
+#include "wire.h"
+#include "crc32c.h"
+
+//接收环形缓冲区的容量，必须大于一个最大帧的长度
+const size_t FRAME_READER_CAPACITY = 64 * 1024;
+
+/**
+ * 基于环形缓冲区的流式帧读取器
+ *
+ * 每次读操作尽可能多地读入socket接收缓冲区中的数据，然后就地解析出其中所有完整的帧，
+ * 不完整的帧留在环中等待下一次读操作补齐，帧可以跨越环的末尾。
+ * 这样每次系统调用和回调可以处理多个帧，而不是每个帧分首部、载荷两次async_read。
+ * 首部按codec协商的版本解码；协商完成之前，先从数据流中解析对端的协商报文。
+ * 协商了CRC32C时校验每个帧的尾部，首部不合法或者校验失败时跳过一个字节，逐字节扫描直到找到下一个校验通过的帧，
+ * 而不是停止读取。重新同步期间，若当前位置解析出的（可能是伪造的）首部声称的长度超过了已收到的数据，
+ * 会继续向后寻找一个完整且校验通过的帧，避免其后已经到达的帧一直等待。
+ * 没有校验尾部时无法可靠地重新同步，遇到不合法的首部后停止解析（corrupt()为true）。
+ *
+ * 使用方式：
+ *   socket.async_read_some(reader.prepare(), handle_read);
+ *   handle_read中：reader.commit(n); while (reader.next(msg)) {...} 然后发起下一次读。
+ */
+class ad_hoc_frame_reader {
+public:
+    typedef boost::array<boost::asio::mutable_buffer, 2> buffers_type;
+
+    explicit ad_hoc_frame_reader(ad_hoc_wire_codec &codec, size_t capacity = FRAME_READER_CAPACITY) : codec_(codec),
+                                                                                                       ring_(capacity),
+                                                                                                       head_(0),
+                                                                                                       size_(0),
+                                                                                                       corrupt_(false),
+                                                                                                       resyncing_(false),
+                                                                                                       skipped_(0) {
+    }
+
+    /**
+     * 环中空闲的区域，环绕时分为两段，可直接作为async_read_some的buffer序列
+     *
+     * @return
+     */
+    buffers_type prepare() {
+        size_t capacity = ring_.size();
+        size_t tail = (head_ + size_) % capacity;
+        size_t free = capacity - size_;
+        size_t first = tail + free <= capacity ? free : capacity - tail;
+        buffers_type buffers;
+        buffers[0] = boost::asio::buffer(ring_.data() + tail, first);
+        buffers[1] = boost::asio::buffer(ring_.data(), free - first);
+        return buffers;
+    }
+
+    /**
+     * 读操作完成，将读入的字节计入环中
+     *
+     * @param bytes_transferred
+     */
+    void commit(size_t bytes_transferred) {
+        size_ += bytes_transferred;
+    }
+
+    /**
+     * 解析环中的下一个完整帧
+     *
+     * 首部就地解码（跨越环末尾时先拼接到临时数组），帧完整时才为其分配缓冲区，拷贝载荷并生成v1格式的本地首部。
+     *
+     * @param msg 解析出的消息
+     * @return 是否解析出了一个完整帧。返回false时，要么数据不足一帧，要么首部不合法（corrupt()为true）。
+     */
+    bool next(ad_hoc_message &msg) {
+        if (corrupt_ || (!codec_.negotiated() && !negotiate())) {
+            return false;
+        }
+        bool checked = codec_.supports(WIRE_FEATURE_CRC32C);
+        size_t trailer_length = checked ? WIRE_CRC_LENGTH : 0;
+        while (true) {
+            int header_length = decode(0, msg);
+            if (header_length < 0) {
+                if (!checked) {
+                    corrupt_ = true;
+                    return false;
+                }
+                skip(1);
+                continue;
+            }
+            size_t frame_length = header_length + msg.body_length();
+            if (header_length == 0 || size_ < frame_length + trailer_length) {
+                if (resyncing_ && seek()) {
+                    continue;
+                }
+                return false;
+            }
+            if (checked && !verify(0, frame_length)) {
+                skip(1);
+                continue;
+            }
+            resyncing_ = false;
+            copy_out(header_length, msg.body_length(), msg.body());
+            msg.encode_header();
+            consume(frame_length + trailer_length);
+            return true;
+        }
+    }
+
+    /**
+     * 是否遇到了不合法的首部，此时读取器不再解析后续数据
+     */
+    bool corrupt() const {
+        return corrupt_;
+    }
+
+    /**
+     * 重新同步时累计跳过的字节数
+     */
+    size_t skipped() const {
+        return skipped_;
+    }
+
+private:
+    /**
+     * 解析对端的协商报文
+     *
+     * @return 协商是否完成
+     */
+    bool negotiate() {
+        char preamble[WIRE_MAX_PREAMBLE_LENGTH];
+        size_t avail = size_ < (size_t) WIRE_MAX_PREAMBLE_LENGTH ? size_ : WIRE_MAX_PREAMBLE_LENGTH;
+        int consumed = codec_.negotiate(peek(0, avail, preamble), avail);
+        if (consumed < 0) {
+            corrupt_ = consumed == -1;
+            return false;
+        }
+        consume(consumed);
+        return true;
+    }
+
+    /**
+     * 解码从head_偏移offset开始的首部
+     *
+     * @return 同ad_hoc_wire_codec::decode_header
+     */
+    int decode(size_t offset, ad_hoc_message &msg) const {
+        char header[WIRE_MAX_HEADER_LENGTH];
+        size_t avail = size_ - offset < (size_t) WIRE_MAX_HEADER_LENGTH ? size_ - offset : WIRE_MAX_HEADER_LENGTH;
+        return codec_.decode_header(peek(offset, avail, header), avail, msg);
+    }
+
+    /**
+     * 校验环中从head_偏移offset开始、长度为length的帧与其后的CRC32C尾部是否一致，帧跨越环末尾时分两段计算
+     */
+    bool verify(size_t offset, size_t length) const {
+        size_t capacity = ring_.size();
+        size_t start = (head_ + offset) % capacity;
+        size_t first = start + length <= capacity ? length : capacity - start;
+        uint32_t crc = crc32c(0, ring_.data() + start, first);
+        crc = crc32c(crc, ring_.data(), length - first);
+        char trailer[WIRE_CRC_LENGTH];
+        return (uint32_t) get_le32(peek(offset + length, WIRE_CRC_LENGTH, trailer)) == crc;
+    }
+
+    /**
+     * 重新同步期间，在已收到的数据中向后寻找第一个完整且校验通过的帧，并跳到它的起点
+     *
+     * @return 是否找到
+     */
+    bool seek() {
+        ad_hoc_message candidate;
+        for (size_t offset = 1; offset < size_; offset++) {
+            int header_length = decode(offset, candidate);
+            if (header_length <= 0) {
+                continue;
+            }
+            size_t frame_length = header_length + candidate.body_length();
+            if (offset + frame_length + WIRE_CRC_LENGTH <= size_ && verify(offset, frame_length)) {
+                skip(offset);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * 跳过length个字节，从之后的位置开始寻找合法的帧
+     */
+    void skip(size_t length) {
+        consume(length);
+        skipped_ += length;
+        resyncing_ = true;
+    }
+
+    /**
+     * 取得从head_偏移offset开始的length个字节，连续时直接返回环内地址，跨越环末尾时拼接到scratch中
+     */
+    const char *peek(size_t offset, size_t length, char *scratch) const {
+        size_t start = (head_ + offset) % ring_.size();
+        if (start + length <= ring_.size()) {
+            return ring_.data() + start;
+        }
+        copy_out(offset, length, scratch);
+        return scratch;
+    }
+
+    void copy_out(size_t offset, size_t length, char *dest) const {
+        size_t capacity = ring_.size();
+        size_t start = (head_ + offset) % capacity;
+        size_t first = start + length <= capacity ? length : capacity - start;
+        memcpy(dest, ring_.data() + start, first);
+        memcpy(dest + first, ring_.data(), length - first);
+    }
+
+    void consume(size_t length) {
+        head_ = (head_ + length) % ring_.size();
+        size_ -= length;
+        if (size_ == 0) {
+            //环为空时回到起点，让下一次读尽量落在一段连续的区域中
+            head_ = 0;
+        }
+    }
+
+    ad_hoc_wire_codec &codec_;
+    std::vector<char> ring_;
+    //环中第一个未解析字节的位置
+    size_t head_;
+    //环中未解析的字节数
+    size_t size_;
+    bool corrupt_;
+    //是否正在重新同步，即上一次校验失败之后还没有找到校验通过的帧
+    bool resyncing_;
+    size_t skipped_;
+};
+
+#endif //ADHOC_SIMULATION_FRAME_READER_H
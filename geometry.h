@@ -0,0 +1,470 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_GEOMETRY_H
+#define ADHOC_SIMULATION_GEOMETRY_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "channel.h"
+#include "topology.h"
+
+using namespace std;
+
+//默认的通信半径，米
+const double GEOMETRY_RANGE = 250;
+//按节点数确定场地大小时的目标平均邻居数
+const double GEOMETRY_DEGREE = 6;
+//移动模型的默认更新间隔
+const int MOBILITY_TICK_MS = 1000;
+//随机路点模型的速度范围（米/秒）和到达路点后的停留时间（秒）
+const double WAYPOINT_MIN_SPEED = 1;
+const double WAYPOINT_MAX_SPEED = 20;
+const double WAYPOINT_PAUSE = 2;
+//Gauss-Markov模型的记忆系数、平均速度（米/秒）、速度和方向（弧度）的标准差
+const double GAUSS_MARKOV_ALPHA = 0.75;
+const double GAUSS_MARKOV_SPEED = 10;
+const double GAUSS_MARKOV_SPEED_DEVIATION = 2;
+const double GAUSS_MARKOV_DIRECTION_DEVIATION = 0.5;
+
+struct ad_hoc_point {
+    double x;
+    double y;
+
+    bool operator==(const ad_hoc_point &other) const {
+        return x == other.x && y == other.y;
+    }
+
+    bool operator!=(const ad_hoc_point &other) const {
+        return !(*this == other);
+    }
+};
+
+/**
+ * 均匀的空间哈希网格
+ *
+ * 平面按边长为cell的正方形划分，每个非空的格子以格子坐标拼成的64位整数为键放在哈希表中，格子里是落在其中的顶点。
+ * 格子边长取通信半径时，一个顶点的所有可能的邻居都在以它所在格子为中心的3x3个格子中。
+ * 每个顶点记录所在的格子和在格子中的位置，移动时只有跨越格子的顶点修改两个格子，删除为O(1)。
+ */
+class ad_hoc_spatial_grid {
+public:
+    explicit ad_hoc_spatial_grid(double cell) : cell(cell) {
+    }
+
+    /**
+     * 放入顶点vertex，顶点的编号从0开始连续增加
+     */
+    void insert(int vertex, const ad_hoc_point &p) {
+        if (vertex >= (int) entries.size()) {
+            entries.resize(vertex + 1, entry{0, NONE});
+        }
+        add(vertex, key(p));
+    }
+
+    /**
+     * 顶点移动到p
+     *
+     * @return 顶点是否换了格子
+     */
+    bool move(int vertex, const ad_hoc_point &p) {
+        uint64_t k = key(p);
+        entry &e = entries[vertex];
+        if (e.slot != NONE && e.cell == k) {
+            return false;
+        }
+        remove(vertex);
+        add(vertex, k);
+        return true;
+    }
+
+    /**
+     * 对p所在格子及其周围8个格子中的每个顶点调用f
+     */
+    template<typename F>
+    void near(const ad_hoc_point &p, F f) const {
+        int64_t cx = coordinate(p.x), cy = coordinate(p.y);
+        for (int64_t x = cx - 1; x <= cx + 1; x++) {
+            for (int64_t y = cy - 1; y <= cy + 1; y++) {
+                auto it = cells.find(pack(x, y));
+                if (it == cells.end()) {
+                    continue;
+                }
+                for (int vertex: it->second) {
+                    f(vertex);
+                }
+            }
+        }
+    }
+
+    void clear() {
+        cells.clear();
+        entries.clear();
+    }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct entry {
+        uint64_t cell;
+        uint32_t slot; //在格子中的下标，不在网格中时为NONE
+    };
+
+    int64_t coordinate(double v) const {
+        return (int64_t) floor(v / cell);
+    }
+
+    static uint64_t pack(int64_t x, int64_t y) {
+        return (uint64_t) (uint32_t) (int32_t) x << 32 | (uint32_t) (int32_t) y;
+    }
+
+    uint64_t key(const ad_hoc_point &p) const {
+        return pack(coordinate(p.x), coordinate(p.y));
+    }
+
+    void add(int vertex, uint64_t k) {
+        vector<int> &members = cells[k];
+        entries[vertex] = entry{k, (uint32_t) members.size()};
+        members.push_back(vertex);
+    }
+
+    void remove(int vertex) {
+        entry &e = entries[vertex];
+        if (e.slot == NONE) {
+            return;
+        }
+        //空出的格子保留在哈希表中，节点来回移动时不反复分配
+        vector<int> &members = cells[e.cell];
+        int last = members.back();
+        members[e.slot] = last;
+        entries[last].slot = e.slot;
+        members.pop_back();
+        e.slot = NONE;
+    }
+
+    double cell;
+    unordered_map<uint64_t, vector<int>> cells; //格子 -> 其中的顶点
+    vector<entry> entries; //顶点 -> 所在的格子
+};
+
+/**
+ * 移动模型：每个更新间隔移动一次所有顶点，顶点保持在[0, width] x [0, height]的场地内
+ */
+class ad_hoc_mobility {
+public:
+    virtual ~ad_hoc_mobility() {}
+
+    /**
+     * 把所有顶点移动seconds秒，positions中新增的顶点在这一次初始化自己的状态
+     */
+    virtual void step(vector<ad_hoc_point> &positions, double width, double height, double seconds,
+                      ad_hoc_random &random) = 0;
+};
+
+/**
+ * 随机路点模型：顶点以[min_speed, max_speed]内随机的速度直线走向场地中随机的路点，到达后停留pause秒再选下一个路点
+ */
+class ad_hoc_random_waypoint : public ad_hoc_mobility {
+public:
+    ad_hoc_random_waypoint(double min_speed = WAYPOINT_MIN_SPEED, double max_speed = WAYPOINT_MAX_SPEED,
+                           double pause = WAYPOINT_PAUSE) : min_speed(min_speed), max_speed(max_speed),
+                                                            pause(pause) {
+    }
+
+    void step(vector<ad_hoc_point> &positions, double width, double height, double seconds,
+              ad_hoc_random &random) override {
+        if (states.size() < positions.size()) {
+            states.resize(positions.size(), state{ad_hoc_point{0, 0}, 0, 0, false});
+        }
+        for (size_t i = 0; i < positions.size(); i++) {
+            state &s = states[i];
+            if (!s.ready) {
+                choose(s, width, height, random);
+            }
+            double remaining = seconds;
+            if (s.wait > 0) {
+                double waited = s.wait < remaining ? s.wait : remaining;
+                s.wait -= waited;
+                remaining -= waited;
+            }
+            if (remaining <= 0) {
+                continue;
+            }
+            ad_hoc_point &p = positions[i];
+            double dx = s.target.x - p.x, dy = s.target.y - p.y;
+            double distance = sqrt(dx * dx + dy * dy);
+            double travel = s.speed * remaining;
+            if (travel >= distance) {
+                //到达路点，本次剩余的时间算作停留
+                p = s.target;
+                choose(s, width, height, random);
+            } else {
+                p.x += dx / distance * travel;
+                p.y += dy / distance * travel;
+            }
+        }
+    }
+
+private:
+    struct state {
+        ad_hoc_point target;
+        double speed;
+        double wait; //剩余的停留时间
+        bool ready;
+    };
+
+    void choose(state &s, double width, double height, ad_hoc_random &random) {
+        s.wait = s.ready ? pause : 0;
+        s.target = ad_hoc_point{random.uniform() * width, random.uniform() * height};
+        s.speed = min_speed + random.uniform() * (max_speed - min_speed);
+        s.ready = true;
+    }
+
+    double min_speed;
+    double max_speed;
+    double pause;
+    vector<state> states; //第i个顶点的状态
+};
+
+/**
+ * Gauss-Markov模型：速度和方向是一阶自回归过程
+ *
+ *      s = alpha * s + (1 - alpha) * mean_speed + sqrt(1 - alpha^2) * speed_deviation * N(0, 1)
+ *      d = alpha * d + (1 - alpha) * mean_direction + sqrt(1 - alpha^2) * direction_deviation * N(0, 1)
+ *
+ * alpha越接近1运动越平滑。每个顶点的平均方向随机选定，靠近场地边界时改为指向场地中心，越界的位置截断到边界上。
+ */
+class ad_hoc_gauss_markov : public ad_hoc_mobility {
+public:
+    ad_hoc_gauss_markov(double alpha = GAUSS_MARKOV_ALPHA, double mean_speed = GAUSS_MARKOV_SPEED,
+                        double speed_deviation = GAUSS_MARKOV_SPEED_DEVIATION,
+                        double direction_deviation = GAUSS_MARKOV_DIRECTION_DEVIATION) : alpha(alpha),
+                                                                                         mean_speed(mean_speed),
+                                                                                         speed_deviation(
+                                                                                                 speed_deviation),
+                                                                                         direction_deviation(
+                                                                                                 direction_deviation) {
+    }
+
+    void step(vector<ad_hoc_point> &positions, double width, double height, double seconds,
+              ad_hoc_random &random) override {
+        if (states.size() < positions.size()) {
+            states.resize(positions.size(), state{0, 0, 0, false});
+        }
+        double noise = sqrt(1 - alpha * alpha);
+        //距边界不到场地的十分之一时转向中心
+        double margin_x = width / 10, margin_y = height / 10;
+        for (size_t i = 0; i < positions.size(); i++) {
+            state &s = states[i];
+            ad_hoc_point &p = positions[i];
+            if (!s.ready) {
+                s.speed = mean_speed;
+                s.direction = random.uniform() * 2 * M_PI;
+                s.mean_direction = s.direction;
+                s.ready = true;
+            }
+            if (p.x < margin_x || p.x > width - margin_x || p.y < margin_y || p.y > height - margin_y) {
+                s.mean_direction = atan2(height / 2 - p.y, width / 2 - p.x);
+            }
+            s.speed = alpha * s.speed + (1 - alpha) * mean_speed + noise * speed_deviation * random.gaussian();
+            s.speed = s.speed < 0 ? 0 : s.speed;
+            s.direction = alpha * s.direction + (1 - alpha) * s.mean_direction +
+                          noise * direction_deviation * random.gaussian();
+            p.x = clamp(p.x + s.speed * seconds * cos(s.direction), width);
+            p.y = clamp(p.y + s.speed * seconds * sin(s.direction), height);
+        }
+    }
+
+private:
+    struct state {
+        double speed;
+        double direction;
+        double mean_direction;
+        bool ready;
+    };
+
+    static double clamp(double v, double limit) {
+        return v < 0 ? 0 : (v > limit ? limit : v);
+    }
+
+    double alpha;
+    double mean_speed;
+    double speed_deviation;
+    double direction_deviation;
+    vector<state> states;
+};
+
+/**
+ * 按名称创建默认参数的移动模型：rwp为随机路点，gm为Gauss-Markov
+ *
+ * @return 名称不认识时返回nullptr
+ */
+inline unique_ptr<ad_hoc_mobility> ad_hoc_make_mobility(const string &name) {
+    if (name == "rwp") {
+        return unique_ptr<ad_hoc_mobility>(new ad_hoc_random_waypoint());
+    } else if (name == "gm") {
+        return unique_ptr<ad_hoc_mobility>(new ad_hoc_gauss_markov());
+    }
+    return nullptr;
+}
+
+/**
+ * 拓扑的几何位置：单位圆盘图
+ *
+ * 每个顶点在width x height的场地上有一个位置，距离不超过通信半径range的两个顶点之间有链路。
+ * 顶点放在格子边长为range的空间哈希网格中，求所有链路只需检查每个顶点周围3x3个格子，期望为O(N)。
+ * 移动一步时只有位置变化的顶点重新检查原有的链路和周围格子中的顶点，得到建立和断开的链路。
+ * 几何位置只给出链路的变化，由调用方作为一个纪元应用到拓扑上。
+ */
+class ad_hoc_geometry {
+public:
+    ad_hoc_geometry(double width, double height, double range) : width_(width), height_(height), range_(range),
+                                                                 grid(range) {
+    }
+
+    /**
+     * 正方形场地，边长使vertices个顶点均匀分布时平均有degree个邻居
+     */
+    static unique_ptr<ad_hoc_geometry> with_density(int vertices, double range = GEOMETRY_RANGE,
+                                                    double degree = GEOMETRY_DEGREE) {
+        double side = sqrt((vertices < 1 ? 1 : vertices) * M_PI * range * range / degree);
+        return unique_ptr<ad_hoc_geometry>(new ad_hoc_geometry(side, side, range));
+    }
+
+    int size() const {
+        return (int) positions.size();
+    }
+
+    double width() const {
+        return width_;
+    }
+
+    double height() const {
+        return height_;
+    }
+
+    double range() const {
+        return range_;
+    }
+
+    const ad_hoc_point &position(int vertex) const {
+        return positions[vertex];
+    }
+
+    /**
+     * 把顶点放在p，不修改拓扑。编号超出时中间的顶点放在原点
+     */
+    void place(int vertex, const ad_hoc_point &p) {
+        while (size() <= vertex) {
+            positions.push_back(ad_hoc_point{0, 0});
+            grid.insert(size() - 1, positions.back());
+        }
+        positions[vertex] = p;
+        grid.move(vertex, p);
+    }
+
+    /**
+     * 把前n个顶点重新随机放置在场地上
+     */
+    void scatter(int n, ad_hoc_random &random) {
+        positions.clear();
+        grid.clear();
+        extend(n, random);
+    }
+
+    /**
+     * 按所有顶点的位置求出拓扑需要建立和断开的链路，追加到changes，不修改拓扑
+     *
+     * 拓扑中多出的顶点先随机放置。每对顶点只由编号小的一方报告一次。
+     */
+    void build(const ad_hoc_topology &topology, ad_hoc_random &random, vector<ad_hoc_link_change> &changes) {
+        extend(topology.size(), random);
+        for (int v = 0; v < size(); v++) {
+            if (v < topology.size()) {
+                for (int u: topology.neighbours(v)) {
+                    if (u > v && !within(v, u)) {
+                        changes.push_back(ad_hoc_link_change{v, u, false});
+                    }
+                }
+            }
+            grid.near(positions[v], [&](int u) {
+                if (u > v && within(v, u) && !topology.linked(v, u)) {
+                    changes.push_back(ad_hoc_link_change{v, u, true});
+                }
+            });
+        }
+    }
+
+    /**
+     * 按移动模型移动seconds秒，把建立和断开的链路追加到changes，不修改拓扑
+     *
+     * 拓扑中新增的顶点先随机放置，视为移动过的顶点。两个移动过的顶点之间的链路只由编号小的一方报告一次。
+     */
+    void move(ad_hoc_mobility &mobility, double seconds, ad_hoc_random &random, const ad_hoc_topology &topology,
+              vector<ad_hoc_link_change> &changes) {
+        int before = size();
+        extend(topology.size(), random);
+        previous.assign(positions.begin(), positions.end());
+        mobility.step(positions, width_, height_, seconds, random);
+        moved.clear();
+        flags.resize(positions.size(), 0);
+        for (int v = 0; v < size(); v++) {
+            if (v >= before || positions[v] != previous[v]) {
+                grid.move(v, positions[v]);
+                flags[v] = 1;
+                moved.push_back(v);
+            }
+        }
+        for (int v: moved) {
+            if (v < topology.size()) {
+                for (int u: topology.neighbours(v)) {
+                    if ((!flags[u] || v < u) && !within(v, u)) {
+                        changes.push_back(ad_hoc_link_change{v, u, false});
+                    }
+                }
+            }
+            grid.near(positions[v], [&](int u) {
+                if (u != v && (!flags[u] || v < u) && within(v, u) && !topology.linked(v, u)) {
+                    changes.push_back(ad_hoc_link_change{v, u, true});
+                }
+            });
+        }
+        for (int v: moved) {
+            flags[v] = 0;
+        }
+    }
+
+private:
+    /**
+     * 随机放置编号在[size(), n)之间的顶点
+     */
+    void extend(int n, ad_hoc_random &random) {
+        for (int v = size(); v < n; v++) {
+            positions.push_back(ad_hoc_point{random.uniform() * width_, random.uniform() * height_});
+            grid.insert(v, positions.back());
+        }
+    }
+
+    bool within(int a, int b) const {
+        double dx = positions[a].x - positions[b].x, dy = positions[a].y - positions[b].y;
+        return dx * dx + dy * dy <= range_ * range_;
+    }
+
+    double width_;
+    double height_;
+    double range_;
+    vector<ad_hoc_point> positions; //第i个顶点的位置
+    ad_hoc_spatial_grid grid;
+    //以下在move中复用，稳定运行后不分配
+    vector<ad_hoc_point> previous;
+    vector<int> moved;
+    vector<char> flags; //顶点本次是否移动过
+};
+
+#endif //ADHOC_SIMULATION_GEOMETRY_H
@@ -0,0 +1,341 @@
+//
+// Created by 邹迪凯 on 2022/3/30.
+//
+
+#ifndef ADHOC_SIMULATION_HOST_H
+#define ADHOC_SIMULATION_HOST_H
+
+#include <vector>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include "server.h"
+#include "client.h"
+#include "mux.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+//arena每次向系统申请的大小
+const size_t HOST_ARENA_CHUNK_SIZE = 2 * 1024 * 1024;
+//host中第一个节点的ID，之后的节点依次加一
+const int HOST_FIRST_ID = 10001;
+
+/**
+ * 只增不减的内存arena
+ *
+ * 按块向系统申请内存，从当前块中顺序切出对象，不单独释放，arena析构时整体归还。
+ * 每个工作线程一个arena，只在该线程上分配，不需要加锁；该线程上的节点状态连续存放，由这个线程首次访问。
+ */
+class ad_hoc_host_arena {
+public:
+    ad_hoc_host_arena() : current_(nullptr), left_(0), used_(0) {
+    }
+
+    ad_hoc_host_arena(const ad_hoc_host_arena &) = delete;
+
+    ad_hoc_host_arena &operator=(const ad_hoc_host_arena &) = delete;
+
+    void *allocate(size_t size, size_t align = alignof(max_align_t)) {
+        size_t padding = (align - (uintptr_t) current_ % align) % align;
+        if (current_ == nullptr || padding + size > left_) {
+            size_t chunk = max(size + align, HOST_ARENA_CHUNK_SIZE);
+            chunks_.emplace_back(new char[chunk]);
+            current_ = chunks_.back().get();
+            left_ = chunk;
+            reserved_.push_back(chunk);
+            padding = (align - (uintptr_t) current_ % align) % align;
+        }
+        void *p = current_ + padding;
+        current_ += padding + size;
+        left_ -= padding + size;
+        used_ += size;
+        return p;
+    }
+
+    /**
+     * 已分配给对象的字节数
+     */
+    size_t used() const {
+        return used_;
+    }
+
+    /**
+     * 向系统申请的字节数
+     */
+    size_t reserved() const {
+        size_t total = 0;
+        for (size_t chunk: reserved_) {
+            total += chunk;
+        }
+        return total;
+    }
+
+private:
+    vector<unique_ptr<char[]>> chunks_;
+    vector<size_t> reserved_;
+    char *current_;
+    size_t left_;
+    size_t used_;
+};
+
+/**
+ * host中节点在scope上的参与者，相当于server端的session
+ *
+ * scope交来的消息句柄直接交给client处理，不编码、不经过socket，与scope中其他接收者共享同一个缓冲区。
+ * 分片在节点所在的线程上投递，此时就地处理，否则投递到节点的io_context上。
+ */
+class ad_hoc_memory_port : public ad_hoc_participant {
+public:
+    ad_hoc_memory_port(boost::asio::io_context &io_context, ad_hoc_message_handler *handler) : io_context(io_context),
+                                                                                            handler(handler) {
+    }
+
+    void deliver(const ad_hoc_message &msg) override {
+        ad_hoc_message_handler *h = handler;
+        boost::asio::dispatch(io_context, [h, msg] {
+            ad_hoc_message received(msg);
+            h->handle_message(received, false);
+        });
+    }
+
+private:
+    boost::asio::io_context &io_context;
+    ad_hoc_message_handler *handler;
+};
+
+/**
+ * 同一进程内client到scope的传输
+ *
+ * send把消息句柄直接交给scope转发，不经过线路编码；节点运行在scope分片的线程上，同一分片内的转发不跨线程，
+ * 跨分片的转发经过分片之间的无锁队列。没有协商，也就不支持压缩和帧校验。
+ * port的生命周期由transport管理，scope中的引用不负责释放，host在停止scope之后才销毁节点。
+ */
+class ad_hoc_memory_transport : public ad_hoc_transport {
+public:
+    ad_hoc_memory_transport(ad_hoc_scope &scope, boost::asio::io_context &io_context, int id,
+                            ad_hoc_message_handler *handler) : ad_hoc_transport(handler), scope(scope),
+                                                               io_context(io_context), id_(id),
+                                                               port_(io_context, handler) {
+    }
+
+    void start() override {
+        boost::asio::post(io_context, [this] {
+            scope.join(id_, ad_hoc_participant_ptr(&port_, [](ad_hoc_participant *) {}));
+            handler_->handle_connected();
+        });
+    }
+
+    bool send(const ad_hoc_message &msg) override {
+        scope.deliver(msg);
+        return true;
+    }
+
+    bool supports(int feature) const override {
+        return false;
+    }
+
+    int local_id() override {
+        return id_;
+    }
+
+    void close() override {
+        scope.leave(id_);
+    }
+
+private:
+    ad_hoc_scope &scope;
+    boost::asio::io_context &io_context;
+    int id_;
+    ad_hoc_memory_port port_;
+};
+
+/**
+ * 在一个进程中运行大量client节点
+ *
+ * 本地模式下scope也在本进程中，工作线程就是scope的分片线程：每个节点按拓扑划分到一个分片上，client的所有回调、定时器和收到的消息都在该分片的线程上执行。
+ * 连接模式下节点连接到外部的server，每个工作线程有自己的io_context和一条多路复用连接，线程上的所有节点共用这条连接，节点按ID连续地分到各个工作线程上。
+ * 节点的client对象在所属工作线程上构造，内存取自该线程的arena。
+ * 节点ID从first_id开始连续编号；本地模式下第i个节点占用拓扑的第i个顶点，顶点之间按width列的网格相连。
+ */
+class ad_hoc_host {
+public:
+    /**
+     * 本地模式
+     *
+     * @param workers 工作线程数，即scope的分片数
+     * @param cpus 第i个工作线程绑定到cpus[i % cpus.size()]上，为空时不绑定
+     */
+    ad_hoc_host(int workers, const vector<int> &cpus) : scope(new ad_hoc_scope(false, io_context,
+                                                                               workers < 1 ? 1 : workers, cpus)),
+                                                         arenas(workers < 1 ? 1 : workers),
+                                                         first_id(HOST_FIRST_ID), stopped(false) {
+        for (int i = 0; i < (int) arenas.size(); i++) {
+            contexts.push_back(&scope->shard_context(i));
+            workers_[contexts.back()] = i;
+        }
+    }
+
+    /**
+     * 连接模式
+     *
+     * @param workers 工作线程数，即到server的连接数
+     * @param cpus 第i个工作线程绑定到cpus[i % cpus.size()]上，为空时不绑定
+     * @param transport TRANSPORT_TCP、TRANSPORT_UNIX或TRANSPORT_SHM
+     * @param endpoint server的地址
+     * @param first 第一个节点的ID
+     */
+    ad_hoc_host(int workers, const vector<int> &cpus, int transport, const tcp::endpoint &endpoint, int first)
+            : arenas(workers < 1 ? 1 : workers), first_id(first), stopped(false) {
+        for (int i = 0; i < (int) arenas.size(); i++) {
+            worker_contexts.emplace_back(new boost::asio::io_context(1));
+            boost::asio::io_context &context = *worker_contexts.back();
+            contexts.push_back(&context);
+            connections.emplace_back(new ad_hoc_mux_connection(transport, endpoint, context,
+                                                               WIRE_FEATURE_COMPRESSION | WIRE_FEATURE_CRC32C));
+            connections.back()->start();
+            vector<int> pinned;
+            if (!cpus.empty()) {
+                pinned.push_back(cpus[i % cpus.size()]);
+            }
+            pools.emplace_back(new ad_hoc_io_thread_pool(context, 1, pinned));
+            pools.back()->start();
+        }
+    }
+
+    ~ad_hoc_host() {
+        stop();
+        //工作线程已经停止，节点的定时器在io_context析构之前释放
+        for (ad_hoc_client *node: nodes) {
+            if (node != nullptr) {
+                node->~ad_hoc_client();
+            }
+        }
+    }
+
+    /**
+     * 创建count个节点，等待所有节点构造完成后返回
+     *
+     * @param width 网格的列数，只用于本地模式
+     */
+    void spawn(int count, int width) {
+        int first = (int) nodes.size();
+        vector<vector<int>> placed(arenas.size());
+        if (scope) {
+            width = width < 1 ? 1 : width;
+            for (int i = first; i < first + count; i++) {
+                if ((i + 1) % width != 0 && i + 1 < first + count) {
+                    scope->link(i, i + 1);
+                }
+                if (i + width < first + count) {
+                    scope->link(i, i + width);
+                }
+            }
+            //先划分好所有节点，再由每个分片的线程构造自己的节点
+            for (int i = first; i < first + count; i++) {
+                placed[workers_[&scope->place(first_id + i)]].push_back(i);
+            }
+        } else {
+            //连续的ID放在同一个工作线程上，相邻节点之间的帧多在同一条连接上往返
+            for (int i = first; i < first + count; i++) {
+                placed[(size_t) (i - first) * arenas.size() / count].push_back(i);
+            }
+        }
+        nodes.resize(first + count, nullptr);
+        vector<future<void>> done;
+        for (size_t w = 0; w < arenas.size(); w++) {
+            auto task = make_shared<packaged_task<void()>>([this, w, &placed] {
+                boost::asio::io_context &context = *contexts[w];
+                for (int i: placed[w]) {
+                    int id = first_id + i;
+                    void *memory = arenas[w].allocate(sizeof(ad_hoc_client), alignof(ad_hoc_client));
+                    nodes[i] = new(memory) ad_hoc_client(context, [this, w, &context, id](ad_hoc_message_handler *h) {
+                        return make_transport(w, context, id, h);
+                    }, -1);
+                }
+            });
+            done.push_back(task->get_future());
+            boost::asio::post(*contexts[w], [task] {
+                (*task)();
+            });
+        }
+        for (future<void> &f: done) {
+            f.get();
+        }
+    }
+
+    /**
+     * 由节点src向dest发送一条用户消息，可以在任意线程上调用
+     *
+     * @return src不是本host的节点时返回false
+     */
+    bool send(int src, int dest, const string &text) {
+        int i = src - first_id;
+        if (i < 0 || i >= (int) nodes.size() || nodes[i] == nullptr) {
+            return false;
+        }
+        nodes[i]->send_user_message(dest, text.c_str(), (int) text.size());
+        return true;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    /**
+     * 打印每个工作线程的节点数、转发数和arena的用量
+     */
+    void print_stats(ostream &out) {
+        if (scope) {
+            scope->print_shards(out);
+        }
+        for (size_t w = 0; w < arenas.size(); w++) {
+            out << "arena " << w << ": used " << arenas[w].used() << ", reserved " << arenas[w].reserved() << endl;
+        }
+        ad_hoc_message_pool::print_stats(out);
+    }
+
+    /**
+     * 停止所有工作线程，可以重复调用
+     */
+    void stop() {
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        if (scope) {
+            scope->stop();
+        }
+        for (auto &context: worker_contexts) {
+            context->stop();
+        }
+        for (auto &pool: pools) {
+            pool->join();
+        }
+    }
+
+private:
+    ad_hoc_transport *make_transport(size_t worker, boost::asio::io_context &context, int id,
+                                     ad_hoc_message_handler *handler) {
+        if (scope) {
+            return new ad_hoc_memory_transport(*scope, context, id, handler);
+        }
+        return new ad_hoc_mux_transport(*connections[worker], context, id, handler);
+    }
+
+    boost::asio::io_context io_context; //分片模式下scope不在这里转发，只为满足scope的构造参数
+    unique_ptr<ad_hoc_scope> scope; //只在本地模式下存在
+    vector<unique_ptr<boost::asio::io_context>> worker_contexts; //连接模式下每个工作线程的io_context
+    vector<unique_ptr<ad_hoc_mux_connection>> connections; //连接模式下每个工作线程到server的连接
+    vector<unique_ptr<ad_hoc_io_thread_pool>> pools; //连接模式下运行各个io_context的线程
+    vector<ad_hoc_host_arena> arenas; //每个工作线程一个
+    vector<boost::asio::io_context *> contexts; //第i个工作线程的io_context
+    unordered_map<boost::asio::io_context *, int> workers_; //分片的io_context -> 工作线程编号
+    vector<ad_hoc_client *> nodes; //第i个节点，ID为first_id + i
+    int first_id;
+    bool stopped;
+};
+
+#endif //ADHOC_SIMULATION_HOST_H
@@ -0,0 +1,88 @@
+//
+// Created by 邹迪凯 on 2022/3/30.
+//
+// 在一个进程中运行大量节点：节点是ad_hoc_client，server的scope也在本进程中，帧以消息句柄在内存中传递，不经过socket。
+// 给出--connect时连接到外部的server，每个工作线程的节点共用一条多路复用连接。
+//
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include "host.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: host <nodes> [--workers <n>] [--width <n>] [--cpus <list>] [--verbose]\n"
+                     "            [--connect <port> [--transport tcp|unix|shm] [--first <id>]]\n";
+        return 1;
+    }
+    int count = stoi(argv[1]);
+    int workers = (int) thread::hardware_concurrency();   //工作线程数，即scope的分片数
+    int width = 0;                                          //网格的列数，为0时取节点数的平方根
+    vector<int> cpus;                                       //工作线程绑定的CPU，例如 0,2,4-7
+    bool verbose = false;                                   //是否输出节点的日志
+    int port = 0;                                           //外部server的端口，为0时在本进程中运行scope
+    int transport = TRANSPORT_TCP;                          //到外部server的传输方式
+    int first = HOST_FIRST_ID;                              //连接模式下第一个节点的ID
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+            width = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--cpus") && i + 1 < argc) {
+            cpus = ad_hoc_io_thread_pool::parse_cpus(argv[++i]);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = true;
+        } else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+            port = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--transport") && i + 1 < argc) {
+            transport = ad_hoc_parse_transport(argv[++i]);
+        } else if (!strcmp(argv[i], "--first") && i + 1 < argc) {
+            first = stoi(argv[++i]);
+        }
+    }
+    if (transport < 0 || transport == TRANSPORT_UDP) {
+        std::cerr << "multiplexed connections need tcp, unix or shm" << endl;
+        return 1;
+    }
+    if (width <= 0) {
+        width = 1;
+        while (width * width < count) {
+            width++;
+        }
+    }
+    //节点沿用client的日志，每次路由表变化都打印整张表，节点多时默认丢弃，host自己的输出写到console
+    ostream console(cout.rdbuf());
+    ofstream null("/dev/null");
+    if (!verbose) {
+        cout.rdbuf(null.rdbuf());
+    }
+    auto start = chrono::steady_clock::now();
+    tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+    unique_ptr<ad_hoc_host> host(port > 0 ? new ad_hoc_host(workers, cpus, transport, endpoint, first)
+                                          : new ad_hoc_host(workers, cpus));
+    host->spawn(count, width);
+    console << "running " << host->size() << " nodes on " << (workers < 1 ? 1 : workers) << " workers, spawned in "
+            << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << " ms."
+            << endl;
+
+    //send <src> <dest> <text>：由节点src向dest发送消息；stats：打印各工作线程的统计；quit：退出
+    string cmd;
+    while (cin >> cmd) {
+        if (cmd == "send") {
+            int src, dest;
+            string text;
+            cin >> src >> dest >> text;
+            if (!host->send(src, dest, text)) {
+                cerr << "unknown node: " << src << endl;
+            }
+        } else if (cmd == "stats") {
+            host->print_stats(console);
+        } else if (cmd == "quit") {
+            break;
+        }
+    }
+    host->stop();
+    cout.rdbuf(console.rdbuf());
+    return 0;
+}
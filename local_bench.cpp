@@ -0,0 +1,302 @@
+//
+// Created by 邹迪凯 on 2022/3/28.
+//
+// 比较client与server之间使用TCP回环、Unix域socket和共享内存环三种传输时，经过server的一跳的延迟和吞吐。
+// 每一轮启动一个新的server，fork出的子进程建立两个节点A和B（按加入顺序占用DEFAULT_UDG中相邻的顶点0和1），
+// 两个节点都发送带有节点ID的协商报文，按v2收发。子进程以非阻塞方式忙等收发，没有进展时让出CPU，
+// 不在内核中睡眠，测出的差异来自server一侧和传输本身。
+// 延迟：A和B之间通过server来回传递一个帧，一跳的延迟是往返时间的一半；
+// 吞吐：A连续向B发送N个帧，B收齐所有帧的时间内每秒转发的帧数。
+//
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "thread_pool.h"
+#include "local_socket.h"
+
+using namespace std;
+
+const int BENCH_PORT_BASE = 9900;
+const int BENCH_TIMEOUT = 60;
+//延迟测量的往返次数
+const int BENCH_ROUND_TRIPS = 10000;
+
+struct bench_config {
+    const char *name;
+    bool local; //经Unix域socket连接
+    bool shm; //连接之后在共享内存的环上收发
+};
+
+struct bench_result {
+    double hop_us; //一跳的平均延迟
+    double seconds; //吞吐测量中B收齐所有帧的耗时
+};
+
+/**
+ * 子进程中的一个节点，socket或者共享内存上的非阻塞收发
+ */
+struct bench_node {
+    int fd = -1;
+    unique_ptr<ad_hoc_shm_channel> shm;
+
+    ssize_t send_some(const char *data, size_t length) {
+        if (shm) {
+            size_t n = shm->write(data, length);
+            if (n > 0) {
+                shm->notify_reader();
+            }
+            return (ssize_t) n;
+        }
+        return send(fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    ssize_t recv_some(char *data, size_t length) {
+        if (shm) {
+            size_t n = shm->read(data, length);
+            if (n > 0) {
+                shm->notify_writer();
+            }
+            return (ssize_t) n;
+        }
+        return recv(fd, data, length, MSG_DONTWAIT);
+    }
+
+    /**
+     * 忙等直到发出全部数据
+     */
+    bool send_all(const char *data, size_t length) {
+        size_t sent = 0;
+        while (sent < length) {
+            ssize_t n = send_some(data + sent, length - sent);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            if (n > 0) {
+                sent += n;
+            } else {
+                this_thread::yield();
+            }
+        }
+        return true;
+    }
+
+    /**
+     * 忙等直到收齐length个字节
+     */
+    bool recv_all(char *data, size_t length) {
+        size_t received = 0;
+        while (received < length) {
+            ssize_t n = recv_some(data + received, length - received);
+            if (n == 0 && !shm) {
+                return false;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            if (n > 0) {
+                received += n;
+            } else {
+                this_thread::yield();
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * 连接server并完成协商
+ *
+ * @param id Unix域socket上的节点ID，TCP上以本地端口作为ID
+ */
+void connect_node(const bench_config &config, int port, int &id, bench_node &node) {
+    int fd;
+    if (config.local) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, ad_hoc_local_path(port).c_str(), sizeof(addr.sun_path) - 1);
+        while (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        while (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        sockaddr_in local{};
+        socklen_t length = sizeof(local);
+        getsockname(fd, (sockaddr *) &local, &length);
+        id = ntohs(local.sin_port);
+    }
+    node.fd = fd;
+    ad_hoc_wire_codec codec;
+    codec.start_client(WIRE_MAX_VERSION, 0, id);
+    string preamble(codec.take_preamble(), codec.preamble_length());
+    bool sent;
+    if (config.shm) {
+        node.shm.reset(new ad_hoc_shm_channel());
+        int fds[SHM_HANDSHAKE_FDS];
+        preamble[6] = (char) (preamble[6] | WIRE_OPTION_SHARED_MEMORY);
+        sent = node.shm->create();
+        node.shm->handshake_fds(fds);
+        sent = sent && ad_hoc_shm_send_handshake(fd, preamble.data(), preamble.size(), fds);
+    } else {
+        sent = write(fd, preamble.data(), preamble.size()) == (ssize_t) preamble.size();
+    }
+    //收到server的回复时节点已经加入scope
+    char reply[WIRE_PREAMBLE_LENGTH];
+    if (!sent || !node.recv_all(reply, sizeof(reply))) {
+        _exit(1);
+    }
+}
+
+/**
+ * 编码一个从from发往to的帧
+ */
+string make_frame(int from, int to, int body_length) {
+    ad_hoc_wire_codec codec;
+    codec.start_client(WIRE_MAX_VERSION);
+    ad_hoc_message msg(AODV_MESSAGE, from, to, from, to);
+    msg.body_length(body_length);
+    memset(msg.body(), 'x', body_length);
+    char header[WIRE_MAX_HEADER_LENGTH];
+    size_t header_length = codec.encode_header(msg, header);
+    return string(header, header_length) + string(msg.body(), body_length);
+}
+
+/**
+ * 子进程：建立A、B两个节点，先测量往返延迟，再测量A向B单向发送frames个帧的耗时，结果写入result_fd
+ */
+void run_clients(const bench_config &config, int port, int body_length, int frames, int result_fd) {
+    int a_id = 1, b_id = 2;
+    bench_node a, b;
+    connect_node(config, port, a_id, a);
+    connect_node(config, port, b_id, b);
+    string to_b = make_frame(a_id, b_id, body_length);
+    string to_a = make_frame(b_id, a_id, body_length);
+    vector<char> buffer(max(to_b.size(), (size_t) 64 * 1024));
+
+    bench_result result{-1, -1};
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ROUND_TRIPS; i++) {
+        if (!a.send_all(to_b.data(), to_b.size()) || !b.recv_all(buffer.data(), to_b.size()) ||
+            !b.send_all(to_a.data(), to_a.size()) || !a.recv_all(buffer.data(), to_a.size())) {
+            _exit(1);
+        }
+    }
+    result.hop_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() /
+                    (2 * BENCH_ROUND_TRIPS);
+
+    string outgoing;
+    outgoing.reserve(to_b.size() * frames);
+    for (int i = 0; i < frames; i++) {
+        outgoing += to_b;
+    }
+    size_t sent = 0, received = 0;
+    start = chrono::steady_clock::now();
+    while (received < outgoing.size() && chrono::steady_clock::now() - start < chrono::seconds(BENCH_TIMEOUT)) {
+        if (sent < outgoing.size()) {
+            ssize_t n = a.send_some(outgoing.data() + sent, outgoing.size() - sent);
+            if (n > 0) {
+                sent += n;
+            }
+        }
+        ssize_t n = b.recv_some(buffer.data(), buffer.size());
+        if (n > 0) {
+            received += n;
+        } else {
+            this_thread::yield();
+        }
+    }
+    if (received == outgoing.size()) {
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    if (write(result_fd, &result, sizeof(result)) != sizeof(result)) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+bench_result run_round(const bench_config &config, int port, int body_length, int frames) {
+    bench_result result{-1, -1};
+    int done[2];
+    if (pipe(done) != 0) {
+        return result;
+    }
+    //在server的IO线程启动之前fork，子进程不会继承被其他线程持有的锁
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(done[0]);
+        run_clients(config, port, body_length, frames, done[1]);
+    }
+    close(done[1]);
+    ofstream null("/dev/null");
+    streambuf *out = cout.rdbuf(null.rdbuf());
+    {
+        boost::asio::io_context io_context(1);
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+        unique_ptr<ad_hoc_server> server(new ad_hoc_server(endpoint, io_context, false, 0, {}, 1, false,
+                                                           config.local));
+        //测量的是转发本身的开销，不施加链路延迟
+        server->link_delay(boost::posix_time::time_duration(), boost::posix_time::time_duration());
+        ad_hoc_io_thread_pool pool(io_context, 1);
+        pool.start();
+
+        if (read(done[0], &result, sizeof(result)) != sizeof(result)) {
+            result = bench_result{-1, -1};
+        }
+        waitpid(pid, nullptr, 0);
+        io_context.stop();
+        pool.join();
+        server.reset();
+    }
+    cout.rdbuf(out);
+    close(done[0]);
+    return result;
+}
+
+int main() {
+    vector<bench_config> configs = {
+            {"tcp",  false, false},
+            {"unix", true,  false},
+            {"shm",  true,  true},
+    };
+    vector<int> bodies = {24, 1024};
+    const int frames = 200000;
+    cout << "one hop = client -> server -> client, " << BENCH_ROUND_TRIPS << " round trips, " << frames
+         << " frames one way" << endl;
+    cout << setw(10) << left << "transport" << right << setw(8) << "body" << setw(16) << "hop latency us"
+         << setw(14) << "frames/s" << endl;
+    int port = BENCH_PORT_BASE;
+    for (int body: bodies) {
+        for (const bench_config &config: configs) {
+            bench_result result = run_round(config, port++, body, frames);
+            cout << setw(10) << left << config.name << right << setw(8) << body;
+            if (result.hop_us < 0) {
+                cout << setw(16) << "failed" << endl;
+                continue;
+            }
+            cout << setw(16) << fixed << setprecision(2) << result.hop_us;
+            if (result.seconds < 0) {
+                cout << setw(14) << "timeout" << endl;
+            } else {
+                cout << setw(14) << setprecision(0) << frames / result.seconds << endl;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+//
+// Created by 邹迪凯 on 2022/3/28.
+//
+
+#ifndef ADHOC_SIMULATION_LOCAL_SOCKET_H
+#define ADHOC_SIMULATION_LOCAL_SOCKET_H
+
+#include <string>
+#include <boost/asio.hpp>
+
+using boost::asio::ip::tcp;
+using namespace std;
+
+// Unix域流式socket。整个仿真运行在同一台主机上时，client与server之间不需要经过回环网卡的TCP协议栈。
+// server在端口号对应的路径上监听，client用同一个端口号找到这个路径。
+// Unix域socket没有端口，节点的ID由client在协商报文中告知（WIRE_OPTION_NODE_ID）。
+typedef boost::asio::local::stream_protocol local_stream;
+
+/**
+ * server在port上监听时，Unix域socket的路径
+ */
+inline string ad_hoc_local_path(int port) {
+    return "/tmp/adhoc-simulation-" + to_string(port) + ".sock";
+}
+
+/**
+ * 把client的socket绑定到节点ID上
+ *
+ * TCP以本地端口作为节点ID，id不大于0时由系统分配端口
+ *
+ * @return 节点ID
+ */
+inline int ad_hoc_bind_node(tcp::socket &socket, int id) {
+    socket.open(tcp::v4());
+    socket.bind(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), id > 0 ? id : 0));
+    return socket.local_endpoint().port();
+}
+
+/**
+ * Unix域socket不需要绑定，节点ID只在协商报文中告知server
+ */
+inline int ad_hoc_bind_node(local_stream::socket &socket, int id) {
+    return id;
+}
+
+/**
+ * 没有在协商报文中告知ID的节点，server以对端的地址识别：TCP是对端的端口
+ */
+inline int ad_hoc_endpoint_id(const tcp::endpoint &endpoint) {
+    return endpoint.port();
+}
+
+/**
+ * Unix域socket的对端没有可以作为ID的地址
+ */
+inline int ad_hoc_endpoint_id(const local_stream::endpoint &endpoint) {
+    return 0;
+}
+
+#endif //ADHOC_SIMULATION_LOCAL_SOCKET_H
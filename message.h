@@ -6,6 +6,10 @@
 #define ADHOC_SIMULATION_MESSAGE_H
 
 #include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#include "frame_buffer.h"
 
 using namespace std;
 
@@ -17,53 +21,111 @@ const int AODV_BROADCAST_ADDRESS = 0;
 const int ORDINARY_MESSAGE = 0;
 const int AODV_MESSAGE = 1;
 const int WORMHOLE_MESSAGE = 2;
+//超过单帧载荷上限的用户消息被拆分成的分片，见fragment.h
+const int FRAGMENT_MESSAGE = 3;
+//多路复用连接上声明节点ID的控制帧，载荷是若干个4字节小端序的节点ID，只在client与server之间传递，见mux.h
+const int REGISTER_MESSAGE = 4;
+
+//消息标志，编码在首部type字段的高16位
+//载荷经过压缩，见compression.h
+const int MESSAGE_FLAG_COMPRESSED = 0x1;
+
+//虫洞隧道帧的载荷是一个完整的内层帧，其载荷长度上限需要容纳内层帧的首部
+const int ADHOCMESSAGE_MAX_TUNNEL_BODY_LENGTH = ADHOCMESSAGE_MAX_BODY_LENGTH + ADHOCMESSAGE_HEADER_LENGTH;
+
+/**
+ * 各类型消息在线路上允许的最大载荷长度
+ */
+inline int ad_hoc_max_body_length(int type) {
+    return type == WORMHOLE_MESSAGE ? ADHOCMESSAGE_MAX_TUNNEL_BODY_LENGTH : ADHOCMESSAGE_MAX_BODY_LENGTH;
+}
 
-// message : sendid -> receiveid -> sourceid -> destid -> body -> type
+// message : sendid -> receiveid -> sourceid -> destid -> body -> type(低16位为type，高16位为flags)
 
+//首部中的int字段统一按小端序编码，与主机字节序无关
+inline void put_le32(char *out, int value) {
+    auto v = (uint32_t) value;
+    out[0] = (char) v;
+    out[1] = (char) (v >> 8);
+    out[2] = (char) (v >> 16);
+    out[3] = (char) (v >> 24);
+}
+
+inline int get_le32(const char *in) {
+    auto p = reinterpret_cast<const uint8_t *>(in);
+    return (int) ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+/**
+ * 自组网消息的句柄
+ *
+ * 首部各字段保存在句柄内，首部和载荷的字节表示保存在引用计数的帧缓冲区中，缓冲区大小等于帧的实际长度。
+ * 拷贝句柄只会增加缓冲区的引用计数，不会拷贝字节数据；通过非const的data()/body()写缓冲区时，
+ * 如果缓冲区被多个句柄共享，会先为当前句柄复制一份（写时复制）。
+ *
+ * 虫洞隧道的外层帧通过encapsulate直接引用内层帧所在的缓冲区作为载荷，此时外层首部只保存在字段中，
+ * 不在缓冲区里，发送时由codec按字段编码，与载荷组成一次gather写。
+ */
 class ad_hoc_message {
 public:
-    ad_hoc_message(const ad_hoc_message &msg) {
-        memcpy(data_, msg.data_, ADHOCMESSAGE_HEADER_LENGTH + ADHOCMESSAGE_MAX_BODY_LENGTH);
-        decode_header();
-    }
-
-    ad_hoc_message() : body_length_(0) {
+    ad_hoc_message() : send_id(0), receive_id(0), source_id(0), dest_id(0), msg_type_(ORDINARY_MESSAGE),
+                       flags_(0), body_length_(0), offset_(0), body_offset_(ADHOCMESSAGE_HEADER_LENGTH) {
 
     }
 
-    ad_hoc_message(int type, int sendid, int receiveid, int src, int dst) {
-        msg_type_ = type;
-        send_id = sendid;
-        receive_id = receiveid;
-        source_id = src;
-        dest_id = dst;
+    ad_hoc_message(int type, int sendid, int receiveid, int src, int dst) : send_id(sendid), receive_id(receiveid),
+                                                                            source_id(src), dest_id(dst),
+                                                                            msg_type_(type), flags_(0),
+                                                                            body_length_(0),
+                                                                            offset_(0),
+                                                                            body_offset_(ADHOCMESSAGE_HEADER_LENGTH) {
     }
 
     /**
-     * 字节数组的首地址，也是消息首部的首地址
+     * 字节数组的首地址，也是消息首部的首地址（可写）
      *
      * @return
      */
     char *data() {
-        return data_;
+        reserve(length());
+        return buf_->bytes() + offset_;
+    }
+
+    /**
+     * 字节数组的首地址（只读），不会触发写时复制
+     *
+     * @return 首部不在缓冲区中（隧道外层帧）时返回nullptr
+     */
+    const char *data() const {
+        return header_in_buffer() ? buf_->bytes() + offset_ : nullptr;
     }
 
     template<class T>
     void body(T body) {
         body_length(sizeof(T));
-        memcpy(data_ + ADHOCMESSAGE_HEADER_LENGTH, &body, body_length_);
+        memcpy(this->body(), &body, body_length_);
         encode_header();
     }
 
     /**
-     * 消息中数据载荷的起始地址
+     * 消息中数据载荷的起始地址（可写）
      *
      * @return
      */
     char *body() {
-        return data_ + ADHOCMESSAGE_HEADER_LENGTH;
+        reserve(length());
+        return buf_->bytes() + body_offset_;
     };
 
+    /**
+     * 消息中数据载荷的起始地址（只读）
+     *
+     * @return
+     */
+    const char *body() const {
+        return buf_ ? buf_->bytes() + body_offset_ : nullptr;
+    }
+
     /**
      * 消息总长度，包括消息首部长度和载荷长度
      *
@@ -78,7 +140,7 @@ public:
      *
      * @return
      */
-    int body_length() {
+    int body_length() const {
         return body_length_;
     }
 
@@ -133,19 +195,28 @@ public:
         msg_type_ = msgtype;
     }
 
+    int flags() const {
+        return flags_;
+    }
+
+    void flags(int flags) {
+        flags_ = flags;
+    }
+
+    bool compressed() const {
+        return flags_ & MESSAGE_FLAG_COMPRESSED;
+    }
+
     /**
      * 编码消息首部
+     *
+     * 隧道外层帧的首部不在缓冲区中，只保留字段，不会因此拷贝共享的内层帧。
      */
     void encode_header() {
-        //根据协议中各个字段的偏移，进行编码
-        memcpy(data_, &send_id, sizeof(send_id));
-        memcpy(data_ + sizeof(send_id), &receive_id, sizeof(receive_id));
-        memcpy(data_ + sizeof(send_id) + sizeof(receive_id), &source_id, sizeof(int));
-        memcpy(data_ + sizeof(send_id) + sizeof(receive_id) + sizeof(source_id), &dest_id, sizeof(int));
-        memcpy(data_ + sizeof(send_id) + sizeof(receive_id) + sizeof(source_id) + sizeof(dest_id), &body_length_,
-               sizeof(int));
-        memcpy(data_ + sizeof(send_id) + sizeof(receive_id) + sizeof(source_id) + sizeof(dest_id) +
-               sizeof(body_length_), &msg_type_, sizeof(int));
+        if (buf_ && !header_in_buffer()) {
+            return;
+        }
+        write_header(data());
     }
 
     /**
@@ -154,18 +225,54 @@ public:
      * @return
      */
     bool decode_header() {
-        //根据协议中各个字段的偏移，进行解码
-        send_id = *reinterpret_cast<int *>(data_);
-        receive_id = *reinterpret_cast<int *>(data_ + 4);
-        source_id = *reinterpret_cast<int *>(data_ + 8);
-        dest_id = *reinterpret_cast<int *>(data_ + 12);
-        body_length_ = *reinterpret_cast<int *>(data_ + 16);
-        msg_type_ = *reinterpret_cast<int *>(data_ + 20);
-        if (body_length_ < 0 || body_length_ > ADHOCMESSAGE_MAX_BODY_LENGTH) {
-            body_length_ = 0;
+        if (!header_in_buffer()) {
             return false;
         }
-        return true;
+        return decode_fields(buf_->bytes() + offset_);
+    }
+
+    /**
+     * 将载荷视为一个完整的内层帧（虫洞隧道），返回与当前消息共享缓冲区的内层消息
+     *
+     * @param inner 内层消息
+     * @return 内层帧首部是否合法
+     */
+    bool inner_frame(ad_hoc_message &inner) const {
+        if (!buf_ || body_length_ < ADHOCMESSAGE_HEADER_LENGTH) {
+            return false;
+        }
+        inner.buf_ = buf_;
+        inner.offset_ = body_offset_;
+        inner.body_offset_ = body_offset_ + ADHOCMESSAGE_HEADER_LENGTH;
+        return inner.decode_header() && (int) inner.length() <= body_length_;
+    }
+
+    /**
+     * 将inner的完整帧作为当前消息的载荷（虫洞隧道），与inner共享缓冲区，不拷贝
+     *
+     * 当前消息的首部只保存在字段中，由发送端的codec编码在载荷之前；接收端通过inner_frame取出内层帧的视图。
+     *
+     * @param inner 内层消息，其首部应当已经编码
+     */
+    void encapsulate(const ad_hoc_message &inner) {
+        if (!inner.header_in_buffer()) {
+            //内层帧本身没有完整的字节表示（空消息或者嵌套的隧道帧），先为其生成一份
+            ad_hoc_message frame(inner);
+            frame.reserve(frame.length());
+            encapsulate(frame);
+            return;
+        }
+        buf_ = inner.buf_;
+        offset_ = inner.offset_;
+        body_offset_ = inner.offset_;
+        body_length_ = (int) inner.length();
+    }
+
+    /**
+     * 释放对缓冲区的引用，首部字段清零
+     */
+    void reset() {
+        *this = ad_hoc_message();
     }
 
     bool operator==(const ad_hoc_message &r) const {
@@ -173,8 +280,71 @@ public:
     }
 
 private:
-    //存放消息首部和载荷的字节数组
-    char data_[ADHOCMESSAGE_HEADER_LENGTH + ADHOCMESSAGE_MAX_BODY_LENGTH];
+    /**
+     * 首部是否以字节形式存放在缓冲区中，载荷紧跟在首部之后
+     */
+    bool header_in_buffer() const {
+        return buf_ && body_offset_ == offset_ + ADHOCMESSAGE_HEADER_LENGTH;
+    }
+
+    void write_header(char *header) const {
+        //根据协议中各个字段的偏移，进行编码
+        put_le32(header, send_id);
+        put_le32(header + 4, receive_id);
+        put_le32(header + 8, source_id);
+        put_le32(header + 12, dest_id);
+        put_le32(header + 16, body_length_);
+        put_le32(header + 20, msg_type_ | flags_ << 16);
+    }
+
+    bool decode_fields(const char *header) {
+        //根据协议中各个字段的偏移，进行解码
+        send_id = get_le32(header);
+        receive_id = get_le32(header + 4);
+        source_id = get_le32(header + 8);
+        dest_id = get_le32(header + 12);
+        body_length_ = get_le32(header + 16);
+        auto type_flags = (uint32_t) get_le32(header + 20);
+        msg_type_ = (int) (type_flags & 0xFFFF);
+        flags_ = (int) (type_flags >> 16);
+        if (body_length_ < 0 || body_length_ > ad_hoc_max_body_length(msg_type_)) {
+            body_length_ = 0;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * 保证当前句柄独占一个容量不小于size、首部和载荷连续存放的缓冲区
+     *
+     * 缓冲区被共享、容量不足或者首部不在缓冲区中时，分配新的缓冲区并拷贝原有的载荷，首部不在缓冲区中时按字段编码。
+     *
+     * @param size
+     */
+    void reserve(size_t size) {
+        if (header_in_buffer() && buf_->refs.load(std::memory_order_acquire) == 1 &&
+            buf_->capacity - offset_ >= size) {
+            return;
+        }
+        ad_hoc_frame_buffer_ptr fresh(ad_hoc_frame_buffer::allocate(size));
+        if (buf_) {
+            size_t old_size = buf_->capacity - body_offset_;
+            size_t new_size = size - ADHOCMESSAGE_HEADER_LENGTH;
+            memcpy(fresh->bytes() + ADHOCMESSAGE_HEADER_LENGTH, buf_->bytes() + body_offset_,
+                   old_size < new_size ? old_size : new_size);
+        }
+        if (header_in_buffer()) {
+            memcpy(fresh->bytes(), buf_->bytes() + offset_, ADHOCMESSAGE_HEADER_LENGTH);
+        } else {
+            write_header(fresh->bytes());
+        }
+        buf_ = fresh;
+        offset_ = 0;
+        body_offset_ = ADHOCMESSAGE_HEADER_LENGTH;
+    }
+
+    //存放消息首部和载荷的缓冲区，可能被多个消息共享
+    ad_hoc_frame_buffer_ptr buf_;
 
     //消息首部各字段，未来可以在此处添加字段
     int send_id;
@@ -182,10 +352,15 @@ private:
     int source_id;
     int dest_id;
     int msg_type_;  // ord=0 aodv=1
+    int flags_;
     int body_length_;
+    //帧在缓冲区中的起始偏移，内层帧与外层帧共享缓冲区时不为0
+    size_t offset_;
+    //载荷在缓冲区中的起始偏移，通常紧跟在首部之后；隧道外层帧的载荷就是内层帧，首部不在缓冲区中
+    size_t body_offset_;
 };
 
-void print_message(ad_hoc_message &msg) {
+void print_message(const ad_hoc_message &msg) {
     cout << "[message] src: " << msg.sourceid() << ", dst: " << msg.destid() << ", sender: " << msg.sendid()
          << ", receiver: " << msg.receiveid() << ", type: " << msg.msg_type() << endl;
 }
@@ -10,6 +10,11 @@
 class ad_hoc_message_handler {
 public:
     virtual void handle_message(ad_hoc_message &, bool) = 0;
+
+    /**
+     * 到server的传输建立之后调用
+     */
+    virtual void handle_connected() {}
 };
 
 #endif //ADHOC_SIMULATION_MESSAGE_HANDLER_H
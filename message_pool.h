@@ -0,0 +1,285 @@
+//
+// Created by 邹迪凯 on 2022/3/4.
+//
+
+#ifndef ADHOC_SIMULATION_MESSAGE_POOL_H
+#define ADHOC_SIMULATION_MESSAGE_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+
+//使用大页内存作为内存池的后备存储，在不支持大页的系统上会自动退回到普通页
+#ifndef POOL_HUGEPAGE
+#define POOL_HUGEPAGE false
+#endif
+
+//尺寸分级：64B容纳HELLO/BACK/RREQ等控制帧，1024B/2048B容纳满载的数据帧，中间的等级用于写队列的节点等
+const size_t POOL_SIZE_CLASSES[] = {64, 128, 256, 512, 1024, 2048};
+const int POOL_SIZE_CLASS_COUNT = sizeof(POOL_SIZE_CLASSES) / sizeof(POOL_SIZE_CLASSES[0]);
+const size_t POOL_MAX_BLOCK_SIZE = 2048;
+//每次向系统申请的内存块大小，切分为若干个同等级的小块
+const size_t POOL_SLAB_SIZE = 64 * 1024;
+//大页arena每次映射的大小
+const size_t POOL_ARENA_SIZE = 2 * 1024 * 1024;
+//线程缓存与全局仓库之间每次转移的块数，线程缓存超过两倍于此的块时归还一批
+const size_t POOL_TRANSFER_BATCH = 32;
+
+struct ad_hoc_message_pool_stats {
+    //向系统申请内存的次数（slab、arena以及超过最大等级的分配），稳定运行后应不再增长
+    size_t system_allocations;
+    //从池中分配的块数
+    size_t pool_allocations;
+    //超过最大等级、直接使用operator new的分配次数
+    size_t large_allocations;
+    //为内存池保留的总字节数
+    size_t reserved_bytes;
+};
+
+/**
+ * 按尺寸分级的消息内存池
+ *
+ * 每个线程持有各等级的空闲链表，分配和释放只操作本线程的链表，不需要加锁。
+ * 当某个线程上释放的块过多时（例如帧在读线程分配、在写线程释放），成批归还到全局仓库，其他线程在本地链表为空时从仓库取回。
+ * 只有仓库也为空时才向系统申请新的slab，因此稳定运行后不再产生系统分配。
+ */
+class ad_hoc_message_pool {
+public:
+    static void *allocate(size_t size) {
+        int level = size_class(size);
+        if (level < 0) {
+            counters().large_allocations.fetch_add(1, std::memory_order_relaxed);
+            counters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(size);
+        }
+        thread_cache &local = cache();
+        if (local.lists[level] == nullptr) {
+            refill(local, level);
+        }
+        free_node *node = local.lists[level];
+        local.lists[level] = node->next;
+        local.counts[level]--;
+        local.allocations++;
+        return node;
+    }
+
+    static void deallocate(void *p, size_t size) {
+        int level = size_class(size);
+        if (level < 0) {
+            ::operator delete(p);
+            return;
+        }
+        thread_cache &local = cache();
+        auto *node = static_cast<free_node *>(p);
+        node->next = local.lists[level];
+        local.lists[level] = node;
+        local.counts[level]++;
+        if (local.counts[level] >= 2 * POOL_TRANSFER_BATCH) {
+            release_batch(local, level);
+        }
+    }
+
+    /**
+     * 返回size所在等级的块大小，超过最大等级时返回size本身
+     */
+    static size_t block_size(size_t size) {
+        int level = size_class(size);
+        return level < 0 ? size : POOL_SIZE_CLASSES[level];
+    }
+
+    static ad_hoc_message_pool_stats stats() {
+        ad_hoc_message_pool_stats s{};
+        s.system_allocations = counters().system_allocations.load(std::memory_order_relaxed);
+        s.pool_allocations = counters().pool_allocations.load(std::memory_order_relaxed) + cache().allocations;
+        s.large_allocations = counters().large_allocations.load(std::memory_order_relaxed);
+        s.reserved_bytes = counters().reserved_bytes.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    static void print_stats(std::ostream &out = std::cout) {
+        auto s = stats();
+        out << "[pool] system allocations: " << s.system_allocations << ", pool allocations: "
+                  << s.pool_allocations << ", large allocations: " << s.large_allocations << ", reserved bytes: "
+                  << s.reserved_bytes << std::endl;
+    }
+
+private:
+    struct free_node {
+        free_node *next;
+    };
+
+    struct thread_cache {
+        free_node *lists[POOL_SIZE_CLASS_COUNT] = {};
+        size_t counts[POOL_SIZE_CLASS_COUNT] = {};
+        size_t allocations = 0;
+
+        ~thread_cache() {
+            //线程退出时把本地链表全部归还给仓库
+            for (int level = 0; level < POOL_SIZE_CLASS_COUNT; level++) {
+                while (lists[level] != nullptr) {
+                    release_batch(*this, level);
+                }
+            }
+            counters().pool_allocations.fetch_add(allocations, std::memory_order_relaxed);
+        }
+    };
+
+    struct shared_counters {
+        std::atomic<size_t> system_allocations{0};
+        std::atomic<size_t> pool_allocations{0};
+        std::atomic<size_t> large_allocations{0};
+        std::atomic<size_t> reserved_bytes{0};
+    };
+
+    //全局仓库，只在线程缓存与仓库之间成批转移时加锁
+    struct depot {
+        std::mutex mutex;
+        free_node *lists[POOL_SIZE_CLASS_COUNT] = {};
+        char *arena = nullptr;
+        size_t arena_left = 0;
+    };
+
+    static int size_class(size_t size) {
+        for (int level = 0; level < POOL_SIZE_CLASS_COUNT; level++) {
+            if (size <= POOL_SIZE_CLASSES[level]) {
+                return level;
+            }
+        }
+        return -1;
+    }
+
+    static thread_cache &cache() {
+        static thread_local thread_cache local;
+        return local;
+    }
+
+    static shared_counters &counters() {
+        static shared_counters c;
+        return c;
+    }
+
+    static depot &global_depot() {
+        static depot d;
+        return d;
+    }
+
+    /**
+     * 本地链表为空时，先尝试从仓库取回一批，仓库为空再切分一个新的slab
+     */
+    static void refill(thread_cache &local, int level) {
+        depot &d = global_depot();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        size_t moved = 0;
+        while (d.lists[level] != nullptr && moved < POOL_TRANSFER_BATCH) {
+            free_node *node = d.lists[level];
+            d.lists[level] = node->next;
+            node->next = local.lists[level];
+            local.lists[level] = node;
+            moved++;
+        }
+        if (moved > 0) {
+            local.counts[level] += moved;
+            return;
+        }
+        size_t block = POOL_SIZE_CLASSES[level];
+        char *slab = allocate_slab(d);
+        for (size_t offset = 0; offset + block <= POOL_SLAB_SIZE; offset += block) {
+            auto *node = reinterpret_cast<free_node *>(slab + offset);
+            node->next = local.lists[level];
+            local.lists[level] = node;
+            local.counts[level]++;
+        }
+    }
+
+    static void release_batch(thread_cache &local, int level) {
+        depot &d = global_depot();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        for (size_t i = 0; i < POOL_TRANSFER_BATCH && local.lists[level] != nullptr; i++) {
+            free_node *node = local.lists[level];
+            local.lists[level] = node->next;
+            local.counts[level]--;
+            node->next = d.lists[level];
+            d.lists[level] = node;
+        }
+    }
+
+    /**
+     * 申请一个slab，调用方需持有仓库的锁
+     */
+    static char *allocate_slab(depot &d) {
+#if POOL_HUGEPAGE
+        if (d.arena_left < POOL_SLAB_SIZE) {
+            d.arena = map_arena();
+            d.arena_left = POOL_ARENA_SIZE;
+        }
+        char *slab = d.arena;
+        d.arena += POOL_SLAB_SIZE;
+        d.arena_left -= POOL_SLAB_SIZE;
+        return slab;
+#else
+        counters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+        counters().reserved_bytes.fetch_add(POOL_SLAB_SIZE, std::memory_order_relaxed);
+        return static_cast<char *>(::operator new(POOL_SLAB_SIZE));
+#endif
+    }
+
+    /**
+     * 映射一块大页arena。优先使用MAP_HUGETLB，系统没有预留大页时退回普通映射并建议内核使用透明大页
+     */
+    static char *map_arena() {
+        counters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+        counters().reserved_bytes.fetch_add(POOL_ARENA_SIZE, std::memory_order_relaxed);
+        void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        p = mmap(nullptr, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(p, POOL_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+        }
+        return static_cast<char *>(p);
+    }
+};
+
+/**
+ * 基于消息内存池的STL分配器，用于session和client的待发送消息队列
+ */
+template<class T>
+class ad_hoc_pool_allocator {
+public:
+    typedef T value_type;
+
+    ad_hoc_pool_allocator() = default;
+
+    template<class U>
+    ad_hoc_pool_allocator(const ad_hoc_pool_allocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(ad_hoc_message_pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        ad_hoc_message_pool::deallocate(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const ad_hoc_pool_allocator<U> &) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const ad_hoc_pool_allocator<U> &) const {
+        return false;
+    }
+};
+
+#endif //ADHOC_SIMULATION_MESSAGE_POOL_H
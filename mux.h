@@ -0,0 +1,164 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_MUX_H
+#define ADHOC_SIMULATION_MUX_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include "message.h"
+#include "message_handler.h"
+#include "transport.h"
+
+using namespace std;
+
+//一个REGISTER帧最多声明的节点数
+const int MUX_MAX_IDS_PER_FRAME = ADHOCMESSAGE_MAX_BODY_LENGTH / 4;
+
+/**
+ * 承载多个节点的一条到server的连接
+ *
+ * 协商报文带有WIRE_OPTION_MULTIPLEX，连接本身不作为节点；节点通过REGISTER帧向server声明自己的ID，之后server把发给这些节点的帧都从这条连接发来，
+ * 广播帧的receiveid被改写为接收节点的ID，这里按receiveid把帧分发给对应节点的handler。
+ * 节点的ID在注册时确定，不再对应socket的端口，多个节点共用一个文件描述符和一个发送队列。
+ * 所有函数都在io_context的线程上调用。
+ */
+class ad_hoc_mux_connection : public ad_hoc_message_handler {
+public:
+    /**
+     * @param transport TRANSPORT_TCP、TRANSPORT_UNIX或TRANSPORT_SHM，UDP没有连接，不支持多路复用
+     * @param endpoint server的地址
+     * @param io_context
+     * @param features 请求的线路特性
+     */
+    ad_hoc_mux_connection(int transport, const tcp::endpoint &endpoint, boost::asio::io_context &io_context,
+                          int features) : transport_(ad_hoc_make_transport(transport, endpoint, io_context, 0,
+                                                                           features, this, WIRE_OPTION_MULTIPLEX)),
+                                          connected_(false) {
+    }
+
+    void start() {
+        transport_->start();
+    }
+
+    /**
+     * 在连接上加入一个节点，连接已建立时立即注册，否则在连接建立后与其他节点一起注册
+     */
+    void attach(int id, ad_hoc_message_handler *handler) {
+        nodes_[id] = handler;
+        if (connected_) {
+            register_nodes(vector<int>{id});
+            handler->handle_connected();
+        } else {
+            pending_.push_back(id);
+        }
+    }
+
+    /**
+     * 节点不再接收消息。server没有注销节点的帧，节点在连接断开时才离开scope
+     */
+    void detach(int id) {
+        nodes_.erase(id);
+    }
+
+    bool send(const ad_hoc_message &msg) {
+        return transport_->send(msg);
+    }
+
+    bool supports(int feature) const {
+        return transport_->supports(feature);
+    }
+
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    void handle_message(ad_hoc_message &msg, bool through_wormhole) override {
+        auto itr = nodes_.find(msg.receiveid());
+        if (itr != nodes_.end()) {
+            itr->second->handle_message(msg, false);
+        }
+    }
+
+    void handle_connected() override {
+        connected_ = true;
+        register_nodes(pending_);
+        for (int id: pending_) {
+            auto itr = nodes_.find(id);
+            if (itr != nodes_.end()) {
+                itr->second->handle_connected();
+            }
+        }
+        pending_.clear();
+    }
+
+private:
+    /**
+     * 发送REGISTER帧，每帧最多MUX_MAX_IDS_PER_FRAME个ID
+     */
+    void register_nodes(const vector<int> &ids) {
+        for (size_t first = 0; first < ids.size(); first += MUX_MAX_IDS_PER_FRAME) {
+            size_t count = min(ids.size() - first, (size_t) MUX_MAX_IDS_PER_FRAME);
+            ad_hoc_message msg(REGISTER_MESSAGE, 0, 0, 0, 0);
+            msg.body_length((int) count * 4);
+            char *body = msg.body();
+            for (size_t i = 0; i < count; i++) {
+                put_le32(body + i * 4, ids[first + i]);
+            }
+            msg.encode_header();
+            transport_->send(msg);
+        }
+    }
+
+    unique_ptr<ad_hoc_transport> transport_;
+    unordered_map<int, ad_hoc_message_handler *> nodes_; //节点ID -> 节点的handler
+    vector<int> pending_; //连接建立前加入的节点
+    bool connected_;
+};
+
+/**
+ * 多路复用连接上一个节点的传输
+ *
+ * 节点的ID由调用方指定，不查询socket；发送直接进入连接的发送队列，与同一连接上其他节点的帧一起成批发出。
+ * 连接的生命周期由调用方管理，必须长于所有节点。
+ */
+class ad_hoc_mux_transport : public ad_hoc_transport {
+public:
+    ad_hoc_mux_transport(ad_hoc_mux_connection &connection, boost::asio::io_context &io_context, int id,
+                         ad_hoc_message_handler *handler) : ad_hoc_transport(handler), connection(connection),
+                                                            io_context(io_context), id_(id) {
+    }
+
+    void start() override {
+        boost::asio::post(io_context, [this] {
+            connection.attach(id_, handler_);
+        });
+    }
+
+    bool send(const ad_hoc_message &msg) override {
+        return connection.send(msg);
+    }
+
+    bool supports(int feature) const override {
+        return connection.supports(feature);
+    }
+
+    int local_id() override {
+        return id_;
+    }
+
+    void close() override {
+        connection.detach(id_);
+    }
+
+private:
+    ad_hoc_mux_connection &connection;
+    boost::asio::io_context &io_context;
+    int id_;
+};
+
+#endif //ADHOC_SIMULATION_MUX_H
@@ -11,66 +11,280 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/asio.hpp>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <deque>
 #include <ctime>
-
-#define  MAX  8
+#include <mutex>
+#include <shared_mutex>
+#include <unistd.h>
 
 #include "message.h"
+#include "batch_writer.h"
+#include "frame_reader.h"
+#include "datagram.h"
+#include "local_socket.h"
+#include "shm.h"
+#include "compression.h"
 #include "aodv.h"
+#include "topology.h"
+#include "channel.h"
+#include "geometry.h"
+#include "trace.h"
+#include "shard.h"
+#include "executor.h"
+#include "uring.h"
 #include "utils.h"
 
 const int UDG_UPDATE_TIMEOUT = 60;
+//多监听器模式下每个监听器同时挂起的accept操作数
+const int SERVER_OUTSTANDING_ACCEPTS = 16;
+//随机生成拓扑图时至少包含的顶点数
+const int UDG_MIN_VERTICES = 8;
+
+//server启动时的默认拓扑，按节点加入的顺序依次占用顶点
+const int DEFAULT_UDG[UDG_MIN_VERTICES][UDG_MIN_VERTICES] = {{1, 1, 0, 0, 1, 0, 0, 1},
+                                                             {1, 1, 1, 0, 0, 0, 0, 0},
+                                                             {0, 1, 1, 1, 0, 0, 0, 0},
+                                                             {0, 0, 1, 1, 0, 0, 1, 0},
+                                                             {1, 0, 0, 0, 1, 1, 0, 0},
+                                                             {0, 0, 0, 0, 1, 1, 1, 0},
+                                                             {0, 0, 0, 1, 0, 1, 1, 0},
+                                                             {1, 0, 0, 0, 0, 0, 0, 1}};
+
+//const int DEFAULT_UDG[UDG_MIN_VERTICES][UDG_MIN_VERTICES] = {{1, 1, 1, 0, 0, 0, 0, 0},
+//                                                             {1, 1, 0, 0, 0, 0, 0, 0},
+//                                                             {1, 0, 1, 1, 0, 0, 0, 0},
+//                                                             {0, 0, 1, 1, 0, 0, 0, 0},
+//                                                             {0, 0, 0, 0, 1, 0, 0, 0},
+//                                                             {0, 0, 0, 0, 0, 1, 0, 0},
+//                                                             {0, 0, 0, 0, 0, 0, 1, 0},
+//                                                             {0, 0, 0, 0, 0, 0, 0, 1}};
 
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 using namespace std;
-//使用deque来实现串型消息队列，主要用于待发送消息队列
-typedef deque<ad_hoc_message> message_queue;
 
-class ad_hoc_participant {
+//在session将message传递给scope时，要求转发给消息的接收端
+//负责管理多个连接的ad_hoc_session，维护一个ID和session映射关系的哈希表
+//多个IO线程会同时调用scope：转发和广播只读映射表和拓扑图，持有共享锁；节点加入、离开和重新生成拓扑持有独占锁。
+//session的deliver只把消息投递到该session的strand上，不会在持有锁时回调scope。
+//
+//分片模式下，每个节点按拓扑划分到一个分片上，session在分片的线程上运行，转发由分片在本地副本上完成，不经过这里的锁。
+//scope只负责加入、离开和修改拓扑这些控制操作，修改完自己的拓扑后按相同的顺序投递给每个分片。
+//已加入的节点不会因为拓扑重新生成而迁移分片。
+class ad_hoc_scope {
 public:
-    virtual ~ad_hoc_participant() {}
+    /**
+     * @param wormhole_channel
+     * @param io_context 非分片模式下转发消息使用的io_context
+     * @param shards 分片数，为0时不分片
+     * @param cpus 第i个分片的线程绑定到cpus[i % cpus.size()]上，为空时不绑定
+     */
+    ad_hoc_scope(bool wormhole_channel, boost::asio::io_context &io_context, int shards = 0,
+                 const vector<int> &cpus = {}) : wormhole_channel(wormhole_channel),
+                                                 own_executor(new ad_hoc_asio_executor(io_context)),
+                                                 executor(*own_executor),
+                                                 links(executor, [this](ad_hoc_link_frame &frame) {
+                                                     transmit(frame);
+                                                 }),
+                                                 unicast_delay(boost::posix_time::millisec(LINK_UNICAST_DELAY_MS)),
+                                                 broadcast_delay(boost::posix_time::millisec(LINK_BROADCAST_DELAY_MS)) {
+        topology.load(&DEFAULT_UDG[0][0], UDG_MIN_VERTICES);
+        vector<ad_hoc_shard *> peers;
+        for (int i = 0; i < shards; i++) {
+            this->shards.emplace_back(new ad_hoc_shard(i, wormhole_channel));
+            peers.push_back(this->shards.back().get());
+        }
+        shard_sizes.assign(shards, 0);
+        for (int i = 0; i < shards; i++) {
+            this->shards[i]->load(topology);
+            this->shards[i]->start(peers, cpus.empty() ? -1 : cpus[i % cpus.size()]);
+        }
+    }
 
-    virtual void deliver(ad_hoc_message &msg) = 0;
-};
+    /**
+     * 由调用方提供执行器的非分片scope，例如离散事件仿真中以虚拟时钟驱动的执行器
+     *
+     * @param wormhole_channel
+     * @param executor 链路延迟的定时器经过这个执行器，生命周期长于scope
+     */
+    ad_hoc_scope(bool wormhole_channel, ad_hoc_executor &executor) : wormhole_channel(wormhole_channel),
+                                                                     executor(executor),
+                                                                     links(executor, [this](ad_hoc_link_frame &frame) {
+                                                                         transmit(frame);
+                                                                     }),
+                                                                     unicast_delay(boost::posix_time::millisec(
+                                                                             LINK_UNICAST_DELAY_MS)),
+                                                                     broadcast_delay(boost::posix_time::millisec(
+                                                                             LINK_BROADCAST_DELAY_MS)) {
+        topology.load(&DEFAULT_UDG[0][0], UDG_MIN_VERTICES);
+    }
 
-typedef boost::shared_ptr<ad_hoc_participant> ad_hoc_participant_ptr;
+    ~ad_hoc_scope() {
+        if (mobility_timer) {
+            mobility_timer->cancel();
+        }
+        replay_.reset();
+        //分片的session的socket属于分片的io_context，要在分片析构之前释放映射表中的引用
+        session_map.clear();
+        shards.clear();
+    }
 
+    /**
+     * 停止所有分片的线程
+     */
+    void stop() {
+        for (auto &s: shards) {
+            s->stop();
+        }
+    }
 
-//在session将message传递给scope时，要求转发给消息的接收端
-//负责管理多个连接的ad_hoc_session，维护一个ID和session映射关系的哈希表
-class ad_hoc_scope {
-public:
-    ad_hoc_scope(bool wormhole_channel, boost::asio::io_context &io_context) : wormhole_channel(wormhole_channel),
-                                                                               io_context(io_context) {
+    bool sharded() const {
+        return !shards.empty();
+    }
 
+    /**
+     * 第i个分片的io_context，用于把监听器分散到各个分片的线程上
+     */
+    boost::asio::io_context &shard_context(int i) {
+        return shards[i % shards.size()]->io_context();
+    }
+
+    /**
+     * 已加入的节点数
+     */
+    size_t size() const {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        return session_map.size();
+    }
+
+    /**
+     * 拓扑中的链路数
+     */
+    size_t link_count() const {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        return topology.links();
+    }
+
+    /**
+     * 分片模式下，为新连接的节点选择分片，返回该分片的io_context，session需要在这个io_context上创建
+     *
+     * @param id
+     * @return
+     */
+    boost::asio::io_context &place(int id) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        return shards[owner(id)]->io_context();
     }
 
     void join(int id, ad_hoc_participant_ptr participant) {
-        session_map[id] = participant;
+        unique_lock<shared_timed_mutex> lock(mutex);
+        join_locked(id, participant);
+    }
 
-        static int i = 0;
-        if (i >= 0) {
-            node[i] = id;
-            i++;
-        }           //每进来一个ID号就作为邻接矩阵的顶点
+    /**
+     * 节点加入，但ID已经加入或者已经place过时不加入，不替换已有的节点
+     *
+     * 多路复用连接的REGISTER帧和Unix域socket的协商报文中的ID由对端自己声明，不能借此接管其他session或连接的节点
+     *
+     * @param placed 调用方已经以这个ID调用过place，此时只检查ID是否已经加入
+     * @return 是否加入
+     */
+    bool claim(int id, ad_hoc_participant_ptr participant, bool placed = false) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        if (session_map.find(id) != session_map.end() || (!placed && topology.vertex(id) >= 0)) {
+            return false;
+        }
+        join_locked(id, participant);
+        return true;
     }
 
-    void create_UDG()    //创建网络拓扑图
-    {
-//        srand(3);
-        for (int column = 0; column < MAX; column++) {
-            for (int low = 0; low < MAX; low++) {
-                matrix[column][low] = 0;
-            }
+    /**
+     * 撤销place：连接在加入之前就失败时，空出place占用的顶点和分片中的名额。已经加入的节点不受影响。
+     */
+    void unplace(int id) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        if (session_map.find(id) != session_map.end()) {
+            return;
         }
-        for (int column = 0; column < MAX; column++) {
-            for (int low = 0; low < MAX; low++) {
-                if (rand() % MAX > int(MAX / 2) || column == low) {
-                    matrix[column][low] = 1;
-                    matrix[low][column] = 1;
-                }
+        topology.leave(id);
+        auto it = owners.find(id);
+        if (it != owners.end()) {
+            shard_sizes[it->second]--;
+            owners.erase(it);
+        }
+    }
+
+    /**
+     * 创建网络拓扑图：把所有顶点重新随机放置在场地上，距离不超过通信半径的顶点之间有链路
+     *
+     * 还没有设置几何位置时按顶点数取场地大小，使平均邻居数为GEOMETRY_DEGREE。
+     */
+    void create_UDG() {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        scatter();
+    }
+
+    /**
+     * 改用width x height场地上的单位圆盘图，随机放置至少vertices个顶点并按通信半径重新生成链路
+     */
+    void geometry(double width, double height, double range, int vertices = 0) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        geometry_.reset(new ad_hoc_geometry(width, height, range));
+        geometry_->scatter(max(vertices, topology.size()), random);
+        changes.clear();
+        geometry_->build(topology, random, changes);
+        publish();
+    }
+
+    /**
+     * 每隔tick按移动模型移动所有顶点，只增删位置变化的顶点的链路。还没有设置几何位置时先按create_UDG生成。
+     */
+    void mobility(unique_ptr<ad_hoc_mobility> model, const boost::posix_time::time_duration &tick =
+            boost::posix_time::millisec(MOBILITY_TICK_MS)) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        if (!geometry_) {
+            scatter();
+        }
+        mobility_ = std::move(model);
+        mobility_tick = tick;
+        if (!mobility_timer) {
+            mobility_timer = executor.create_timer();
+            arm_mobility();
+        }
+    }
+
+    /**
+     * 打印每个分片的节点数，以及本地投递、跨分片投递的消息数
+     */
+    void print_shards(ostream &out = cout) {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        for (auto &s: shards) {
+            ad_hoc_shard::stats stats = s->statistics();
+            out << "shard " << s->index() << ": nodes " << shard_sizes[s->index()] << ", local " << stats.local << ", remote "
+                 << stats.remote << ", overflow " << stats.overflow << ", lost " << stats.lost << ", failed "
+                 << stats.failed << endl;
+        }
+        if (!sharded()) {
+            out << "scope: lost " << lost_.load(memory_order_relaxed) << ", failed "
+                << failed_.load(memory_order_relaxed) << endl;
+        }
+    }
+
+    /**
+     * 打印最近一个纪元的链路变化，变化不多时逐条打印
+     */
+    void print_epoch(ostream &out = cout) {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        uint64_t epoch = topology.epoch();
+        const vector<ad_hoc_link_change> *latest = log.at(epoch);
+        size_t count = latest ? latest->size() : 0;
+        out << "epoch " << epoch << ": " << count << " link changes, " << topology.links() << " links" << endl;
+        if (latest && count <= (size_t) TOPOLOGY_MATRIX_PRINT_LIMIT) {
+            for (const ad_hoc_link_change &change: *latest) {
+                out << (change.up ? "  + " : "  - ") << change.a << "-" << change.b << endl;
             }
         }
     }
@@ -79,40 +293,169 @@ public:
     {
         print_time();
         cout << "The node network topology is as follows: " << endl;
-        for (int i = 0; i < MAX; i++) {
-            for (int j = 0; j < MAX; j++) {
-                cout << matrix[i][j] << " ";
-
-            }
-            cout << endl;
-        }
+        shared_lock<shared_timed_mutex> lock(mutex);
+        topology.print();
         cout << endl;
     }
 
+    /**
+     * ID是否已经加入或者已经place过，此时claim不会成功
+     */
+    bool taken(int id) const {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        return session_map.find(id) != session_map.end() || topology.vertex(id) >= 0;
+    }
+
     void leave(int id) {
-        session_map.erase(id);
+        unique_lock<shared_timed_mutex> lock(mutex);
+        leave_locked(id);
     }
 
-    bool judge_deliver(const ad_hoc_message &msg)   //判断是否转发消息
+    /**
+     * 节点离开，只在ID仍然属于participant时离开，不影响之后以同一个ID加入的其他节点
+     */
+    void leave(int id, const ad_hoc_participant *participant) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        auto it = session_map.find(id);
+        if (it != session_map.end() && it->second.get() == participant) {
+            leave_locked(id);
+        }
+    }
+
+    bool judge_deliver(const ad_hoc_message &msg)   //判断是否转发消息，调用方持有锁
     {
-        for (int k = 0; k < MAX; k++) {
-            if (node[k] == msg.receiveid())       //msg.receiveid()是要消息要发送到的ID号
-            {
-                int row = k;
-                for (int j = 0; j < MAX; j++) {
-                    if (node[j] == msg.sendid())      //msg.sendid()是要发送方的ID号
-                    {
-                        int column = j;
-                        if (matrix[column][row] == 1) {
-                            return true;
-                        }
+        //msg.sendid()是要发送方的ID号，msg.receiveid()是要消息要发送到的ID号
+        return topology.connected(msg.sendid(), msg.receiveid());
+    }
 
-                    }
-                }
+    /**
+     * 在两个顶点之间增加链路
+     */
+    void link(int a, int b) {
+        apply({ad_hoc_link_change{a, b, true}});
+    }
 
-            }
+    /**
+     * 把一批链路的建立和断开作为一个新的纪元应用到拓扑上
+     *
+     * 只有实际生效的变化被记入日志、交给各分片的副本和订阅者，开销与变化的链路数成正比。
+     * 延迟队列中经过断开的链路的帧到期时按链路故障丢弃。
+     *
+     * @return 新的纪元
+     */
+    uint64_t apply(const vector<ad_hoc_link_change> &batch) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        changes.assign(batch.begin(), batch.end());
+        return publish();
+    }
+
+    /**
+     * 订阅拓扑的变化：每个纪元结束时以纪元和其中实际生效的链路变化调用subscriber
+     *
+     * 回调在持有拓扑的独占锁时执行，不能再调用scope的函数。
+     *
+     * @return 用于取消订阅的编号
+     */
+    int subscribe(ad_hoc_topology_subscriber subscriber) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        subscribers[next_subscriber] = std::move(subscriber);
+        return next_subscriber++;
+    }
+
+    void unsubscribe(int handle) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        subscribers.erase(handle);
+    }
+
+    /**
+     * 当前纪元
+     */
+    uint64_t epoch() const {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        return topology.epoch();
+    }
+
+    /**
+     * 取纪元epoch之后的所有链路变化，用于落后的订阅者追赶
+     *
+     * @return 变化日志已经不包含这些纪元时返回false，需要重新读取整个拓扑
+     */
+    bool changes_since(uint64_t epoch, vector<ad_hoc_link_change> &out) const {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        return log.since(epoch, out);
+    }
+
+    /**
+     * 设置一跳链路上单播和广播的延迟，为0时帧不经过延迟队列
+     */
+    void link_delay(const boost::posix_time::time_duration &unicast,
+                    const boost::posix_time::time_duration &broadcast) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        unicast_delay = unicast;
+        broadcast_delay = broadcast;
+        for (auto &s: shards) {
+            s->link_delay(unicast, broadcast);
+        }
+    }
+
+    /**
+     * 设置两个顶点之间链路的信道参数，链路不存在时忽略
+     */
+    void channel(int a, int b, const ad_hoc_channel_params &params) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        topology.configure(a, b, params);
+        for (auto &s: shards) {
+            s->configure(a, b, params);
+        }
+    }
+
+    /**
+     * 设置所有链路的信道参数，之后增加的链路也使用这组参数
+     */
+    void channel(const ad_hoc_channel_params &params) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        topology.configure(params);
+        for (auto &s: shards) {
+            s->configure(params);
+        }
+    }
+
+    /**
+     * 修改两个顶点之间链路的传播延迟，保留信道的其他参数，链路不存在时忽略
+     */
+    void link_delay(int a, int b, const boost::posix_time::time_duration &delay) {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        ad_hoc_channel *c = topology.channel(a, b);
+        if (c == nullptr) {
+            return;
+        }
+        ad_hoc_channel_params params = c->parameters();
+        params.delay_us = delay.total_microseconds();
+        topology.configure(a, b, params);
+        for (auto &s: shards) {
+            s->configure(a, b, params);
         }
-        return false;
+    }
+
+    /**
+     * 按轨迹文件（见trace.h）的时间回放链路的建立、断开和延迟变化，替换正在进行的回放
+     *
+     * 文件以内存映射读取，事件在到期时才解码，同一时刻的链路增删作为一个纪元应用。
+     *
+     * @return 文件不能打开或者不是轨迹文件时返回false
+     */
+    bool replay(const string &path) {
+        unique_ptr<ad_hoc_trace_replay> r(new ad_hoc_trace_replay(executor, [this](const vector<ad_hoc_link_change> &batch) {
+            apply(batch);
+        }, [this](int a, int b, int delay) {
+            link_delay(a, b, boost::posix_time::microseconds(delay));
+        }));
+        if (!r->start(path)) {
+            return false;
+        }
+        unique_lock<shared_timed_mutex> lock(mutex);
+        replay_ = std::move(r);
+        return true;
     }
 
     /**
@@ -123,40 +466,54 @@ public:
         * @param msg 待转发消息
         * @return
         */
-    bool deliver(ad_hoc_message msg) {
+    bool deliver(const ad_hoc_message &msg) {
+        //分片线程上的session由所在的分片转发
+        if (ad_hoc_shard *shard = ad_hoc_shard::current()) {
+            return shard->route(msg);
+        }
         if (wormhole_channel) {
 #if DEBUG
 //            cout << "deliver through wormhole" << endl;
 //            print(msg);
 #endif
+            shared_lock<shared_timed_mutex> lock(mutex);
             int dest_i;
-            if (msg.sendid() == node[0]) {
+            if (msg.sendid() == topology.id(0)) {
                 dest_i = 1;
             } else {
                 dest_i = 0;
             }
-            session_map[node[dest_i]]->deliver(msg);
+            auto it = session_map.find(topology.id(dest_i));
+            if (it != session_map.end()) {
+                it->second->deliver(msg);
+            }
         } else if (msg.receiveid() == AODV_BROADCAST_ADDRESS) {
             //一跳范围内广播
 #if DEBUG
 //            cout << "broadcasting" << endl;
 //            print(msg);
 #endif
-            boost::asio::deadline_timer timer(io_context);
-            timer.expires_from_now(boost::posix_time::millisec(100));
-            timer.async_wait(boost::bind(&ad_hoc_scope::broadcast, this, msg));
-        } else if (session_map.find(msg.receiveid()) == session_map.end()) { //没有查到相应的ID，就返回错误
-            return false;
+            broadcast(msg);
         } else {
+            shared_lock<shared_timed_mutex> lock(mutex);
+            if (session_map.find(msg.receiveid()) == session_map.end()) { //没有查到相应的ID，就返回错误
+                return false;
+            }
             if (judge_deliver(msg))       //根据网络拓扑图判断是否能转发信息
             {
 #if DEBUG
 //                cout << "sending" << endl;
 //                print(msg);
 #endif
-                boost::asio::deadline_timer timer(io_context);
-                timer.expires_from_now(boost::posix_time::millisec(200));
-                timer.async_wait(boost::bind(&ad_hoc_scope::deliver, this, msg.receiveid(), msg));
+                int from = topology.vertex(msg.sendid()), to = topology.vertex(msg.receiveid());
+                int64_t delay = topology.transmit(from, to, msg.length(), ad_hoc_channel_time(executor.now()),
+                                                  unicast_delay.total_microseconds(), ad_hoc_thread_random());
+                if (delay < 0) {
+                    lost_.fetch_add(1, memory_order_relaxed);
+                    return false;
+                }
+                links.push(boost::posix_time::microseconds(delay),
+                           ad_hoc_link_frame{msg.receiveid(), from, to, topology.epoch(), msg});
 //                session_map[msg.receiveid()]->deliver(msg);    //调用ID号对应的session去发送信息
                 return true;
             } else {
@@ -168,56 +525,192 @@ public:
         return false;
     }
 
-    void deliver(int id, ad_hoc_message &msg) {
-        session_map[id]->deliver(msg);    //调用ID号对应的session去发送信息
+    void deliver(int id, const ad_hoc_message &msg) {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        auto it = session_map.find(id);     //延迟期间接收方可能已经离开
+        if (it != session_map.end()) {
+            it->second->deliver(msg);    //调用ID号对应的session去发送信息
+        }
     }
 
     /**
      * 在 sender 所能直接联通(一跳)的范围内广播该消息
      *
+     * 每个邻居的帧分别经过各自链路的信道，按各自的延迟到达，丢失的帧不投递。
+     *
      * @param msg
      */
-    void broadcast(ad_hoc_message &msg) {
-        for (int i = 0; i < MAX; i++) {
-            if (node[i] == msg.sendid()) {
-                for (int j = 0; j < MAX; j++) {
-                    if (j != i && matrix[i][j] && session_map.find(node[j]) != session_map.end()) {
-                        session_map[node[j]]->deliver(msg);
-                    }
-                }
-                break;
+    void broadcast(const ad_hoc_message &msg) {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        int vertex = topology.vertex(msg.sendid());
+        if (vertex < 0) {
+            return;
+        }
+        const vector<int> &neighbours = topology.neighbours(vertex);
+        const vector<uint32_t> &channels = topology.neighbour_channels(vertex);
+        int64_t now = ad_hoc_channel_time(executor.now());
+        int64_t fallback = broadcast_delay.total_microseconds();
+        ad_hoc_random &random = ad_hoc_thread_random();
+        for (size_t i = 0; i < neighbours.size(); i++) {
+            int id = topology.id(neighbours[i]);
+            if (session_map.find(id) == session_map.end()) {
+                continue;
+            }
+            int64_t delay = topology.channel(channels[i]).transmit(vertex < neighbours[i], msg.length(), now,
+                                                                   fallback, random);
+            if (delay < 0) {
+                lost_.fetch_add(1, memory_order_relaxed);
+                continue;
             }
+            links.push(boost::posix_time::microseconds(delay),
+                       ad_hoc_link_frame{id, vertex, neighbours[i], topology.epoch(), msg});
         }
     }
 
-    int matrix[MAX][MAX] = {{1, 1, 0, 0, 1, 0, 0, 1},
-                            {1, 1, 1, 0, 0, 0, 0, 0},
-                            {0, 1, 1, 1, 0, 0, 0, 0},
-                            {0, 0, 1, 1, 0, 0, 1, 0},
-                            {1, 0, 0, 0, 1, 1, 0, 0},
-                            {0, 0, 0, 0, 1, 1, 1, 0},
-                            {0, 0, 0, 1, 0, 1, 1, 0},
-                            {1, 0, 0, 0, 0, 0, 0, 1}};
-
-//    int matrix[MAX][MAX] = {{1, 1, 1, 0, 0, 0, 0, 0},
-//                            {1, 1, 0, 0, 0, 0, 0, 0},
-//                            {1, 0, 1, 1, 0, 0, 0, 0},
-//                            {0, 0, 1, 1, 0, 0, 0, 0},
-//                            {0, 0, 0, 0, 1, 0, 0, 0},
-//                            {0, 0, 0, 0, 0, 1, 0, 0},
-//                            {0, 0, 0, 0, 0, 0, 1, 0},
-//                            {0, 0, 0, 0, 0, 0, 0, 1}};
 private:
     unordered_map<int, ad_hoc_participant_ptr> session_map;
-    int node[MAX];
+    ad_hoc_topology topology; //网络拓扑图，节点ID到顶点的映射和顶点之间的链路
+    mutable shared_timed_mutex mutex; //保护session_map、topology以及以下分片的归属信息
+    vector<unique_ptr<ad_hoc_shard>> shards;
+    unordered_map<int, int> owners; //节点ID -> 所属分片
+    vector<size_t> shard_sizes; //每个分片的节点数
+
+    /**
+     * 以下两个函数的调用方持有独占锁
+     */
+    void join_locked(int id, const ad_hoc_participant_ptr &participant) {
+        session_map[id] = participant;
+        int vertex = topology.join(id);          //每进来一个ID号就占用拓扑图的一个空闲顶点，place过的节点保持place时的顶点
+        if (sharded()) {
+            //分片的副本使用scope分配的顶点：各个session在不同的分片线程上加入，加入的顺序与place的顺序不同
+            int shard = owner(id);
+            for (auto &s: shards) {
+                s->join(id, vertex, shard, participant);
+            }
+        }
+    }
+
+    void leave_locked(int id) {
+        session_map.erase(id);
+        topology.leave(id);         //空出顶点，之后加入的节点复用
+        auto it = owners.find(id);
+        if (it != owners.end()) {
+            shard_sizes[it->second]--;
+            owners.erase(it);
+            for (auto &s: shards) {
+                s->leave(id);
+            }
+        }
+    }
+
+    /**
+     * 节点所属的分片，还没有分配时按拓扑划分，调用方持有独占锁
+     */
+    int owner(int id) {
+        auto it = owners.find(id);
+        if (it != owners.end()) {
+            return it->second;
+        }
+        int vertex = topology.join(id);
+        int shard = ad_hoc_partition(topology, vertex, owners, shard_sizes);
+        owners[id] = shard;
+        shard_sizes[shard]++;
+        return shard;
+    }
+    /**
+     * 重新随机放置所有顶点并生成单位圆盘图，调用方持有独占锁
+     */
+    void scatter() {
+        int n = max(topology.size(), UDG_MIN_VERTICES);
+        if (!geometry_) {
+            geometry_ = ad_hoc_geometry::with_density(n);
+        }
+        geometry_->scatter(n, random);
+        changes.clear();
+        geometry_->build(topology, random, changes);
+        publish();
+    }
+
+    /**
+     * 把changes作为一个新的纪元应用到拓扑上，再交给变化日志、各分片和订阅者，调用方持有独占锁
+     */
+    uint64_t publish() {
+        uint64_t epoch = topology.apply(changes);
+        log.append(epoch, changes);
+        for (auto &s: shards) {
+            s->apply(changes);
+        }
+        for (auto &entry: subscribers) {
+            entry.second(epoch, changes);
+        }
+        return epoch;
+    }
+
+    void arm_mobility() {
+        mobility_timer->expires_from_now(mobility_tick);
+        mobility_timer->async_wait([this](const boost::system::error_code &error) {
+            if (error != boost::asio::error::operation_aborted) {
+                move();
+            }
+        });
+    }
+
+    /**
+     * 移动一步，把建立和断开的链路应用到拓扑和各分片的副本上
+     */
+    void move() {
+        unique_lock<shared_timed_mutex> lock(mutex);
+        changes.clear();
+        geometry_->move(*mobility_, mobility_tick.total_microseconds() / 1e6, random, topology, changes);
+        publish();
+        arm_mobility();
+    }
+
+    /**
+     * 链路延迟到期后投递帧，延迟期间链路断开过的帧按链路故障丢弃
+     */
+    void transmit(const ad_hoc_link_frame &frame) {
+        shared_lock<shared_timed_mutex> lock(mutex);
+        if (!topology.intact(frame.from, frame.to, frame.epoch)) {
+            failed_.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        auto it = session_map.find(frame.receiver);     //延迟期间接收方可能已经离开
+        if (it != session_map.end()) {
+            it->second->deliver(frame.msg);
+        }
+    }
+
     bool wormhole_channel;
-    boost::asio::io_context &io_context;
+    unique_ptr<ad_hoc_executor> own_executor; //以io_context构造时自己创建的执行器
+    ad_hoc_executor &executor;
+    ad_hoc_delay_queue<ad_hoc_link_frame> links; //等待链路延迟的帧，所有节点共用一个定时器
+    boost::posix_time::time_duration unicast_delay; //由mutex保护
+    boost::posix_time::time_duration broadcast_delay;
+    //信道的排队和丢包状态在转发时修改，转发只持有mutex的共享锁，由每条链路自己的锁保护，随机数每个线程一个
+    ad_hoc_random random; //几何位置和移动模型使用，由mutex的独占锁保护
+    //几何位置和移动模型，由mutex保护
+    unique_ptr<ad_hoc_geometry> geometry_;
+    unique_ptr<ad_hoc_mobility> mobility_;
+    timer_ptr mobility_timer;
+    boost::posix_time::time_duration mobility_tick;
+    vector<ad_hoc_link_change> changes; //正在应用的一个纪元的链路变化，复用
+    ad_hoc_topology_log log; //最近各纪元实际生效的链路变化
+    map<int, ad_hoc_topology_subscriber> subscribers;
+    int next_subscriber = 0;
+    unique_ptr<ad_hoc_trace_replay> replay_; //正在进行的轨迹回放
+    atomic<size_t> failed_{0}; //非分片模式下延迟期间链路断开而丢弃的帧数
+    atomic<size_t> lost_{0}; //非分片模式下在信道上丢弃的帧数
 };
 
 
 //对于server端的socket连接，每个对象对应一个socket连接
-class ad_hoc_session : public boost::enable_shared_from_this<ad_hoc_session>,
-                       public ad_hoc_participant {
+//Protocol是TCP或Unix域的流式协议，两者的收发流程完全相同，只是识别节点的方式不同
+//Stream是socket上的读写流，Unix域socket上还可以是共享内存的流
+//协商报文带有WIRE_OPTION_MULTIPLEX的连接承载多个节点：连接本身不加入scope，REGISTER帧声明的每个节点各自加入
+template<typename Protocol, typename Stream = ad_hoc_basic_stream<typename Protocol::socket>>
+class ad_hoc_basic_session : public boost::enable_shared_from_this<ad_hoc_basic_session<Protocol, Stream>>,
+                             public ad_hoc_participant {
 public:
     /**
     * 构造函数
@@ -227,80 +720,123 @@ public:
     * @param ioContext 此session未来进行读写操作时，需要维护其IO事件的io_context。应该和server使用同一个io_context。
     * @param scope 此session隶属的scope。
     */
-    ad_hoc_session(boost::asio::io_context &ioContext, ad_hoc_scope &scope) : socket_(ioContext),
-                                                                              scope(scope) {
+    ad_hoc_basic_session(boost::asio::io_context &ioContext, ad_hoc_scope &scope) : socket_(ioContext),
+                                                                                    stream_(socket_),
+                                                                                    strand_(boost::asio::make_strand(
+                                                                                            ioContext)),
+                                                                                    scope(scope),
+                                                                                    reader_(codec_),
+                                                                                    writer_(codec_),
+                                                                                    multiplexed_(false) {
     }
 
-    tcp::socket &socket() {
+    typename Protocol::socket &socket() {
         return socket_;
     }
 
+    Stream &stream() {
+        return stream_;
+    }
+
     /**
      * 启动session接收消息的循环
+     *
+     * 在session的strand上执行，保证加入scope之后其他session投递过来的消息排在启动之后
+     *
+     * @param id 接受连接时由对端地址得到的ID（见id()），分片模式下已经以这个ID在scope中place过
      */
-    void start() {
-        //加入隶属的scope
-        scope.join(id(), shared_from_this());
-        //发起异步的读数据操作，这个读数据操作只负责读取头部，参数：
-        //1.socket。和client的连接socket，从该socket的接收缓冲区中读字节数据。
-        //2.msg_timer_map。创建一个地址是read_msg_的数据的起始位置，长度是ADHOCMESSAGE_HEADER_LENGTH的buffer。
-        //      当async_read读满了这个buffer（读到了ADHOCMESSAGE_HEADER_LENGTH个字节），则本次读数据完成，会调用回调函数handle_read_header。
-        //3.回调函数。通过bind方法绑定了一个参数：this指针，后两个参数是占位符。
-        boost::asio::async_read(socket_,
-                                boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                boost::bind(
-                                        &ad_hoc_session::handle_read_header,
-                                        shared_from_this(),
-                                        boost::asio::placeholders::error,
-                                        boost::asio::placeholders::bytes_transferred));
+    void start(int id) {
+        boost::asio::dispatch(strand_, boost::bind(&ad_hoc_basic_session::do_start, this->shared_from_this(), id));
+    }
+
+    void do_start(int id) {
+        //等待client的协商报文，老版本的client不发送协商报文，由reader识别后按v1收发
+        codec_.start_server(WIRE_MAX_VERSION, WIRE_FEATURE_COMPRESSION | WIRE_FEATURE_CRC32C);
+        //加入隶属的scope。连接断开后无法再取得对端地址，离开scope时使用这里记下的ID。
+        //不在这里重新读取对端地址：对端此时可能已经断开，place过的顶点就再也没有节点加入和离开
+        id_ = id;
+        scope.join(id_, this->shared_from_this());
+        read_some();
     }
 
     /**
-        * 读消息头部的回调函数
-        *
-        * 会对消息头部进行解码，并发起读数据载荷（body）的操作。
-        *
-        * @param error
-        * @param bytes_transferred
-        */
-    void handle_read_header(const boost::system::error_code &error, size_t bytes_transferred) {
-        //若没有发生错误，且消息头部的解码成功（符合协议格式）
-        if (!error && read_msg_.decode_header()) {
-            //此时已经从头部得到了数据载荷的实际长度read_msg_.body_length()
-            //创建一个buffer，地址为read_msg_的起点向后偏移HEADER_LENGTH，长度为body_length。
-            //当async_read读满此buffer后（读到了body_length个字节），会调用回调函数handle_read_body。
-            boost::asio::async_read(socket_,
-                                    boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                                    boost::bind(
-                                            &ad_hoc_session::handle_read_body,
-                                            shared_from_this(),
-                                            boost::asio::placeholders::error));
+     * 以已经完成的协商启动session
+     *
+     * server在创建session之前读入了协商报文，从中得到节点的ID（Unix域socket只能这样识别节点），
+     * codec中保存了协商的结果和待回复的协商报文。
+     *
+     * @param codec 已经完成协商的codec，对端告知了节点ID
+     */
+    void start(const ad_hoc_wire_codec &codec) {
+        boost::asio::dispatch(strand_, boost::bind(&ad_hoc_basic_session::do_start_negotiated,
+                                                   this->shared_from_this(), codec));
+    }
+
+    void do_start_negotiated(const ad_hoc_wire_codec &codec) {
+        codec_ = codec;
+        id_ = codec_.peer_id();
+        if (codec_.peer_options() & WIRE_OPTION_MULTIPLEX) {
+            multiplexed_ = true;
+        } else if (!scope.claim(id_, this->shared_from_this(), scope.sharded())) {
+            //ID由对端自己声明，不能借此接管已经在线的节点：不回复协商报文，直接关闭
+            cerr << "reject local node " << id_ << ": already in use" << endl;
+            stream_.close();
+            return;
+        }
+        read_some();
+        if (writer_.resume()) {
+            write_batch();
         }
     }
 
     /**
-        * 读取消息中的数据载荷的回调函数
+     * 发起异步的读数据操作，参数：
+     * 1.stream。和client的连接socket上的读写流，从该socket的接收缓冲区中读字节数据。
+     * 2.buffer序列。reader_环形缓冲区中的空闲区域，一次读操作会读入接收缓冲区中所有已到达的数据（可能包含多个帧）。
+     * 3.回调函数。通过bind方法绑定了一个参数：this指针，后两个参数是占位符。回调绑定在session的strand上执行。
+     */
+    void read_some() {
+        stream_.async_read_some(reader_.prepare(),
+                                boost::asio::bind_executor(strand_, boost::bind(
+                                        &ad_hoc_basic_session::handle_read,
+                                        this->shared_from_this(),
+                                        boost::asio::placeholders::error,
+                                        boost::asio::placeholders::bytes_transferred)));
+    }
+
+    /**
+        * 读数据的回调函数
         *
-        * 将message交付给scope进行转发，完成转发后发起下一次异步读操作。
+        * 解析出本次读入的所有完整帧，逐个交付给scope进行转发，然后发起下一次异步读操作。
+        * 若遇到不符合协议格式的首部，则停止读取。
         *
         * @param error
+        * @param bytes_transferred
         */
-    void handle_read_body(const boost::system::error_code &error) {
+    void handle_read(const boost::system::error_code &error, size_t bytes_transferred) {
         if (!error) {
+            reader_.commit(bytes_transferred);
+            ad_hoc_message msg;
+            while (reader_.next(msg)) {
 #if DEBUG
-            LOG_RECEIVED(read_msg_);
+                LOG_RECEIVED(msg);
 #endif
-            //由scope去查询该message里的目的ID，进行消息转发。
-            scope.deliver(read_msg_);
-            //发起下一次异步的读操作，等待读取的对象为下一个数据包的首部。
-            read_msg_ = ad_hoc_message();
-            boost::asio::async_read(socket_,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(
-                                            &ad_hoc_session::handle_read_header,
-                                            shared_from_this(),
-                                            boost::asio::placeholders::error,
-                                            boost::asio::placeholders::bytes_transferred));
+                if (msg.msg_type() == REGISTER_MESSAGE) {
+                    register_nodes(msg);
+                    continue;
+                }
+                //由scope去查询该message里的目的ID，进行消息转发。scope只持有缓冲区的引用，不拷贝数据。
+                scope.deliver(msg);
+            }
+            if (!reader_.corrupt()) {
+                read_some();
+            }
+            //协商完成后需要回复协商报文，并发出协商期间积累的消息
+            if (writer_.resume()) {
+                write_batch();
+            }
+        } else {
+            leave();
         }
     }
 
@@ -313,25 +849,18 @@ public:
         */
     void handle_write(const boost::system::error_code &error) {
         if (!error) {
-            //如果消息发送成功了，就从队列头部删除它。
-            write_msgs_.pop_front();
+            //如果本批次发送成功了，就从队列头部删除本批次的所有消息。
             //如果队列非空，说明还存在待发消息，继续发送。此时队列非空有两种可能：
-            //1. 在上一次async_write之前，队列中就已经有超过1个待发消息。
+            //1. 在上一次async_write之前，队列中的待发消息超过了一个批次的上限。
             //2. 在调用async_write但还未完成时，deliver函数又向队列放入了新的待发数据。
-            //      此时由于deliver会检查write_in_progress，所以deliver内不会调用async_write。即不会对一个待发消息调用两次async_write。
-            //      注意：在deliver检查write_in_progress，以及此处检查write_msgs_.empty()的代码前后，不会发生线程的切换。
+            //      此时由于push会返回写操作正在进行，所以deliver内不会调用async_write。即不会对一个待发消息调用两次async_write。
+            //      注意：在deliver调用push，以及此处调用complete的代码前后，不会发生线程的切换。
             //              实际上这两段代码是在同一个线程上的同一个io_context中执行的，所以不会出现代码交错运行导致状态不一致的情况。
-            if (!write_msgs_.empty()) {
-                //创建一个新的buffer，buffer起始地址为待发队列中的第一个消息的起始地址，长度为第一个消息的完整长度（包括首部长度和载荷长度）。
-                //在socket完成发送后，会调用回调函数handle_write（也就是此函数）
-                boost::asio::async_write(socket_,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&ad_hoc_session::handle_write, shared_from_this(),
-                                                     boost::asio::placeholders::error));
+            if (writer_.complete()) {
+                write_batch();
             }
         } else {
-            scope.leave(id());
+            leave();
         }
     }
 
@@ -341,39 +870,275 @@ public:
        * 由于只有server端有session，因此只有在server转发数据时才会调用此函数，和client无关。
        * 在scope.deliver函数中会先查找对应的session，然后调用此session的deliver函数。
        *
+       * scope可能在其他session的IO线程上调用此函数，这里只把消息投递到本session的strand上，由do_deliver放入发送队列。
+       *
        * @param msg 待发送的数据
        */
-    void deliver(ad_hoc_message &msg) override {
-        //判断队列中有没有未发完的消息。
-        bool write_in_progress = !write_msgs_.empty();
+    void deliver(const ad_hoc_message &msg) override {
+        boost::asio::post(strand_, boost::bind(&ad_hoc_basic_session::do_deliver, this->shared_from_this(), msg));
+    }
+
+    void do_deliver(const ad_hoc_message &msg) {
+        //压缩的载荷对server是不透明的，原样转发；只有对端不支持压缩时才解压出一份
+        if (msg.compressed() && !codec_.supports(WIRE_FEATURE_COMPRESSION)) {
+            ad_hoc_message plain(msg);
+            if (ad_hoc_decompress(plain)) {
+                do_deliver(plain);
+            }
+            return;
+        }
         //向队列末端添加一个待发送的消息，实际的发送顺序服从于发起deliver的先后顺序。
-        write_msgs_.push_back(msg);
-        if (!write_in_progress) {
-            boost::asio::async_write(socket_,
-                                     boost::asio::buffer(write_msgs_.front().data(),
-                                                         write_msgs_.front().length()),
-                                     boost::bind(&ad_hoc_session::handle_write,
-                                                 shared_from_this(),
-                                                 boost::asio::placeholders::error));
-        }
-        //如果队列尾端有未发完的消息，那么这里不需要手动调用async_write函数，因为IO线程的handle_write是会发送队列中的剩余消息的。
+        //队列中保存的是消息句柄，与scope中其他接收者共享同一个缓冲区。
+        if (writer_.push(msg)) {
+            write_batch();
+        }
+        //如果有进行中的写操作，那么这里不需要手动调用async_write函数，因为IO线程的handle_write会把队列中积累的消息作为下一批次发送。
         //只需要把消息存入队列即可。
     }
 
+    /**
+     * 把队列中所有待发消息收集为一个buffer序列，用一次gather写发出
+     */
+    void write_batch() {
+        stream_.async_write(writer_.gather(),
+                            boost::asio::bind_executor(strand_, boost::bind(&ad_hoc_basic_session::handle_write,
+                                                                            this->shared_from_this(),
+                                                                            boost::asio::placeholders::error)));
+    }
+
+    /**
+     * 没有在协商报文中告知ID的节点，以对端的地址作为ID
+     */
     int id() {
-        return socket_.remote_endpoint().port();
+        return ad_hoc_endpoint_id(socket_.remote_endpoint());
     }
 
 private:
+    /**
+     * 连接上的一个节点，scope交给它的消息由所在的session发出
+     *
+     * 同一个连接上的节点共用一个发送队列，client按帧的receiveid分发给各个节点。
+     * 广播帧的receiveid不指明接收方，这里在句柄上改写为本节点，首部在发送时按字段编码，不拷贝缓冲区。
+     */
+    class node : public ad_hoc_participant {
+    public:
+        node(const boost::shared_ptr<ad_hoc_basic_session> &session, int id) : session(session), id(id) {
+        }
+
+        void deliver(const ad_hoc_message &msg) override {
+            if (msg.receiveid() == AODV_BROADCAST_ADDRESS) {
+                ad_hoc_message addressed(msg);
+                addressed.receiveid(id);
+                session->deliver(addressed);
+            } else {
+                session->deliver(msg);
+            }
+        }
+
+    private:
+        boost::shared_ptr<ad_hoc_basic_session> session;
+        int id;
+    };
+
+    /**
+     * 处理REGISTER帧，把其中声明的节点加入scope
+     *
+     * TCP连接在接受时已经以对端端口加入了scope，第一次收到多路复用连接的REGISTER帧时先离开。不是多路复用的连接上的REGISTER帧被忽略。
+     * 已经被其他session或连接占用的ID不加入，也不记入本连接声明的节点。
+     */
+    void register_nodes(const ad_hoc_message &msg) {
+        if (!(codec_.peer_options() & WIRE_OPTION_MULTIPLEX)) {
+            return;
+        }
+        if (!multiplexed_) {
+            multiplexed_ = true;
+            scope.leave(id_, this);
+        }
+        const char *body = msg.body();
+        for (int offset = 0; offset + 4 <= msg.body_length(); offset += 4) {
+            int id = get_le32(body + offset);
+            if (id <= 0) {
+                continue;
+            }
+            ad_hoc_participant_ptr participant(new node(this->shared_from_this(), id));
+            if (scope.claim(id, participant)) {
+                nodes_.emplace_back(id, participant.get());
+            } else {
+                cerr << "reject registration of node " << id << ": already in use" << endl;
+            }
+        }
+    }
+
+    /**
+     * 连接断开后离开scope，多路复用的连接上所有声明过的节点都离开。只离开ID仍然属于本连接的节点。
+     */
+    void leave() {
+        if (!multiplexed_) {
+            scope.leave(id_, this);
+            return;
+        }
+        for (auto &entry: nodes_) {
+            scope.leave(entry.first, entry.second);
+        }
+        nodes_.clear();
+    }
+
     ad_hoc_scope &scope; //此session对象所属于的scope，一般会有多个session对象隶属于同一个scope
-    tcp::socket socket_; //从server端到client端的socket连接，需要持有这个对象来进行读写操作
-    ad_hoc_message read_msg_; //存放接收到的消息的存储空间。这个对象是复用的，不会重新初始化，但是其内部的数据在每次收到新消息后会被重新填充。
-    //等待发送的消息队列。为了防止有多个用户线程同时发送数据，这里将多个待发送的数据存放在一个队列中，由IO线程逐一发送。
-    message_queue write_msgs_;
+    typename Protocol::socket socket_; //从server端到client端的socket连接，需要持有这个对象来进行读写操作
+    Stream stream_; //socket上的读写流，按编译选项运行在asio或io_uring上，或者是共享内存上的流
+    //session的所有回调都在这个strand上串行执行，多个IO线程运行io_context时reader_、writer_和socket_不需要加锁
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    int id_; //加入scope时的ID
+    ad_hoc_wire_codec codec_; //此连接协商的线路格式，reader_和writer_共享
+    ad_hoc_frame_reader reader_; //接收数据的环形缓冲区，每个完整的帧会被解析为一个独立的消息交给scope
+    //等待发送的消息队列。为了防止有多个用户线程同时发送数据，这里将多个待发送的数据存放在一个队列中，由IO线程成批发送。
+    ad_hoc_batch_writer writer_;
+    bool multiplexed_; //是否是多路复用的连接，此时id_不在scope中
+    //多路复用的连接上声明成功的节点，以及加入scope的对象，只用于离开时比较，不持有引用：节点对象持有session
+    vector<pair<int, const ad_hoc_participant *>> nodes_;
     bool wormhole_channel;
 };
 
+typedef ad_hoc_basic_session<tcp> ad_hoc_session;
+typedef ad_hoc_basic_session<local_stream> ad_hoc_local_session;
+typedef ad_hoc_basic_session<local_stream, ad_hoc_shm_stream> ad_hoc_shm_session;
 typedef boost::shared_ptr<ad_hoc_session> ad_hoc_session_ptr;
+typedef boost::shared_ptr<ad_hoc_local_session> ad_hoc_local_session_ptr;
+typedef boost::shared_ptr<ad_hoc_shm_session> ad_hoc_shm_session_ptr;
+
+/**
+ * 数据报传输的server端
+ *
+ * 在与TCP监听器相同的端口上绑定一个UDP socket，所有数据报节点共用这一个socket，由datagram channel成批收发。
+ * 节点以发送方的端口作为ID，收到JOIN控制报文（或者一个未加入地址的第一个帧）时加入scope，收到LEAVE时离开。
+ * 收到的每个帧直接交给scope转发；scope投递给数据报节点的帧进入channel的发送队列，队列满时丢弃，
+ * scope不转发的帧就是丢失的帧，不会重传，也不会阻塞同一节点之后的帧。
+ * 所有收发都在endpoint的strand上执行，scope可以在任意线程上投递。
+ */
+class ad_hoc_datagram_endpoint : public ad_hoc_datagram_listener {
+public:
+    ad_hoc_datagram_endpoint(boost::asio::io_context &io_context, const udp::endpoint &endpoint, ad_hoc_scope &scope,
+                             bool log_joins) : socket_(io_context, endpoint),
+                                               strand_(boost::asio::make_strand(io_context)),
+                                               channel_(socket_, strand_, this),
+                                               scope(scope), log_joins(log_joins) {
+    }
+
+    void start() {
+        boost::asio::dispatch(strand_, [this] {
+            channel_.start();
+        });
+    }
+
+    /**
+     * 由peer在scope转发的线程上调用
+     */
+    void send(const ad_hoc_message &msg, const udp::endpoint &to, bool compression) {
+        boost::asio::post(strand_, [this, msg, to, compression] {
+            //与session相同，只有对端不支持压缩时才解压出一份
+            if (msg.compressed() && !compression) {
+                ad_hoc_message plain(msg);
+                if (ad_hoc_decompress(plain)) {
+                    channel_.send(plain, to);
+                }
+                return;
+            }
+            channel_.send(msg, to);
+        });
+    }
+
+    void handle_datagram(ad_hoc_message &msg, const udp::endpoint &from) override {
+        //ID被其他节点占用的对端，以及冒用已加入节点端口的其他地址，它们的帧都丢弃
+        auto it = peers.find(from.port());
+        if (it == peers.end() ? !join(from, DATAGRAM_FEATURES, false) : it->second.address != from) {
+            return;
+        }
+#if DEBUG
+        LOG_RECEIVED(msg);
+#endif
+        scope.deliver(msg);
+    }
+
+    void handle_control(int op, int features, const udp::endpoint &from) override {
+        if (op == DATAGRAM_JOIN) {
+            join(from, features, true);
+        } else if (op == DATAGRAM_LEAVE) {
+            //只接受加入时的地址发来的LEAVE
+            auto it = peers.find(from.port());
+            if (it != peers.end() && it->second.address == from) {
+                scope.leave(it->first, it->second.participant);
+                peers.erase(it);
+            }
+        }
+    }
+
+    /**
+     * 在strand上打印收发统计
+     */
+    void print_stats() {
+        boost::asio::post(strand_, [this] {
+            ad_hoc_datagram_channel::stats stats = channel_.statistics();
+            cout << "datagram nodes " << peers.size() << ", received " << stats.received << " in "
+                 << stats.receive_calls << " recvmmsg, sent " << stats.sent << " in " << stats.send_calls
+                 << " sendmmsg, dropped " << stats.dropped << ", malformed " << stats.malformed << endl;
+        });
+    }
+
+private:
+    class peer : public ad_hoc_participant {
+    public:
+        peer(ad_hoc_datagram_endpoint &owner, const udp::endpoint &address, bool compression)
+                : owner(owner), address(address), compression(compression) {
+        }
+
+        void deliver(const ad_hoc_message &msg) override {
+            owner.send(msg, address, compression);
+        }
+
+    private:
+        ad_hoc_datagram_endpoint &owner;
+        udp::endpoint address;
+        bool compression; //对端是否支持压缩
+    };
+
+    /**
+     * 以源端口为ID加入scope。TCP节点的ID也是对端端口，ID已经被占用时不加入，不替换已有的节点
+     *
+     * @param report 加入失败时是否报告，隐式加入的每个数据报都会重试，不逐个报告
+     * @return 对端是否已经加入
+     */
+    bool join(const udp::endpoint &from, int features, bool report) {
+        int id = from.port();
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            return it->second.address == from;
+        }
+        ad_hoc_participant_ptr participant(new peer(*this, from, features & WIRE_FEATURE_COMPRESSION));
+        if (!scope.claim(id, participant)) {
+            if (report) {
+                cerr << "reject datagram node " << from.address() << ":" << id << ": already in use" << endl;
+            }
+            return false;
+        }
+        peers[id] = member{from, participant.get()};
+        if (log_joins) {
+            cout << "accept datagram node: " << from.address() << ":" << id << endl;
+        }
+        return true;
+    }
+
+    struct member {
+        udp::endpoint address; //加入时的地址
+        const ad_hoc_participant *participant; //加入scope的对象，只用于离开时比较
+    };
+
+    udp::socket socket_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    ad_hoc_datagram_channel channel_;
+    ad_hoc_scope &scope;
+    unordered_map<int, member> peers; //已加入scope的数据报节点，只在strand上访问
+    bool log_joins;
+};
 
 class ad_hoc_server {
 public:
@@ -382,17 +1147,31 @@ public:
      *
      * 实例化之后就会立刻开始监听端口，等待新连接到来。当新连接到来后，封装成session对象。
      *
+     * 默认只有一个监听器，每次挂起一个accept操作。acceptors大于1时使用多个设置了SO_REUSEPORT的监听器绑定同一个端口，
+     * 由内核把新连接分散到各个监听器上，每个监听器同时挂起SERVER_OUTSTANDING_ACCEPTS个accept操作；
+     * 分片模式下监听器轮流放在各个分片的io_context上，否则都放在io_context上，由运行它的多个IO线程处理。
+     * 大量client同时连接时，多监听器模式不再逐个打印新连接。
+     * datagram为true时，还在同一个端口上接收数据报节点，与TCP节点在同一个scope中。
+     * local为true时，还在端口对应的Unix域socket路径上监听，Unix域节点的ID来自协商报文。
+     *
      * @param endpoint server要监听的端口
      * @param io_context 负责server收发消息的IO事件循环。当异步函数绑定好回调函数之后，需要运行io_context.run()来启动事件循环。
+     *                   分片模式下只负责接受连接和控制操作，session运行在各个分片自己的线程上。
+     * @param shards 分片数，为0时不分片
+     * @param cpus 分片线程绑定的CPU
+     * @param acceptors 监听器数
+     * @param datagram 是否接收数据报节点
+     * @param local 是否接收Unix域socket上的节点
      */
-    ad_hoc_server(const tcp::endpoint &endpoint, boost::asio::io_context &io_context, bool wc) : acceptor(io_context,
-                                                                                                          endpoint),
-                                                                                                 io_context(io_context),
-                                                                                                 udg_timer(io_context,
-                                                                                                           boost::posix_time::seconds(
-                                                                                                                   UDG_UPDATE_TIMEOUT)),
-                                                                                                 wormhole_channel(wc),
-                                                                                                 scope(wc, io_context) {
+    ad_hoc_server(const tcp::endpoint &endpoint, boost::asio::io_context &io_context, bool wc, int shards = 0,
+                  const vector<int> &cpus = {}, int acceptors = 1, bool datagram = false,
+                  bool local = false) : io_context(io_context),
+                                                                     udg_timer(io_context,
+                                                                               boost::posix_time::seconds(
+                                                                                       UDG_UPDATE_TIMEOUT)),
+                                                                     wormhole_channel(wc),
+                                                                     scope(wc, io_context, shards, cpus),
+                                                                     log_accepts(acceptors <= 1) {
         cout << "start listening at port " << endpoint.port() << endl;
         if (!wormhole_channel) {
             cout << "running at normal mode." << endl;
@@ -401,23 +1180,45 @@ public:
         } else {
             cout << "running at wormhole mode." << endl;
             scope.create_UDG();
-            scope.matrix[0][1] = scope.matrix[1][0] = 1;
+            scope.link(0, 1);
             scope.print_UDG();
         }
 
-        //创建一个空的session对象
-        ad_hoc_session_ptr new_session(new ad_hoc_session(io_context, scope));
-        //服务器异步监听端口，直到有新连接到来
-        //等待连接建立后，acceptor得到的新的socket会被填充到session中
-        //boost::bind 给回调函数绑定2个局部变量（this和new_session）作为头两个参数
-        //回调函数的第三个参数error是一个占位符，由async_accept在运行时负责填入这个参数
-        acceptor.async_accept(new_session->socket(),
-                              boost::bind(
-                                      &ad_hoc_server::handle_accept,
-                                      this,
-                                      new_session,
-                                      boost::asio::placeholders::error
-                              ));
+        if (acceptors <= 1) {
+            this->acceptors.emplace_back(new tcp::acceptor(io_context, endpoint));
+            accept(0);
+        } else {
+            for (int i = 0; i < acceptors; i++) {
+                boost::asio::io_context &context = scope.sharded() ? scope.shard_context(i) : io_context;
+                this->acceptors.emplace_back(new tcp::acceptor(context));
+                tcp::acceptor &acceptor = *this->acceptors.back();
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(tcp::acceptor::reuse_address(true));
+                acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                acceptor.bind(endpoint);
+                acceptor.listen(boost::asio::socket_base::max_listen_connections);
+            }
+            for (int i = 0; i < acceptors; i++) {
+                for (int k = 0; k < SERVER_OUTSTANDING_ACCEPTS; k++) {
+                    accept(i);
+                }
+            }
+        }
+        if (datagram) {
+            cout << "accept datagram nodes at port " << endpoint.port() << endl;
+            this->datagram.reset(new ad_hoc_datagram_endpoint(io_context, udp::endpoint(endpoint.address(),
+                                                                                         endpoint.port()), scope,
+                                                              log_accepts));
+            this->datagram->start();
+        }
+        if (local) {
+            local_path = ad_hoc_local_path(endpoint.port());
+            //上次运行遗留的路径会导致bind失败
+            ::unlink(local_path.c_str());
+            local_acceptor.reset(new local_stream::acceptor(io_context, local_stream::endpoint(local_path)));
+            cout << "start listening at " << local_path << endl;
+            accept_local();
+        }
 //        udg_timer.async_wait(boost::bind(&ad_hoc_server::update_udg, this));
     }
 
@@ -425,47 +1226,298 @@ public:
         io_context.post(boost::bind(&ad_hoc_server::update_udg, this));
     }
 
+    /**
+     * 在IO线程上打印消息内存池的统计信息，稳定运行时system allocations不再增长
+     */
+    void print_pool_stats() {
+        io_context.post([] {
+            ad_hoc_message_pool::print_stats();
+        });
+    }
+
+    /**
+     * 设置一跳链路上单播和广播的延迟
+     */
+    void link_delay(const boost::posix_time::time_duration &unicast,
+                    const boost::posix_time::time_duration &broadcast) {
+        scope.link_delay(unicast, broadcast);
+    }
+
+    /**
+     * 设置所有链路的信道参数
+     */
+    void channel(const ad_hoc_channel_params &params) {
+        scope.channel(params);
+    }
+
+    /**
+     * 按移动模型周期性地移动节点，链路随节点间的距离建立和断开
+     */
+    void mobility(unique_ptr<ad_hoc_mobility> model) {
+        scope.mobility(std::move(model));
+    }
+
+    /**
+     * 按轨迹文件回放拓扑的变化
+     */
+    bool replay(const string &path) {
+        return scope.replay(path);
+    }
+
+    /**
+     * 打印每个分片的节点数和投递统计
+     */
+    void print_shard_stats() {
+        io_context.post([this] {
+            scope.print_shards();
+        });
+    }
+
+    ~ad_hoc_server() {
+        //先停止分片线程，之后析构监听器时被取消的accept回调不会再在分片线程上执行
+        scope.stop();
+        if (local_acceptor) {
+            ::unlink(local_path.c_str());
+        }
+    }
+
+    /**
+     * 打印数据报节点的收发统计
+     */
+    void print_datagram_stats() {
+        if (datagram) {
+            datagram->print_stats();
+        }
+    }
+
+    /**
+     * 已加入scope的节点数
+     */
+    size_t connections() const {
+        return scope.size();
+    }
+
 private:
 
     void update_udg() {
         scope.create_UDG();
-        scope.print_UDG();
+        print_time();
+        scope.print_epoch();
 //        udg_timer.expires_from_now(boost::posix_time::seconds(UDG_UPDATE_TIMEOUT));
 //        udg_timer.async_wait(boost::bind(&ad_hoc_server::update_udg, this));
     }
 
+    /**
+     * 在第i个监听器上发起一个accept操作
+     *
+     * 先创建一个空的session对象，等待连接建立后，acceptor得到的新的socket会被填充到session中。
+     * boost::bind 给回调函数绑定3个局部变量（this、监听器下标和new_session）作为头三个参数，
+     * 回调函数的第四个参数error是一个占位符，由async_accept在运行时负责填入这个参数
+     *
+     * @param i
+     */
+    void accept(int i) {
+        tcp::acceptor &acceptor = *acceptors[i];
+        ad_hoc_session_ptr new_session(new ad_hoc_session(
+                static_cast<boost::asio::io_context &>(acceptor.get_executor().context()), scope));
+        acceptor.async_accept(new_session->socket(),
+                              boost::bind(
+                                      &ad_hoc_server::handle_accept,
+                                      this,
+                                      i,
+                                      new_session,
+                                      boost::asio::placeholders::error
+                              ));
+    }
+
     /**
     * 新连接建立的回调函数
     *
-    * @param session 构造函数中绑定的参数new_session
+    * @param i 接受连接的监听器
+    * @param session accept中绑定的参数new_session
     * @param error async_accept在运行时填入的、表示连接结果的状态码
     */
-    void handle_accept(ad_hoc_session_ptr session, const boost::system::error_code &error) {
+    void handle_accept(int i, ad_hoc_session_ptr session, const boost::system::error_code &error) {
         //如果成功，则error为0
         if (!error) {
-            cout << "accept incoming connection: " << session->socket().remote_endpoint().address() << ":"
-                 << session->id() << endl;
-            //启动该session的接收消息的循环
-            session->start();
-            //同构造函数里的步骤，等待下一个新连接的到来
-            ad_hoc_session_ptr new_session(new ad_hoc_session(io_context, scope));
-            acceptor.async_accept(new_session->socket(),
-                                  boost::bind(
-                                          &ad_hoc_server::handle_accept,
-                                          this,
-                                          new_session,
-                                          boost::asio::placeholders::error
-                                  ));
-        } else {
+            boost::system::error_code ec;
+            tcp::endpoint remote = session->socket().remote_endpoint(ec);
+            //连接可能在accept之后立刻被对端关闭
+            if (!ec) {
+                if (log_accepts) {
+                    cout << "accept incoming connection: " << remote.address() << ":" << remote.port() << endl;
+                }
+                //分片模式下，把连接交给节点所属分片的io_context，之后这个连接上的所有读写都在该分片的线程上进行
+                if (scope.sharded()) {
+                    boost::asio::io_context &context = scope.place(ad_hoc_endpoint_id(remote));
+                    if (&context != &session->socket().get_executor().context()) {
+                        ad_hoc_session_ptr homed(new ad_hoc_session(context, scope));
+                        homed->socket().assign(tcp::v4(), session->socket().release());
+                        session = homed;
+                    }
+                }
+                //启动该session的接收消息的循环
+                session->start(ad_hoc_endpoint_id(remote));
+            }
+            //等待下一个新连接的到来
+            accept(i);
+        } else if (error != boost::asio::error::operation_aborted) {
             cerr << error << endl;
         }
     }
 
-    boost::asio::deadline_timer udg_timer;
-    tcp::acceptor acceptor; //端口监听器，接收新的连接并创建一个对应的socket
+    /**
+     * Unix域socket上的新连接在创建session之前的状态
+     *
+     * 先在这里读入client的协商报文，从中得到节点ID，才能决定session在哪个分片的io_context上创建。
+     * 共享内存传输的client随协商报文附带fd，没有被session接管的fd在析构时关闭。
+     */
+    struct local_handshake {
+        explicit local_handshake(boost::asio::io_context &io_context) : socket(io_context), received(0) {
+            codec.start_server(WIRE_MAX_VERSION, WIRE_FEATURE_COMPRESSION | WIRE_FEATURE_CRC32C);
+        }
+
+        ~local_handshake() {
+            for (int fd: fds) {
+                ::close(fd);
+            }
+        }
+
+        local_stream::socket socket;
+        ad_hoc_wire_codec codec;
+        char preamble[WIRE_MAX_PREAMBLE_LENGTH];
+        size_t received; //已经读入的字节数
+        vector<int> fds; //随协商报文收到的fd
+    };
+
+    typedef shared_ptr<local_handshake> local_handshake_ptr;
+
+    /**
+     * 在Unix域socket的监听器上发起一个accept操作
+     */
+    void accept_local() {
+        local_handshake_ptr handshake = make_shared<local_handshake>(io_context);
+        local_acceptor->async_accept(handshake->socket, [this, handshake](const boost::system::error_code &error) {
+            if (!error) {
+                read_handshake(handshake);
+                accept_local();
+            } else if (error != boost::asio::error::operation_aborted) {
+                cerr << error << endl;
+            }
+        });
+    }
+
+    /**
+     * 读入协商报文，长度由报文中的选项决定。client在收到回复之前只发送协商报文，不会多读入之后的帧。
+     * 用recvmsg读入，以便收下共享内存传输附带的fd
+     */
+    void read_handshake(const local_handshake_ptr &handshake) {
+        handshake->socket.async_wait(local_stream::socket::wait_read,
+                                     [this, handshake](const boost::system::error_code &error) {
+                                         if (!error) {
+                                             receive_handshake(handshake);
+                                         }
+                                     });
+    }
+
+    void receive_handshake(const local_handshake_ptr &handshake) {
+        size_t length = wire_client_preamble_length(handshake->preamble, handshake->received);
+        iovec iov{handshake->preamble + handshake->received, length - handshake->received};
+        char control[CMSG_SPACE(sizeof(int) * SHM_HANDSHAKE_FDS)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(handshake->socket.native_handle(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            read_handshake(handshake);
+            return;
+        }
+        if (n <= 0) {
+            return;
+        }
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                handshake->fds.insert(handshake->fds.end(), fds, fds + count);
+            }
+        }
+        handshake->received += n;
+        if (handshake->received < wire_client_preamble_length(handshake->preamble, handshake->received)) {
+            read_handshake(handshake);
+        } else {
+            handle_handshake(handshake);
+        }
+    }
+
+    /**
+     * 协商报文读入完成后创建session
+     *
+     * 协商报文中没有节点ID的连接无法识别，直接关闭。分片模式下在节点所属分片的io_context上创建session。
+     * 带有共享内存选项的连接，session的读写流接管附带的fd，此后在共享内存的环上收发。
+     */
+    void handle_handshake(const local_handshake_ptr &handshake) {
+        int consumed = handshake->codec.negotiate(handshake->preamble, handshake->received);
+        int id = handshake->codec.peer_id();
+        bool multiplexed = handshake->codec.peer_options() & WIRE_OPTION_MULTIPLEX;
+        if (consumed != (int) handshake->received || (id <= 0 && !multiplexed)) {
+            cerr << "reject local connection without node id" << endl;
+            return;
+        }
+        //ID已经有节点在线时不创建session，也不回复协商报文；session加入时还会再用claim检查一次
+        if (!multiplexed && scope.taken(id)) {
+            cerr << "reject local node " << id << ": already in use" << endl;
+            return;
+        }
+        //多路复用的连接本身不是节点，轮流放在各个分片上
+        boost::asio::io_context &context = !scope.sharded() ? io_context : multiplexed ? scope.shard_context(
+                multiplexed_accepts++) : scope.place(id);
+        if (handshake->codec.peer_options() & WIRE_OPTION_SHARED_MEMORY) {
+            if (handshake->fds.size() != (size_t) SHM_HANDSHAKE_FDS) {
+                cerr << "reject shared memory connection without its descriptors" << endl;
+                if (scope.sharded() && !multiplexed) {
+                    scope.unplace(id);
+                }
+                return;
+            }
+            ad_hoc_shm_session_ptr session(new ad_hoc_shm_session(context, scope));
+            session->socket().assign(local_stream(), handshake->socket.release());
+            bool attached = session->stream().attach(handshake->fds.data());
+            handshake->fds.clear();
+            if (!attached) {
+                cerr << "cannot map shared memory of node " << id << endl;
+                if (scope.sharded() && !multiplexed) {
+                    scope.unplace(id);
+                }
+                return;
+            }
+            if (log_accepts) {
+                cout << "accept shared memory connection: " << (multiplexed ? "multiplexed" : "node " + to_string(id))
+                     << endl;
+            }
+            session->start(handshake->codec);
+            return;
+        }
+        if (log_accepts) {
+            cout << "accept local connection: " << (multiplexed ? "multiplexed" : "node " + to_string(id)) << endl;
+        }
+        ad_hoc_local_session_ptr session(new ad_hoc_local_session(context, scope));
+        session->socket().assign(local_stream(), handshake->socket.release());
+        session->start(handshake->codec);
+    }
+
     boost::asio::io_context &io_context;
+    boost::asio::deadline_timer udg_timer;
     ad_hoc_scope scope; //scope对象，每个server有一个scope，维护ID->session的映射表
+    vector<unique_ptr<tcp::acceptor>> acceptors; //端口监听器，接收新的连接并创建一个对应的socket
+    unique_ptr<ad_hoc_datagram_endpoint> datagram; //数据报节点的UDP socket，没有开启时为空
+    unique_ptr<local_stream::acceptor> local_acceptor; //Unix域socket的监听器，没有开启时为空
+    string local_path;
+    int multiplexed_accepts = 0; //分片模式下已经分配了分片的多路复用Unix域连接数
     bool wormhole_channel;
+    bool log_accepts; //是否逐个打印新连接
 };
 
 #endif //ADHOC_SIMULATION_SERVER_H
@@ -3,32 +3,94 @@
 //
 #include <iostream>
 #include "server.h"
+#include "thread_pool.h"
 
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        std::cerr << "Usage: chat_server <port> [args ...]\n";
+        std::cerr << "Usage: chat_server <port> [wc] [--threads <n>] [--shards <n>] [--acceptors <n>] [--cpus <list>] [--udp] [--unix] [--channel <spec>] [--mobility rwp|gm] [--trace <file>]\n";
         return 1;
     }
     string strPort(argv[1]);
     bool wc = false;
-    if (argc > 2 && !strcmp(argv[2], "wc")) {
-        wc = true;
+    int threads = 1;            //IO线程数
+    int shards = 0;             //分片数，每个分片一个线程，为0时不分片
+    int acceptors = 1;          //SO_REUSEPORT监听器数
+    vector<int> cpus;           //IO线程或分片线程绑定的CPU，例如 0,2,4-7
+    bool datagram = false;      //是否在同一个端口上接收UDP节点
+    bool local = false;         //是否在端口对应的路径上接收Unix域socket节点
+    bool channel = false;       //是否设置了所有链路的信道参数
+    ad_hoc_channel_params params;
+    unique_ptr<ad_hoc_mobility> mobility; //节点的移动模型，为空时拓扑不随时间变化
+    string trace;               //回放的轨迹文件，由trace_convert生成
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "wc")) {
+            wc = true;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--shards") && i + 1 < argc) {
+            shards = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--acceptors") && i + 1 < argc) {
+            acceptors = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--cpus") && i + 1 < argc) {
+            cpus = ad_hoc_io_thread_pool::parse_cpus(argv[++i]);
+        } else if (!strcmp(argv[i], "--udp")) {
+            datagram = true;
+        } else if (!strcmp(argv[i], "--unix")) {
+            local = true;
+        } else if (!strcmp(argv[i], "--channel") && i + 1 < argc) {
+            //延迟毫秒,抖动毫秒,带宽kbps,好转坏概率,坏转好概率,好状态丢包率,坏状态丢包率
+            if (!ad_hoc_parse_channel(argv[++i], params)) {
+                return 1;
+            }
+            channel = true;
+        } else if (!strcmp(argv[i], "--mobility") && i + 1 < argc) {
+            mobility = ad_hoc_make_mobility(argv[++i]);
+            if (!mobility) {
+                std::cerr << "unknown mobility model: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace = argv[++i];
+        }
     }
     int port = stoi(strPort);
-    boost::asio::io_context io_context;
+    boost::asio::io_context io_context(threads);
     tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
-    auto *server = new ad_hoc_server(endpoint, io_context, wc);
-    std::thread t(boost::bind(&boost::asio::io_service::run, &io_context));
+    auto *server = new ad_hoc_server(endpoint, io_context, wc, shards, cpus, acceptors, datagram, local);
+    if (channel) {
+        server->channel(params);
+    }
+    if (mobility) {
+        server->mobility(std::move(mobility));
+    }
+    if (!trace.empty() && !server->replay(trace)) {
+        std::cerr << "invalid trace file: " << trace << "\n";
+        return 1;
+    }
+    //分片模式下CPU分给分片线程，接受连接的线程不绑定
+    ad_hoc_io_thread_pool pool(io_context, threads, shards > 0 ? vector<int>() : cpus);
+    pool.start();
+    if (shards > 0) {
+        cout << "running with " << shards << " shards." << endl;
+    } else {
+        cout << "running with " << pool.size() << " io threads." << endl;
+    }
 
     string cmd;
     while (true) {
         cin >> cmd;
         if (!strcmp(cmd.c_str(), "re")) {
             server->regenerate_matrix();
+        } else if (!strcmp(cmd.c_str(), "pool")) {
+            server->print_pool_stats();
+        } else if (!strcmp(cmd.c_str(), "shards")) {
+            server->print_shard_stats();
+        } else if (!strcmp(cmd.c_str(), "udp")) {
+            server->print_datagram_stats();
         }
     }
-    t.join();
+    pool.join();
     return 0;
 }
 
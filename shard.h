@@ -0,0 +1,528 @@
+//
+// Created by 邹迪凯 on 2022/3/24.
+//
+
+#ifndef ADHOC_SIMULATION_SHARD_H
+#define ADHOC_SIMULATION_SHARD_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "message.h"
+#include "aodv.h"
+#include "topology.h"
+#include "thread_pool.h"
+#include "executor.h"
+#include "timing_wheel.h"
+
+using namespace std;
+
+//跨分片投递队列的容量，必须是2的幂
+const size_t SHARD_RING_CAPACITY = 4096;
+//无锁队列中隔开生产者和消费者字段的填充长度，取缓存行的大小
+const size_t SHARD_CACHE_LINE = 64;
+//划分节点时允许各分片的节点数超出平均值的比例
+const double SHARD_IMBALANCE = 0.1;
+//一跳链路上单播和广播的默认延迟，由scope和分片的延迟队列施加，信道设置了传播延迟的链路使用信道的延迟
+const int LINK_UNICAST_DELAY_MS = 200;
+const int LINK_BROADCAST_DELAY_MS = 100;
+
+class ad_hoc_participant {
+public:
+    virtual ~ad_hoc_participant() {}
+
+    virtual void deliver(const ad_hoc_message &msg) = 0;
+};
+
+typedef boost::shared_ptr<ad_hoc_participant> ad_hoc_participant_ptr;
+
+/**
+ * 在链路上传输、等待链路延迟的帧，广播在发送时按邻居展开，每个邻居一帧
+ *
+ * 帧记录经过的链路（两端的顶点）和发出时拓扑的纪元，延迟期间链路断开过的帧到期时按链路故障丢弃。
+ */
+struct ad_hoc_link_frame {
+    int receiver;
+    int from;
+    int to;
+    uint64_t epoch;
+    ad_hoc_message msg;
+};
+
+/**
+ * 有界的无锁多生产者单消费者环形队列
+ *
+ * 每个槽位带有一个序号：生产者用CAS抢占队尾的槽位，写入数据后发布序号；消费者只在序号表明数据已发布时取出，
+ * 然后把序号推进一圈，交还给生产者。队列满时push返回false，不阻塞。
+ */
+template<typename T>
+class ad_hoc_mpsc_ring {
+public:
+    explicit ad_hoc_mpsc_ring(size_t capacity) : cells_(new cell[capacity]), mask_(capacity - 1), tail_(0), head_(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells_[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    /**
+     * 任意线程调用
+     *
+     * @return 队列满时返回false
+     */
+    bool push(const T &value) {
+        size_t pos = tail_.load(memory_order_relaxed);
+        cell *c;
+        while (true) {
+            c = &cells_[pos & mask_];
+            size_t sequence = c->sequence.load(memory_order_acquire);
+            auto diff = (intptr_t) sequence - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(memory_order_relaxed);
+            }
+        }
+        c->value = value;
+        c->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    /**
+     * 只能由消费者线程调用
+     *
+     * @return 队列空时返回false
+     */
+    bool pop(T &value) {
+        cell &c = cells_[head_ & mask_];
+        if (c.sequence.load(memory_order_acquire) != head_ + 1) {
+            return false;
+        }
+        value = std::move(c.value);
+        //释放槽位中的消息引用，不让缓冲区在队列中滞留一圈
+        c.value = T();
+        c.sequence.store(head_ + mask_ + 1, memory_order_release);
+        head_++;
+        return true;
+    }
+
+    /**
+     * 取出一个已经被生产者占用的槽位，生产者还没有写完时等待它发布，只能由消费者线程调用
+     *
+     * 生产者占用槽位之后只写入数据和发布序号，不会阻塞，等待很短。
+     *
+     * @return 没有被占用的槽位时返回false
+     */
+    bool pop_claimed(T &value) {
+        if (head_ == tail_.load(memory_order_acquire)) {
+            return false;
+        }
+        while (!pop(value)) {
+            this_thread::yield();
+        }
+        return true;
+    }
+
+private:
+    struct cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    //生产者竞争的队尾和消费者独占的队头之间手工填充一条缓存行，不用alignas：
+    //C++14的new不保证超过16字节的对齐，分片是new出来的，alignas既不生效又是未定义行为
+    unique_ptr<cell[]> cells_;
+    size_t mask_;
+    char pad0_[SHARD_CACHE_LINE];
+    atomic<size_t> tail_;
+    char pad1_[SHARD_CACHE_LINE];
+    size_t head_;
+    char pad2_[SHARD_CACHE_LINE];
+};
+
+/**
+ * scope的一个分片
+ *
+ * 每个分片有自己的io_context和线程，拥有一部分节点的session，这些session的读写回调都在分片的线程上执行。
+ * 分片保存一份拓扑图和节点归属表的副本，由scope在加入、离开和修改拓扑时按相同的顺序投递到每个分片上重放，
+ * 转发消息时只读本分片的副本，不需要加锁。
+ * 接收方属于其他分片的消息放入接收方分片的无锁队列，队列从空变为非空时向该分片的io_context投递一次清空操作；
+ * 队列满时放入加锁的溢出列表，此后直到溢出列表被清空，所有消息都排在溢出列表中，保持每个发送方的消息顺序。
+ */
+class ad_hoc_shard {
+public:
+    struct stats {
+        size_t local;
+        size_t remote;
+        size_t overflow;
+        size_t lost; //在信道上丢弃的帧数
+        size_t failed; //延迟期间链路断开而丢弃的帧数
+    };
+
+    ad_hoc_shard(int index, bool wormhole_channel) : index_(index), wormhole_channel(wormhole_channel),
+                                                     work(boost::asio::make_work_guard(io_context_)),
+                                                     executor_(io_context_),
+                                                     links(executor_, [this](ad_hoc_link_frame &frame) {
+                                                         transmit(frame);
+                                                     }),
+                                                     unicast_delay(boost::posix_time::millisec(
+                                                             LINK_UNICAST_DELAY_MS)),
+                                                     broadcast_delay(boost::posix_time::millisec(
+                                                             LINK_BROADCAST_DELAY_MS)),
+                                                     inbox(SHARD_RING_CAPACITY), overflowing(false), scheduled(false), local_(0),
+                                                     remote_(0), overflow_(0), lost_(0), failed_(0) {
+    }
+
+    ~ad_hoc_shard() {
+        stop();
+    }
+
+    /**
+     * 停止分片的线程，未执行的回调不再执行
+     */
+    void stop() {
+        work.reset();
+        io_context_.stop();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    /**
+     * 启动分片的线程
+     *
+     * @param peers 所有分片，下标即分片编号
+     * @param cpu 绑定的CPU，小于0时不绑定
+     */
+    void start(const vector<ad_hoc_shard *> &peers, int cpu) {
+        this->peers = peers;
+        worker = thread([this, cpu] {
+            if (cpu >= 0) {
+                ad_hoc_io_thread_pool::pin(cpu);
+            }
+            current() = this;
+            io_context_.run();
+        });
+    }
+
+    /**
+     * 当前线程所属的分片，不是分片线程时为nullptr
+     */
+    static ad_hoc_shard *&current() {
+        static thread_local ad_hoc_shard *shard = nullptr;
+        return shard;
+    }
+
+    boost::asio::io_context &io_context() {
+        return io_context_;
+    }
+
+    int index() const {
+        return index_;
+    }
+
+    /**
+     * 以下修改副本的函数由scope在持有控制锁时调用，实际的修改在分片线程上执行
+     *
+     * 节点加入时副本占用scope为节点分配的顶点vertex，不按自己的空闲顶点重新分配
+     */
+    void join(int id, int vertex, int owner, const ad_hoc_participant_ptr &participant) {
+        boost::asio::post(io_context_, [this, id, vertex, owner, participant] {
+            topology.join(id, vertex);
+            owners[id] = owner;
+            if (owner == index_) {
+                sessions[id] = participant;
+            }
+        });
+    }
+
+    void leave(int id) {
+        boost::asio::post(io_context_, [this, id] {
+            topology.leave(id);
+            owners.erase(id);
+            sessions.erase(id);
+        });
+    }
+
+    /**
+     * 应用scope的一个纪元中实际生效的链路变化
+     */
+    void apply(const vector<ad_hoc_link_change> &changes) {
+        boost::asio::post(io_context_, [this, changes] {
+            vector<ad_hoc_link_change> copy(changes);
+            topology.apply(copy);
+        });
+    }
+
+    void link_delay(const boost::posix_time::time_duration &unicast,
+                    const boost::posix_time::time_duration &broadcast) {
+        boost::asio::post(io_context_, [this, unicast, broadcast] {
+            unicast_delay = unicast;
+            broadcast_delay = broadcast;
+        });
+    }
+
+    void configure(int a, int b, const ad_hoc_channel_params &params) {
+        boost::asio::post(io_context_, [this, a, b, params] {
+            topology.configure(a, b, params);
+        });
+    }
+
+    void configure(const ad_hoc_channel_params &params) {
+        boost::asio::post(io_context_, [this, params] {
+            topology.configure(params);
+        });
+    }
+
+    void load(const ad_hoc_topology &snapshot) {
+        boost::asio::post(io_context_, [this, snapshot] {
+            topology = snapshot;
+        });
+    }
+
+    /**
+     * 转发本分片的session收到的消息，只在本分片的线程上调用，规则与ad_hoc_scope::deliver相同
+     *
+     * @param msg
+     * @return
+     */
+    bool route(const ad_hoc_message &msg) {
+        if (wormhole_channel) {
+            int dest_i;
+            if (msg.sendid() == topology.id(0)) {
+                dest_i = 1;
+            } else {
+                dest_i = 0;
+            }
+            send(topology.id(dest_i), msg);
+            return true;
+        } else if (msg.receiveid() == AODV_BROADCAST_ADDRESS) {
+            //一跳范围内广播
+            broadcast(msg);
+            return false;
+        } else if (owners.find(msg.receiveid()) == owners.end()) {
+            return false;
+        } else if (topology.connected(msg.sendid(), msg.receiveid())) {
+            int from = topology.vertex(msg.sendid()), to = topology.vertex(msg.receiveid());
+            int64_t delay = topology.transmit(from, to, msg.length(), ad_hoc_channel_time(executor_.now()),
+                                              unicast_delay.total_microseconds(), random);
+            if (delay < 0) {
+                lost_.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+            links.push(boost::posix_time::microseconds(delay),
+                       ad_hoc_link_frame{msg.receiveid(), from, to, topology.epoch(), msg});
+            return true;
+        }
+        return false;
+    }
+
+    stats statistics() const {
+        return stats{local_.load(memory_order_relaxed), remote_.load(memory_order_relaxed),
+                     overflow_.load(memory_order_relaxed), lost_.load(memory_order_relaxed),
+                     failed_.load(memory_order_relaxed)};
+    }
+
+private:
+    struct handoff {
+        int receiver;
+        ad_hoc_message msg;
+    };
+
+    /**
+     * 链路延迟到期后投递帧，延迟期间链路断开过的帧丢弃
+     */
+    void transmit(const ad_hoc_link_frame &frame) {
+        if (!topology.intact(frame.from, frame.to, frame.epoch)) {
+            failed_.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        send(frame.receiver, frame.msg);
+    }
+
+    /**
+     * 在 sender 所能直接联通(一跳)的范围内广播该消息，每个邻居的帧分别经过各自链路的信道
+     */
+    void broadcast(const ad_hoc_message &msg) {
+        int vertex = topology.vertex(msg.sendid());
+        if (vertex < 0) {
+            return;
+        }
+        const vector<int> &neighbours = topology.neighbours(vertex);
+        const vector<uint32_t> &channels = topology.neighbour_channels(vertex);
+        int64_t now = ad_hoc_channel_time(executor_.now());
+        int64_t fallback = broadcast_delay.total_microseconds();
+        for (size_t i = 0; i < neighbours.size(); i++) {
+            int id = topology.id(neighbours[i]);
+            if (id < 0) {
+                continue;
+            }
+            int64_t delay = topology.channel(channels[i]).transmit(vertex < neighbours[i], msg.length(), now,
+                                                                   fallback, random);
+            if (delay < 0) {
+                lost_.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+            links.push(boost::posix_time::microseconds(delay),
+                       ad_hoc_link_frame{id, vertex, neighbours[i], topology.epoch(), msg});
+        }
+    }
+
+    /**
+     * 把消息交给接收方所在的分片
+     */
+    void send(int id, const ad_hoc_message &msg) {
+        auto it = owners.find(id);
+        if (it == owners.end()) {
+            return;
+        }
+        if (it->second == index_) {
+            deliver_local(id, msg);
+        } else {
+            remote_.fetch_add(1, memory_order_relaxed);
+            peers[it->second]->handoff_from_peer(id, msg);
+        }
+    }
+
+    /**
+     * 由其他分片的线程调用
+     *
+     * 已经有消息在溢出列表中时，之后的消息也放入溢出列表，不能越过它们放入队列。
+     * 溢出标志在锁内重新检查，drain清空溢出列表与这里追加互斥。
+     */
+    void handoff_from_peer(int id, const ad_hoc_message &msg) {
+        handoff item{id, msg};
+        if (overflowing.load(memory_order_acquire) || !inbox.push(item)) {
+            lock_guard<mutex> lock(overflow_mutex);
+            if (overflowing.load(memory_order_relaxed) || !inbox.push(item)) {
+                overflow_.fetch_add(1, memory_order_relaxed);
+                overflow_list.push_back(std::move(item));
+                overflowing.store(true, memory_order_release);
+            }
+        }
+        if (!scheduled.exchange(true)) {
+            boost::asio::post(io_context_, boost::bind(&ad_hoc_shard::drain, this));
+        }
+    }
+
+    /**
+     * 取出队列和溢出列表中所有的消息。先清除标志再取，保证清除之后放入的消息会触发下一次drain
+     *
+     * 溢出列表中每个发送方的消息都晚于它已经放入队列的消息，所以持有锁时先取完队列中所有已经被占用的槽位，
+     * 再取溢出列表，最后清除溢出标志，之后的消息重新放入队列。
+     */
+    void drain() {
+        scheduled.store(false);
+        handoff item;
+        while (inbox.pop(item)) {
+            deliver_local(item.receiver, item.msg);
+        }
+        if (!overflowing.load(memory_order_acquire)) {
+            return;
+        }
+        lock_guard<mutex> lock(overflow_mutex);
+        while (inbox.pop_claimed(item)) {
+            deliver_local(item.receiver, item.msg);
+        }
+        for (handoff &pending: overflow_list) {
+            deliver_local(pending.receiver, pending.msg);
+        }
+        overflow_list.clear();
+        overflowing.store(false, memory_order_release);
+    }
+
+    void deliver_local(int id, const ad_hoc_message &msg) {
+        auto it = sessions.find(id);     //投递期间接收方可能已经离开
+        if (it != sessions.end()) {
+            local_.fetch_add(1, memory_order_relaxed);
+            it->second->deliver(msg);
+        }
+    }
+
+    int index_;
+    bool wormhole_channel;
+    boost::asio::io_context io_context_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    ad_hoc_asio_executor executor_;
+    ad_hoc_delay_queue<ad_hoc_link_frame> links; //等待链路延迟的帧，只在本分片的线程上到期
+    boost::posix_time::time_duration unicast_delay; //只在本分片的线程上访问
+    boost::posix_time::time_duration broadcast_delay;
+    ad_hoc_random random; //信道的随机数，只在本分片的线程上访问
+    thread worker;
+    vector<ad_hoc_shard *> peers;
+
+    //以下副本只在本分片的线程上访问
+    ad_hoc_topology topology;
+    unordered_map<int, int> owners; //节点ID -> 所属分片
+    unordered_map<int, ad_hoc_participant_ptr> sessions; //属于本分片的session
+
+    ad_hoc_mpsc_ring<handoff> inbox; //其他分片投递过来的消息
+    mutex overflow_mutex; //保护overflow_list
+    vector<handoff> overflow_list; //队列满时其他分片投递过来的消息，按到达顺序
+    atomic<bool> overflowing; //overflow_list是否非空，非空时新的消息都追加到overflow_list
+    atomic<bool> scheduled; //是否已经投递了drain
+    atomic<size_t> local_; //交给本分片session的消息数
+    atomic<size_t> remote_; //交给其他分片的消息数
+    atomic<size_t> overflow_; //队列满时放入溢出列表的消息数
+    atomic<size_t> lost_; //在信道上丢弃的帧数
+    atomic<size_t> failed_; //延迟期间链路断开而丢弃的帧数
+};
+
+/**
+ * 按线性确定性贪心（LDG）的流式图划分启发式为新加入的节点选择分片
+ *
+ * 得分 = 该分片中已有的邻居数 * (1 - 分片节点数 / 容量)，取得分最高的分片，得分相同时取节点最少的分片。
+ * 容量为平均节点数的(1 + SHARD_IMBALANCE)倍，已满的分片不参与选择。
+ * 这样一跳范围内的转发和广播大多发生在同一个分片内，分片之间的节点数又大致均衡。
+ *
+ * @param topology 加入后的拓扑图
+ * @param vertex 新节点占用的顶点
+ * @param owners 已加入节点所属的分片
+ * @param sizes 每个分片的节点数
+ * @return 分片编号
+ */
+inline int ad_hoc_partition(const ad_hoc_topology &topology, int vertex, const unordered_map<int, int> &owners,
+                            const vector<size_t> &sizes) {
+    size_t shards = sizes.size();
+    vector<int> neighbours(shards, 0);
+    for (int neighbour: topology.neighbours(vertex)) {
+        auto it = owners.find(topology.id(neighbour));
+        if (it != owners.end()) {
+            neighbours[it->second]++;
+        }
+    }
+    double capacity = (double) (owners.size() + 1) / shards * (1 + SHARD_IMBALANCE) + 1;
+    int best = -1;
+    double best_score = -1;
+    for (size_t s = 0; s < shards; s++) {
+        if (sizes[s] >= capacity) {
+            continue;
+        }
+        double score = neighbours[s] * (1 - sizes[s] / capacity);
+        if (best < 0 || score > best_score || (score == best_score && sizes[s] < sizes[best])) {
+            best = (int) s;
+            best_score = score;
+        }
+    }
+    if (best < 0) {
+        best = 0;
+        for (size_t s = 1; s < shards; s++) {
+            if (sizes[s] < sizes[best]) {
+                best = (int) s;
+            }
+        }
+    }
+    return best;
+}
+
+#endif //ADHOC_SIMULATION_SHARD_H
@@ -0,0 +1,692 @@
+//
+// Created by 邹迪凯 on 2022/3/29.
+//
+
+#ifndef ADHOC_SIMULATION_SHM_H
+#define ADHOC_SIMULATION_SHM_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <boost/asio.hpp>
+
+#include "wire.h"
+#include "local_socket.h"
+
+using namespace std;
+
+// 共享内存传输：client进程与server之间通过/dev/shm中的一个段交换帧，段中有两个单生产者/单消费者的字节环，
+// 一个从client到server，一个从server到client。环中的字节流与socket上的完全相同（协商报文的回复、帧、CRC32C尾部），
+// 所以frame reader、batch writer和codec不需要任何改动。
+//
+// 建立连接：client先连接server的Unix域socket（server要加上--unix），在协商报文中带上WIRE_OPTION_SHARED_MEMORY，
+// 并用SCM_RIGHTS随协商报文传递3个fd：段、client的门铃eventfd、server的门铃eventfd。此后Unix域socket上不再有数据，
+// 只用来发现对端关闭。
+//
+// 唤醒：每一端在自己的门铃上等待。消费者读不到数据时先在事件循环中轮询SHM_POLL_ROUNDS次，仍然没有数据才在环上
+// 标记reader_waiting并等待门铃；生产者发布数据后只有看到这个标记才敲对端的门铃，消费者在轮询时不会产生系统调用。
+// 环满时生产者以writer_waiting标记等待，消费者读走数据后同样只在看到标记时敲门铃。
+// 只有一个CPU时轮询只会占用对端的时间片，直接等待门铃。
+
+//每个方向的环的字节数，必须是2的幂
+const size_t SHM_RING_SIZE = 1 << 20;
+//读不到数据时睡眠之前在事件循环中重新检查的次数
+const int SHM_POLL_ROUNDS = 64;
+//随协商报文传递的fd个数：段、client的门铃、server的门铃
+const int SHM_HANDSHAKE_FDS = 3;
+
+/**
+ * 读不到数据时实际轮询的次数，单CPU上不轮询
+ */
+inline int ad_hoc_shm_poll_rounds() {
+    static const int rounds = thread::hardware_concurrency() > 1 ? SHM_POLL_ROUNDS : 0;
+    return rounds;
+}
+
+/**
+ * 共享内存中的单生产者/单消费者字节环
+ *
+ * head和tail是单调增长的字节计数，分别只由消费者和生产者修改，放在不同的缓存行上。
+ * 发布数据和检查对方的等待标记之间用顺序一致的原子操作，与对方“先置标记、再检查环”构成Dekker式的配对，不会丢失唤醒。
+ */
+struct ad_hoc_shm_ring {
+    alignas(64) atomic<uint64_t> head; //消费者已经读走的字节数
+    alignas(64) atomic<uint64_t> tail; //生产者已经发布的字节数
+    alignas(64) atomic<uint32_t> reader_waiting; //消费者在等待数据
+    atomic<uint32_t> writer_waiting; //生产者在等待空间
+    alignas(64) char data[SHM_RING_SIZE];
+
+    size_t readable() const {
+        return (size_t) (tail.load(memory_order_seq_cst) - head.load(memory_order_relaxed));
+    }
+
+    size_t writable() const {
+        return SHM_RING_SIZE - (size_t) (tail.load(memory_order_relaxed) - head.load(memory_order_seq_cst));
+    }
+
+    /**
+     * 生产者写入最多length个字节
+     *
+     * @return 写入的字节数，环满时为0
+     */
+    size_t write(const char *in, size_t length) {
+        uint64_t t = tail.load(memory_order_relaxed);
+        size_t n = min(length, SHM_RING_SIZE - (size_t) (t - head.load(memory_order_acquire)));
+        size_t offset = t & (SHM_RING_SIZE - 1);
+        size_t first = min(n, SHM_RING_SIZE - offset);
+        memcpy(data + offset, in, first);
+        memcpy(data, in + first, n - first);
+        tail.store(t + n, memory_order_seq_cst);
+        return n;
+    }
+
+    /**
+     * 消费者读出最多length个字节
+     *
+     * @return 读出的字节数，环空时为0
+     */
+    size_t read(char *out, size_t length) {
+        uint64_t h = head.load(memory_order_relaxed);
+        size_t n = min(length, (size_t) (tail.load(memory_order_acquire) - h));
+        size_t offset = h & (SHM_RING_SIZE - 1);
+        size_t first = min(n, SHM_RING_SIZE - offset);
+        memcpy(out, data + offset, first);
+        memcpy(out + first, data, n - first);
+        head.store(h + n, memory_order_seq_cst);
+        return n;
+    }
+};
+
+/**
+ * 一个连接的共享内存段，rings[0]从client到server，rings[1]从server到client
+ */
+struct ad_hoc_shm_segment {
+    ad_hoc_shm_ring rings[2];
+};
+
+/**
+ * 一端看到的共享内存通道：映射的段、本端的门铃和对端的门铃
+ *
+ * 只负责环上的收发和门铃，不涉及事件循环，client、server和基准测试都通过它访问环。
+ */
+class ad_hoc_shm_channel {
+public:
+    struct stats {
+        size_t polls; //读不到数据时的轮询次数
+        size_t sleeps; //轮询之后进入睡眠的次数
+        size_t doorbells; //敲对端门铃的次数
+        size_t suppressed; //发布了数据但对端在轮询、不需要敲门铃的次数
+    };
+
+    ad_hoc_shm_channel() : segment_(nullptr), inbound_(nullptr), outbound_(nullptr), segment_fd_(-1), bell_fd_(-1),
+                           peer_bell_fd_(-1), stats_() {
+    }
+
+    ad_hoc_shm_channel(const ad_hoc_shm_channel &) = delete;
+
+    ad_hoc_shm_channel &operator=(const ad_hoc_shm_channel &) = delete;
+
+    ~ad_hoc_shm_channel() {
+        close();
+    }
+
+    /**
+     * client创建段和两个门铃
+     *
+     * 段在/dev/shm中创建，映射之后立刻删除名字，只通过fd传给server，进程退出后不会遗留
+     */
+    bool create() {
+        static atomic<int> sequence(0);
+        string name = "/adhoc-simulation-" + to_string(getpid()) + "-" + to_string(sequence++);
+        segment_fd_ = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (segment_fd_ < 0) {
+            return false;
+        }
+        shm_unlink(name.c_str());
+        if (ftruncate(segment_fd_, sizeof(ad_hoc_shm_segment)) != 0 || !map()) {
+            return false;
+        }
+        new(segment_) ad_hoc_shm_segment();
+        bell_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        peer_bell_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        inbound_ = &segment_->rings[1];
+        outbound_ = &segment_->rings[0];
+        return bell_fd_ >= 0 && peer_bell_fd_ >= 0;
+    }
+
+    /**
+     * server接管client传来的fd，无论成功与否fd都归通道所有
+     *
+     * @param fds 段、client的门铃、server的门铃
+     */
+    bool attach(const int fds[SHM_HANDSHAKE_FDS]) {
+        segment_fd_ = fds[0];
+        peer_bell_fd_ = fds[1];
+        bell_fd_ = fds[2];
+        struct stat st{};
+        if (fstat(segment_fd_, &st) != 0 || (size_t) st.st_size < sizeof(ad_hoc_shm_segment) || !map()) {
+            return false;
+        }
+        inbound_ = &segment_->rings[0];
+        outbound_ = &segment_->rings[1];
+        return true;
+    }
+
+    /**
+     * client传给server的fd，顺序与attach的参数一致
+     */
+    void handshake_fds(int fds[SHM_HANDSHAKE_FDS]) const {
+        fds[0] = segment_fd_;
+        fds[1] = bell_fd_;
+        fds[2] = peer_bell_fd_;
+    }
+
+    /**
+     * 本端等待的门铃
+     */
+    int bell() const {
+        return bell_fd_;
+    }
+
+    size_t write(const char *in, size_t length) {
+        return outbound_->write(in, length);
+    }
+
+    /**
+     * 写入一批数据之后调用：对端在等待数据时敲它的门铃
+     */
+    void notify_reader() {
+        if (outbound_->reader_waiting.exchange(0, memory_order_seq_cst)) {
+            ring();
+        } else {
+            stats_.suppressed++;
+        }
+    }
+
+    size_t read(char *out, size_t length) {
+        return inbound_->read(out, length);
+    }
+
+    /**
+     * 读走一批数据之后调用：对端在等待空间时敲它的门铃
+     */
+    void notify_writer() {
+        if (inbound_->writer_waiting.load(memory_order_seq_cst) &&
+            inbound_->writer_waiting.exchange(0, memory_order_seq_cst)) {
+            ring();
+        }
+    }
+
+    bool readable() const {
+        return inbound_->readable() > 0;
+    }
+
+    /**
+     * 准备等待数据：置reader_waiting之后再检查一次环
+     *
+     * @return 环仍然是空的，可以等待门铃
+     */
+    bool sleep_for_data() {
+        inbound_->reader_waiting.store(1, memory_order_seq_cst);
+        if (inbound_->readable() > 0) {
+            inbound_->reader_waiting.store(0, memory_order_relaxed);
+            return false;
+        }
+        stats_.sleeps++;
+        return true;
+    }
+
+    /**
+     * 准备等待空间：置writer_waiting之后再检查一次环
+     *
+     * @return 环仍然是满的，可以等待门铃
+     */
+    bool sleep_for_space() {
+        outbound_->writer_waiting.store(1, memory_order_seq_cst);
+        if (outbound_->writable() > 0) {
+            outbound_->writer_waiting.store(0, memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * 读走门铃上的计数
+     */
+    void drain() {
+        uint64_t count;
+        while (::read(bell_fd_, &count, sizeof(count)) == sizeof(count)) {
+        }
+    }
+
+    void count_poll() {
+        stats_.polls++;
+    }
+
+    stats statistics() const {
+        return stats_;
+    }
+
+    void close() {
+        if (segment_) {
+            munmap(segment_, sizeof(ad_hoc_shm_segment));
+            segment_ = nullptr;
+        }
+        for (int *fd: {&segment_fd_, &bell_fd_, &peer_bell_fd_}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+private:
+    bool map() {
+        void *addr = mmap(nullptr, sizeof(ad_hoc_shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd_, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        segment_ = static_cast<ad_hoc_shm_segment *>(addr);
+        return true;
+    }
+
+    void ring() {
+        uint64_t one = 1;
+        if (::write(peer_bell_fd_, &one, sizeof(one)) == sizeof(one)) {
+            stats_.doorbells++;
+        }
+    }
+
+    ad_hoc_shm_segment *segment_;
+    ad_hoc_shm_ring *inbound_;
+    ad_hoc_shm_ring *outbound_;
+    int segment_fd_;
+    int bell_fd_;
+    int peer_bell_fd_;
+    stats stats_;
+};
+
+/**
+ * 在Unix域socket上发送协商报文，并用SCM_RIGHTS附带共享内存的fd
+ */
+inline bool ad_hoc_shm_send_handshake(int socket, const char *preamble, size_t length,
+                                      const int fds[SHM_HANDSHAKE_FDS]) {
+    iovec iov{const_cast<char *>(preamble), length};
+    char control[CMSG_SPACE(sizeof(int) * SHM_HANDSHAKE_FDS)];
+    memset(control, 0, sizeof(control));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_HANDSHAKE_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * SHM_HANDSHAKE_FDS);
+    return sendmsg(socket, &msg, MSG_NOSIGNAL) == (ssize_t) length;
+}
+
+/**
+ * 共享内存上的读写流，接口与ad_hoc_socket_stream相同，可以代替Unix域socket上的流用于session和client
+ *
+ * client在第一次写（即协商报文）时创建段，把协商报文连同fd经Unix域socket发出，此后的读写都在环上进行；
+ * server在读入协商报文、接管fd之后调用attach。
+ * 读不到数据时在回调关联的executor上重新投递检查，SHM_POLL_ROUNDS次之后才等待门铃；环满时等待对端读走数据。
+ * Unix域socket变为可读（对端关闭）时，进行中的读写以eof结束。
+ * 回调投递到回调关联的executor上，与asio的socket一致。内部状态由所有异步操作共享持有，关闭或析构后才完成的操作不会访问已释放的对象。
+ */
+class ad_hoc_shm_stream {
+public:
+    explicit ad_hoc_shm_stream(local_stream::socket &socket) : socket_(socket),
+                                                               state_(make_shared<state>(socket.get_executor())) {
+    }
+
+    ad_hoc_shm_stream(const ad_hoc_shm_stream &) = delete;
+
+    ad_hoc_shm_stream &operator=(const ad_hoc_shm_stream &) = delete;
+
+    ~ad_hoc_shm_stream() {
+        state_->close();
+    }
+
+    /**
+     * server接管client随协商报文传来的fd
+     */
+    bool attach(const int fds[SHM_HANDSHAKE_FDS]) {
+        return state_->attach(socket_, fds);
+    }
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler handler) {
+        boost::asio::any_io_executor executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+        state_->read(buffers, handler_type(handler), executor);
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler handler) {
+        boost::asio::any_io_executor executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+        if (!state_->attached()) {
+            //client的第一次写是协商报文，经socket发出
+            state_->handshake(socket_, buffers, handler_type(handler), executor);
+            return;
+        }
+        state_->write(buffers, handler_type(handler), executor);
+    }
+
+    void close() {
+        state_->close();
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
+
+    ad_hoc_shm_channel::stats statistics() const {
+        return state_->statistics();
+    }
+
+private:
+    typedef function<void(const boost::system::error_code &, size_t)> handler_type;
+
+    class state : public enable_shared_from_this<state> {
+    public:
+        explicit state(const boost::asio::any_io_executor &executor) : executor(executor), bell(executor),
+                                                                        control(executor) {
+        }
+
+        bool attached() {
+            lock_guard<mutex> lock(mutex_);
+            return attached_;
+        }
+
+        bool attach(local_stream::socket &socket, const int fds[SHM_HANDSHAKE_FDS]) {
+            lock_guard<mutex> lock(mutex_);
+            if (!channel.attach(fds)) {
+                return false;
+            }
+            return start(socket);
+        }
+
+        template<typename ConstBufferSequence>
+        void handshake(local_stream::socket &socket, const ConstBufferSequence &buffers, handler_type handler,
+                       const boost::asio::any_io_executor &ex) {
+            lock_guard<mutex> lock(mutex_);
+            write_handler = std::move(handler);
+            write_executor = ex;
+            written = 0;
+            string preamble;
+            for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                 it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                boost::asio::const_buffer buffer(*it);
+                preamble.append(static_cast<const char *>(buffer.data()), buffer.size());
+            }
+            //协商报文由codec生成，这里加上共享内存的选项，server据此接管fd
+            if (preamble.size() < (size_t) WIRE_PREAMBLE_LENGTH || !channel.create()) {
+                finish_write(boost::asio::error::invalid_argument);
+                return;
+            }
+            preamble[6] = (char) (preamble[6] | WIRE_OPTION_SHARED_MEMORY);
+            int fds[SHM_HANDSHAKE_FDS];
+            channel.handshake_fds(fds);
+            if (!ad_hoc_shm_send_handshake(socket.native_handle(), preamble.data(), preamble.size(), fds) ||
+                !start(socket)) {
+                finish_write(boost::asio::error::broken_pipe);
+                return;
+            }
+            written = preamble.size();
+            finish_write(boost::system::error_code());
+            //连接建立后先发起的读操作在等待段建立
+            if (read_handler) {
+                try_read();
+            }
+        }
+
+        template<typename MutableBufferSequence>
+        void read(const MutableBufferSequence &buffers, handler_type handler, const boost::asio::any_io_executor &ex) {
+            lock_guard<mutex> lock(mutex_);
+            read_buffers.clear();
+            for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                 it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                boost::asio::mutable_buffer buffer(*it);
+                if (buffer.size() > 0) {
+                    read_buffers.push_back(buffer);
+                }
+            }
+            read_handler = std::move(handler);
+            read_executor = ex;
+            poll_rounds = 0;
+            if (closed) {
+                finish_read(boost::asio::error::operation_aborted, 0);
+            } else if (attached_) {
+                try_read();
+            }
+        }
+
+        template<typename ConstBufferSequence>
+        void write(const ConstBufferSequence &buffers, handler_type handler, const boost::asio::any_io_executor &ex) {
+            lock_guard<mutex> lock(mutex_);
+            write_buffers.clear();
+            for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                 it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                boost::asio::const_buffer buffer(*it);
+                if (buffer.size() > 0) {
+                    write_buffers.push_back(buffer);
+                }
+            }
+            write_handler = std::move(handler);
+            write_executor = ex;
+            write_index = 0;
+            written = 0;
+            if (closed) {
+                finish_write(boost::asio::error::operation_aborted);
+            } else {
+                try_write();
+            }
+        }
+
+        void close() {
+            lock_guard<mutex> lock(mutex_);
+            shutdown(boost::asio::error::operation_aborted);
+        }
+
+        ad_hoc_shm_channel::stats statistics() {
+            lock_guard<mutex> lock(mutex_);
+            return channel.statistics();
+        }
+
+    private:
+        /**
+         * 段建立之后开始监视对端关闭，调用方持有锁
+         */
+        bool start(local_stream::socket &socket) {
+            boost::system::error_code ec;
+            bell.assign(dup(channel.bell()), ec);
+            int fd = dup(socket.native_handle());
+            if (!ec) {
+                control.assign(fd, ec);
+            } else {
+                ::close(fd);
+            }
+            if (ec) {
+                return false;
+            }
+            attached_ = true;
+            auto self = shared_from_this();
+            control.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                               [self](const boost::system::error_code &error) {
+                                   lock_guard<mutex> lock(self->mutex_);
+                                   if (!error) {
+                                       self->shutdown(boost::asio::error::eof);
+                                   }
+                               });
+            return true;
+        }
+
+        /**
+         * 从环中读出数据交给调用方；没有数据时轮询或者等待门铃。调用方持有锁
+         */
+        void try_read() {
+            size_t total = 0;
+            for (boost::asio::mutable_buffer &buffer: read_buffers) {
+                size_t n = channel.read(static_cast<char *>(buffer.data()), buffer.size());
+                total += n;
+                if (n < buffer.size()) {
+                    break;
+                }
+            }
+            if (total > 0 || read_buffers.empty()) {
+                channel.notify_writer();
+                finish_read(boost::system::error_code(), total);
+                return;
+            }
+            if (poll_rounds < ad_hoc_shm_poll_rounds()) {
+                //在事件循环中重新检查，其间其他回调照常执行，不产生系统调用
+                poll_rounds++;
+                channel.count_poll();
+                auto self = shared_from_this();
+                boost::asio::post(executor, [self] {
+                    lock_guard<mutex> lock(self->mutex_);
+                    if (self->read_handler && !self->closed) {
+                        self->try_read();
+                    }
+                });
+                return;
+            }
+            if (channel.sleep_for_data()) {
+                wait_bell();
+            } else {
+                try_read();
+            }
+        }
+
+        /**
+         * 把待写的数据尽量写入环；环满时等待对端读走。调用方持有锁
+         */
+        void try_write() {
+            bool wrote = false;
+            while (write_index < write_buffers.size()) {
+                boost::asio::const_buffer &buffer = write_buffers[write_index];
+                size_t n = channel.write(static_cast<const char *>(buffer.data()), buffer.size());
+                if (n > 0) {
+                    wrote = true;
+                    written += n;
+                    buffer += n;
+                }
+                if (buffer.size() > 0) {
+                    break;
+                }
+                write_index++;
+            }
+            if (wrote) {
+                channel.notify_reader();
+            }
+            if (write_index == write_buffers.size()) {
+                finish_write(boost::system::error_code());
+            } else if (channel.sleep_for_space()) {
+                wait_bell();
+            } else {
+                try_write();
+            }
+        }
+
+        /**
+         * 等待本端的门铃，醒来后重试进行中的读和写。调用方持有锁
+         */
+        void wait_bell() {
+            if (waiting) {
+                return;
+            }
+            waiting = true;
+            auto self = shared_from_this();
+            bell.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                            [self](const boost::system::error_code &error) {
+                                lock_guard<mutex> lock(self->mutex_);
+                                self->waiting = false;
+                                if (error || self->closed) {
+                                    return;
+                                }
+                                self->channel.drain();
+                                self->poll_rounds = 0;
+                                if (self->read_handler) {
+                                    self->try_read();
+                                }
+                                if (self->write_handler) {
+                                    self->try_write();
+                                }
+                            });
+        }
+
+        /**
+         * 关闭通道，进行中的读写以error结束。调用方持有锁
+         */
+        void shutdown(const boost::system::error_code &error) {
+            if (closed) {
+                return;
+            }
+            closed = true;
+            boost::system::error_code ec;
+            bell.close(ec);
+            control.close(ec);
+            if (read_handler) {
+                finish_read(error, 0);
+            }
+            if (write_handler) {
+                finish_write(error);
+            }
+            channel.close();
+        }
+
+        void finish_read(const boost::system::error_code &error, size_t bytes) {
+            handler_type handler;
+            handler.swap(read_handler);
+            boost::asio::post(read_executor, [handler, error, bytes] {
+                handler(error, bytes);
+            });
+        }
+
+        void finish_write(const boost::system::error_code &error) {
+            handler_type handler;
+            handler.swap(write_handler);
+            size_t bytes = written;
+            boost::asio::post(write_executor, [handler, error, bytes] {
+                handler(error, bytes);
+            });
+        }
+
+        mutex mutex_;
+        boost::asio::any_io_executor executor; //轮询投递到这里
+        ad_hoc_shm_channel channel;
+        boost::asio::posix::stream_descriptor bell; //本端门铃的副本，由asio等待
+        boost::asio::posix::stream_descriptor control; //Unix域socket的副本，可读即对端关闭
+        bool attached_ = false;
+        bool closed = false;
+        bool waiting = false; //是否在等待门铃
+        int poll_rounds = 0;
+        //读
+        handler_type read_handler;
+        boost::asio::any_io_executor read_executor;
+        vector<boost::asio::mutable_buffer> read_buffers;
+        //写
+        handler_type write_handler;
+        boost::asio::any_io_executor write_executor;
+        vector<boost::asio::const_buffer> write_buffers;
+        size_t write_index = 0;
+        size_t written = 0;
+    };
+
+    local_stream::socket &socket_;
+    shared_ptr<state> state_;
+};
+
+#endif //ADHOC_SIMULATION_SHM_H
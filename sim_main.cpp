@@ -0,0 +1,110 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+// 离散事件仿真：节点和scope由虚拟时钟驱动，AODV的各个定时器不等待真实时间，仿真速度只取决于CPU。
+//
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include "simulation.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: sim <nodes> [--width <n> | --range <m>] [--mobility rwp|gm] [--trace <file>] [--channel <spec>] [--verbose]\n";
+        return 1;
+    }
+    int count = stoi(argv[1]);
+    int width = 0;          //网格的列数，为0时取节点数的平方根
+    bool verbose = false;   //是否输出节点的日志
+    bool channel = false;   //是否设置了所有链路的信道参数
+    ad_hoc_channel_params params;
+    double range = 0;       //通信半径，大于0时节点随机放置，按距离相连，否则排成网格
+    unique_ptr<ad_hoc_mobility> mobility;
+    string trace;           //按虚拟时间回放的轨迹文件
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+            width = stoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = true;
+        } else if (!strcmp(argv[i], "--channel") && i + 1 < argc) {
+            //同chat_server：延迟毫秒,抖动毫秒,带宽kbps,好转坏概率,坏转好概率,好状态丢包率,坏状态丢包率
+            if (!ad_hoc_parse_channel(argv[++i], params)) {
+                return 1;
+            }
+            channel = true;
+        } else if (!strcmp(argv[i], "--range") && i + 1 < argc) {
+            range = stod(argv[++i]);
+        } else if (!strcmp(argv[i], "--mobility") && i + 1 < argc) {
+            mobility = ad_hoc_make_mobility(argv[++i]);
+            if (!mobility) {
+                std::cerr << "unknown mobility model: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace = argv[++i];
+        }
+    }
+    if (width <= 0) {
+        width = 1;
+        while (width * width < count) {
+            width++;
+        }
+    }
+    //同host，节点日志默认丢弃，仿真自己的输出写到console
+    ostream console(cout.rdbuf());
+    ofstream null("/dev/null");
+    if (!verbose) {
+        cout.rdbuf(null.rdbuf());
+    }
+    {
+        ad_hoc_simulation simulation;
+        if (channel) {
+            simulation.channel(params);
+        }
+        simulation.spawn(count, width);
+        //移动的节点需要几何位置
+        if (range <= 0 && mobility) {
+            range = GEOMETRY_RANGE;
+        }
+        if (range > 0) {
+            simulation.geometry(range);
+        }
+        if (mobility) {
+            simulation.mobility(std::move(mobility));
+        }
+        if (!trace.empty() && !simulation.replay(trace)) {
+            cerr << "invalid trace file: " << trace << endl;
+            cout.rdbuf(console.rdbuf());
+            return 1;
+        }
+        console << "simulating " << simulation.size() << " nodes." << endl;
+
+        //send <src> <dest> <text>：由节点src向dest发送消息；run <seconds>：虚拟时钟前进seconds秒；stats：打印统计；quit：退出
+        string cmd;
+        while (cin >> cmd) {
+            if (cmd == "send") {
+                int src, dest;
+                string text;
+                cin >> src >> dest >> text;
+                if (!simulation.send(src, dest, text)) {
+                    cerr << "unknown node: " << src << endl;
+                }
+            } else if (cmd == "run") {
+                double seconds;
+                cin >> seconds;
+                auto start = chrono::steady_clock::now();
+                size_t events = simulation.run_for(boost::posix_time::microseconds((int64_t) (seconds * 1e6)));
+                console << "ran " << seconds << " s of virtual time, " << events << " events in "
+                        << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count()
+                        << " ms." << endl;
+            } else if (cmd == "stats") {
+                simulation.print_stats(console);
+            } else if (cmd == "quit") {
+                break;
+            }
+        }
+    }
+    cout.rdbuf(console.rdbuf());
+    return 0;
+}
@@ -0,0 +1,379 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_SIMULATION_H
+#define ADHOC_SIMULATION_SIMULATION_H
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "executor.h"
+#include "geometry.h"
+#include "server.h"
+#include "client.h"
+
+using namespace std;
+
+//仿真中第一个节点的ID，之后的节点依次加一
+const int SIMULATION_FIRST_ID = 10001;
+
+/**
+ * 离散事件仿真的执行器
+ *
+ * 事件按虚拟时间放在最小堆中，时间相同的按投递顺序执行。执行一个事件时虚拟时钟跳到该事件的时间，
+ * 不等待真实的时间流逝，仿真的速度只取决于CPU。所有函数都在同一个线程上调用。
+ */
+class ad_hoc_simulator : public ad_hoc_executor {
+public:
+    ad_hoc_simulator() : now_(boost::posix_time::from_time_t(0)), sequence(0), executed_(0), stopped(false) {
+    }
+
+    void post(function<void()> handler) override {
+        schedule(now_, std::move(handler));
+    }
+
+    timer_ptr create_timer() override;
+
+    boost::posix_time::ptime now() override {
+        return now_;
+    }
+
+    /**
+     * 在虚拟时间at执行handler，at早于当前时间时在当前时间执行
+     */
+    void schedule(const boost::posix_time::ptime &at, function<void()> handler) {
+        if (stopped) {
+            return;
+        }
+        events.push_back(event{at < now_ ? now_ : at, sequence++, std::move(handler)});
+        push_heap(events.begin(), events.end(), later());
+    }
+
+    /**
+     * 依次执行虚拟时间不晚于until的所有事件，执行完后时钟停在until
+     *
+     * @return 执行的事件数
+     */
+    size_t run_until(const boost::posix_time::ptime &until) {
+        size_t count = 0;
+        while (!stopped && !events.empty() && events.front().at <= until) {
+            pop_heap(events.begin(), events.end(), later());
+            event e = std::move(events.back());
+            events.pop_back();
+            now_ = e.at;
+            e.handler();
+            count++;
+        }
+        if (!stopped && now_ < until) {
+            now_ = until;
+        }
+        executed_ += count;
+        return count;
+    }
+
+    size_t run_for(const boost::posix_time::time_duration &duration) {
+        return run_until(now_ + duration);
+    }
+
+    /**
+     * 丢弃所有未执行的事件，之后投递的事件也被丢弃
+     */
+    void stop() {
+        stopped = true;
+        events.clear();
+    }
+
+    /**
+     * 已执行的事件数
+     */
+    size_t executed() const {
+        return executed_;
+    }
+
+    /**
+     * 等待执行的事件数
+     */
+    size_t pending() const {
+        return events.size();
+    }
+
+private:
+    struct event {
+        boost::posix_time::ptime at;
+        uint64_t sequence;
+        function<void()> handler;
+    };
+
+    //最小堆的比较函数，时间相同时先投递的先执行
+    struct later {
+        bool operator()(const event &a, const event &b) const {
+            return a.at > b.at || (a.at == b.at && a.sequence > b.sequence);
+        }
+    };
+
+    boost::posix_time::ptime now_; //虚拟时钟，从1970-01-01开始
+    vector<event> events;
+    uint64_t sequence;
+    size_t executed_;
+    bool stopped;
+};
+
+/**
+ * 虚拟时钟上的定时器
+ *
+ * async_wait在到期时间投递一个事件；取消时回调在当前虚拟时间收到operation_aborted，与deadline_timer的语义一致。
+ * 已经取消的等待在事件到来时什么也不做，不需要从堆中删除。
+ */
+class ad_hoc_simulated_timer : public ad_hoc_timer {
+public:
+    explicit ad_hoc_simulated_timer(ad_hoc_simulator &simulator) : simulator(simulator), expiry(simulator.now()) {
+    }
+
+    ~ad_hoc_simulated_timer() override {
+        cancel();
+    }
+
+    void expires_from_now(const boost::posix_time::time_duration &duration) override {
+        cancel();
+        expiry = simulator.now() + duration;
+    }
+
+    void async_wait(ad_hoc_wait_handler handler) override {
+        waits.erase(remove_if(waits.begin(), waits.end(), [](const shared_ptr<ad_hoc_wait_handler> &w) {
+            return !*w;
+        }), waits.end());
+        auto wait = make_shared<ad_hoc_wait_handler>(std::move(handler));
+        waits.push_back(wait);
+        simulator.schedule(expiry, [wait] {
+            complete(*wait, boost::system::error_code());
+        });
+    }
+
+    void cancel() override {
+        for (auto &wait: waits) {
+            if (*wait) {
+                ad_hoc_wait_handler handler = std::move(*wait);
+                *wait = nullptr;
+                simulator.post([handler] {
+                    handler(boost::asio::error::operation_aborted);
+                });
+            }
+        }
+        waits.clear();
+    }
+
+private:
+    /**
+     * 执行一次等待的回调，已经执行或取消的等待为空
+     */
+    static void complete(ad_hoc_wait_handler &wait, const boost::system::error_code &error) {
+        if (wait) {
+            ad_hoc_wait_handler handler = std::move(wait);
+            wait = nullptr;
+            handler(error);
+        }
+    }
+
+    ad_hoc_simulator &simulator;
+    boost::posix_time::ptime expiry;
+    vector<shared_ptr<ad_hoc_wait_handler>> waits; //还没有完成的等待
+};
+
+inline timer_ptr ad_hoc_simulator::create_timer() {
+    return make_shared<ad_hoc_simulated_timer>(*this);
+}
+
+/**
+ * 仿真中节点在scope上的参与者
+ *
+ * scope交来的消息作为一个事件投递给节点，与scope中其他接收者共享同一个缓冲区。
+ */
+class ad_hoc_simulated_port : public ad_hoc_participant {
+public:
+    ad_hoc_simulated_port(ad_hoc_simulator &simulator, ad_hoc_message_handler *handler) : simulator(simulator),
+                                                                                        handler(handler) {
+    }
+
+    void deliver(const ad_hoc_message &msg) override {
+        ad_hoc_message_handler *h = handler;
+        simulator.post([h, msg] {
+            ad_hoc_message received(msg);
+            h->handle_message(received, false);
+        });
+    }
+
+private:
+    ad_hoc_simulator &simulator;
+    ad_hoc_message_handler *handler;
+};
+
+/**
+ * 仿真中client到scope的内存链路
+ *
+ * 同host.h中的ad_hoc_memory_transport，但加入、转发和接收都是仿真器上的事件。
+ */
+class ad_hoc_simulated_transport : public ad_hoc_transport {
+public:
+    ad_hoc_simulated_transport(ad_hoc_scope &scope, ad_hoc_simulator &simulator, int id,
+                               ad_hoc_message_handler *handler) : ad_hoc_transport(handler), scope(scope),
+                                                                  simulator(simulator), id_(id),
+                                                                  port_(simulator, handler) {
+    }
+
+    void start() override {
+        simulator.post([this] {
+            scope.join(id_, ad_hoc_participant_ptr(&port_, [](ad_hoc_participant *) {}));
+            handler_->handle_connected();
+        });
+    }
+
+    bool send(const ad_hoc_message &msg) override {
+        scope.deliver(msg);
+        return true;
+    }
+
+    bool supports(int feature) const override {
+        return false;
+    }
+
+    int local_id() override {
+        return id_;
+    }
+
+    void close() override {
+        scope.leave(id_);
+    }
+
+private:
+    ad_hoc_scope &scope;
+    ad_hoc_simulator &simulator;
+    int id_;
+    ad_hoc_simulated_port port_;
+};
+
+/**
+ * 离散事件仿真：一个虚拟时钟驱动的scope和一组client节点
+ *
+ * client的HELLO、路由超时等AODV定时器以及scope的转发都是仿真器上的事件，仿真一小时不需要等待一小时。
+ * 节点ID从SIMULATION_FIRST_ID开始连续编号，第i个节点占用拓扑的第i个顶点，顶点之间按width列的网格相连。
+ * 所有函数都在同一个线程上调用。
+ */
+class ad_hoc_simulation {
+public:
+    ad_hoc_simulation() : scope(false, simulator) {
+    }
+
+    ~ad_hoc_simulation() {
+        //先丢弃未执行的事件，节点的定时器在析构时取消的回调不再执行
+        simulator.stop();
+        nodes.clear();
+    }
+
+    /**
+     * 创建count个节点，节点在下一次run时加入scope
+     *
+     * @param width 网格的列数
+     */
+    void spawn(int count, int width) {
+        int first = (int) nodes.size();
+        width = width < 1 ? 1 : width;
+        for (int i = first; i < first + count; i++) {
+            if ((i + 1) % width != 0 && i + 1 < first + count) {
+                scope.link(i, i + 1);
+            }
+            if (i + width < first + count) {
+                scope.link(i, i + width);
+            }
+        }
+        for (int i = first; i < first + count; i++) {
+            int id = SIMULATION_FIRST_ID + i;
+            nodes.emplace_back(new ad_hoc_client(simulator, [this, id](ad_hoc_message_handler *h) {
+                return new ad_hoc_simulated_transport(scope, simulator, id, h);
+            }));
+        }
+    }
+
+    /**
+     * 由节点src向dest发送一条用户消息，在下一次run时发出
+     *
+     * @return src不是仿真中的节点时返回false
+     */
+    bool send(int src, int dest, const string &text) {
+        int i = src - SIMULATION_FIRST_ID;
+        if (i < 0 || i >= (int) nodes.size()) {
+            return false;
+        }
+        nodes[i]->send_user_message(dest, text.c_str(), (int) text.size());
+        return true;
+    }
+
+    /**
+     * 把虚拟时钟向前推进duration，执行其间的所有事件
+     *
+     * @return 执行的事件数
+     */
+    size_t run_for(const boost::posix_time::time_duration &duration) {
+        return simulator.run_for(duration);
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    /**
+     * 设置所有链路的信道参数
+     */
+    void channel(const ad_hoc_channel_params &params) {
+        scope.channel(params);
+    }
+
+    /**
+     * 改用单位圆盘图：所有节点随机放置在正方形场地上，场地大小使平均有degree个邻居
+     */
+    void geometry(double range, double degree = GEOMETRY_DEGREE) {
+        double side = sqrt(nodes.size() * M_PI * range * range / degree);
+        scope.geometry(side, side, range, (int) nodes.size());
+    }
+
+    /**
+     * 按移动模型每隔tick移动一次节点
+     */
+    void mobility(unique_ptr<ad_hoc_mobility> model, const boost::posix_time::time_duration &tick =
+            boost::posix_time::millisec(MOBILITY_TICK_MS)) {
+        scope.mobility(std::move(model), tick);
+    }
+
+    /**
+     * 按虚拟时间回放轨迹文件中的拓扑变化
+     */
+    bool replay(const string &path) {
+        return scope.replay(path);
+    }
+
+    ad_hoc_simulator &executor() {
+        return simulator;
+    }
+
+    /**
+     * 打印虚拟时间、事件数、信道丢弃的帧数和消息池的统计
+     */
+    void print_stats(ostream &out) {
+        out << "virtual time " << boost::posix_time::to_simple_string(
+                simulator.now() - boost::posix_time::from_time_t(0)) << ", executed " << simulator.executed()
+            << " events, pending " << simulator.pending() << ", links " << scope.link_count() << endl;
+        scope.print_shards(out);
+        ad_hoc_message_pool::print_stats(out);
+    }
+
+private:
+    ad_hoc_simulator simulator;
+    ad_hoc_scope scope;
+    vector<unique_ptr<ad_hoc_client>> nodes; //第i个节点，ID为SIMULATION_FIRST_ID + i
+};
+
+#endif //ADHOC_SIMULATION_SIMULATION_H
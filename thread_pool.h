@@ -0,0 +1,119 @@
+//
+// Created by 邹迪凯 on 2022/3/23.
+//
+
+#ifndef ADHOC_SIMULATION_THREAD_POOL_H
+#define ADHOC_SIMULATION_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+/**
+ * 运行同一个io_context的IO线程池
+ *
+ * 每个线程都调用io_context.run()，异步操作的回调可能在任意一个线程上执行，需要串行执行的回调由调用方绑定到strand上。
+ * 线程池持有io_context的work guard，没有挂起的异步操作时线程也不会退出，直到io_context.stop()。
+ * 给定CPU列表时，第i个线程绑定到cpus[i % cpus.size()]上。
+ *
+ * 使用方式：
+ *   ad_hoc_io_thread_pool pool(io_context, 4, {0, 1, 2, 3});
+ *   pool.start();
+ *   ...
+ *   pool.join();
+ */
+class ad_hoc_io_thread_pool {
+public:
+    ad_hoc_io_thread_pool(boost::asio::io_context &io_context, int threads, vector<int> cpus = {}) : io_context(
+            io_context), work(boost::asio::make_work_guard(io_context)), threads_(threads < 1 ? 1 : threads),
+                                                                                                    cpus_(std::move(cpus)) {
+    }
+
+    void start() {
+        for (int i = 0; i < threads_; i++) {
+            workers.emplace_back([this, i] {
+                if (!cpus_.empty()) {
+                    pin(cpus_[i % cpus_.size()]);
+                }
+                io_context.run();
+            });
+        }
+    }
+
+    void join() {
+        for (thread &worker: workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    int size() const {
+        return threads_;
+    }
+
+    /**
+     * 把当前线程绑定到一个CPU上
+     *
+     * @param cpu
+     * @return 是否成功，不支持的平台上总是返回false
+     */
+    static bool pin(int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error != 0) {
+            cerr << "failed to pin thread to cpu " << cpu << ": " << error << endl;
+        }
+        return error == 0;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * 解析逗号分隔的CPU列表，支持"0-3"形式的区间，例如"0,2,4-7"
+     *
+     * @param text
+     * @return 不合法的项被忽略
+     */
+    static vector<int> parse_cpus(const string &text) {
+        vector<int> cpus;
+        stringstream ss(text);
+        string item;
+        while (getline(ss, item, ',')) {
+            try {
+                size_t dash = item.find('-');
+                int first = stoi(item.substr(0, dash));
+                int last = dash == string::npos ? first : stoi(item.substr(dash + 1));
+                for (int cpu = first; cpu <= last; cpu++) {
+                    cpus.push_back(cpu);
+                }
+            } catch (const exception &) {
+                cerr << "ignore invalid cpu: " << item << endl;
+            }
+        }
+        return cpus;
+    }
+
+private:
+    boost::asio::io_context &io_context;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    int threads_;
+    vector<int> cpus_;
+    vector<thread> workers;
+};
+
+#endif //ADHOC_SIMULATION_THREAD_POOL_H
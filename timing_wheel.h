@@ -0,0 +1,273 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_TIMING_WHEEL_H
+#define ADHOC_SIMULATION_TIMING_WHEEL_H
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <boost/asio.hpp>
+
+#include "executor.h"
+
+using namespace std;
+
+//时间轮每层的格数为2^WHEEL_SLOT_BITS
+const int WHEEL_SLOT_BITS = 8;
+const uint64_t WHEEL_SLOTS = 1u << WHEEL_SLOT_BITS;
+const uint64_t WHEEL_SLOT_MASK = WHEEL_SLOTS - 1;
+//层数，最多容纳2^32个刻度之后到期的元素，更远的按最远处理
+const int WHEEL_LEVELS = 4;
+//延迟队列的刻度
+const int WHEEL_TICK_MICROSECONDS = 1000;
+
+/**
+ * 分层时间轮
+ *
+ * 第0层每格一个刻度，第i层每格是第i-1层转一圈的刻度数。元素按到期刻度与当前刻度的距离放入能容纳它的最低一层，
+ * 低一层转完一圈时把高一层对应格中的元素重新放置到低层，最终在第0层到期。插入和到期都是O(1)。
+ * 元素存放在一个数组中，各格是数组下标串成的单链表，空闲的元素复用，稳定运行后插入不分配内存。
+ * 不是线程安全的。
+ */
+template<typename T>
+class ad_hoc_timing_wheel {
+public:
+    ad_hoc_timing_wheel() : current_(0), size_(0), free_(NONE) {
+        for (auto &level: slots_) {
+            for (uint32_t &head: level) {
+                head = NONE;
+            }
+        }
+    }
+
+    /**
+     * 放入一个在第expiry个刻度到期的元素，不晚于当前刻度的在下一个刻度到期
+     */
+    void schedule(uint64_t expiry, T value) {
+        uint32_t i = allocate();
+        //当前刻度已经到期过了
+        nodes_[i].expiry = expiry > current_ ? expiry : current_ + 1;
+        nodes_[i].value = std::move(value);
+        place(i);
+        size_++;
+    }
+
+    /**
+     * 把时间轮推进到第tick个刻度，依次对到期的元素调用fire
+     *
+     * @return 到期的元素数
+     */
+    template<typename F>
+    size_t advance(uint64_t tick, F fire) {
+        if (size_ == 0) {
+            current_ = tick > current_ ? tick : current_;
+            return 0;
+        }
+        size_t fired = 0;
+        while (current_ < tick && size_ > 0) {
+            current_++;
+            if ((current_ & WHEEL_SLOT_MASK) == 0) {
+                cascade();
+            }
+            uint32_t i = take(slots_[0][current_ & WHEEL_SLOT_MASK]);
+            while (i != NONE) {
+                uint32_t next = nodes_[i].next;
+                fire(nodes_[i].value);
+                release(i);
+                size_--;
+                fired++;
+                i = next;
+            }
+        }
+        if (size_ == 0 && current_ < tick) {
+            current_ = tick;
+        }
+        return fired;
+    }
+
+    uint64_t current() const {
+        return current_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct node {
+        uint64_t expiry;
+        uint32_t next;
+        T value;
+    };
+
+    uint32_t allocate() {
+        if (free_ != NONE) {
+            uint32_t i = free_;
+            free_ = nodes_[i].next;
+            return i;
+        }
+        nodes_.emplace_back();
+        return (uint32_t) nodes_.size() - 1;
+    }
+
+    void release(uint32_t i) {
+        //释放元素持有的资源，例如消息的缓冲区
+        nodes_[i].value = T();
+        nodes_[i].next = free_;
+        free_ = i;
+    }
+
+    /**
+     * 取下一格的整条链表
+     */
+    static uint32_t take(uint32_t &head) {
+        uint32_t i = head;
+        head = NONE;
+        return i;
+    }
+
+    /**
+     * 按到期刻度与当前刻度的距离选择层和格，级联时到期刻度可能等于当前刻度，放入随后就要到期的第0层当前格
+     */
+    void place(uint32_t i) {
+        node &n = nodes_[i];
+        uint64_t distance = n.expiry - current_;
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && distance >= (1ull << (WHEEL_SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        if (distance >= (1ull << (WHEEL_SLOT_BITS * WHEEL_LEVELS))) {
+            n.expiry = current_ + (1ull << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1;
+        }
+        uint32_t &head = slots_[level][(n.expiry >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK];
+        n.next = head;
+        head = i;
+    }
+
+    /**
+     * 第0层转完一圈，把高层中当前格的元素放到低层，高一层也转完一圈时继续向上
+     */
+    void cascade() {
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            uint64_t index = (current_ >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+            uint32_t i = take(slots_[level][index]);
+            while (i != NONE) {
+                uint32_t next = nodes_[i].next;
+                place(i);
+                i = next;
+            }
+            if (index != 0) {
+                break;
+            }
+        }
+    }
+
+    vector<node> nodes_;
+    uint32_t slots_[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current_; //当前刻度
+    size_t size_;
+    uint32_t free_; //空闲元素的链表
+};
+
+/**
+ * 延迟队列：放入的元素经过给定的延迟后交给回调
+ *
+ * 元素放在时间轮中，整个队列只用执行器的一个定时器：队列非空时每个刻度触发一次，把时间轮推进到当前时间，
+ * 到期的元素成批取出后在锁外交给回调。执行器是虚拟时钟时延迟按虚拟时间计算。
+ * push可以在任意线程上调用，回调在执行器上依次执行。
+ */
+template<typename T>
+class ad_hoc_delay_queue {
+public:
+    ad_hoc_delay_queue(ad_hoc_executor &executor, function<void(T &)> fire) : executor(executor),
+                                                                             fire(std::move(fire)),
+                                                                             timer(executor.create_timer()),
+                                                                             origin(executor.now()),
+                                                                             armed(false) {
+    }
+
+    ~ad_hoc_delay_queue() {
+        timer->cancel();
+    }
+
+    /**
+     * delay不大于0时不经过时间轮，直接投递到执行器上
+     */
+    void push(const boost::posix_time::time_duration &delay, T value) {
+        if (delay <= boost::posix_time::time_duration()) {
+            executor.post([this, value] {
+                T copy(value);
+                fire(copy);
+            });
+            return;
+        }
+        lock_guard<mutex> lock(mutex_);
+        int64_t at = (executor.now() + delay - origin).total_microseconds();
+        wheel.schedule((uint64_t) ((at + WHEEL_TICK_MICROSECONDS - 1) / WHEEL_TICK_MICROSECONDS), std::move(value));
+        if (!armed) {
+            arm();
+        }
+    }
+
+    size_t size() {
+        lock_guard<mutex> lock(mutex_);
+        return wheel.size();
+    }
+
+private:
+    /**
+     * 调用方持有锁
+     */
+    void arm() {
+        armed = true;
+        timer->expires_from_now(boost::posix_time::microseconds(WHEEL_TICK_MICROSECONDS));
+        timer->async_wait([this](const boost::system::error_code &error) {
+            if (error != boost::asio::error::operation_aborted) {
+                expire();
+            }
+        });
+    }
+
+    /**
+     * 同一时间只有一次定时器的等待，expire不会并发执行，batch只在这里访问
+     */
+    void expire() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            uint64_t tick = (uint64_t) ((executor.now() - origin).total_microseconds() / WHEEL_TICK_MICROSECONDS);
+            wheel.advance(tick, [this](T &value) {
+                batch.push_back(std::move(value));
+            });
+        }
+        for (T &value: batch) {
+            fire(value);
+        }
+        batch.clear();
+        lock_guard<mutex> lock(mutex_);
+        if (wheel.empty()) {
+            armed = false;
+        } else {
+            arm();
+        }
+    }
+
+    ad_hoc_executor &executor;
+    function<void(T &)> fire;
+    timer_ptr timer;
+    boost::posix_time::ptime origin; //第0个刻度的时间
+    ad_hoc_timing_wheel<T> wheel;
+    vector<T> batch; //本次到期的元素，复用以免每个刻度分配
+    mutex mutex_;
+    bool armed; //定时器是否在等待
+};
+
+#endif //ADHOC_SIMULATION_TIMING_WHEEL_H
@@ -0,0 +1,472 @@
+//
+// Created by 邹迪凯 on 2022/3/22.
+//
+
+#ifndef ADHOC_SIMULATION_TOPOLOGY_H
+#define ADHOC_SIMULATION_TOPOLOGY_H
+
+#include <cstdint>
+#include <vector>
+#include <set>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+
+#include "channel.h"
+
+using namespace std;
+
+//打印拓扑时，顶点数不超过此值则打印邻接矩阵，否则只打印每个顶点的邻居
+const int TOPOLOGY_MATRIX_PRINT_LIMIT = 32;
+//变化日志保留的纪元数，落后更多的订阅者需要重新加载整个拓扑
+const int TOPOLOGY_LOG_EPOCHS = 64;
+
+/**
+ * 一条链路的建立或断开
+ */
+struct ad_hoc_link_change {
+    int a;
+    int b;
+    bool up;
+};
+
+/**
+ * 拓扑变化的订阅者，参数为纪元和其中实际生效的链路变化
+ */
+typedef function<void(uint64_t, const vector<ad_hoc_link_change> &)> ad_hoc_topology_subscriber;
+
+/**
+ * 稀疏的网络拓扑图
+ *
+ * 拓扑图定义在顶点（下标从0开始的稠密编号）上，每个加入的节点占用一个顶点，并继承该顶点上已有的链路。
+ * 节点离开后顶点空出，之后加入的节点优先复用编号最小的空闲顶点；顶点不够时自动增加。
+ *
+ * 节点ID到顶点的映射是一个哈希表，链路同时保存在两个结构中：
+ *      每个顶点的邻居列表，遍历一个顶点的邻居为O(degree)
+ *      以两个顶点编号拼成的64位整数为键的哈希表，判断两个顶点是否相连为O(1)
+ * 每条链路有一个信道，所有信道连续存放在一个数组中，删除链路空出的位置由之后增加的链路复用。
+ * 哈希表的值和邻居列表旁的平行数组都是信道的下标，遍历邻居时顺序访问各链路的信道，不需要查哈希表。
+ * 顶点与自身总是相连的，不占用链路，也没有信道。
+ *
+ * 不用CSR或者按位压缩的邻接矩阵：CSR的邻居数组是一整块，增删一条链路要搬移之后所有顶点的邻居，
+ * 移动模型和轨迹回放每个纪元都增删链路；邻接矩阵占用O(N^2)位，5万个顶点就要约300MB，而平均邻居数只有个位数。
+ * 邻居列表加哈希表同样是O(1)判断相连、O(degree)遍历邻居，增删链路为O(degree)，内存与链路数成正比。
+ *
+ * 链路的增删以批为单位应用，每批是一个纪元（epoch）。每条链路记录建立时的纪元，
+ * 某个纪元经过一条链路发出的帧到达时，可以由此判断链路期间是否断开过。
+ */
+class ad_hoc_topology {
+public:
+    ad_hoc_topology() = default;
+
+    /**
+     * 节点加入，占用一个空闲顶点。已经加入的节点保持原来的顶点。
+     *
+     * @param id
+     * @return 节点占用的顶点
+     */
+    int join(int id) {
+        auto it = index_map.find(id);
+        if (it != index_map.end()) {
+            return it->second;
+        }
+        if (free_vertices.empty()) {
+            add_vertex();
+        }
+        int vertex = *free_vertices.begin();
+        free_vertices.erase(free_vertices.begin());
+        ids[vertex] = id;
+        index_map[id] = vertex;
+        return vertex;
+    }
+
+    /**
+     * 节点加入并占用指定的顶点，用于按另一份拓扑（例如scope）分配好的顶点重放加入，保证两份拓扑的映射一致
+     *
+     * 顶点不存在时自动增加。节点已经占用其他顶点时先空出原来的顶点，顶点上已有的其他节点被移出。
+     */
+    void join(int id, int vertex) {
+        auto it = index_map.find(id);
+        if (it != index_map.end()) {
+            if (it->second == vertex) {
+                return;
+            }
+            leave(id);
+        }
+        while (vertex >= size()) {
+            add_vertex();
+        }
+        if (ids[vertex] >= 0) {
+            index_map.erase(ids[vertex]);
+        }
+        free_vertices.erase(vertex);
+        ids[vertex] = id;
+        index_map[id] = vertex;
+    }
+
+    /**
+     * 节点离开，空出其占用的顶点，顶点上的链路保留给之后加入的节点
+     *
+     * @param id
+     */
+    void leave(int id) {
+        auto it = index_map.find(id);
+        if (it == index_map.end()) {
+            return;
+        }
+        ids[it->second] = -1;
+        free_vertices.insert(it->second);
+        index_map.erase(it);
+    }
+
+    /**
+     * 节点占用的顶点
+     *
+     * @param id
+     * @return 节点没有加入时返回-1
+     */
+    int vertex(int id) const {
+        auto it = index_map.find(id);
+        return it == index_map.end() ? -1 : it->second;
+    }
+
+    /**
+     * 占用顶点的节点ID
+     *
+     * @param vertex
+     * @return 顶点空闲或者不存在时返回-1
+     */
+    int id(int vertex) const {
+        return vertex >= 0 && vertex < (int) ids.size() ? ids[vertex] : -1;
+    }
+
+    /**
+     * 顶点数，包括空闲顶点
+     */
+    int size() const {
+        return (int) ids.size();
+    }
+
+    /**
+     * 链路数，不包括顶点与自身
+     */
+    size_t links() const {
+        return link_map.size();
+    }
+
+    /**
+     * 在两个顶点之间增加一条双向链路，顶点不存在时自动增加，新链路使用默认的信道参数
+     *
+     * @return 链路已经存在或者两个顶点相同时返回false
+     */
+    bool link(int a, int b) {
+        if (a == b || a < 0 || b < 0) {
+            return false;
+        }
+        while (max(a, b) >= size()) {
+            add_vertex();
+        }
+        auto inserted = link_map.emplace(link_key(a, b), 0);
+        if (!inserted.second) {
+            return false;
+        }
+        uint32_t edge = allocate_channel();
+        inserted.first->second = edge;
+        adjacency[a].push_back(b);
+        adjacency[b].push_back(a);
+        adjacency_channels[a].push_back(edge);
+        adjacency_channels[b].push_back(edge);
+        return true;
+    }
+
+    /**
+     * 删除两个顶点之间的链路
+     *
+     * @return 链路不存在时返回false
+     */
+    bool unlink(int a, int b) {
+        auto it = link_map.find(link_key(a, b));
+        if (it == link_map.end()) {
+            return false;
+        }
+        free_channels.push_back(it->second);
+        link_map.erase(it);
+        erase_neighbour(a, b);
+        erase_neighbour(b, a);
+        return true;
+    }
+
+    /**
+     * 把一批链路变化作为一个新的纪元应用到拓扑上，开销只与变化的链路数有关
+     *
+     * @param changes 按顺序应用，应用后只保留实际生效的变化：增加已有的链路、删除不存在的链路被去掉
+     * @return 新的纪元
+     */
+    uint64_t apply(vector<ad_hoc_link_change> &changes) {
+        epoch_++;
+        size_t kept = 0;
+        for (const ad_hoc_link_change &change: changes) {
+            if (change.up ? link(change.a, change.b) : unlink(change.a, change.b)) {
+                changes[kept++] = change;
+            }
+        }
+        changes.resize(kept);
+        return epoch_;
+    }
+
+    /**
+     * 当前纪元，每次apply加一
+     */
+    uint64_t epoch() const {
+        return epoch_;
+    }
+
+    /**
+     * 在纪元epoch经过链路a-b发出的帧，现在链路是否还在，期间断开后又建立的链路不算
+     */
+    bool intact(int a, int b, uint64_t epoch) const {
+        if (a == b) {
+            return a >= 0;
+        }
+        auto it = link_map.find(link_key(a, b));
+        return it != link_map.end() && link_epochs[it->second] <= epoch;
+    }
+
+    /**
+     * 两个顶点之间是否有链路
+     */
+    bool linked(int a, int b) const {
+        if (a < 0 || b < 0 || a >= size() || b >= size()) {
+            return false;
+        }
+        return a == b || link_map.find(link_key(a, b)) != link_map.end();
+    }
+
+    /**
+     * 两个节点之间是否有链路，任意一个节点没有加入时返回false
+     */
+    bool connected(int id_a, int id_b) const {
+        return linked(vertex(id_a), vertex(id_b));
+    }
+
+    /**
+     * 顶点的所有邻居，不包括顶点自身
+     */
+    const vector<int> &neighbours(int vertex) const {
+        return adjacency[vertex];
+    }
+
+    /**
+     * 顶点到各个邻居的链路的信道下标，与neighbours一一对应
+     */
+    const vector<uint32_t> &neighbour_channels(int vertex) const {
+        return adjacency_channels[vertex];
+    }
+
+    /**
+     * 按下标取链路的信道
+     */
+    ad_hoc_channel &channel(uint32_t index) {
+        return channels[index];
+    }
+
+    /**
+     * 两个顶点之间链路的信道
+     *
+     * @return 没有链路或者是同一个顶点时返回nullptr
+     */
+    ad_hoc_channel *channel(int a, int b) {
+        auto it = link_map.find(link_key(a, b));
+        return it == link_map.end() ? nullptr : &channels[it->second];
+    }
+
+    /**
+     * 设置两个顶点之间链路的信道参数
+     *
+     * @return 没有链路时返回false
+     */
+    bool configure(int a, int b, const ad_hoc_channel_params &params) {
+        ad_hoc_channel *c = channel(a, b);
+        if (c == nullptr) {
+            return false;
+        }
+        c->configure(params);
+        return true;
+    }
+
+    /**
+     * 设置所有已有链路和之后增加的链路的信道参数
+     */
+    void configure(const ad_hoc_channel_params &params) {
+        default_params = params;
+        for (const auto &entry: link_map) {
+            channels[entry.second].configure(params);
+        }
+    }
+
+    /**
+     * 帧从顶点from到to的延迟，顶点与自身之间没有信道，延迟为fallback
+     *
+     * @return 微秒，帧丢失时返回-1
+     */
+    int64_t transmit(int from, int to, size_t bytes, int64_t now, int64_t fallback, ad_hoc_random &random) {
+        ad_hoc_channel *c = from == to ? nullptr : channel(from, to);
+        return c == nullptr ? fallback : c->transmit(from < to, bytes, now, fallback, random);
+    }
+
+    /**
+     * 按邻接矩阵设置前n个顶点之间的链路，矩阵按行存放
+     */
+    void load(const int *matrix, int n) {
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                if (matrix[i * n + j] || matrix[j * n + i]) {
+                    link(i, j);
+                }
+            }
+        }
+    }
+
+    void print() const {
+        if (size() <= TOPOLOGY_MATRIX_PRINT_LIMIT) {
+            for (int i = 0; i < size(); i++) {
+                for (int j = 0; j < size(); j++) {
+                    cout << linked(i, j) << " ";
+                }
+                cout << endl;
+            }
+            return;
+        }
+        cout << size() << " vertices, " << links() << " links" << endl;
+        for (int i = 0; i < size(); i++) {
+            cout << i << "(" << ids[i] << "):";
+            for (int neighbour: adjacency[i]) {
+                cout << " " << neighbour;
+            }
+            cout << endl;
+        }
+    }
+
+private:
+    static uint64_t link_key(int a, int b) {
+        if (a > b) {
+            swap(a, b);
+        }
+        return (uint64_t) (uint32_t) a << 32 | (uint32_t) b;
+    }
+
+    /**
+     * 增加一个空闲顶点，由join按编号从小到大取用
+     */
+    void add_vertex() {
+        ids.push_back(-1);
+        adjacency.emplace_back();
+        adjacency_channels.emplace_back();
+        free_vertices.insert((int) ids.size() - 1);
+    }
+
+    /**
+     * 为新链路取一个信道，优先复用删除的链路空出的位置，信道的状态重新开始
+     */
+    uint32_t allocate_channel() {
+        if (!free_channels.empty()) {
+            uint32_t edge = free_channels.back();
+            free_channels.pop_back();
+            channels[edge] = ad_hoc_channel(default_params);
+            link_epochs[edge] = epoch_;
+            return edge;
+        }
+        channels.emplace_back(default_params);
+        link_epochs.push_back(epoch_);
+        return (uint32_t) channels.size() - 1;
+    }
+
+    void erase_neighbour(int vertex, int neighbour) {
+        vector<int> &neighbours = adjacency[vertex];
+        vector<uint32_t> &edges = adjacency_channels[vertex];
+        for (size_t i = 0; i < neighbours.size(); i++) {
+            if (neighbours[i] == neighbour) {
+                neighbours[i] = neighbours.back();
+                neighbours.pop_back();
+                edges[i] = edges.back();
+                edges.pop_back();
+                return;
+            }
+        }
+    }
+
+    unordered_map<int, int> index_map; //节点ID -> 顶点
+    vector<int> ids; //顶点 -> 节点ID，空闲顶点为-1
+    vector<vector<int>> adjacency; //每个顶点的邻居
+    vector<vector<uint32_t>> adjacency_channels; //每个顶点到各个邻居的链路的信道下标
+    unordered_map<uint64_t, uint32_t> link_map; //链路 -> 信道下标
+    vector<ad_hoc_channel> channels; //所有链路的信道
+    vector<uint64_t> link_epochs; //与channels一一对应，链路建立时的纪元
+    vector<uint32_t> free_channels; //删除的链路空出的信道下标
+    ad_hoc_channel_params default_params; //新链路的信道参数
+    uint64_t epoch_ = 0;
+    set<int> free_vertices; //空闲顶点，取编号最小的，指定顶点加入时可以从中删除
+};
+
+/**
+ * 拓扑的变化日志：最近TOPOLOGY_LOG_EPOCHS个纪元各自实际生效的链路变化
+ *
+ * 日志是按纪元取模的环，每个纪元的数组复用，稳定运行后追加不分配。
+ */
+class ad_hoc_topology_log {
+public:
+    ad_hoc_topology_log() : entries(TOPOLOGY_LOG_EPOCHS), latest_(0) {
+    }
+
+    void append(uint64_t epoch, const vector<ad_hoc_link_change> &changes) {
+        entry &e = entries[epoch % entries.size()];
+        e.epoch = epoch;
+        e.changes.assign(changes.begin(), changes.end());
+        latest_ = epoch;
+    }
+
+    /**
+     * 把纪元epoch之后（不含）直到最新纪元的所有变化按顺序追加到out
+     *
+     * @return 日志已经不包含这些纪元时返回false，调用方需要重新加载整个拓扑
+     */
+    bool since(uint64_t epoch, vector<ad_hoc_link_change> &out) const {
+        if (epoch >= latest_) {
+            return true;
+        }
+        if (latest_ - epoch > entries.size()) {
+            return false;
+        }
+        for (uint64_t e = epoch + 1; e <= latest_; e++) {
+            const entry &item = entries[e % entries.size()];
+            if (item.epoch != e) {
+                return false;
+            }
+            out.insert(out.end(), item.changes.begin(), item.changes.end());
+        }
+        return true;
+    }
+
+    /**
+     * 纪元epoch的变化，不在日志中时返回nullptr
+     */
+    const vector<ad_hoc_link_change> *at(uint64_t epoch) const {
+        const entry &item = entries[epoch % entries.size()];
+        return item.epoch == epoch ? &item.changes : nullptr;
+    }
+
+    uint64_t latest() const {
+        return latest_;
+    }
+
+private:
+    struct entry {
+        uint64_t epoch = 0;
+        vector<ad_hoc_link_change> changes;
+    };
+
+    vector<entry> entries;
+    uint64_t latest_;
+};
+
+#endif //ADHOC_SIMULATION_TOPOLOGY_H
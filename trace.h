@@ -0,0 +1,562 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+
+#ifndef ADHOC_SIMULATION_TRACE_H
+#define ADHOC_SIMULATION_TRACE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <istream>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "message.h"
+#include "executor.h"
+#include "topology.h"
+#include "geometry.h"
+
+using namespace std;
+
+// 链路轨迹文件
+//
+// 16字节的文件头之后是按时间排序的定长事件，所有整数都是小端序：
+//      文件头：'A' 'D' 'H' 'T' | 版本(4) | 每个事件的字节数(4) | 顶点数(4)
+//      事件：  时间，从轨迹开始的微秒数(8) | 类型(1) | 保留(3) | 顶点a(4) | 顶点b(4) | 取值(4)
+// 取值只对TRACE_LINK_DELAY有意义，是链路新的传播延迟（微秒）。
+// 顶点数是事件中最大的顶点编号加一，不超过TRACE_MAX_VERTICES；为0时没有记录，回放按TRACE_MAX_VERTICES检查。
+// 事件定长，回放时直接在内存映射上按下标解码，不需要在启动时解析整个文件。
+
+const char TRACE_MAGIC[4] = {'A', 'D', 'H', 'T'};
+const int TRACE_VERSION = 1;
+const int TRACE_HEADER_LENGTH = 16;
+const int TRACE_EVENT_LENGTH = 24;
+
+//轨迹中顶点编号的上限，拓扑按顶点编号增加顶点，一个写错的编号不能让回放分配几十亿个顶点
+const int TRACE_MAX_VERTICES = 1 << 20;
+
+//事件类型
+const int TRACE_LINK_UP = 1;
+const int TRACE_LINK_DOWN = 2;
+const int TRACE_LINK_DELAY = 3;
+
+//回放时一次最多应用的事件数，积压的事件分多次应用，每次之间让出执行器
+const size_t TRACE_BATCH_EVENTS = 65536;
+//回放经过这么多字节后把已经读过的页还给内核，驻留内存不随轨迹大小增长
+const size_t TRACE_RELEASE_BYTES = 16 << 20;
+//把ns-2移动轨迹转换为链路事件时的默认时间步长
+const int TRACE_NS2_STEP_MS = 100;
+
+struct ad_hoc_trace_event {
+    uint64_t time; //微秒
+    int type;
+    int a;
+    int b;
+    int value;
+};
+
+/**
+ * 顶点编号是否可以出现在轨迹中
+ */
+inline bool ad_hoc_trace_vertex(int vertex) {
+    return vertex >= 0 && vertex < TRACE_MAX_VERTICES;
+}
+
+/**
+ * 顺序写入轨迹文件
+ */
+class ad_hoc_trace_writer {
+public:
+    ad_hoc_trace_writer() : file(nullptr), count_(0), last(0), vertices(0) {
+    }
+
+    ~ad_hoc_trace_writer() {
+        close();
+    }
+
+    bool open(const string &path) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        char header[TRACE_HEADER_LENGTH] = {0};
+        memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        put_le32(header + 4, TRACE_VERSION);
+        put_le32(header + 8, TRACE_EVENT_LENGTH);
+        return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    }
+
+    /**
+     * 追加一个事件，时间不能早于上一个事件，顶点编号在[0, TRACE_MAX_VERTICES)内
+     */
+    bool write(const ad_hoc_trace_event &event) {
+        if (event.time < last || !ad_hoc_trace_vertex(event.a) || !ad_hoc_trace_vertex(event.b)) {
+            return false;
+        }
+        vertices = max(vertices, max(event.a, event.b) + 1);
+        char record[TRACE_EVENT_LENGTH] = {0};
+        put_le32(record, (int) (uint32_t) event.time);
+        put_le32(record + 4, (int) (uint32_t) (event.time >> 32));
+        record[8] = (char) event.type;
+        put_le32(record + 12, event.a);
+        put_le32(record + 16, event.b);
+        put_le32(record + 20, event.value);
+        last = event.time;
+        count_++;
+        return fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    }
+
+    /**
+     * 把一个纪元的链路变化写为同一时刻的事件
+     */
+    bool write(uint64_t time, const vector<ad_hoc_link_change> &changes) {
+        for (const ad_hoc_link_change &change: changes) {
+            if (!write(ad_hoc_trace_event{time, change.up ? TRACE_LINK_UP : TRACE_LINK_DOWN, change.a, change.b, 0})) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * 在文件头中补上顶点数后关闭
+     */
+    bool close() {
+        if (file == nullptr) {
+            return true;
+        }
+        char count[4];
+        put_le32(count, vertices);
+        bool ok = fseek(file, 12, SEEK_SET) == 0 && fwrite(count, 1, sizeof(count), file) == sizeof(count);
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    size_t count() const {
+        return count_;
+    }
+
+private:
+    FILE *file;
+    size_t count_;
+    uint64_t last;
+    int vertices; //最大的顶点编号加一
+};
+
+/**
+ * 以只读内存映射打开的轨迹文件
+ *
+ * 映射按顺序访问提示内核预读，读过的部分可以用release还给内核，多GB的轨迹回放时驻留内存保持不变。
+ */
+class ad_hoc_trace_file {
+public:
+    ad_hoc_trace_file() : fd(-1), data(nullptr), length(0), count(0), released(0), vertices_(0) {
+    }
+
+    ~ad_hoc_trace_file() {
+        close();
+    }
+
+    /**
+     * @return 文件不存在或者文件头不合法时返回false
+     */
+    bool open(const string &path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || st.st_size < TRACE_HEADER_LENGTH) {
+            close();
+            return false;
+        }
+        length = (size_t) st.st_size;
+        void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            data = nullptr;
+            close();
+            return false;
+        }
+        data = static_cast<const char *>(addr);
+        madvise(const_cast<char *>(data), length, MADV_SEQUENTIAL);
+        vertices_ = get_le32(data + 12);
+        if (memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || get_le32(data + 4) != TRACE_VERSION ||
+            get_le32(data + 8) != TRACE_EVENT_LENGTH || vertices_ < 0 || vertices_ > TRACE_MAX_VERTICES) {
+            close();
+            return false;
+        }
+        if (vertices_ == 0) {
+            vertices_ = TRACE_MAX_VERTICES;
+        }
+        //末尾不完整的事件忽略
+        count = (length - TRACE_HEADER_LENGTH) / TRACE_EVENT_LENGTH;
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) {
+            munmap(const_cast<char *>(data), length);
+            data = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    /**
+     * 事件数
+     */
+    size_t size() const {
+        return count;
+    }
+
+    /**
+     * 事件中的顶点编号应当小于这个值，文件头没有记录时为TRACE_MAX_VERTICES
+     */
+    int vertices() const {
+        return vertices_;
+    }
+
+    ad_hoc_trace_event at(size_t i) const {
+        const char *record = data + TRACE_HEADER_LENGTH + i * TRACE_EVENT_LENGTH;
+        ad_hoc_trace_event event{};
+        event.time = (uint64_t) (uint32_t) get_le32(record) | (uint64_t) (uint32_t) get_le32(record + 4) << 32;
+        event.type = (uint8_t) record[8];
+        event.a = get_le32(record + 12);
+        event.b = get_le32(record + 16);
+        event.value = get_le32(record + 20);
+        return event;
+    }
+
+    /**
+     * 第i个事件之前的内容不再读取，超过TRACE_RELEASE_BYTES后把整页还给内核
+     */
+    void release(size_t i) {
+        size_t offset = TRACE_HEADER_LENGTH + i * TRACE_EVENT_LENGTH;
+        if (offset - released < TRACE_RELEASE_BYTES) {
+            return;
+        }
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t end = offset / page * page;
+        madvise(const_cast<char *>(data) + released, end - released, MADV_DONTNEED);
+        released = end;
+    }
+
+private:
+    int fd;
+    const char *data;
+    size_t length;
+    size_t count;
+    size_t released; //已经还给内核的字节数，按页对齐
+    int vertices_;
+};
+
+/**
+ * 按时间回放轨迹文件
+ *
+ * 从start开始计时，定时器在下一个事件的时间到期，把时间已到的链路增删作为一个纪元交给apply，
+ * 延迟变化在遇到时先应用之前积压的增删再交给delay，保持文件中的顺序。执行器是虚拟时钟时按虚拟时间回放。
+ * 所有回调都在执行器上执行，每次最多处理TRACE_BATCH_EVENTS个事件，内存占用与轨迹大小无关。
+ */
+class ad_hoc_trace_replay {
+public:
+    typedef function<void(const vector<ad_hoc_link_change> &)> apply_handler;
+    typedef function<void(int, int, int)> delay_handler;
+
+    ad_hoc_trace_replay(ad_hoc_executor &executor, apply_handler apply, delay_handler delay) : executor(executor),
+                                                                                              apply(std::move(apply)),
+                                                                                              delay(std::move(delay)),
+                                                                                              timer(executor.create_timer()),
+                                                                                              next(0), skipped(0) {
+    }
+
+    ~ad_hoc_trace_replay() {
+        timer->cancel();
+    }
+
+    /**
+     * 打开轨迹文件并开始回放
+     *
+     * @return 文件不能打开或者不是轨迹文件时返回false
+     */
+    bool start(const string &path) {
+        if (!file.open(path)) {
+            return false;
+        }
+        origin = executor.now();
+        arm(0);
+        return true;
+    }
+
+    /**
+     * 已经回放的事件数
+     */
+    size_t replayed() const {
+        return next;
+    }
+
+    bool finished() const {
+        return next >= file.size();
+    }
+
+private:
+    void arm(int64_t after) {
+        timer->expires_from_now(boost::posix_time::microseconds(after));
+        timer->async_wait([this](const boost::system::error_code &error) {
+            if (error != boost::asio::error::operation_aborted) {
+                run();
+            }
+        });
+    }
+
+    void run() {
+        auto elapsed = (uint64_t) (executor.now() - origin).total_microseconds();
+        size_t limit = next + TRACE_BATCH_EVENTS;
+        changes.clear();
+        while (next < file.size() && next < limit) {
+            ad_hoc_trace_event event = file.at(next);
+            if (event.time > elapsed) {
+                break;
+            }
+            next++;
+            //顶点编号超出文件头记录的顶点数的事件跳过，不让拓扑按它增加顶点
+            if (event.a < 0 || event.b < 0 || event.a >= file.vertices() || event.b >= file.vertices()) {
+                skipped++;
+                continue;
+            }
+            if (event.type == TRACE_LINK_UP || event.type == TRACE_LINK_DOWN) {
+                changes.push_back(ad_hoc_link_change{event.a, event.b, event.type == TRACE_LINK_UP});
+            } else if (event.type == TRACE_LINK_DELAY) {
+                flush();
+                delay(event.a, event.b, event.value);
+            }
+        }
+        flush();
+        file.release(next);
+        if (finished()) {
+            cout << "trace replayed " << next << " events";
+            if (skipped > 0) {
+                cout << ", skipped " << skipped << " with vertices out of range";
+            }
+            cout << "." << endl;
+            return;
+        }
+        uint64_t at = file.at(next).time;
+        arm(at > elapsed ? (int64_t) (at - elapsed) : 0);
+    }
+
+    void flush() {
+        if (!changes.empty()) {
+            apply(changes);
+            changes.clear();
+        }
+    }
+
+    ad_hoc_executor &executor;
+    apply_handler apply;
+    delay_handler delay;
+    timer_ptr timer;
+    ad_hoc_trace_file file;
+    boost::posix_time::ptime origin; //轨迹时间0对应的时刻
+    size_t next; //下一个要回放的事件
+    size_t skipped; //顶点编号超出范围而跳过的事件数
+    vector<ad_hoc_link_change> changes; //积压的链路增删，复用
+};
+
+/**
+ * 把CSV格式的链路事件转换为轨迹文件，输入逐行读取，内存占用与输入大小无关
+ *
+ * 每行为 时间秒,up|down|delay,顶点a,顶点b[,延迟毫秒]，按时间排序。#开头的行和首字段不是数字的表头行跳过。
+ * 顶点编号在[0, TRACE_MAX_VERTICES)内。
+ *
+ * @return 格式错误、顶点编号超出范围或者时间倒退时在cerr上报告行号并返回false
+ */
+inline bool ad_hoc_convert_csv(istream &in, ad_hoc_trace_writer &writer) {
+    string line;
+    size_t number = 0;
+    while (getline(in, line)) {
+        number++;
+        if (line.empty() || line[0] == '#' || !(isdigit((unsigned char) line[0]) || line[0] == '.')) {
+            continue;
+        }
+        double seconds = 0, milliseconds = 0;
+        char kind[16] = {0};
+        int a = -1, b = -1; //sscanf没有匹配到的字段不写入
+        int fields = sscanf(line.c_str(), "%lf,%15[a-z],%d,%d,%lf", &seconds, kind, &a, &b, &milliseconds);
+        ad_hoc_trace_event event{(uint64_t) (seconds * 1e6), 0, a, b, 0};
+        if (fields >= 4 && !strcmp(kind, "up")) {
+            event.type = TRACE_LINK_UP;
+        } else if (fields >= 4 && !strcmp(kind, "down")) {
+            event.type = TRACE_LINK_DOWN;
+        } else if (fields == 5 && !strcmp(kind, "delay")) {
+            event.type = TRACE_LINK_DELAY;
+            event.value = (int) (milliseconds * 1000);
+        } else {
+            cerr << "line " << number << ": invalid event: " << line << endl;
+            return false;
+        }
+        if (!ad_hoc_trace_vertex(a) || !ad_hoc_trace_vertex(b)) {
+            cerr << "line " << number << ": vertex out of range [0, " << TRACE_MAX_VERTICES << "): " << line << endl;
+            return false;
+        }
+        if (!writer.write(event)) {
+            cerr << "line " << number << ": events must be sorted by time" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * ns-2 setdest命令的移动模型：顶点以给定的速度直线走向目的地，到达后停下
+ */
+class ad_hoc_setdest_mobility : public ad_hoc_mobility {
+public:
+    void setdest(int vertex, const ad_hoc_point &target, double speed) {
+        if (vertex >= (int) states.size()) {
+            states.resize(vertex + 1, state{ad_hoc_point{0, 0}, 0});
+        }
+        states[vertex] = state{target, speed};
+    }
+
+    /**
+     * 是否所有顶点都已经停下
+     */
+    bool idle() const {
+        for (const state &s: states) {
+            if (s.speed > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void step(vector<ad_hoc_point> &positions, double width, double height, double seconds,
+              ad_hoc_random &random) override {
+        for (size_t i = 0; i < states.size() && i < positions.size(); i++) {
+            state &s = states[i];
+            if (s.speed <= 0) {
+                continue;
+            }
+            ad_hoc_point &p = positions[i];
+            double dx = s.target.x - p.x, dy = s.target.y - p.y;
+            double distance = sqrt(dx * dx + dy * dy);
+            double travel = s.speed * seconds;
+            if (travel >= distance) {
+                p = s.target;
+                s.speed = 0;
+            } else {
+                p.x += dx / distance * travel;
+                p.y += dy / distance * travel;
+            }
+        }
+    }
+
+private:
+    struct state {
+        ad_hoc_point target;
+        double speed; //为0时已经停下
+    };
+
+    vector<state> states;
+};
+
+/**
+ * 把ns-2的移动轨迹（setdest生成的场景文件）转换为链路事件
+ *
+ * 识别两种命令，其他行忽略：
+ *      $node_(i) set X_ x / set Y_ y   顶点的初始位置
+ *      $ns_ at t "$node_(i) setdest x y speed"
+ * setdest生成的文件按节点而不是按时间排列，命令先读入再按时间排序；转换只在离线进行，回放时不需要。
+ * 以step秒为步长移动顶点，距离不超过range的顶点之间有链路，每一步变化的链路写为该时刻的事件。
+ * 最后一个命令之后继续移动到所有顶点停下。
+ *
+ * @return 节点编号超出[0, TRACE_MAX_VERTICES)或者写文件失败时返回false
+ */
+inline bool ad_hoc_convert_ns2(istream &in, ad_hoc_trace_writer &writer, double range,
+                               double step = TRACE_NS2_STEP_MS / 1000.0) {
+    struct setdest {
+        double time;
+        int vertex;
+        ad_hoc_point target;
+        double speed;
+    };
+    ad_hoc_geometry geometry(0, 0, range);
+    vector<setdest> commands;
+    string line;
+    while (getline(in, line)) {
+        int vertex;
+        char axis;
+        double v, time, x, y, speed;
+        if (sscanf(line.c_str(), " $node_(%d) set %c_ %lf", &vertex, &axis, &v) == 3) {
+            if (!ad_hoc_trace_vertex(vertex)) {
+                cerr << "node out of range [0, " << TRACE_MAX_VERTICES << "): " << line << endl;
+                return false;
+            }
+            ad_hoc_point p = vertex < geometry.size() ? geometry.position(vertex) : ad_hoc_point{0, 0};
+            if (axis == 'X') {
+                p.x = v;
+            } else if (axis == 'Y') {
+                p.y = v;
+            } else {
+                continue;
+            }
+            geometry.place(vertex, p);
+        } else if (sscanf(line.c_str(), " $ns_ at %lf \"$node_(%d) setdest %lf %lf %lf\"", &time, &vertex, &x, &y,
+                          &speed) == 5) {
+            if (!ad_hoc_trace_vertex(vertex)) {
+                cerr << "node out of range [0, " << TRACE_MAX_VERTICES << "): " << line << endl;
+                return false;
+            }
+            commands.push_back(setdest{time, vertex, ad_hoc_point{x, y}, speed});
+            if (vertex >= geometry.size()) {
+                geometry.place(vertex, ad_hoc_point{0, 0});
+            }
+        }
+    }
+    stable_sort(commands.begin(), commands.end(), [](const setdest &a, const setdest &b) {
+        return a.time < b.time;
+    });
+
+    ad_hoc_setdest_mobility mobility;
+    ad_hoc_topology topology;
+    ad_hoc_random random;
+    vector<ad_hoc_link_change> changes;
+    geometry.build(topology, random, changes);
+    topology.apply(changes);
+    if (!writer.write(0, changes)) {
+        return false;
+    }
+    double now = 0;
+    size_t i = 0;
+    while (i < commands.size() || !mobility.idle()) {
+        for (; i < commands.size() && commands[i].time <= now; i++) {
+            mobility.setdest(commands[i].vertex, commands[i].target, commands[i].speed);
+        }
+        //下一步不越过下一个命令的时间
+        double seconds = step;
+        if (i < commands.size() && commands[i].time - now < seconds) {
+            seconds = commands[i].time - now;
+        }
+        now += seconds;
+        changes.clear();
+        geometry.move(mobility, seconds, random, topology, changes);
+        topology.apply(changes);
+        if (!writer.write((uint64_t) (now * 1e6), changes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif //ADHOC_SIMULATION_TRACE_H
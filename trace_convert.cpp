@@ -0,0 +1,45 @@
+//
+// Created by 邹迪凯 on 2022/3/31.
+//
+// 把CSV格式的链路事件或ns-2的移动轨迹转换为server回放用的二进制轨迹文件（格式见trace.h）。
+//
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include "trace.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: trace_convert <input> <output> [--ns2] [--range <m>] [--step <ms>]\n";
+        return 1;
+    }
+    bool ns2 = false;               //输入是否是ns-2的移动轨迹，否则是CSV格式的链路事件
+    double range = GEOMETRY_RANGE;  //ns-2轨迹中节点的通信半径
+    double step = TRACE_NS2_STEP_MS; //ns-2轨迹的时间步长，毫秒
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--ns2")) {
+            ns2 = true;
+        } else if (!strcmp(argv[i], "--range") && i + 1 < argc) {
+            range = stod(argv[++i]);
+        } else if (!strcmp(argv[i], "--step") && i + 1 < argc) {
+            step = stod(argv[++i]);
+        }
+    }
+    ifstream in(argv[1]);
+    if (!in) {
+        std::cerr << "cannot open " << argv[1] << "\n";
+        return 1;
+    }
+    ad_hoc_trace_writer writer;
+    if (!writer.open(argv[2])) {
+        std::cerr << "cannot create " << argv[2] << "\n";
+        return 1;
+    }
+    bool ok = ns2 ? ad_hoc_convert_ns2(in, writer, range, step / 1000) : ad_hoc_convert_csv(in, writer);
+    if (!writer.close() || !ok) {
+        std::cerr << "conversion failed\n";
+        return 1;
+    }
+    cout << "wrote " << writer.count() << " events to " << argv[2] << endl;
+    return 0;
+}
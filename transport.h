@@ -0,0 +1,365 @@
+//
+// Created by 邹迪凯 on 2022/3/27.
+//
+
+#ifndef ADHOC_SIMULATION_TRANSPORT_H
+#define ADHOC_SIMULATION_TRANSPORT_H
+
+#include <string>
+#include <functional>
+#include <boost/bind/bind.hpp>
+#include <boost/asio.hpp>
+
+#include "message.h"
+#include "wire.h"
+#include "batch_writer.h"
+#include "frame_reader.h"
+#include "datagram.h"
+#include "local_socket.h"
+#include "shm.h"
+#include "uring.h"
+#include "message_handler.h"
+#include "utils.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+using namespace std;
+
+//client与server之间的传输方式
+const int TRANSPORT_TCP = 0;
+const int TRANSPORT_UDP = 1;
+const int TRANSPORT_UNIX = 2;
+const int TRANSPORT_SHM = 3;
+
+/**
+ * 解析命令行中的传输方式名称
+ *
+ * @return 不认识的名称返回-1
+ */
+inline int ad_hoc_parse_transport(const string &name) {
+    if (name == "tcp") {
+        return TRANSPORT_TCP;
+    } else if (name == "udp") {
+        return TRANSPORT_UDP;
+    } else if (name == "unix") {
+        return TRANSPORT_UNIX;
+    } else if (name == "shm") {
+        return TRANSPORT_SHM;
+    }
+    return -1;
+}
+
+/**
+ * client到server的传输
+ *
+ * 负责建立连接、收发帧，client只通过它发送消息和取得自己的ID。
+ * 连接建立后回调handler的handle_connected，收到的每个帧交给handler的handle_message(msg, false)。
+ * 除构造函数和start外，所有函数都在io_context的线程上调用。
+ */
+class ad_hoc_transport {
+public:
+    explicit ad_hoc_transport(ad_hoc_message_handler *handler) : handler_(handler) {}
+
+    virtual ~ad_hoc_transport() {}
+
+    /**
+     * 发起连接
+     */
+    virtual void start() = 0;
+
+    /**
+     * 发送一个帧
+     *
+     * @return 本次调用是否发起了新的一次写操作
+     */
+    virtual bool send(const ad_hoc_message &msg) = 0;
+
+    /**
+     * 与server之间是否启用了feature
+     */
+    virtual bool supports(int feature) const = 0;
+
+    /**
+     * 本节点的ID，TCP和UDP上即本端的端口
+     */
+    virtual int local_id() = 0;
+
+    virtual void close() = 0;
+
+protected:
+    ad_hoc_message_handler *handler_;
+};
+
+/**
+ * 以给定的handler创建client的传输
+ */
+typedef function<ad_hoc_transport *(ad_hoc_message_handler *)> ad_hoc_transport_factory;
+
+/**
+ * 字节流上的传输，Protocol是TCP或Unix域的流式协议，Stream是socket上的读写流
+ *
+ * 一次读操作读入所有已到达的数据，由frame reader解析出其中所有完整的帧；待发送的帧由batch writer成批用一次gather写发出。
+ * 连接建立后首先发送协商报文，其中带有本节点的ID。
+ * Stream为共享内存的流时，socket只用来发送协商报文，之后的数据都在共享内存的环上收发。
+ */
+template<typename Protocol, typename Stream = ad_hoc_basic_stream<typename Protocol::socket>>
+class ad_hoc_basic_stream_transport : public ad_hoc_transport {
+public:
+    /**
+     * @param endpoint server的地址
+     * @param io_context
+     * @param id 节点ID。TCP上大于0时绑定到本地的这个端口上，否则由系统分配端口，以端口作为ID；Unix域socket上必须大于0
+     * @param features 请求的线路特性
+     * @param handler
+     * @param options 协商报文中的其他选项，例如WIRE_OPTION_MULTIPLEX
+     */
+    ad_hoc_basic_stream_transport(const typename Protocol::endpoint &endpoint, boost::asio::io_context &io_context,
+                                  int id, int features, ad_hoc_message_handler *handler,
+                                  int options = 0) : ad_hoc_transport(handler),
+                                                                                          socket_(io_context),
+                                                                                          stream_(socket_),
+                                                                                          reader_(codec_),
+                                                                                          writer_(codec_),
+                                                                                          endpoint_(endpoint) {
+        id_ = ad_hoc_bind_node(socket_, id);
+        codec_.start_client(WIRE_MAX_VERSION, features, id_, options);
+    }
+
+    void start() override {
+        socket_.async_connect(endpoint_,
+                              boost::bind(&ad_hoc_basic_stream_transport::handle_connect, this,
+                                          boost::asio::placeholders::error));
+    }
+
+    bool send(const ad_hoc_message &msg) override {
+        if (writer_.push(msg)) {
+            write_batch();
+            return true;
+        }
+        return false;
+    }
+
+    bool supports(int feature) const override {
+        return codec_.supports(feature);
+    }
+
+    int local_id() override {
+        return id_;
+    }
+
+    void close() override {
+        stream_.close();
+    }
+
+private:
+    /**
+     * 与server发起连接成功后的回调函数
+     *
+     * 在建立连接成功后，发起异步读操作，等待数据到来，并发出协商报文。
+     */
+    void handle_connect(const boost::system::error_code &error) {
+        if (!error) {
+            cout << "connected to " << socket_.remote_endpoint() << endl;
+            cout << "local id is " << id_ << endl;
+            read_some();
+            if (writer_.resume()) {
+                write_batch();
+            }
+            handler_->handle_connected();
+        } else {
+            cerr << error << endl;
+        }
+    }
+
+    /**
+     * 发起异步读操作，读入socket接收缓冲区中所有已到达的数据
+     */
+    void read_some() {
+        stream_.async_read_some(reader_.prepare(),
+                                boost::bind(&ad_hoc_basic_stream_transport::handle_read, this,
+                                            boost::asio::placeholders::error,
+                                            boost::asio::placeholders::bytes_transferred));
+    }
+
+    /**
+        * 读数据的回调函数
+        * 同ad_hoc_session中的同名函数
+        *
+        * @param error
+        * @param bytes_transferred
+        */
+    void handle_read(const boost::system::error_code &error, size_t bytes_transferred) {
+        if (!error) {
+            reader_.commit(bytes_transferred);
+            ad_hoc_message msg;
+            while (reader_.next(msg)) {
+#if DEBUG
+                LOG_RECEIVED(msg);
+#endif
+                //将缓冲区的所有权交给上层处理
+                handler_->handle_message(msg, false);
+            }
+            if (!reader_.corrupt()) {
+                read_some();
+                //协商完成后发出协商期间积累的消息
+                if (writer_.resume()) {
+                    write_batch();
+                }
+                return;
+            }
+        }
+        close();
+    }
+
+    /**
+        * 发送消息的回调函数
+        * 同ad_hoc_session中的同名函数
+        *
+        * @param error
+        */
+    void handle_write(const boost::system::error_code &error) {
+        if (!error) {
+#if DEBUG
+            for (auto itr = writer_.batch_begin(); itr != writer_.batch_end(); itr++) {
+                LOG_SENDING(*itr);
+            }
+#endif
+            if (writer_.complete()) {
+                write_batch();
+            }
+        } else {
+            close();
+        }
+    }
+
+    /**
+     * 把队列中所有待发消息收集为一个buffer序列，用一次gather写发出
+     */
+    void write_batch() {
+        stream_.async_write(writer_.gather(),
+                            boost::bind(&ad_hoc_basic_stream_transport::handle_write,
+                                        this,
+                                        boost::asio::placeholders::error));
+    }
+
+    typename Protocol::socket socket_;
+    Stream stream_; //socket上的读写流，按编译选项运行在asio或io_uring上，或者是共享内存上的流
+    ad_hoc_wire_codec codec_;
+    ad_hoc_frame_reader reader_;
+    ad_hoc_batch_writer writer_;
+    typename Protocol::endpoint endpoint_;
+    int id_; //本节点的ID
+};
+
+typedef ad_hoc_basic_stream_transport<tcp> ad_hoc_stream_transport;
+typedef ad_hoc_basic_stream_transport<local_stream> ad_hoc_local_transport;
+typedef ad_hoc_basic_stream_transport<local_stream, ad_hoc_shm_stream> ad_hoc_shm_transport;
+
+/**
+ * UDP数据报上的传输
+ *
+ * 每个帧是一个数据报，由datagram channel成批收发，一个帧丢失不会阻塞之后的帧。没有连接，start时向server发送JOIN控制报文，
+ * close时发送LEAVE。只接收来自server地址的数据报。
+ */
+class ad_hoc_datagram_transport : public ad_hoc_transport, public ad_hoc_datagram_listener {
+public:
+    /**
+     * @param endpoint server的地址
+     * @param io_context
+     * @param id 大于0时绑定到本地的这个端口上，作为本节点的ID
+     * @param features 本端支持的特性，只有DATAGRAM_FEATURES中的生效，随JOIN告知server
+     * @param handler
+     */
+    ad_hoc_datagram_transport(const udp::endpoint &endpoint, boost::asio::io_context &io_context, int id,
+                              int features, ad_hoc_message_handler *handler) : ad_hoc_transport(handler),
+                                                                               io_context(io_context),
+                                                                               socket_(io_context),
+                                                                               channel_(socket_,
+                                                                                        io_context.get_executor(),
+                                                                                        this, features),
+                                                                               endpoint_(endpoint) {
+        socket_.open(udp::v4());
+        socket_.bind(udp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), id > 0 ? id : 0));
+        //数据报socket的本地地址在绑定后不再变化，只查询一次
+        id_ = socket_.local_endpoint().port();
+    }
+
+    void start() override {
+        boost::asio::post(io_context, [this] {
+            channel_.start();
+            channel_.send_control(DATAGRAM_JOIN, endpoint_);
+            cout << "datagram transport to " << endpoint_.address() << ":" << endpoint_.port() << endl;
+            cout << "local port is " << id_ << endl;
+            handler_->handle_connected();
+        });
+    }
+
+    bool send(const ad_hoc_message &msg) override {
+        return channel_.send(msg, endpoint_);
+    }
+
+    bool supports(int feature) const override {
+        return channel_.codec().supports(feature);
+    }
+
+    int local_id() override {
+        return id_;
+    }
+
+    void close() override {
+        //LEAVE直接发出，不经过即将被丢弃的发送队列
+        char leave[WIRE_PREAMBLE_LENGTH] = {'A', 'D', 'H', 'C', (char) WIRE_VERSION_2,
+                                            (char) channel_.codec().features(), (char) DATAGRAM_LEAVE, 0};
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(leave), endpoint_, 0, ec);
+        channel_.close();
+    }
+
+    void handle_datagram(ad_hoc_message &msg, const udp::endpoint &from) override {
+        if (from != endpoint_) {
+            return;
+        }
+#if DEBUG
+        LOG_RECEIVED(msg);
+#endif
+        handler_->handle_message(msg, false);
+    }
+
+    void handle_control(int op, int features, const udp::endpoint &from) override {
+    }
+
+private:
+    boost::asio::io_context &io_context;
+    udp::socket socket_;
+    ad_hoc_datagram_channel channel_;
+    udp::endpoint endpoint_;
+    int id_;
+};
+
+/**
+ * 按传输方式创建client到server的传输
+ *
+ * @param transport TRANSPORT_TCP、TRANSPORT_UDP、TRANSPORT_UNIX或TRANSPORT_SHM
+ * @param endpoint server的地址，UDP使用相同的地址和端口，Unix域socket和共享内存使用端口对应的路径
+ * @param features 请求的线路特性，UDP上只有DATAGRAM_FEATURES中的生效
+ * @param options 协商报文中的其他选项，只用于字节流上的传输
+ */
+inline ad_hoc_transport *ad_hoc_make_transport(int transport, const tcp::endpoint &endpoint,
+                                               boost::asio::io_context &io_context, int id, int features,
+                                               ad_hoc_message_handler *handler, int options = 0) {
+    if (transport == TRANSPORT_UDP) {
+        return new ad_hoc_datagram_transport(udp::endpoint(endpoint.address(), endpoint.port()), io_context, id,
+                                             features, handler);
+    }
+    if (transport == TRANSPORT_UNIX) {
+        return new ad_hoc_local_transport(local_stream::endpoint(ad_hoc_local_path(endpoint.port())), io_context, id,
+                                          features, handler, options);
+    }
+    if (transport == TRANSPORT_SHM) {
+        return new ad_hoc_shm_transport(local_stream::endpoint(ad_hoc_local_path(endpoint.port())), io_context, id,
+                                        features, handler, options);
+    }
+    return new ad_hoc_stream_transport(endpoint, io_context, id, features, handler, options);
+}
+
+#endif //ADHOC_SIMULATION_TRANSPORT_H
@@ -0,0 +1,998 @@
+//
+// Created by 邹迪凯 on 2022/3/26.
+//
+
+#ifndef ADHOC_SIMULATION_URING_H
+#define ADHOC_SIMULATION_URING_H
+
+#include <boost/asio.hpp>
+
+//session和client的读写循环运行在io_uring上，而不是epoll上。只在Linux上可用，默认关闭
+#ifndef IO_URING
+#define IO_URING false
+#endif
+
+using boost::asio::ip::tcp;
+using namespace std;
+
+/**
+ * 直接使用asio socket的读写流，默认的IO引擎
+ *
+ * 与ad_hoc_uring_stream接口相同，session和client只通过ad_hoc_stream读写，由编译选项决定使用哪一个。
+ * Socket可以是TCP或Unix域的流式socket。
+ */
+template<typename Socket>
+class ad_hoc_socket_stream {
+public:
+    explicit ad_hoc_socket_stream(Socket &socket) : socket_(socket) {}
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler handler) {
+        socket_.async_read_some(buffers, handler);
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler handler) {
+        boost::asio::async_write(socket_, buffers, handler);
+    }
+
+    void close() {
+        socket_.close();
+    }
+
+private:
+    Socket &socket_;
+};
+
+#if IO_URING
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "message_pool.h"
+
+//提交队列的深度，完成队列是它的URING_CQ_FACTOR倍
+const unsigned URING_QUEUE_DEPTH = 1024;
+const unsigned URING_CQ_FACTOR = 4;
+//提供给内核的接收缓冲区个数，必须是2的幂。缓冲区取自消息内存池的最大等级，所有连接共享
+const unsigned URING_BUFFER_COUNT = 512;
+const size_t URING_BUFFER_SIZE = POOL_MAX_BLOCK_SIZE;
+const unsigned URING_BUFFER_GROUP = 0;
+//一个连接上已收到但还没有被读走的缓冲区超过此数时暂停它的multishot接收，避免一个不读数据的连接占满缓冲区
+const size_t URING_STREAM_PENDING = 32;
+
+/**
+ * 对io_uring系统调用的最小封装，不依赖liburing
+ *
+ * 只负责映射提交队列和完成队列，提交队列的填写和完成队列的消费都由调用方加锁。
+ */
+class ad_hoc_uring {
+public:
+    ad_hoc_uring() = default;
+
+    ad_hoc_uring(const ad_hoc_uring &) = delete;
+
+    ad_hoc_uring &operator=(const ad_hoc_uring &) = delete;
+
+    ~ad_hoc_uring() {
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) {
+            munmap(cq_ptr_, cq_size_);
+        }
+        if (sq_ptr_ != nullptr) {
+            munmap(sq_ptr_, sq_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    /**
+     * @return 内核不支持io_uring或者被禁用时返回false
+     */
+    bool open(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        params.cq_entries = entries * URING_CQ_FACTOR;
+        fd_ = (int) syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0) {
+            return false;
+        }
+        features_ = params.features;
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (features_ & IORING_FEAT_SINGLE_MMAP) {
+            sq_size_ = cq_size_ = max(sq_size_, cq_size_);
+        }
+        sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED) {
+            sq_ptr_ = nullptr;
+            return false;
+        }
+        if (features_ & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr_ = sq_ptr_;
+        } else {
+            cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                           IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED) {
+                cq_ptr_ = nullptr;
+                return false;
+            }
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                          IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+        char *sq = static_cast<char *>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+        sq_flags_ = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        char *cq = static_cast<char *>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        local_tail_ = *sq_tail_;
+        return true;
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    /**
+     * 取一个空闲的提交项，提交队列满时返回nullptr
+     */
+    io_uring_sqe *get_sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (local_tail_ - head >= sq_entries_) {
+            return nullptr;
+        }
+        unsigned index = local_tail_ & sq_mask_;
+        io_uring_sqe *sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        local_tail_++;
+        return sqe;
+    }
+
+    /**
+     * 还没有交给内核的提交项个数
+     */
+    unsigned pending() const {
+        return local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * 把已填写的提交项交给内核；完成队列溢出时顺便让内核把积压的完成项搬回队列
+     *
+     * @return io_uring_enter的返回值，没有需要提交的内容时返回0且不进入内核
+     */
+    int submit() {
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        unsigned count = pending();
+        unsigned flags = 0;
+        if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+            flags |= IORING_ENTER_GETEVENTS;
+        }
+        if (count == 0 && flags == 0) {
+            return 0;
+        }
+        int ret;
+        do {
+            ret = (int) syscall(__NR_io_uring_enter, fd_, count, 0, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    int register_ring(unsigned opcode, void *arg, unsigned count) {
+        return (int) syscall(__NR_io_uring_register, fd_, opcode, arg, count);
+    }
+
+    /**
+     * 完成队列是否非空
+     */
+    bool ready() const {
+        return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) != *cq_head_;
+    }
+
+    /**
+     * 依次处理完成队列中的所有完成项
+     *
+     * @return 处理的个数
+     */
+    template<typename Function>
+    unsigned reap(Function function) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (unsigned i = head; i != tail; i++) {
+            function(cqes_[i & cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, tail, __ATOMIC_RELEASE);
+        return tail - head;
+    }
+
+private:
+    int fd_ = -1;
+    unsigned features_ = 0;
+    void *sq_ptr_ = nullptr;
+    void *cq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_flags_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned local_tail_ = 0; //已填写但还没有发布给内核的队尾
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+};
+
+/**
+ * 接收完成项的对象，user_data中的编号映射到它
+ */
+class ad_hoc_uring_target {
+public:
+    virtual ~ad_hoc_uring_target() {}
+
+    virtual void complete(unsigned kind, int result, unsigned flags) = 0;
+
+    /**
+     * io_context析构时调用，释放还在等待完成的回调
+     */
+    virtual void abandon() = 0;
+};
+
+/**
+ * 每个io_context一个io_uring实例，作为io_context的service存在
+ *
+ * 提交：各个连接填写提交项后不立即进入内核，而是向io_context投递一次flush，同一轮事件循环中的所有提交项用一次
+ *      io_uring_enter交给内核，多个连接的小帧读写合并为一次系统调用。
+ * 完成：io_uring的fd注册在io_context的epoll上，完成队列非空时fd可读，回调中一次取出所有完成项，
+ *      按user_data中的编号找到对应的连接，由连接把结果交给各自的回调（投递到回调关联的executor上，例如session的strand）。
+ * 接收缓冲区：从消息内存池中取URING_BUFFER_COUNT个最大等级的块，以provided buffer ring的形式注册给内核，
+ *      multishot接收由内核从中挑选缓冲区填入数据，一次提交持续产生完成项，连接读走数据后把缓冲区还给内核。
+ *      内核不支持buffer ring或multishot接收时，退化为每次读操作提交一次直接读入调用方缓冲区的recvmsg。
+ *
+ * user_data的低2位是操作类型，高位是连接的编号，已经关闭的连接的迟到完成项被忽略，其中的缓冲区直接还给内核。
+ */
+class ad_hoc_uring_service : public boost::asio::detail::execution_context_service_base<ad_hoc_uring_service> {
+public:
+    struct stats {
+        size_t enters; //io_uring_enter的次数
+        size_t completions; //处理的完成项个数
+    };
+
+    explicit ad_hoc_uring_service(boost::asio::execution_context &context)
+            : boost::asio::detail::execution_context_service_base<ad_hoc_uring_service>(context),
+              wakeup_(static_cast<boost::asio::io_context &>(context)), available_(false), multishot_(false), flush_scheduled_(false), shutdown_(false),
+              next_id_(1), enters_(0), completions_(0) {
+        if (!enabled() || !ring_.open(URING_QUEUE_DEPTH)) {
+            return;
+        }
+        int fd = dup(ring_.fd());
+        if (fd < 0) {
+            return;
+        }
+        wakeup_.assign(fd);
+        available_ = true;
+        multishot_ = setup_buffers();
+        arm_wakeup();
+    }
+
+    ~ad_hoc_uring_service() {
+        if (buffer_ring_ != nullptr) {
+            munmap(buffer_ring_, buffer_ring_size());
+        }
+        for (char *block: blocks_) {
+            ad_hoc_message_pool::deallocate(block, URING_BUFFER_SIZE);
+        }
+    }
+
+    /**
+     * io_context析构时调用，停止等待完成项，释放还在进行中的操作持有的回调
+     */
+    void shutdown() override {
+        unordered_map<uint64_t, shared_ptr<ad_hoc_uring_target>> targets;
+        {
+            lock_guard<mutex> lock(mutex_);
+            shutdown_ = true;
+            targets.swap(targets_);
+        }
+        boost::system::error_code ec;
+        wakeup_.close(ec);
+        for (auto &item: targets) {
+            item.second->abandon();
+        }
+    }
+
+    /**
+     * 是否使用io_uring，在创建io_context之前设置为false时全部连接使用asio的socket读写
+     */
+    static bool &enabled() {
+        static bool value = true;
+        return value;
+    }
+
+    bool available() const {
+        return available_;
+    }
+
+    bool multishot() const {
+        return multishot_.load(memory_order_relaxed);
+    }
+
+    /**
+     * 内核不支持multishot接收时，之后的读操作都使用一次性的recvmsg
+     */
+    void disable_multishot() {
+        multishot_.store(false, memory_order_relaxed);
+    }
+
+    stats statistics() const {
+        return stats{enters_.load(memory_order_relaxed), completions_.load(memory_order_relaxed)};
+    }
+
+    uint64_t attach(const shared_ptr<ad_hoc_uring_target> &target) {
+        lock_guard<mutex> lock(mutex_);
+        uint64_t id = next_id_++;
+        if (!shutdown_) {
+            targets_[id] = target;
+        }
+        return id;
+    }
+
+    void detach(uint64_t id) {
+        shared_ptr<ad_hoc_uring_target> target;
+        lock_guard<mutex> lock(mutex_);
+        auto it = targets_.find(id);
+        if (it != targets_.end()) {
+            //在锁外析构，析构时可能释放session
+            target.swap(it->second);
+            targets_.erase(it);
+        }
+    }
+
+    /**
+     * 填写一个提交项并安排flush
+     *
+     * @param prepare 填写提交项的函数，user_data由这里设置
+     * @return io_context已经停止时返回false
+     */
+    template<typename Prepare>
+    bool submit(uint64_t id, unsigned kind, Prepare prepare) {
+        lock_guard<mutex> lock(mutex_);
+        if (shutdown_) {
+            return false;
+        }
+        io_uring_sqe *sqe = ring_.get_sqe();
+        if (sqe == nullptr) {
+            //提交队列满时先把已填写的交给内核
+            flush_locked();
+            sqe = ring_.get_sqe();
+            if (sqe == nullptr) {
+                return false;
+            }
+        }
+        prepare(sqe);
+        sqe->user_data = id << 2 | kind;
+        schedule_flush();
+        return true;
+    }
+
+    /**
+     * 取消一个连接上某种类型的操作，被取消的操作以-ECANCELED完成
+     *
+     * 取消项和之前填写的所有提交项立即交给内核，不等投递的flush：连接取消操作之后紧接着关闭fd，
+     * 还没有提交的接收、发送项只记着fd的编号，编号被新accept的连接复用后会在无关的socket上执行。
+     * 提交时内核已经取得了fd对应的文件，之后关闭fd不影响这些操作。
+     */
+    void cancel(uint64_t id, unsigned kind) {
+        lock_guard<mutex> lock(mutex_);
+        if (shutdown_) {
+            return;
+        }
+        io_uring_sqe *sqe = ring_.get_sqe();
+        if (sqe == nullptr) {
+            flush_locked();
+            sqe = ring_.get_sqe();
+            if (sqe == nullptr) {
+                return;
+            }
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = id << 2 | kind;
+        sqe->user_data = 0;
+        flush_locked();
+    }
+
+    /**
+     * 接收缓冲区的地址
+     */
+    char *buffer(unsigned bid) const {
+        return blocks_[bid];
+    }
+
+    /**
+     * 把读完的接收缓冲区还给内核
+     */
+    void recycle(unsigned bid) {
+        lock_guard<mutex> lock(mutex_);
+        recycle_locked(bid);
+    }
+
+private:
+    static size_t buffer_ring_size() {
+        return URING_BUFFER_COUNT * sizeof(io_uring_buf);
+    }
+
+    /**
+     * 从内存池取出接收缓冲区，注册为provided buffer ring
+     *
+     * @return 内核不支持时返回false
+     */
+    bool setup_buffers() {
+        void *ring = mmap(nullptr, buffer_ring_size(), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) {
+            return false;
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t) ring;
+        reg.ring_entries = URING_BUFFER_COUNT;
+        reg.bgid = URING_BUFFER_GROUP;
+        if (ring_.register_ring(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            munmap(ring, buffer_ring_size());
+            return false;
+        }
+        buffer_ring_ = static_cast<io_uring_buf_ring *>(ring);
+        buffer_tail_ = 0;
+        for (unsigned bid = 0; bid < URING_BUFFER_COUNT; bid++) {
+            blocks_.push_back(static_cast<char *>(ad_hoc_message_pool::allocate(URING_BUFFER_SIZE)));
+            recycle_locked(bid);
+        }
+        return true;
+    }
+
+    void recycle_locked(unsigned bid) {
+        io_uring_buf &buf = buffer_ring_->bufs[buffer_tail_ & (URING_BUFFER_COUNT - 1)];
+        buf.addr = (uint64_t) blocks_[bid];
+        buf.len = URING_BUFFER_SIZE;
+        buf.bid = (uint16_t) bid;
+        buffer_tail_++;
+        __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    void schedule_flush() {
+        if (!flush_scheduled_.exchange(true)) {
+            boost::asio::post(wakeup_.get_executor(), [this] {
+                flush();
+            });
+        }
+    }
+
+    void flush() {
+        flush_scheduled_.store(false);
+        lock_guard<mutex> lock(mutex_);
+        if (!shutdown_) {
+            flush_locked();
+        }
+    }
+
+    void flush_locked() {
+        if (ring_.submit() > 0) {
+            enters_.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    /**
+     * 等待io_uring的fd可读。epoll上的注册是边沿触发的，重新等待之后再检查一次完成队列，
+     * 避免取完完成项和重新等待之间到达的完成项没有通知
+     */
+    void arm_wakeup() {
+        wakeup_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                           [this](const boost::system::error_code &error) {
+                               if (error) {
+                                   return;
+                               }
+                               reap();
+                               arm_wakeup();
+                               if (ring_.ready()) {
+                                   boost::asio::post(wakeup_.get_executor(), [this] {
+                                       reap();
+                                   });
+                               }
+                           });
+    }
+
+    /**
+     * 取出所有完成项，在锁外交给对应的连接，连接在处理中会再次提交
+     */
+    void reap() {
+        struct completion {
+            shared_ptr<ad_hoc_uring_target> target;
+            unsigned kind;
+            int result;
+            unsigned flags;
+        };
+        lock_guard<mutex> reaping(reap_mutex_);
+        vector<completion> completions;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (shutdown_) {
+                return;
+            }
+            ring_.reap([&](const io_uring_cqe &cqe) {
+                if (cqe.user_data == 0) {
+                    return;
+                }
+                auto it = targets_.find(cqe.user_data >> 2);
+                if (it != targets_.end()) {
+                    completions.push_back(completion{it->second, (unsigned) (cqe.user_data & 3), cqe.res,
+                                                     cqe.flags});
+                } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    recycle_locked(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            });
+            flush_locked();
+        }
+        completions_.fetch_add(completions.size(), memory_order_relaxed);
+        for (completion &c: completions) {
+            c.target->complete(c.kind, c.result, c.flags);
+        }
+    }
+
+    ad_hoc_uring ring_;
+    boost::asio::posix::stream_descriptor wakeup_; //io_uring的fd的副本，注册在io_context的epoll上
+    mutex mutex_; //保护提交队列、buffer ring和targets_
+    mutex reap_mutex_; //保证同一时刻只有一个线程消费完成队列，同一个连接的完成项按顺序处理
+    bool available_;
+    atomic<bool> multishot_;
+    atomic<bool> flush_scheduled_;
+    bool shutdown_;
+    unordered_map<uint64_t, shared_ptr<ad_hoc_uring_target>> targets_;
+    uint64_t next_id_;
+    io_uring_buf_ring *buffer_ring_ = nullptr;
+    uint16_t buffer_tail_ = 0;
+    vector<char *> blocks_; //下标即buffer id
+    atomic<size_t> enters_;
+    atomic<size_t> completions_;
+};
+
+/**
+ * 运行在io_uring上的读写流，接口与ad_hoc_socket_stream相同
+ *
+ * socket仍由asio创建、连接和关闭，这里只借用它的fd收发数据。async_read_some先交出multishot接收已经收到、还没有读走的数据，
+ * 一次可以拷贝多个缓冲区；没有数据时等待下一个完成项。async_write用sendmsg发出整个buffer序列，部分发送时继续发送剩余部分。
+ * 回调投递到回调关联的executor上，与asio的socket一致。
+ * 关闭或析构时取消进行中的操作，等内核交回所有完成项之后才释放内部状态。
+ * io_uring不可用时所有操作转交给asio的socket。
+ */
+template<typename Socket>
+class ad_hoc_uring_stream {
+public:
+    explicit ad_hoc_uring_stream(Socket &socket) : socket_(socket), service_(
+            boost::asio::use_service<ad_hoc_uring_service>(socket.get_executor().context())) {
+        if (service_.available()) {
+            state_ = make_shared<state>(service_, socket.get_executor());
+            state_->id = service_.attach(state_);
+        }
+    }
+
+    ad_hoc_uring_stream(const ad_hoc_uring_stream &) = delete;
+
+    ad_hoc_uring_stream &operator=(const ad_hoc_uring_stream &) = delete;
+
+    ~ad_hoc_uring_stream() {
+        if (state_) {
+            state_->close();
+        }
+    }
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence &buffers, ReadHandler handler) {
+        if (!state_) {
+            socket_.async_read_some(buffers, handler);
+            return;
+        }
+        boost::asio::any_io_executor executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+        state_->read(socket_.native_handle(), buffers, handler_type(handler), executor);
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    void async_write(const ConstBufferSequence &buffers, WriteHandler handler) {
+        if (!state_) {
+            boost::asio::async_write(socket_, buffers, handler);
+            return;
+        }
+        boost::asio::any_io_executor executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+        state_->write(socket_.native_handle(), buffers, handler_type(handler), executor);
+    }
+
+    void close() {
+        //取消时已经把这个fd上还没有提交的操作交给了内核，之后才能关闭fd
+        if (state_) {
+            state_->close();
+        }
+        socket_.close();
+    }
+
+private:
+    typedef function<void(const boost::system::error_code &, size_t)> handler_type;
+
+    enum {
+        RECV_MULTISHOT = 1,
+        RECV = 2,
+        SEND = 3
+    };
+
+    struct chunk {
+        unsigned bid;
+        size_t offset;
+        size_t length;
+    };
+
+    class state : public ad_hoc_uring_target, public enable_shared_from_this<state> {
+    public:
+        state(ad_hoc_uring_service &service, const boost::asio::any_io_executor &executor) : service(service),
+                                                                                       executor(executor) {
+            memset(&read_msg, 0, sizeof(read_msg));
+            memset(&write_msg, 0, sizeof(write_msg));
+        }
+
+        template<typename MutableBufferSequence>
+        void read(int fd, const MutableBufferSequence &buffers, handler_type handler,
+                  const boost::asio::any_io_executor &ex) {
+            lock_guard<mutex> lock(mutex_);
+            this->fd = fd;
+            read_iov.clear();
+            size_t total = 0;
+            for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                 it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                boost::asio::mutable_buffer buffer(*it);
+                if (buffer.size() > 0) {
+                    read_iov.push_back(iovec{buffer.data(), buffer.size()});
+                    total += buffer.size();
+                }
+            }
+            read_handler = std::move(handler);
+            read_executor = ex;
+            if (closed) {
+                finish_read(boost::asio::error::operation_aborted, 0);
+            } else if (total == 0) {
+                finish_read(boost::system::error_code(), 0);
+            } else if (!chunks.empty()) {
+                finish_read(boost::system::error_code(), copy_out());
+            } else if (read_error) {
+                finish_read(read_error, 0);
+            } else {
+                reading = true;
+                arm();
+            }
+        }
+
+        template<typename ConstBufferSequence>
+        void write(int fd, const ConstBufferSequence &buffers, handler_type handler,
+                   const boost::asio::any_io_executor &ex) {
+            lock_guard<mutex> lock(mutex_);
+            this->fd = fd;
+            write_iov.clear();
+            for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                 it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                boost::asio::const_buffer buffer(*it);
+                if (buffer.size() > 0) {
+                    write_iov.push_back(iovec{const_cast<void *>(buffer.data()), buffer.size()});
+                }
+            }
+            write_handler = std::move(handler);
+            write_executor = ex;
+            write_index = 0;
+            written = 0;
+            if (closed) {
+                finish_write(boost::asio::error::operation_aborted);
+            } else if (write_iov.empty()) {
+                finish_write(boost::system::error_code());
+            } else {
+                send();
+            }
+        }
+
+        void close() {
+            lock_guard<mutex> lock(mutex_);
+            if (closed) {
+                return;
+            }
+            closed = true;
+            for (chunk &c: chunks) {
+                service.recycle(c.bid);
+            }
+            chunks.clear();
+            if (multishot_armed) {
+                service.cancel(id, RECV_MULTISHOT);
+            }
+            if (recv_armed) {
+                service.cancel(id, RECV);
+            }
+            if (sending) {
+                service.cancel(id, SEND);
+            }
+            release();
+        }
+
+        void complete(unsigned kind, int result, unsigned flags) override {
+            lock_guard<mutex> lock(mutex_);
+            if (kind == SEND) {
+                complete_send(result);
+            } else {
+                complete_recv(kind, result, flags);
+            }
+            release();
+        }
+
+        void abandon() override {
+            handler_type read, write;
+            {
+                lock_guard<mutex> lock(mutex_);
+                closed = true;
+                read.swap(read_handler);
+                write.swap(write_handler);
+            }
+        }
+
+        ad_hoc_uring_service &service;
+        boost::asio::any_io_executor executor;
+        uint64_t id = 0;
+
+    private:
+        /**
+         * 有数据可读时发起接收：优先使用multishot，缓冲区耗尽或内核不支持时读入调用方的缓冲区
+         */
+        void arm() {
+            if (multishot_armed || recv_armed) {
+                return;
+            }
+            if (service.multishot() && !buffers_exhausted) {
+                int fd = this->fd;
+                multishot_armed = service.submit(id, RECV_MULTISHOT, [fd](io_uring_sqe *sqe) {
+                    sqe->opcode = IORING_OP_RECV;
+                    sqe->fd = fd;
+                    sqe->ioprio = IORING_RECV_MULTISHOT;
+                    sqe->flags = IOSQE_BUFFER_SELECT;
+                    sqe->buf_group = URING_BUFFER_GROUP;
+                });
+                if (multishot_armed) {
+                    return;
+                }
+            } else {
+                read_msg.msg_iov = read_iov.data();
+                read_msg.msg_iovlen = read_iov.size();
+                int fd = this->fd;
+                msghdr *msg = &read_msg;
+                recv_armed = service.submit(id, RECV, [fd, msg](io_uring_sqe *sqe) {
+                    sqe->opcode = IORING_OP_RECVMSG;
+                    sqe->fd = fd;
+                    sqe->addr = (uint64_t) msg;
+                    sqe->len = 1;
+                });
+                if (recv_armed) {
+                    return;
+                }
+            }
+            reading = false;
+            finish_read(boost::asio::error::operation_aborted, 0);
+        }
+
+        void send() {
+            write_msg.msg_iov = write_iov.data() + write_index;
+            write_msg.msg_iovlen = write_iov.size() - write_index;
+            int fd = this->fd;
+            msghdr *msg = &write_msg;
+            sending = service.submit(id, SEND, [fd, msg](io_uring_sqe *sqe) {
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t) msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+            });
+            if (!sending) {
+                finish_write(boost::asio::error::operation_aborted);
+            }
+        }
+
+        void complete_recv(unsigned kind, int result, unsigned flags) {
+            if (flags & IORING_CQE_F_BUFFER) {
+                unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (result > 0 && !closed) {
+                    chunks.push_back(chunk{bid, 0, (size_t) result});
+                } else {
+                    service.recycle(bid);
+                }
+            }
+            if (kind == RECV) {
+                recv_armed = false;
+            } else if (!(flags & IORING_CQE_F_MORE)) {
+                multishot_armed = false;
+            }
+            buffers_exhausted = result == -ENOBUFS;
+            if (kind == RECV_MULTISHOT && (result == -EINVAL || result == -EOPNOTSUPP)) {
+                service.disable_multishot();
+            } else if (result == 0) {
+                read_error = boost::asio::error::eof;
+            } else if (result < 0 && result != -ENOBUFS && !(kind == RECV_MULTISHOT && result == -ECANCELED)) {
+                read_error = result == -ECANCELED ? boost::system::error_code(boost::asio::error::operation_aborted)
+                                                  : boost::system::error_code(-result,
+                                                                              boost::system::system_category());
+            }
+            if (!reading) {
+                //暂时没有人读，接收的数据积压过多时暂停multishot，读走之后再重新发起
+                if (multishot_armed && chunks.size() >= URING_STREAM_PENDING) {
+                    service.cancel(id, RECV_MULTISHOT);
+                }
+                return;
+            }
+            if (kind == RECV && result > 0) {
+                reading = false;
+                finish_read(boost::system::error_code(), (size_t) result);
+            } else if (!chunks.empty()) {
+                reading = false;
+                finish_read(boost::system::error_code(), copy_out());
+            } else if (read_error || closed) {
+                reading = false;
+                finish_read(read_error ? read_error : boost::asio::error::operation_aborted, 0);
+            } else {
+                arm();
+            }
+        }
+
+        void complete_send(int result) {
+            sending = false;
+            if (result < 0) {
+                finish_write(result == -ECANCELED ? boost::system::error_code(boost::asio::error::operation_aborted)
+                                                  : boost::system::error_code(-result,
+                                                                              boost::system::system_category()));
+                return;
+            }
+            if (result == 0) {
+                finish_write(boost::asio::error::broken_pipe);
+                return;
+            }
+            written += result;
+            size_t left = result;
+            while (write_index < write_iov.size() && left >= write_iov[write_index].iov_len) {
+                left -= write_iov[write_index].iov_len;
+                write_index++;
+            }
+            if (write_index == write_iov.size()) {
+                finish_write(boost::system::error_code());
+                return;
+            }
+            //部分发送，从未发送的位置继续
+            iovec &first = write_iov[write_index];
+            first.iov_base = static_cast<char *>(first.iov_base) + left;
+            first.iov_len -= left;
+            if (closed) {
+                finish_write(boost::asio::error::operation_aborted);
+            } else {
+                send();
+            }
+        }
+
+        /**
+         * 把积压的接收数据尽量拷贝到调用方的缓冲区中，读完的缓冲区还给内核
+         */
+        size_t copy_out() {
+            size_t total = 0;
+            for (iovec &iov: read_iov) {
+                size_t filled = 0;
+                while (filled < iov.iov_len && !chunks.empty()) {
+                    chunk &c = chunks.front();
+                    size_t n = min(iov.iov_len - filled, c.length - c.offset);
+                    memcpy(static_cast<char *>(iov.iov_base) + filled, service.buffer(c.bid) + c.offset, n);
+                    filled += n;
+                    c.offset += n;
+                    if (c.offset == c.length) {
+                        service.recycle(c.bid);
+                        chunks.pop_front();
+                    }
+                }
+                total += filled;
+            }
+            return total;
+        }
+
+        void finish_read(const boost::system::error_code &error, size_t bytes) {
+            handler_type handler;
+            handler.swap(read_handler);
+            boost::asio::post(read_executor, [handler, error, bytes] {
+                handler(error, bytes);
+            });
+        }
+
+        void finish_write(const boost::system::error_code &error) {
+            handler_type handler;
+            handler.swap(write_handler);
+            size_t bytes = written;
+            boost::asio::post(write_executor, [handler, error, bytes] {
+                handler(error, bytes);
+            });
+        }
+
+        /**
+         * 关闭之后所有操作都已经完成时从service中注销
+         */
+        void release() {
+            if (closed && !multishot_armed && !recv_armed && !sending) {
+                service.detach(id);
+            }
+        }
+
+        mutex mutex_;
+        int fd = -1;
+        bool closed = false;
+        //读
+        handler_type read_handler;
+        boost::asio::any_io_executor read_executor;
+        vector<iovec> read_iov;
+        msghdr read_msg;
+        bool reading = false; //有等待数据的读操作
+        bool multishot_armed = false;
+        bool recv_armed = false;
+        bool buffers_exhausted = false;
+        deque<chunk> chunks; //multishot接收到、还没有读走的数据
+        boost::system::error_code read_error; //读走积压的数据之后再交给调用方
+        //写
+        handler_type write_handler;
+        boost::asio::any_io_executor write_executor;
+        vector<iovec> write_iov;
+        msghdr write_msg;
+        size_t write_index = 0;
+        size_t written = 0;
+        bool sending = false;
+    };
+
+    Socket &socket_;
+    ad_hoc_uring_service &service_;
+    shared_ptr<state> state_;
+};
+
+template<typename Socket>
+using ad_hoc_basic_stream = ad_hoc_uring_stream<Socket>;
+
+#else
+
+template<typename Socket>
+using ad_hoc_basic_stream = ad_hoc_socket_stream<Socket>;
+
+#endif
+
+typedef ad_hoc_basic_stream<tcp::socket> ad_hoc_stream;
+
+#endif //ADHOC_SIMULATION_URING_H
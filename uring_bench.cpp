@@ -0,0 +1,218 @@
+//
+// Created by 邹迪凯 on 2022/3/26.
+//
+// 比较epoll（asio默认的reactor）和io_uring两种IO引擎下server转发小帧的开销。
+// 两种引擎使用相同的拓扑（DEFAULT_UDG的8个节点）和相同的流量：fork出的子进程建立8个连接，每个节点连续广播M个
+// 携带24字节载荷的AODV帧（与RREQ的大小相当），server把每个帧转发给发送方的所有一跳邻居。
+// 子进程用非阻塞socket和poll收发，收齐所有转发的字节后报告耗时；父进程只运行server，统计这一段时间内server的CPU时间，
+// io_uring引擎下还统计io_uring_enter的次数。
+//
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "server.h"
+#include "thread_pool.h"
+#include "uring.h"
+
+using namespace std;
+
+const int BENCH_PORT_BASE = 9800;
+const int BENCH_TIMEOUT = 60;
+const int BENCH_BODY_LENGTH = 24;
+const int BENCH_FRAME_LENGTH = ADHOCMESSAGE_HEADER_LENGTH + BENCH_BODY_LENGTH;
+
+struct bench_config {
+    const char *name;
+    bool uring;
+};
+
+/**
+ * v1格式的帧，老版本的client不发送协商报文，server按v1收发
+ */
+void put_frame(char *out, int sendid) {
+    memset(out, 0, BENCH_FRAME_LENGTH);
+    put_le32(out, sendid);
+    put_le32(out + 4, AODV_BROADCAST_ADDRESS);
+    put_le32(out + 8, sendid);
+    put_le32(out + 12, AODV_BROADCAST_ADDRESS);
+    put_le32(out + 16, BENCH_BODY_LENGTH);
+    put_le32(out + 20, AODV_MESSAGE);
+}
+
+/**
+ * 子进程：建立所有连接后等待开始信号，然后发出全部帧，收齐expected字节后把耗时写入result_fd
+ */
+void run_clients(int port, int frames, size_t expected, int go_fd, int result_fd) {
+    vector<int> fds;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < UDG_MIN_VERTICES; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        while (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        fds.push_back(fd);
+    }
+    char byte;
+    if (read(go_fd, &byte, 1) != 1) {
+        _exit(1);
+    }
+
+    vector<string> outgoing(fds.size());
+    vector<size_t> sent(fds.size(), 0);
+    for (size_t i = 0; i < fds.size(); i++) {
+        sockaddr_in local{};
+        socklen_t length = sizeof(local);
+        getsockname(fds[i], (sockaddr *) &local, &length);
+        outgoing[i].resize((size_t) frames * BENCH_FRAME_LENGTH);
+        for (int k = 0; k < frames; k++) {
+            put_frame(&outgoing[i][k * BENCH_FRAME_LENGTH], ntohs(local.sin_port));
+        }
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    auto start = chrono::steady_clock::now();
+    size_t received = 0;
+    vector<char> buffer(64 * 1024);
+    vector<pollfd> polls(fds.size());
+    while (received < expected && chrono::steady_clock::now() - start < chrono::seconds(BENCH_TIMEOUT)) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            polls[i] = pollfd{fds[i], (short) (POLLIN | (sent[i] < outgoing[i].size() ? POLLOUT : 0)), 0};
+        }
+        if (poll(polls.data(), polls.size(), 100) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (polls[i].revents & POLLOUT) {
+                ssize_t n = send(fds[i], outgoing[i].data() + sent[i], outgoing[i].size() - sent[i], MSG_NOSIGNAL);
+                if (n > 0) {
+                    sent[i] += n;
+                }
+            }
+            if (polls[i].revents & POLLIN) {
+                ssize_t n;
+                while ((n = recv(fds[i], buffer.data(), buffer.size(), 0)) > 0) {
+                    received += n;
+                }
+            }
+        }
+    }
+    double seconds = received < expected ? -1 : chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (write(result_fd, &seconds, sizeof(seconds)) != sizeof(seconds)) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct bench_result {
+    double seconds;
+    double cpu;
+    size_t enters;
+};
+
+bench_result run_round(const bench_config &config, int port, int frames, size_t expected) {
+    bench_result result{-1, 0, 0};
+    int go[2], done[2];
+    if (pipe(go) != 0 || pipe(done) != 0) {
+        return result;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(go[1]);
+        close(done[0]);
+        run_clients(port, frames, expected, go[0], done[1]);
+    }
+    close(go[0]);
+    close(done[1]);
+
+    ofstream null("/dev/null");
+    streambuf *out = cout.rdbuf(null.rdbuf());
+    {
+        //io_uring的service在第一个session创建时按这个开关初始化
+        ad_hoc_uring_service::enabled() = config.uring;
+        boost::asio::io_context io_context(1);
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+        unique_ptr<ad_hoc_server> server(new ad_hoc_server(endpoint, io_context, false));
+        //测量的是转发本身的开销，不施加链路延迟
+        server->link_delay(boost::posix_time::time_duration(), boost::posix_time::time_duration());
+        ad_hoc_io_thread_pool pool(io_context, 1);
+        pool.start();
+
+        auto start = chrono::steady_clock::now();
+        while (server->connections() < (size_t) UDG_MIN_VERTICES &&
+               chrono::steady_clock::now() - start < chrono::seconds(BENCH_TIMEOUT)) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        auto &service = boost::asio::use_service<ad_hoc_uring_service>(io_context);
+        size_t enters = service.statistics().enters;
+        double cpu = cpu_seconds();
+        if (write(go[1], "g", 1) == 1 && read(done[0], &result.seconds, sizeof(result.seconds)) ==
+                                         sizeof(result.seconds)) {
+            result.cpu = cpu_seconds() - cpu;
+            result.enters = service.statistics().enters - enters;
+        }
+        waitpid(pid, nullptr, 0);
+        io_context.stop();
+        pool.join();
+        server.reset();
+    }
+    cout.rdbuf(out);
+    close(go[1]);
+    close(done[0]);
+    return result;
+}
+
+int main() {
+    ad_hoc_topology topology;
+    topology.load(&DEFAULT_UDG[0][0], UDG_MIN_VERTICES);
+    //每个帧转发给发送方的所有邻居，邻居数之和是链路数的两倍
+    size_t fanout = 2 * topology.links();
+
+    vector<bench_config> configs = {
+            {"epoll",    false},
+            {"io_uring", true},
+    };
+    vector<int> sizes = {1000, 10000, 50000};
+    cout << "topology: " << UDG_MIN_VERTICES << " nodes, " << topology.links() << " links, frame " << BENCH_FRAME_LENGTH
+         << " bytes" << endl;
+    cout << setw(10) << left << "engine" << right << setw(12) << "frames/node" << setw(12) << "delivered"
+         << setw(10) << "seconds" << setw(14) << "frames/s" << setw(14) << "cpu us/frame" << setw(16)
+         << "enters/frame" << endl;
+    int port = BENCH_PORT_BASE;
+    for (int frames: sizes) {
+        for (const bench_config &config: configs) {
+            size_t delivered = (size_t) frames * fanout;
+            bench_result result = run_round(config, port++, frames, delivered * BENCH_FRAME_LENGTH);
+            cout << setw(10) << left << config.name << right << setw(12) << frames << setw(12) << delivered;
+            if (result.seconds < 0) {
+                cout << setw(10) << "timeout" << endl;
+                continue;
+            }
+            cout << setw(10) << fixed << setprecision(3) << result.seconds << setw(14) << setprecision(0)
+                 << delivered / result.seconds << setw(14) << setprecision(2) << result.cpu * 1e6 / delivered;
+            if (config.uring) {
+                cout << setw(16) << setprecision(4) << (double) result.enters / delivered;
+            } else {
+                cout << setw(16) << "-";
+            }
+            cout << endl;
+        }
+    }
+    return 0;
+}
@@ -21,7 +21,7 @@ void print_time() {
     cout << loc_date << endl;
 }
 
-void print(const char *op, ad_hoc_message &msg) {
+void print(const char *op, const ad_hoc_message &msg) {
 #if DEBUG
     if (msg.msg_type() == AODV_MESSAGE && *(int *) (msg.body()) == AODV_HELLO) {
         //忽略hello
@@ -33,7 +33,11 @@ void print(const char *op, ad_hoc_message &msg) {
         cout << "[message] src: " << msg.sourceid() << ", dst: " << msg.destid() << ", sender: " << msg.sendid()
              << ", receiver: " << msg.receiveid() << ", type: " << msg.msg_type() << endl;
         cout << "[user_message] ";
-        cout.write(msg.body(), msg.body_length());
+        if (msg.compressed()) {
+            cout << "(compressed, " << msg.body_length() << " bytes)";
+        } else {
+            cout.write(msg.body(), msg.body_length());
+        }
         cout << endl;
         cout << endl;
     } else if (msg.msg_type() == AODV_MESSAGE) {
@@ -41,13 +45,17 @@ void print(const char *op, ad_hoc_message &msg) {
              << ", receiver: " << msg.receiveid() << ", type: " << msg.msg_type() << endl;
         print_aodv(msg.body());
         cout << endl;
+    } else if (msg.msg_type() == FRAGMENT_MESSAGE) {
+        cout << "[fragment] src: " << msg.sourceid() << ", dst: " << msg.destid() << ", sender: " << msg.sendid()
+             << ", receiver: " << msg.receiveid() << ", length: " << msg.body_length() << endl;
+        cout << endl;
     } else {
         cout << "[wormhole] sender: " << msg.sendid()
              << ", receiver: " << msg.receiveid() << ", type: " << msg.msg_type() << endl;
         ad_hoc_message body_msg;
-        memcpy(body_msg.data(), msg.body(), msg.body_length());
-        body_msg.decode_header();
-        print(op, body_msg);
+        if (msg.inner_frame(body_msg)) {
+            print(op, body_msg);
+        }
     }
 #else
     print_time();
@@ -56,22 +64,40 @@ void print(const char *op, ad_hoc_message &msg) {
         cout << "[message] src: " << msg.sourceid() << ", dst: " << msg.destid() << ", sender: " << msg.sendid()
              << ", receiver: " << msg.receiveid() << ", type: " << msg.msg_type() << endl;
         cout << "[user_message] ";
-        cout.write(msg.body(), msg.body_length());
+        if (msg.compressed()) {
+            cout << "(compressed, " << msg.body_length() << " bytes)";
+        } else {
+            cout.write(msg.body(), msg.body_length());
+        }
         cout << endl;
         cout << endl;
     }
 #endif
 }
 
-void LOG_HANDLE(ad_hoc_message &msg) {
+/**
+ * 输出一个重组完成的载荷，载荷可能很大，只输出长度和开头的一部分
+ */
+void LOG_PAYLOAD(const ad_hoc_message &msg) {
+    print_time();
+    cout << "payload" << endl;
+    cout << "[message] src: " << msg.sourceid() << ", dst: " << msg.destid() << ", length: " << msg.body_length()
+         << endl;
+    cout << "[user_message] ";
+    cout.write(msg.body(), msg.body_length() < 64 ? msg.body_length() : 64);
+    cout << endl;
+    cout << endl;
+}
+
+void LOG_HANDLE(const ad_hoc_message &msg) {
     print("handle", msg);
 }
 
-void LOG_RECEIVED(ad_hoc_message &msg) {
+void LOG_RECEIVED(const ad_hoc_message &msg) {
     print("received", msg);
 }
 
-void LOG_SENDING(ad_hoc_message &msg) {
+void LOG_SENDING(const ad_hoc_message &msg) {
     print("sending", msg);
 }
 
@@ -0,0 +1,388 @@
+//
+// Created by 邹迪凯 on 2022/3/14.
+//
+
+#ifndef ADHOC_SIMULATION_WIRE_H
+#define ADHOC_SIMULATION_WIRE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "message.h"
+
+// v1：6个int组成的24字节定长首部 sendid -> receiveid -> sourceid -> destid -> body_length -> type，小端序
+// v2：变长首部
+//      1字节：低4位为type，高4位为flags（与消息标志相同，目前只有MESSAGE_FLAG_COMPRESSED）
+//      varint：sendid、receiveid、sourceid、destid（zigzag编码，id可以为负数）
+//      varint：body_length
+//
+// 连接建立后由client发送8字节的协商报文：'A' 'D' 'H' 'C' version features 0 0，
+// server回复相同格式的报文，其中version为双方都支持的最高版本，features为双方都支持的特性。
+// 老版本的client不发送协商报文，server根据第一个帧的前4个字节不是魔数来识别，此后按v1收发。
+// client的协商报文中第7个字节是选项：带有WIRE_OPTION_NODE_ID时协商报文之后紧跟4字节小端序的节点ID，
+// server以它作为节点的身份（Unix域socket没有端口，只能这样识别节点），没有这个选项时以对端的端口作为身份。
+// 带有WIRE_OPTION_SHARED_MEMORY时，此后的数据经共享内存中的环收发（见shm.h）。
+// 带有WIRE_OPTION_MULTIPLEX时，连接本身不是节点，连接上的节点由之后的REGISTER_MESSAGE帧声明（见mux.h）。
+// 带有标志的帧只在协商了对应特性的连接上收发，v1首部中的标志位于type字段的高16位。
+// 协商了CRC32C特性的连接上，每个帧之后紧跟4字节小端序的CRC32C，覆盖线路上的首部和载荷。
+const int WIRE_VERSION_1 = 1;
+const int WIRE_VERSION_2 = 2;
+//本程序支持的最高版本，也是client默认请求的版本
+const int WIRE_MAX_VERSION = WIRE_VERSION_2;
+
+const int WIRE_PREAMBLE_LENGTH = 8;
+const char WIRE_PREAMBLE_MAGIC[4] = {'A', 'D', 'H', 'C'};
+//选项：协商报文之后带有节点ID
+const int WIRE_OPTION_NODE_ID = 0x01;
+//选项：协商报文随SCM_RIGHTS附带共享内存的fd，只用于Unix域socket
+const int WIRE_OPTION_SHARED_MEMORY = 0x02;
+//选项：连接上承载多个节点，节点ID由REGISTER_MESSAGE帧声明
+const int WIRE_OPTION_MULTIPLEX = 0x04;
+const int WIRE_NODE_ID_LENGTH = 4;
+//client协商报文的最大长度
+const int WIRE_MAX_PREAMBLE_LENGTH = WIRE_PREAMBLE_LENGTH + WIRE_NODE_ID_LENGTH;
+//v2首部的最大长度：1字节type/flags + 5个最长5字节的varint
+const int WIRE_MAX_HEADER_LENGTH = 1 + 5 * 5;
+//v2首部中type所能表示的最大值
+const int WIRE_MAX_TYPE = 0x0F;
+
+//特性：帧的载荷可以经过压缩（MESSAGE_FLAG_COMPRESSED）
+const int WIRE_FEATURE_COMPRESSION = 0x01;
+//特性：每个帧带有CRC32C校验尾部，校验失败时接收端重新同步到下一个合法的帧
+const int WIRE_FEATURE_CRC32C = 0x02;
+const int WIRE_CRC_LENGTH = 4;
+
+inline uint32_t wire_zigzag(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+inline int32_t wire_unzigzag(uint32_t value) {
+    return (int32_t) ((value >> 1) ^ (~(value & 1) + 1));
+}
+
+inline char *wire_put_varint(char *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char) value;
+    return out;
+}
+
+/**
+ * 解码一个varint
+ *
+ * @return 读取的字节数，数据不足时返回0，超过5个字节时返回-1
+ */
+inline int wire_get_varint(const char *in, size_t avail, uint32_t &value) {
+    value = 0;
+    for (int i = 0; i < 5; i++) {
+        if ((size_t) i >= avail) {
+            return 0;
+        }
+        auto byte = (uint8_t) in[i];
+        value |= (uint32_t) (byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * client协商报文的总长度，由前8个字节中的选项决定
+ *
+ * @param in 已经收到的数据
+ * @param avail 数据长度，不足WIRE_PREAMBLE_LENGTH时返回WIRE_PREAMBLE_LENGTH
+ */
+inline size_t wire_client_preamble_length(const char *in, size_t avail) {
+    if (avail < (size_t) WIRE_PREAMBLE_LENGTH || !(in[6] & WIRE_OPTION_NODE_ID)) {
+        return WIRE_PREAMBLE_LENGTH;
+    }
+    return WIRE_MAX_PREAMBLE_LENGTH;
+}
+
+/**
+ * 每个连接的编解码器，记录协商的状态和结果
+ *
+ * 同一个连接上的ad_hoc_frame_reader和ad_hoc_batch_writer共享一个codec：
+ * reader在收到对端的协商报文（或识别出对端是v1）后完成协商，writer在协商完成之前只发送协商报文，消息留在队列中。
+ */
+class ad_hoc_wire_codec {
+public:
+    ad_hoc_wire_codec() : version_(WIRE_VERSION_1), features_(0), negotiated_(true), server_(false),
+                          preamble_pending_(false), preamble_length_(0), peer_id_(0),
+                          peer_options_(0) {
+    }
+
+    /**
+     * 作为client发起协商
+     *
+     * @param version 请求的最高版本，为v1时不发送协商报文，直接按v1收发，以便连接老版本的server
+     * @param features 本端支持的特性
+     * @param node_id 大于0时随协商报文告知server本节点的ID，v1下无法告知
+     * @param options 协商报文中的其他选项，例如WIRE_OPTION_MULTIPLEX
+     */
+    void start_client(int version, int features = 0, int node_id = 0, int options = 0) {
+        server_ = false;
+        features_ = features;
+        if (version <= WIRE_VERSION_1) {
+            version_ = WIRE_VERSION_1;
+            negotiated_ = true;
+            return;
+        }
+        version_ = version;
+        negotiated_ = false;
+        encode_preamble(version_, features_);
+        if (node_id > 0) {
+            preamble_[6] = (char) WIRE_OPTION_NODE_ID;
+            put_le32(preamble_ + WIRE_PREAMBLE_LENGTH, node_id);
+            preamble_length_ = WIRE_MAX_PREAMBLE_LENGTH;
+        }
+        preamble_[6] = (char) (preamble_[6] | options);
+    }
+
+    /**
+     * 作为server等待对端的协商报文
+     *
+     * @param max_version 本端支持的最高版本
+     * @param features 本端支持的特性
+     */
+    void start_server(int max_version = WIRE_MAX_VERSION, int features = 0) {
+        server_ = true;
+        version_ = max_version;
+        features_ = features;
+        negotiated_ = false;
+    }
+
+    /**
+     * 数据报传输上的codec，不交换协商报文，双方直接按v2收发，不带CRC32C尾部（UDP自带校验和）
+     *
+     * @param features 双方约定的特性
+     */
+    void start_datagram(int features = 0) {
+        server_ = false;
+        version_ = WIRE_VERSION_2;
+        features_ = features & ~WIRE_FEATURE_CRC32C;
+        negotiated_ = true;
+        preamble_pending_ = false;
+    }
+
+    bool negotiated() const {
+        return negotiated_;
+    }
+
+    int version() const {
+        return version_;
+    }
+
+    int features() const {
+        return features_;
+    }
+
+    /**
+     * 对端在协商报文中告知的节点ID，没有告知时为0
+     */
+    int peer_id() const {
+        return peer_id_;
+    }
+
+    /**
+     * 对端协商报文中的选项
+     */
+    int peer_options() const {
+        return peer_options_;
+    }
+
+    /**
+     * 协商是否已经完成，并且双方都支持feature
+     */
+    bool supports(int feature) const {
+        return negotiated_ && (features_ & feature);
+    }
+
+    /**
+     * 是否有待发送的协商报文
+     */
+    bool preamble_pending() const {
+        return preamble_pending_;
+    }
+
+    /**
+     * 取出待发送的协商报文，调用后不再处于待发送状态
+     */
+    const char *take_preamble() {
+        preamble_pending_ = false;
+        return preamble_;
+    }
+
+    /**
+     * 待发送的协商报文的长度
+     */
+    size_t preamble_length() const {
+        return preamble_length_;
+    }
+
+    /**
+     * 处理对端发来的协商数据
+     *
+     * @param in 接收到的数据
+     * @param avail 数据长度
+     * @return 消耗的字节数（识别出对端是v1时为0），数据不足时返回-2，报文不合法时返回-1
+     */
+    int negotiate(const char *in, size_t avail) {
+        size_t magic_length = sizeof(WIRE_PREAMBLE_MAGIC);
+        if (avail < magic_length) {
+            return -2;
+        }
+        if (memcmp(in, WIRE_PREAMBLE_MAGIC, magic_length) != 0) {
+            if (server_) {
+                //老版本的client，不回复协商报文
+                version_ = WIRE_VERSION_1;
+                features_ = 0;
+                negotiated_ = true;
+                return 0;
+            }
+            return -1;
+        }
+        if (avail < (size_t) WIRE_PREAMBLE_LENGTH) {
+            return -2;
+        }
+        int peer_version = (uint8_t) in[4];
+        int peer_features = (uint8_t) in[5];
+        int peer_options = (uint8_t) in[6];
+        if (peer_version < WIRE_VERSION_1) {
+            return -1;
+        }
+        int consumed = WIRE_PREAMBLE_LENGTH;
+        peer_options_ = peer_options;
+        if (server_ && (peer_options & WIRE_OPTION_NODE_ID)) {
+            if (avail < (size_t) WIRE_MAX_PREAMBLE_LENGTH) {
+                return -2;
+            }
+            peer_id_ = get_le32(in + WIRE_PREAMBLE_LENGTH);
+            consumed = WIRE_MAX_PREAMBLE_LENGTH;
+        }
+        if (server_) {
+            version_ = peer_version < version_ ? peer_version : version_;
+            features_ &= peer_features;
+            encode_preamble(version_, features_);
+        } else {
+            if (peer_version > version_) {
+                return -1;
+            }
+            version_ = peer_version;
+            features_ &= peer_features;
+        }
+        negotiated_ = true;
+        return consumed;
+    }
+
+    /**
+     * 按协商的版本编码消息首部
+     *
+     * @param msg
+     * @param out 至少WIRE_MAX_HEADER_LENGTH字节
+     * @return 首部长度
+     */
+    size_t encode_header(const ad_hoc_message &msg, char *out) const {
+        if (version_ == WIRE_VERSION_1) {
+            put_le32(out, msg.sendid());
+            put_le32(out + 4, msg.receiveid());
+            put_le32(out + 8, msg.sourceid());
+            put_le32(out + 12, msg.destid());
+            put_le32(out + 16, msg.body_length());
+            put_le32(out + 20, msg.msg_type() | msg.flags() << 16);
+            return ADHOCMESSAGE_HEADER_LENGTH;
+        }
+        char *p = out;
+        *p++ = (char) ((msg.msg_type() & WIRE_MAX_TYPE) | msg.flags() << 4);
+        p = wire_put_varint(p, wire_zigzag(msg.sendid()));
+        p = wire_put_varint(p, wire_zigzag(msg.receiveid()));
+        p = wire_put_varint(p, wire_zigzag(msg.sourceid()));
+        p = wire_put_varint(p, wire_zigzag(msg.destid()));
+        p = wire_put_varint(p, (uint32_t) msg.body_length());
+        return p - out;
+    }
+
+    /**
+     * 按协商的版本解码消息首部，解码出的字段和载荷长度写入msg
+     *
+     * @param in 接收到的数据
+     * @param avail 数据长度
+     * @param msg
+     * @return 首部长度，数据不足时返回0，首部不合法时返回-1
+     */
+    int decode_header(const char *in, size_t avail, ad_hoc_message &msg) const {
+        if (version_ == WIRE_VERSION_1) {
+            if (avail < (size_t) ADHOCMESSAGE_HEADER_LENGTH) {
+                return 0;
+            }
+            int body_length = get_le32(in + 16);
+            auto type_flags = (uint32_t) get_le32(in + 20);
+            int type = (int) (type_flags & 0xFFFF);
+            int flags = (int) (type_flags >> 16);
+            if (body_length < 0 || body_length > ad_hoc_max_body_length(type) || (flags & ~allowed_flags())) {
+                return -1;
+            }
+            msg = ad_hoc_message(type, get_le32(in), get_le32(in + 4), get_le32(in + 8), get_le32(in + 12));
+            msg.flags(flags);
+            msg.body_length(body_length);
+            return ADHOCMESSAGE_HEADER_LENGTH;
+        }
+        if (avail < 1) {
+            return 0;
+        }
+        auto type_flags = (uint8_t) in[0];
+        if ((type_flags >> 4) & ~allowed_flags()) {
+            return -1;
+        }
+        uint32_t fields[5];
+        size_t offset = 1;
+        for (uint32_t &field: fields) {
+            int n = wire_get_varint(in + offset, avail - offset, field);
+            if (n <= 0) {
+                return n;
+            }
+            offset += n;
+        }
+        if (fields[4] > (uint32_t) ad_hoc_max_body_length(type_flags & WIRE_MAX_TYPE)) {
+            return -1;
+        }
+        msg = ad_hoc_message(type_flags & WIRE_MAX_TYPE, wire_unzigzag(fields[0]), wire_unzigzag(fields[1]),
+                             wire_unzigzag(fields[2]), wire_unzigzag(fields[3]));
+        msg.flags(type_flags >> 4);
+        msg.body_length((int) fields[4]);
+        return (int) offset;
+    }
+
+private:
+    /**
+     * 本连接上允许出现的消息标志
+     */
+    int allowed_flags() const {
+        return features_ & WIRE_FEATURE_COMPRESSION ? MESSAGE_FLAG_COMPRESSED : 0;
+    }
+
+    void encode_preamble(int version, int features) {
+        memcpy(preamble_, WIRE_PREAMBLE_MAGIC, sizeof(WIRE_PREAMBLE_MAGIC));
+        preamble_[4] = (char) version;
+        preamble_[5] = (char) features;
+        preamble_[6] = 0;
+        preamble_[7] = 0;
+        preamble_length_ = WIRE_PREAMBLE_LENGTH;
+        preamble_pending_ = true;
+    }
+
+    int version_;
+    int features_;
+    bool negotiated_;
+    bool server_;
+    bool preamble_pending_;
+    char preamble_[WIRE_MAX_PREAMBLE_LENGTH];
+    size_t preamble_length_;
+    int peer_id_; //对端告知的节点ID
+    int peer_options_;
+};
+
+#endif //ADHOC_SIMULATION_WIRE_H
@@ -14,6 +14,9 @@
 #include <boost/asio.hpp>
 
 #include "message_handler.h"
+#include "batch_writer.h"
+#include "frame_reader.h"
+#include "uring.h"
 #include "utils.h"
 
 const int AODV_WORMHOLE_DIFF_THRESHOLD = 2;
@@ -22,8 +25,6 @@ using boost::asio::ip::tcp;
 using namespace std;
 
 
-typedef deque<ad_hoc_message> ad_hoc_message_queue;
-
 struct ad_hoc_wormhole_watchdog_item {
     //input-output(rx-tx)
     int diff;
@@ -124,8 +125,13 @@ public:
      */
     ad_hoc_wormhole_client(tcp::endpoint &endpoint, boost::asio::io_context &io_context, ad_hoc_message_handler *client)
             : socket(io_context),
+              stream(socket),
               io_context(io_context),
+              reader_(codec_),
+              writer_(codec_),
               client(client) {
+        //连接建立后首先发送协商报文，请求本程序支持的最高版本和帧校验
+        codec_.start_client(WIRE_MAX_VERSION, WIRE_FEATURE_CRC32C);
         socket.async_connect(endpoint,
                              boost::bind(
                                      &ad_hoc_wormhole_client::handle_connect,
@@ -140,7 +146,7 @@ public:
      *
      * @param msg 待发消息
      */
-    void write(const ad_hoc_message msg) {
+    void write(const ad_hoc_message &msg) {
         io_context.post(boost::bind(&ad_hoc_wormhole_client::do_write, this, msg));
     }
 
@@ -165,56 +171,57 @@ private:
             cout << "connected to " << socket.remote_endpoint().address() << ":" << socket.remote_endpoint().port()
                  << endl;
             cout << "local port is " << socket.local_endpoint().port() << endl;
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&ad_hoc_wormhole_client::handle_read_header, this,
-                                                boost::asio::placeholders::error));
+            read_some();
+            if (writer_.resume()) {
+                write_batch();
+            }
         } else {
             cerr << error << endl;
         }
     }
 
     /**
-     * 读取消息首部的回调函数
-     * 同ad_hoc_session中的同名函数
-     *
-     * @param error
+     * 发起异步读操作，读入socket接收缓冲区中所有已到达的数据
      */
-    void handle_read_header(const boost::system::error_code &error) {
-        if (!error && read_msg_.decode_header()) {
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                                    boost::bind(&ad_hoc_wormhole_client::handle_read_body,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
-        }
+    void read_some() {
+        stream.async_read_some(reader_.prepare(),
+                               boost::bind(&ad_hoc_wormhole_client::handle_read, this,
+                                           boost::asio::placeholders::error,
+                                           boost::asio::placeholders::bytes_transferred));
     }
 
     /**
-     * 读取消息数据载荷的回调函数
-     * 同ad_hoc_session中的同名函数
-     *
-     * @param error
-     */
-    void handle_read_body(const boost::system::error_code &error) {
+        * 读数据的回调函数
+        * 同ad_hoc_session中的同名函数
+        *
+        * @param error
+        * @param bytes_transferred
+        */
+    void handle_read(const boost::system::error_code &error, size_t bytes_transferred) {
         if (!error) {
+            reader_.commit(bytes_transferred);
+            ad_hoc_message msg;
+            while (reader_.next(msg)) {
 #if DEBUG
-            LOG_RECEIVED(read_msg_);
+                LOG_RECEIVED(msg);
 #endif
-            ad_hoc_message body_msg;
-            memcpy(body_msg.data(), read_msg_.body(), read_msg_.body_length());
-            body_msg.decode_header();
-            client->handle_message(body_msg, true);
-            boost::asio::async_read(socket,
-                                    boost::asio::buffer(read_msg_.data(), ADHOCMESSAGE_HEADER_LENGTH),
-                                    boost::bind(&ad_hoc_wormhole_client::handle_read_header,
-                                                this,
-                                                boost::asio::placeholders::error));
-        } else {
-            do_close();
+                //内层帧与外层帧共享同一个缓冲区，不再拷贝
+                ad_hoc_message body_msg;
+                if (msg.inner_frame(body_msg)) {
+                    msg.reset();
+                    client->handle_message(body_msg, true);
+                }
+            }
+            if (!reader_.corrupt()) {
+                read_some();
+                //协商完成后发出协商期间积累的消息
+                if (writer_.resume()) {
+                    write_batch();
+                }
+                return;
+            }
         }
+        do_close();
     }
 
     /**
@@ -225,25 +232,28 @@ private:
      */
     void handle_write(const boost::system::error_code &error) {
         if (!error) {
-            auto msg = write_msgs_.front();
 #if DEBUG
             //            cout << "sent" << endl;
             //            print(msg);
 #endif
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty()) {
-                boost::asio::async_write(socket,
-                                         boost::asio::buffer(write_msgs_.front().data(),
-                                                             write_msgs_.front().length()),
-                                         boost::bind(&ad_hoc_wormhole_client::handle_write,
-                                                     this,
-                                                     boost::asio::placeholders::error));
+            if (writer_.complete()) {
+                write_batch();
             }
         } else {
             do_close();
         }
     }
 
+    /**
+     * 把队列中所有待发消息收集为一个buffer序列，用一次gather写发出
+     */
+    void write_batch() {
+        stream.async_write(writer_.gather(),
+                           boost::bind(&ad_hoc_wormhole_client::handle_write,
+                                       this,
+                                       boost::asio::placeholders::error));
+    }
+
     /**
      * 发送消息函数
      *
@@ -257,26 +267,21 @@ private:
 #endif
         msg.sendid(socket.local_endpoint().port());
         msg.encode_header();
-        bool write_in_progress = !write_msgs_.empty();
-        write_msgs_.push_back(msg);
-        if (!write_in_progress) {
-            boost::asio::async_write(socket,
-                                     boost::asio::buffer(write_msgs_.front().data(),
-                                                         write_msgs_.front().length()),
-                                     boost::bind(&ad_hoc_wormhole_client::handle_write,
-                                                 this,
-                                                 boost::asio::placeholders::error));
+        if (writer_.push(std::move(msg))) {
+            write_batch();
         }
     }
 
     void do_close() {
-        socket.close();
+        stream.close();
     }
 
     boost::asio::io_context &io_context;
     tcp::socket socket;
-    ad_hoc_message read_msg_;
-    ad_hoc_message_queue write_msgs_;
+    ad_hoc_stream stream; //socket上的读写流，按编译选项运行在asio或io_uring上
+    ad_hoc_wire_codec codec_;
+    ad_hoc_frame_reader reader_;
+    ad_hoc_batch_writer writer_;
     ad_hoc_message_handler *client;
 };
 